@@ -0,0 +1,369 @@
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <pthread.h>
+#include "batch.h"
+
+#define BATCH_PENDING 0
+#define BATCH_RUNNING 1
+#define BATCH_DONE 2
+
+Batch *batchCreate() {
+	return calloc(1, sizeof(Batch));
+}
+
+// A destination that doesn't exist yet will be on its directory's device.
+static dev_t deviceOf(const char *path, int isDest) {
+	struct stat fileStat;
+
+	if (stat(path, &fileStat) == 0) {
+		return fileStat.st_dev;
+	}
+
+	if (isDest) {
+		char *copy = strdup(path);
+		if (copy && stat(dirname(copy), &fileStat) == 0) {
+			free(copy);
+			return fileStat.st_dev;
+		}
+		free(copy);
+	}
+	return 0;
+}
+
+int batchAdd(Batch *batch, const char *source, const char *dest) {
+	if (batch->jobsCount == batch->jobsCapacity) {
+		int capacity = batch->jobsCapacity ? batch->jobsCapacity * 2 : 64;
+		BatchJob *jobs = realloc(batch->jobs, capacity * sizeof(BatchJob));
+		if (jobs == NULL) {
+			return -1;
+		}
+		batch->jobs = jobs;
+		batch->jobsCapacity = capacity;
+	}
+
+	BatchJob *job = &batch->jobs[batch->jobsCount];
+	memset(job, 0, sizeof(BatchJob));
+	job->source = strdup(source);
+	job->dest = strdup(dest);
+	if (job->source == NULL || job->dest == NULL) {
+		free(job->source);
+		free(job->dest);
+		return -1;
+	}
+	job->sourceDevice = deviceOf(source, 0);
+	job->destDevice = deviceOf(dest, 1);
+	job->state = BATCH_PENDING;
+
+	batch->jobsCount++;
+	return 0;
+}
+
+static int addToDirectory(Batch *batch, const char *source, const char *destDirectory) {
+	char *copy = strdup(source);
+	char *dest = NULL;
+
+	if (copy == NULL || asprintf(&dest, "%s/%s", destDirectory, basename(copy)) < 0) {
+		free(copy);
+		return -1;
+	}
+
+	int result = batchAdd(batch, source, dest);
+	free(dest);
+	free(copy);
+	return result;
+}
+
+// bigsync's own files, in case the destination is the source directory
+static int isBigsyncFile(const char *name) {
+	const char *suffixes[] = { ".bigsync", ".journal", ".merkle", ".tmp" };
+	size_t length = strlen(name);
+	size_t i;
+
+	// generations of a destination, ".bigsync.gen.<number>"
+	if (strstr(name, ".bigsync.gen.")) {
+		return 1;
+	}
+
+	for (i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+		size_t suffixLength = strlen(suffixes[i]);
+		if (length > suffixLength && strcmp(name + length - suffixLength, suffixes[i]) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Every regular file of a directory (not its subdirectories), in name order.
+static int loadDirectory(Batch *batch, const char *path, const char *destDirectory, char *error, size_t errorSize) {
+	struct dirent **entries;
+	int entriesCount = scandir(path, &entries, NULL, alphasort);
+	if (entriesCount < 0) {
+		snprintf(error, errorSize, "Cannot read directory %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	int result = 0;
+	int i;
+	for (i = 0; i < entriesCount; i++) {
+		char *source = NULL;
+		struct stat fileStat;
+
+		if (result == 0 && !isBigsyncFile(entries[i]->d_name) &&
+			asprintf(&source, "%s/%s", path, entries[i]->d_name) >= 0) {
+
+			if (stat(source, &fileStat) == 0 && S_ISREG(fileStat.st_mode) &&
+				addToDirectory(batch, source, destDirectory) == -1) {
+
+				snprintf(error, errorSize, "Out of memory");
+				result = -1;
+			}
+			free(source);
+		}
+		free(entries[i]);
+	}
+	free(entries);
+
+	return result;
+}
+
+// A manifest has a source per line, optionally followed by a tab and its
+// destination; blank lines and lines starting with # are skipped.
+static int loadManifest(Batch *batch, const char *path, const char *destDirectory, char *error, size_t errorSize) {
+	FILE *manifest = fopen(path, "r");
+	if (manifest == NULL) {
+		snprintf(error, errorSize, "Cannot open %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	char *line = NULL;
+	size_t lineSize = 0;
+	int lineNumber = 0;
+	int result = 0;
+
+	while (result == 0 && getline(&line, &lineSize, manifest) != -1) {
+		lineNumber++;
+		line[strcspn(line, "\r\n")] = 0;
+		if (line[0] == 0 || line[0] == '#') {
+			continue;
+		}
+
+		char *dest = strchr(line, '\t');
+		if (dest) {
+			*dest++ = 0;
+			result = batchAdd(batch, line, dest);
+		} else if (destDirectory) {
+			result = addToDirectory(batch, line, destDirectory);
+		} else {
+			snprintf(error, errorSize, "%s:%d: no destination, and no --dest directory to put it in", path, lineNumber);
+			result = -1;
+			break;
+		}
+
+		if (result == -1) {
+			snprintf(error, errorSize, "Out of memory");
+		}
+	}
+
+	free(line);
+	fclose(manifest);
+	return result;
+}
+
+// path is either a directory, all files of which go to destDirectory, or a
+// manifest.
+int batchLoad(Batch *batch, const char *path, const char *destDirectory, char *error, size_t errorSize) {
+	struct stat fileStat;
+
+	if (stat(path, &fileStat) == -1) {
+		snprintf(error, errorSize, "Cannot open %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	if (S_ISDIR(fileStat.st_mode)) {
+		if (destDirectory == NULL || stat(destDirectory, &fileStat) == -1 || !S_ISDIR(fileStat.st_mode)) {
+			snprintf(error, errorSize, "Syncing the directory %s needs a --dest directory", path);
+			return -1;
+		}
+		return loadDirectory(batch, path, destDirectory, error, errorSize);
+	}
+
+	if (destDirectory && (stat(destDirectory, &fileStat) == -1 || !S_ISDIR(fileStat.st_mode))) {
+		snprintf(error, errorSize, "--dest %s has to be a directory in batch mode", destDirectory);
+		return -1;
+	}
+	return loadManifest(batch, path, destDirectory, error, errorSize);
+}
+
+static int runningOn(Batch *batch, dev_t device) {
+	int count = 0;
+	int i;
+	for (i = 0; i < batch->jobsCount; i++) {
+		BatchJob *job = &batch->jobs[i];
+		if (job->state == BATCH_RUNNING && (job->sourceDevice == device || job->destDevice == device)) {
+			count++;
+		}
+	}
+	return count;
+}
+
+typedef struct {
+	Batch *batch;
+	int maxDeviceJobs;
+	int isQuiet;
+	pthread_mutex_t lock;
+	pthread_cond_t isJobDone;
+} BatchRun;
+
+typedef struct {
+	BatchRun *run;
+	Engine *engine;
+	pthread_t thread;
+} BatchWorker;
+
+// The next file that can be synced without going over the device limit; NULL
+// when all have been started, or when the rest have to wait for some to end.
+static BatchJob *nextJob(BatchRun *run, int *isAnyPending) {
+	Batch *batch = run->batch;
+	int i;
+
+	*isAnyPending = 0;
+	for (i = 0; i < batch->jobsCount; i++) {
+		BatchJob *job = &batch->jobs[i];
+		if (job->state != BATCH_PENDING) {
+			continue;
+		}
+		*isAnyPending = 1;
+		if (runningOn(batch, job->sourceDevice) < run->maxDeviceJobs &&
+			runningOn(batch, job->destDevice) < run->maxDeviceJobs) {
+			return job;
+		}
+	}
+	return NULL;
+}
+
+// Called with the lock held.
+static void finishJob(BatchRun *run, BatchJob *job, Engine *engine, int result, EngineTotals *totals) {
+	Batch *batch = run->batch;
+
+	job->state = BATCH_DONE;
+
+	if (result == 0) {
+		batch->filesSynced++;
+		batch->totals.bytesRead += totals->bytesRead;
+		batch->totals.bytesWritten += totals->bytesWritten;
+		batch->totals.blocksChanged += totals->blocksChanged;
+	} else {
+		batch->filesFailed++;
+	}
+
+	if (result == -1) {
+		fprintf(stderr, "%s -> %s: FAILED: %s\n", job->source, job->dest, engineError(engine));
+	} else if (!run->isQuiet) {
+		printf("%s -> %s: synced\n", job->source, job->dest);
+		fflush(stdout);
+	}
+}
+
+static void *batchWorker(void *argument) {
+	BatchWorker *worker = (BatchWorker *) argument;
+	BatchRun *run = worker->run;
+
+	pthread_mutex_lock(&run->lock);
+	for (;;) {
+		int isAnyPending;
+		BatchJob *job = nextJob(run, &isAnyPending);
+		if (job == NULL) {
+			if (!isAnyPending) {
+				break;
+			}
+			pthread_cond_wait(&run->isJobDone, &run->lock);
+			continue;
+		}
+
+		job->state = BATCH_RUNNING;
+		pthread_mutex_unlock(&run->lock);
+
+		EngineTotals totals;
+		int result = engineSync(worker->engine, job->source, job->dest, &totals);
+
+		pthread_mutex_lock(&run->lock);
+		finishJob(run, job, worker->engine, result, &totals);
+		pthread_cond_broadcast(&run->isJobDone);
+	}
+	pthread_mutex_unlock(&run->lock);
+
+	return NULL;
+}
+
+// Syncs every file with engines like the one given, which share its hashing
+// threads and has to stay unused meanwhile. Returns once all are done; -1
+// with errno set if not even one worker could be started.
+int batchRun(Batch *batch, Engine *engine, int maxJobs, int maxDeviceJobs, int isQuiet) {
+	BatchRun run;
+	run.batch = batch;
+	run.maxDeviceJobs = maxDeviceJobs;
+	run.isQuiet = isQuiet;
+
+	int workersCount = maxJobs < batch->jobsCount ? maxJobs : batch->jobsCount;
+	if (workersCount == 0) {
+		return 0;
+	}
+
+	BatchWorker *workers = calloc(workersCount, sizeof(BatchWorker));
+	if (workers == NULL) {
+		return -1;
+	}
+
+	pthread_mutex_init(&run.lock, NULL);
+	pthread_cond_init(&run.isJobDone, NULL);
+
+	int started = 0;
+	while (started < workersCount) {
+		BatchWorker *worker = &workers[started];
+		worker->run = &run;
+		worker->engine = engineCreateLike(engine);
+		if (worker->engine == NULL) {
+			break;
+		}
+		int error = pthread_create(&worker->thread, NULL, batchWorker, worker);
+		if (error != 0) {
+			engineDestroy(worker->engine);
+			errno = error;
+			break;
+		}
+		started++;
+	}
+
+	int i;
+	for (i = 0; i < started; i++) {
+		pthread_join(workers[i].thread, NULL);
+		engineDestroy(workers[i].engine);
+	}
+
+	pthread_mutex_destroy(&run.lock);
+	pthread_cond_destroy(&run.isJobDone);
+	free(workers);
+
+	return started > 0 ? 0 : -1;
+}
+
+void batchDestroy(Batch *batch) {
+	int i;
+	for (i = 0; i < batch->jobsCount; i++) {
+		free(batch->jobs[i].source);
+		free(batch->jobs[i].dest);
+	}
+	free(batch->jobs);
+	free(batch);
+}
@@ -0,0 +1,44 @@
+#ifndef BIGSYNC_BATCH_H
+#define BIGSYNC_BATCH_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "engine.h"
+
+// Runs many syncs from one invocation. maxJobs threads take the files in
+// turn, each syncing with an engine of its own, so that one file failing
+// doesn't stop the rest. They never run more than maxDeviceJobs syncs
+// reading from the same source device or writing to the same destination
+// device at a time, and add up what the engines did.
+
+typedef struct {
+	uint64_t bytesRead;
+	uint64_t bytesWritten;
+	uint64_t blocksChanged;
+} BatchTotals;
+
+typedef struct {
+	char *source;
+	char *dest;
+	dev_t sourceDevice;
+	dev_t destDevice;
+	int state;
+} BatchJob;
+
+typedef struct {
+	BatchJob *jobs;
+	int jobsCount;
+	int jobsCapacity;
+
+	int filesSynced;
+	int filesFailed;
+	BatchTotals totals;
+} Batch;
+
+Batch *batchCreate();
+int batchAdd(Batch *batch, const char *source, const char *dest);
+int batchLoad(Batch *batch, const char *path, const char *destDirectory, char *error, size_t errorSize);
+int batchRun(Batch *batch, Engine *engine, int maxJobs, int maxDeviceJobs, int isQuiet);
+void batchDestroy(Batch *batch);
+
+#endif
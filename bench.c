@@ -0,0 +1,519 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include "engine.h"
+#include "engine_internal.h"
+
+// Throughput of the sync loop, scenario by scenario: a source is made up,
+// synced once if the scenario is about updating a destination, changed, and
+// then the sync that counts is timed, along with the CPU it took and the
+// time spent in each stage of a block. Results are printed as a table and,
+// with --json, written one JSON object per line, which --baseline compares
+// against to catch a version that got slower.
+
+#define DEFAULT_SIZE_MB 256
+#define DEFAULT_TOLERANCE 10
+
+#define BENCH_SOURCE "benchSource.bin"
+#define BENCH_DEST "benchDest.bin"
+#define BENCH_SHIFTED "benchShifted.bin"
+
+#define BENCH_BUFFER_SIZE (1024 * 1024)
+
+// sparse sources have one such run of data in every BENCH_SPARSE_STRIDE
+#define BENCH_SPARSE_STRIDE (16 * 1024 * 1024)
+
+#ifndef VERSION
+#define VERSION "0.0.0"
+#endif
+
+typedef struct {
+	const char *name;
+	const char *description;
+	void (*create)(uint64_t size);
+	void (*change)(uint64_t size); // NULL: the destination is new
+	int isSparse;
+	int shouldUseChunks;
+} Scenario;
+
+typedef struct {
+	double seconds;
+	double cpuUser;
+	double cpuSystem;
+	EngineTotals totals;
+} BenchResult;
+
+// what the results were measured with, for findBaseline() to match
+typedef struct {
+	const char *hashName;
+	uint64_t blockSize;
+	int threadsCount;
+	uint64_t latency;
+} BenchSettings;
+
+void printAndFail(const char *what, const char *filename) {
+	fprintf(stderr, "%s %s: %s\n", what, filename, strerror(errno));
+	exit(1);
+}
+
+// xorshift: random enough to defeat zero detection and compression, and
+// fast enough not to matter
+void fillRandom(unsigned char *buffer, size_t size, uint64_t *state) {
+	size_t i;
+	for (i = 0; i + 8 <= size; i += 8) {
+		*state ^= *state << 13;
+		*state ^= *state >> 7;
+		*state ^= *state << 17;
+		memcpy(buffer + i, state, 8);
+	}
+	for (; i < size; i++) {
+		buffer[i] = (unsigned char) (*state >> (i % 8 * 8));
+	}
+}
+
+void writeAll(int fd, const unsigned char *buffer, size_t size, const char *filename) {
+	while (size > 0) {
+		ssize_t written = write(fd, buffer, size);
+		if (written < 0) {
+			printAndFail("Cannot write", filename);
+		}
+		buffer += written;
+		size -= written;
+	}
+}
+
+void createRandom(const char *filename, uint64_t size, uint64_t seed) {
+	unsigned char *buffer = malloc(BENCH_BUFFER_SIZE);
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (buffer == NULL || fd == -1) {
+		printAndFail("Cannot create", filename);
+	}
+
+	uint64_t state = seed * 0x9e3779b97f4a7c15ULL + 1;
+	uint64_t done;
+	for (done = 0; done < size; done += BENCH_BUFFER_SIZE) {
+		size_t length = size - done < BENCH_BUFFER_SIZE ? size - done : BENCH_BUFFER_SIZE;
+		fillRandom(buffer, length, &state);
+		writeAll(fd, buffer, length, filename);
+	}
+
+	close(fd);
+	free(buffer);
+}
+
+void createRandomSource(uint64_t size) {
+	createRandom(BENCH_SOURCE, size, 1);
+}
+
+void createZeroSource(uint64_t size) {
+	unsigned char *buffer = calloc(1, BENCH_BUFFER_SIZE);
+	int fd = open(BENCH_SOURCE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (buffer == NULL || fd == -1) {
+		printAndFail("Cannot create", BENCH_SOURCE);
+	}
+
+	uint64_t done;
+	for (done = 0; done < size; done += BENCH_BUFFER_SIZE) {
+		writeAll(fd, buffer, size - done < BENCH_BUFFER_SIZE ? size - done : BENCH_BUFFER_SIZE, BENCH_SOURCE);
+	}
+
+	close(fd);
+	free(buffer);
+}
+
+// a disk image: holes, with some data here and there
+void createSparseSource(uint64_t size) {
+	unsigned char *buffer = malloc(BENCH_BUFFER_SIZE);
+	int fd = open(BENCH_SOURCE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (buffer == NULL || fd == -1 || ftruncate(fd, size) == -1) {
+		printAndFail("Cannot create", BENCH_SOURCE);
+	}
+
+	uint64_t state = 2;
+	uint64_t offset;
+	for (offset = 0; offset < size; offset += BENCH_SPARSE_STRIDE) {
+		size_t length = size - offset < BENCH_BUFFER_SIZE ? size - offset : BENCH_BUFFER_SIZE;
+		fillRandom(buffer, length, &state);
+		if (lseek(fd, offset, SEEK_SET) == -1) {
+			printAndFail("Cannot seek", BENCH_SOURCE);
+		}
+		writeAll(fd, buffer, length, BENCH_SOURCE);
+	}
+
+	close(fd);
+	free(buffer);
+}
+
+void keepSource(uint64_t size) {
+}
+
+void rewriteSource(uint64_t size) {
+	createRandom(BENCH_SOURCE, size, 3);
+}
+
+// one byte inserted at the start moves every block
+void shiftSource(uint64_t size) {
+	unsigned char *buffer = malloc(BENCH_BUFFER_SIZE);
+	FILE *source = fopen(BENCH_SOURCE, "r");
+	int fd = open(BENCH_SHIFTED, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (buffer == NULL || source == NULL || fd == -1) {
+		printAndFail("Cannot create", BENCH_SHIFTED);
+	}
+
+	writeAll(fd, (const unsigned char *) "!", 1, BENCH_SHIFTED);
+	size_t readBytes;
+	while ((readBytes = fread(buffer, 1, BENCH_BUFFER_SIZE, source)) > 0) {
+		writeAll(fd, buffer, readBytes, BENCH_SHIFTED);
+	}
+
+	fclose(source);
+	close(fd);
+	free(buffer);
+	if (rename(BENCH_SHIFTED, BENCH_SOURCE) == -1) {
+		printAndFail("Cannot rename", BENCH_SHIFTED);
+	}
+}
+
+Scenario scenarios[] = {
+	{ "random", "new destination, random data", createRandomSource, NULL, 0, 0 },
+	{ "zero", "new destination, all zeros", createZeroSource, NULL, 0, 0 },
+	{ "sparse", "new destination, --sparse, 1/16 data", createSparseSource, NULL, 1, 0 },
+	{ "unchanged", "update, nothing changed", createRandomSource, keepSource, 0, 0 },
+	{ "changed", "update, everything changed", createRandomSource, rewriteSource, 0, 0 },
+	{ "shifted", "update, one byte inserted at the start", createRandomSource, shiftSource, 0, 0 },
+	{ "shifted-cdc", "the same with --cdc", createRandomSource, shiftSource, 0, 1 },
+	{ NULL, NULL, NULL, NULL, 0, 0 }
+};
+
+void removeBenchFiles() {
+	remove(BENCH_SOURCE);
+	remove(BENCH_SHIFTED);
+	remove(BENCH_DEST);
+	remove(BENCH_DEST ".bigsync");
+	remove(BENCH_DEST ".bigsync.merkle");
+	remove(BENCH_DEST ".bigsync.journal");
+}
+
+// out of the page cache, so that the sync reads from the disk
+void dropCache(const char *filename) {
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		return;
+	}
+	fsync(fd);
+#ifdef POSIX_FADV_DONTNEED
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+	close(fd);
+}
+
+double cpuSeconds(struct timeval *time) {
+	return time->tv_sec + time->tv_usec / 1000000.0;
+}
+
+void runScenario(Engine *engine, Scenario *scenario, uint64_t size, int shouldDropCache, BenchResult *result) {
+	removeBenchFiles();
+	scenario->create(size);
+
+	engineSetSparse(engine, scenario->isSparse);
+	engineSetChunks(engine, scenario->shouldUseChunks);
+
+	if (scenario->change) {
+		if (engineSync(engine, BENCH_SOURCE, BENCH_DEST, &result->totals) == -1) {
+			fprintf(stderr, "%s: %s\n", scenario->name, engineError(engine));
+			exit(1);
+		}
+		scenario->change(size);
+	}
+
+	if (shouldDropCache) {
+		dropCache(BENCH_SOURCE);
+		dropCache(BENCH_DEST);
+	}
+
+	struct rusage usageBefore, usageAfter;
+	getrusage(RUSAGE_SELF, &usageBefore);
+	uint64_t startedAt = statsNow();
+
+	if (engineSync(engine, BENCH_SOURCE, BENCH_DEST, &result->totals) == -1) {
+		fprintf(stderr, "%s: %s\n", scenario->name, engineError(engine));
+		exit(1);
+	}
+
+	result->seconds = (statsNow() - startedAt) / 1000000.0;
+	getrusage(RUSAGE_SELF, &usageAfter);
+	result->cpuUser = cpuSeconds(&usageAfter.ru_utime) - cpuSeconds(&usageBefore.ru_utime);
+	result->cpuSystem = cpuSeconds(&usageAfter.ru_stime) - cpuSeconds(&usageBefore.ru_stime);
+
+	removeBenchFiles();
+}
+
+double throughput(uint64_t size, BenchResult *result) {
+	return result->seconds > 0 ? size / result->seconds / (1024 * 1024) : 0;
+}
+
+void showHeader() {
+	printf("%-12s %8s %8s %9s %7s %7s", "scenario", "size MB", "seconds", "MB/s", "user", "sys");
+	int i;
+	for (i = 0; i < STATS_STAGES; i++) {
+		printf(" %8s", statsStageName(i));
+	}
+	printf("\n");
+}
+
+// stage columns are the time spent in them, in seconds; hashing runs on
+// several threads at once, so it can take longer than the whole sync
+void showResult(Scenario *scenario, uint64_t size, BenchResult *result) {
+	printf("%-12s %8" PRIu64 " %8.2f %9.1f %7.2f %7.2f", scenario->name, size / (1024 * 1024), result->seconds,
+		throughput(size, result), result->cpuUser, result->cpuSystem);
+	int i;
+	for (i = 0; i < STATS_STAGES; i++) {
+		printf(" %8.2f", result->totals.stages[i].totalMicroseconds / 1000000.0);
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+// scenario and size come first and the settings next, for findBaseline()
+void writeResult(FILE *json, BenchSettings *settings, Scenario *scenario, uint64_t size, BenchResult *result) {
+
+	fprintf(json, "{\"scenario\":\"%s\",\"size\":%" PRIu64 ",\"version\":\"%s\",\"hash\":\"%s\",\"blockSize\":%" PRIu64
+		",\"threads\":%d,\"latencyUs\":%" PRIu64 ",\"seconds\":%.3f,\"mbps\":%.1f,\"cpuUser\":%.3f,\"cpuSystem\":%.3f"
+		",\"bytesRead\":%" PRIu64 ",\"bytesWritten\":%" PRIu64 ",\"stages\":{",
+		scenario->name, size, VERSION, settings->hashName, settings->blockSize, settings->threadsCount, settings->latency,
+		result->seconds, throughput(size, result),
+		result->cpuUser, result->cpuSystem, result->totals.bytesRead, result->totals.bytesWritten);
+
+	int i;
+	for (i = 0; i < STATS_STAGES; i++) {
+		StatsStage *stage = &result->totals.stages[i];
+		fprintf(json, "%s\"%s\":{\"count\":%" PRIu64 ",\"totalUs\":%" PRIu64 ",\"maxUs\":%" PRIu64 "}", i ? "," : "",
+			statsStageName(i), stage->count, stage->totalMicroseconds, stage->maxMicroseconds);
+	}
+	fprintf(json, "}}\n");
+	fflush(json);
+}
+
+// MB/s of the same scenario, size and settings in a --json file, or -1.
+double findBaseline(const char *baselineFilename, BenchSettings *settings, Scenario *scenario, uint64_t size) {
+	FILE *baseline = fopen(baselineFilename, "r");
+	if (baseline == NULL) {
+		printAndFail("Cannot open", baselineFilename);
+	}
+
+	char prefix[200];
+	snprintf(prefix, sizeof(prefix), "{\"scenario\":\"%s\",\"size\":%" PRIu64 ",", scenario->name, size);
+	char settingsText[200];
+	snprintf(settingsText, sizeof(settingsText), "\"hash\":\"%s\",\"blockSize\":%" PRIu64 ",\"threads\":%d,\"latencyUs\":%" PRIu64 ",",
+		settings->hashName, settings->blockSize, settings->threadsCount, settings->latency);
+
+	double mbps = -1;
+	char line[4096];
+	while (fgets(line, sizeof(line), baseline)) {
+		char *found = strstr(line, "\"mbps\":");
+		if (strncmp(line, prefix, strlen(prefix)) == 0 && strstr(line, settingsText) && found) {
+			mbps = atof(found + strlen("\"mbps\":"));
+		}
+	}
+
+	fclose(baseline);
+	return mbps;
+}
+
+void showHelp() {
+	printf(
+		"Usage: bench [options]\n"
+		"  -s, --size MB[,MB...]          source sizes, %d by default\n"
+		"  -n, --scenario NAME[,NAME...]  only these scenarios\n"
+		"  -b, --blocksize MB             block size\n"
+		"  -H, --hash NAME                hash: %s\n"
+		"  -j, --threads N                hashing threads\n"
+		"  -l, --latency MICROSECONDS     added to every write, as on a slow destination\n"
+		"  -C, --cold                     drop the files from the page cache before each timed sync\n"
+		"  -o, --json FILENAME            write the results as JSON lines\n"
+		"  -B, --baseline FILENAME        compare with the results of an earlier --json\n"
+		"  -t, --tolerance PERCENT        slower than the baseline by more fails, %d by default\n"
+		"\nScenarios:\n",
+		DEFAULT_SIZE_MB, hashAlgorithmNames(), DEFAULT_TOLERANCE);
+
+	Scenario *scenario;
+	for (scenario = scenarios; scenario->name; scenario++) {
+		printf("  %-12s %s\n", scenario->name, scenario->description);
+	}
+}
+
+int isListed(const char *list, const char *name) {
+	if (list == NULL) {
+		return 1;
+	}
+
+	size_t length = strlen(name);
+	const char *found = list;
+	while ((found = strstr(found, name))) {
+		if ((found == list || found[-1] == ',') && (found[length] == ',' || found[length] == 0)) {
+			return 1;
+		}
+		found += length;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	char *sizes = NULL;
+	char *scenarioNames = NULL;
+	uint64_t blockSize = 0;
+	const HashAlgorithm *hashAlgorithm = NULL;
+	int threadsCount = 0;
+	uint64_t latency = 0;
+	int shouldDropCache = 0;
+	char *jsonFilename = NULL;
+	char *baselineFilename = NULL;
+	int tolerance = DEFAULT_TOLERANCE;
+	int ch;
+
+	static struct option longopts[] = {
+		{ "size",      required_argument, NULL, 's' },
+		{ "scenario",  required_argument, NULL, 'n' },
+		{ "blocksize", required_argument, NULL, 'b' },
+		{ "hash",      required_argument, NULL, 'H' },
+		{ "threads",   required_argument, NULL, 'j' },
+		{ "latency",   required_argument, NULL, 'l' },
+		{ "cold",      no_argument,       NULL, 'C' },
+		{ "json",      required_argument, NULL, 'o' },
+		{ "baseline",  required_argument, NULL, 'B' },
+		{ "tolerance", required_argument, NULL, 't' },
+		{ "help",      no_argument,       NULL, 'h' },
+		{ NULL,        0,                 NULL, 0   }
+	};
+
+	while ((ch = getopt_long(argc, argv, "s:n:b:H:j:l:Co:B:t:h", longopts, NULL)) != -1) {
+		switch (ch) {
+			case 's':
+				sizes = optarg;
+				break;
+
+			case 'n':
+				scenarioNames = optarg;
+				break;
+
+			case 'b':
+				blockSize = strtoull(optarg, NULL, 10) * 1024 * 1024;
+				break;
+
+			case 'H':
+				hashAlgorithm = hashAlgorithmByName(optarg);
+				if (hashAlgorithm == NULL) {
+					fprintf(stderr, "Unknown hash \"%s\", supported are: %s\n", optarg, hashAlgorithmNames());
+					return 1;
+				}
+				break;
+
+			case 'j':
+				threadsCount = atoi(optarg);
+				break;
+
+			case 'l':
+				latency = strtoull(optarg, NULL, 10);
+				break;
+
+			case 'C':
+				shouldDropCache = 1;
+				break;
+
+			case 'o':
+				jsonFilename = optarg;
+				break;
+
+			case 'B':
+				baselineFilename = optarg;
+				break;
+
+			case 't':
+				tolerance = atoi(optarg);
+				break;
+
+			case 'h':
+			default:
+				showHelp();
+				return 1;
+		}
+	}
+
+	FILE *json = NULL;
+	if (jsonFilename) {
+		json = fopen(jsonFilename, "w");
+		if (json == NULL) {
+			printAndFail("Cannot create", jsonFilename);
+		}
+	}
+
+	Engine *engine = engineCreate(threadsCount);
+	if (engine == NULL) {
+		printAndFail("Cannot create", "engine");
+	}
+	engineSetHash(engine, hashAlgorithm);
+	engineSetBlockSize(engine, blockSize);
+	engineSetStageTimes(engine, 1);
+	engineSetWriteLatency(engine, latency);
+
+	BenchSettings settings;
+	settings.hashName = hashAlgorithm ? hashAlgorithm->name : hashAlgorithmById(HASH_MD4)->name;
+	settings.blockSize = blockSize ? blockSize : ENGINE_DEFAULT_BLOCK_SIZE;
+	settings.threadsCount = engineThreadsCount(engine);
+	settings.latency = latency;
+	printf("bigsync %s, hash = %s, %d thread(s), write latency = %" PRIu64 " us%s\n", VERSION, settings.hashName,
+		settings.threadsCount, latency, shouldDropCache ? ", cold cache" : "");
+	showHeader();
+
+	int regressionsCount = 0;
+	const char *size = sizes ? sizes : "";
+	do {
+		uint64_t sizeBytes = (sizes ? strtoull(size, NULL, 10) : DEFAULT_SIZE_MB) * 1024 * 1024;
+
+		Scenario *scenario;
+		for (scenario = scenarios; scenario->name; scenario++) {
+			if (!isListed(scenarioNames, scenario->name)) {
+				continue;
+			}
+
+			BenchResult result;
+			runScenario(engine, scenario, sizeBytes, shouldDropCache, &result);
+			showResult(scenario, sizeBytes, &result);
+			if (json) {
+				writeResult(json, &settings, scenario, sizeBytes, &result);
+			}
+
+			if (baselineFilename) {
+				double baseline = findBaseline(baselineFilename, &settings, scenario, sizeBytes);
+				double mbps = throughput(sizeBytes, &result);
+				if (baseline > 0 && mbps < baseline * (100 - tolerance) / 100) {
+					printf("  slower than the baseline: %.1f MB/s, was %.1f MB/s\n", mbps, baseline);
+					regressionsCount++;
+				}
+			}
+		}
+
+		size = strchr(size, ',');
+	} while (size && *++size);
+
+	engineDestroy(engine);
+	if (json) {
+		fclose(json);
+	}
+
+	if (regressionsCount) {
+		printf("%d scenario(s) got slower\n", regressionsCount);
+		return 1;
+	}
+	return 0;
+}
@@ -11,21 +11,28 @@
 #include <errno.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <getopt.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <libgen.h>
 #include <inttypes.h>
-#include "md4_global.h"
-#include "md4.h"
 #include "hr.h"
-
-#define CHECKSUM_REPLACE 1
-#define CHECKSUM_ADD 0
-
-#define PROGRESS_SAME 0
-#define PROGRESS_DIFFERENT 1
-#define PROGRESS_NOT_EXISTENT 2
+#include "hash.h"
+#include "checksums.h"
+#include "merkle.h"
+#include "cdc.h"
+#include "compress.h"
+#include "store.h"
+#include "generations.h"
+#include "remote.h"
+#include "batch.h"
+#include "writer.h"
+#include "throttle.h"
+#include "stats.h"
+#include "engine.h"
+#include "engine_internal.h"
+#include "util.h"
 
 #define REPORT_MODE_DEFAULT 0
 #define REPORT_MODE_VERBOSE 1
@@ -37,6 +44,9 @@
 #define TRUNCATE_MODE_OFF 0
 #define TRUNCATE_MODE_ON 1
 
+#define DEFAULT_BATCH_JOBS 4
+#define DEFAULT_DEVICE_JOBS 2
+
 #ifndef VERSION
 #define VERSION "0.0.0"
 #endif
@@ -58,13 +68,76 @@ void showHelp() {
 		"  --dest <path>       | -d <path>        destination, file name or directory\n" \
 		"                                         (if directory specified, then file will\n" \
 		"                                         have the same name in that directory,\n" \
-		"                                         mandatory)\n" \
-		"  --blocksize <MB>    | -b <MB>          block size in MB, defaults to 15\n" \
+		"                                         mandatory; <host>:<path> for another machine)\n" \
+		"  --blocksize <MB>    | -b <MB>          block size in MB, defaults to the one the checksum\n" \
+		"                                         file was made with, or 15 for a new one; auto\n" \
+		"                                         picks one from the size and changes of the source\n" \
 		"  --sparse            | -S               destination file to be sparsa (man dd)\n" \
 		"  --rebuild           | -r               only create checksums file, do not actually copy data\n" \
 		"  --notruncate        | -t               do not truncate the destinatation file\n" \
 		"  --checksum <path>   | -c               file name to use as checksum file\n" \
 		"                                         (if none is given then \"<DEST>.bigsync\" is used)\n" \
+		"  --threads <N>       | -j <N>           number of hashing threads, defaults to the\n" \
+		"                                         number of CPUs (up to 8)\n" \
+		"  --sync-policy <p>   | -P <p>           when to fsync the destination: \"per-block\" (default),\n" \
+		"                                         \"end\" or a number of MB written between syncs\n" \
+		"  --no-resume                            verify blocks an interrupted run was writing, but\n" \
+		"                                         start reading from the beginning anyway\n" \
+		"  --hash <name>       | -H <name>        checksum algorithm: md4, xxh64, blake3 or crc32c\n" \
+		"                                         (defaults to the one the checksum file was made\n" \
+		"                                         with, or md4 for a new one)\n" \
+		"  --io-engine <name>                     \"stdio\" (default) or \"uring\" to keep several reads\n" \
+		"                                         and writes in flight with io_uring (Linux)\n" \
+		"  --queue-depth <N>                      reads or writes in flight with io_uring,\n" \
+		"                                         defaults to 16\n" \
+		"  --direct                               read and write with O_DIRECT, bypassing the\n" \
+		"                                         page cache\n" \
+		"  --fadvise                              tell the kernel not to keep what was read or\n" \
+		"                                         written in the page cache\n" \
+		"  --read-limit <rate>                    read the source at most <rate> bytes a second\n" \
+		"                                         (K, M or G of them with a suffix)\n" \
+		"  --write-limit <rate>                   write the destination at most <rate> bytes a second\n" \
+		"  --iops-limit <N>                       make at most <N> reads and writes a second\n" \
+		"  --schedule <HH:MM>-<HH:MM>[,...]       only apply the limits within these hours\n" \
+		"  --stats-json <fd|path>                 write progress, throughput, stage latencies,\n" \
+		"                                         queue depth and ETA as a JSON line a second\n" \
+		"  --prometheus <path>                    write the totals of the run as a Prometheus\n" \
+		"                                         textfile at the end\n" \
+		"  --leafsize <KB>                        also keep checksums of every <KB> of a block and\n" \
+		"                                         only write the ones that changed; 0 stops that\n" \
+		"  --extent-hints                         skip reading blocks whose extents haven't moved\n" \
+		"                                         since the last run (copy-on-write filesystems),\n" \
+		"                                         and holes in the source\n" \
+		"  --batch <path>                         sync every file of a directory, or every file\n" \
+		"                                         listed in a manifest (\"<source>[<tab><dest>]\"\n" \
+		"                                         per line), into the --dest directory\n" \
+		"  --jobs <N>                             files synced at once in batch mode, defaults to 4\n" \
+		"  --device-jobs <N>                      files read from or written to the same device at\n" \
+		"                                         once in batch mode, defaults to 2\n" \
+		"  --verify-range <from>:<to>             read back the destination between <from> and\n" \
+		"                                         <to> MB (either may be left out) and check it\n" \
+		"                                         against the checksum tree, no copying\n" \
+		"  --root                                 show the checksum tree root of the destination,\n" \
+		"                                         equal roots mean equal files\n" \
+		"  --cdc                                  cut the source into chunks by content, so that\n" \
+		"                                         inserted data doesn't shift every block after it;\n" \
+		"                                         the destination becomes a container of chunks\n" \
+		"  --store <dir>                          write every distinct block once into a store\n" \
+		"                                         shared by many destinations, which become lists\n" \
+		"                                         of their blocks\n" \
+		"  --restore <path>                       put the source of a --cdc or --store destination\n" \
+		"                                         back together into <path>\n" \
+		"  --keep-generations <N>                 save the blocks a run overwrites, keeping the\n" \
+		"                                         destination as it was before each of the last\n" \
+		"                                         <N> runs; 0 removes them\n" \
+		"  --list-generations                     list the generations kept of the destination\n" \
+		"  --generation <N>                       with --restore, write out generation <N>\n" \
+		"  --rsh <command>                        how to reach the host of a <host>:<path> destination\n" \
+		"                                         (\"ssh\" by default); needs --checksum\n" \
+		"  --remote-command <command>             bigsync on the remote host (\"bigsync\" by default)\n" \
+		"  --serve                                receive a destination over stdin and stdout\n" \
+		"  --compress <none|lz4|lz4hc>            compress changed blocks sent to a remote\n" \
+		"                                         destination, or the chunks of a --cdc container\n" \
 		"\n" \
 		"  --verbose           | -v               verbose output\n" \
 		"  --quiet             | -q               only show errors\n" \
@@ -101,6 +174,16 @@ void showGrandTotal(uint64_t totalBytesRead, uint64_t totalBytesWritten, uint64_
 	);
 }
 
+off_t fileSize(char *filename) {
+ 	struct stat fileStat;
+
+	if (stat(filename,&fileStat) == -1) {
+		return -1;
+	}
+
+	return fileStat.st_size;
+}
+
 char *makeProgressBar(uint64_t currentPosition, uint64_t totalSize) {
 	float percent = (float) currentPosition / totalSize * 100;
 
@@ -126,8 +209,9 @@ char *makeProgressBar(uint64_t currentPosition, uint64_t totalSize) {
 void showProgress(
 	uint64_t currentPosition,
 	uint64_t totalSize,
-	char *readingMD4,
-	char *storedMD4,
+	const unsigned char *readingDigest,
+	const unsigned char *storedDigest,
+	int digestSize,
 	int status,
 	int reportMode) {
 
@@ -136,22 +220,29 @@ void showProgress(
 	}
 
 	if (reportMode == REPORT_MODE_VERBOSE) {
+		char readingChecksum[HASH_MAX_HEX_SIZE];
+		char storedChecksum[HASH_MAX_HEX_SIZE];
+		hashToHex(readingChecksum, readingDigest, digestSize);
+		if (storedDigest) {
+			hashToHex(storedChecksum, storedDigest, digestSize);
+		}
+
 		char _currentPosHR[100];
 		makeHumanReadableSize(_currentPosHR, currentPosition);
 		char _totalSizeHR[100];
 		makeHumanReadableSize(_totalSizeHR, totalSize);
 
 		switch(status) {
-			case PROGRESS_SAME:
-				printf("%s/%s %s -> same\n", _currentPosHR, _totalSizeHR, readingMD4);
+			case ENGINE_BLOCK_SAME:
+				printf("%s/%s %s -> same\n", _currentPosHR, _totalSizeHR, readingChecksum);
 				break;
 
-			case PROGRESS_DIFFERENT:
-				printf("%s/%s %s -> %s\n", _currentPosHR, _totalSizeHR, readingMD4, storedMD4);
+			case ENGINE_BLOCK_CHANGED:
+				printf("%s/%s %s -> %s\n", _currentPosHR, _totalSizeHR, readingChecksum, storedChecksum);
 				break;
 
-			case PROGRESS_NOT_EXISTENT:
-				printf("%s/%s %s -> added\n", _currentPosHR, _totalSizeHR, readingMD4);
+			case ENGINE_BLOCK_ADDED:
+				printf("%s/%s %s -> added\n", _currentPosHR, _totalSizeHR, readingChecksum);
 				break;
 		}
 
@@ -179,14 +270,36 @@ void showProgressEnd(int reportMode) {
 	}
 }
 
-void showStartingInfo(char *sourceFilename, char *destFilename, uint64_t sourceSize, uint64_t blockSize) {
-	char _blockSizeHR[100];
-	char _sourceSizeHR[100];
+// The engine calls these with the report mode as context.
+typedef struct {
+	int reportMode;
+	// for tests: exits without cleaning up once that many blocks are done,
+	// as if the machine had gone down
+	uint64_t crashAfterBlocks;
+	uint64_t blocksDone;
+} ProgressContext;
+
+void showEngineProgress(void *context, uint64_t position, uint64_t size, const unsigned char *digest,
+	const unsigned char *storedDigest, int digestSize, int state) {
 
-	makeHumanReadableSize(_blockSizeHR, blockSize);
-	makeHumanReadableSize(_sourceSizeHR, sourceSize);
+	ProgressContext *progress = context;
+
+	// the engine reports a block before writing it, so this is the one after
+	if (progress->crashAfterBlocks && progress->blocksDone++ == progress->crashAfterBlocks) {
+		_exit(1);
+	}
 
-	printf("%s -> %s, %s, block size = %s\n", sourceFilename, destFilename, _sourceSizeHR, _blockSizeHR);
+	showProgress(position, size, digest, storedDigest, digestSize, state, progress->reportMode);
+}
+
+void showEngineNote(void *context, int level, const char *message) {
+	int reportMode = ((ProgressContext *) context)->reportMode;
+
+	if (level == ENGINE_INFO && reportMode == REPORT_MODE_VERBOSE) {
+		printf("%s\n", message);
+	} else if (level == ENGINE_NOTE && reportMode != REPORT_MODE_QUIET) {
+		printf("Note: %s\n", message);
+	}
 }
 
 void showElapsedTime(uint64_t elapsedTime) {
@@ -197,98 +310,157 @@ void showElapsedTime(uint64_t elapsedTime) {
 	printf("Elapsed %s\n", _elapsedTimeHR);
 }
 
-off_t fileSize(char *filename) {
- 	struct stat fileStat;
+void showThrottled(Throttle *throttle) {
+	if (throttle) {
+		char waitedHR[200];
+		makeHumanReadableTime(waitedHR, throttle->waitedMicroseconds / 1000000);
+		printf("Throttled for %s\n", waitedHR);
+	}
+}
 
-	if (stat(filename,&fileStat) == -1) {
-		return -1;
+int parseSyncPolicy(char *argument, uint64_t *syncEveryBytes) {
+	if (strcmp(argument, "per-block") == 0) {
+		return SYNC_POLICY_PER_BLOCK;
 	}
 
-	return fileStat.st_size;
+	if (strcmp(argument, "end") == 0) {
+		return SYNC_POLICY_END;
+	}
+
+	int megabytes = atoi(argument);
+	if (megabytes < 1) {
+		printAndFail("Sync policy must be \"per-block\", \"end\" or a number of MB\n");
+	}
+
+	*syncEveryBytes = (uint64_t) megabytes * 1024 * 1024;
+	return SYNC_POLICY_EVERY_MB;
 }
 
-int createEmptyFile(char *filename) {
-	FILE *f = fopen(filename, "w");
+// Bytes per second, or K, M or G of them.
+uint64_t parseRate(char *argument, char *option) {
+	char *suffix;
+	double rate = strtod(argument, &suffix);
+
+	switch (*suffix) {
+		case 'K':
+		case 'k':
+			rate *= 1024;
+			suffix++;
+			break;
+		case 'M':
+		case 'm':
+			rate *= 1024 * 1024;
+			suffix++;
+			break;
+		case 'G':
+		case 'g':
+			rate *= 1024 * 1024 * 1024;
+			suffix++;
+			break;
+	}
 
-	if (f == NULL) {
-		return 0;
+	if (suffix == argument || *suffix || rate < 1) {
+		printAndFail("%s must be a positive number, optionally followed by K, M or G\n", option);
 	}
+	return (uint64_t) rate;
+}
 
-	fclose(f);
+// "<from>:<to>" in MB, either of them may be left out.
+void parseRange(char *argument, uint64_t *from, uint64_t *to) {
+	char *separator = strchr(argument, ':');
+	if (separator == NULL) {
+		printAndFail("Range must be given as <from>:<to> in MB\n");
+	}
 
-	return 1;
+	*from = (uint64_t) atoll(argument) * 1024 * 1024;
+	*to = separator[1] ? (uint64_t) atoll(separator + 1) * 1024 * 1024 : UINT64_MAX;
+	if (*to <= *from) {
+		printAndFail("Range must be given as <from>:<to> in MB\n");
+	}
 }
 
-void updateBlockInFile(char *block, FILE *source, FILE *dest, uint64_t readBytes, int sparseMode,
-	char *readingMD4, char *storedMD4, char *zeroBlockMD4) {
-
-	if (fseeko(dest, ftello(source)-readBytes, SEEK_SET) == -1) {
-		printAndFail("Failed to seek on file: %s\n", strerror(errno));
+MerkleTree *openMerkleTree(char *merkleFilename) {
+	MerkleTree *tree = merkleOpen(merkleFilename);
+	if (tree == NULL) {
+		printAndFail("Cannot open checksum tree %s: %s (a complete run without --cdc creates it)\n", merkleFilename, strerror(errno));
 	}
+	return tree;
+}
 
-	int isSourceBlockZero = strcmp(readingMD4, zeroBlockMD4) == 0 ? 1 : 0;
+int showMerkleRoot(char *merkleFilename) {
+	MerkleTree *tree = openMerkleTree(merkleFilename);
 
-	int shouldWriteBlock = 0;
+	char root[HASH_MAX_HEX_SIZE];
+	hashToHex(root, (unsigned char *) merkleRoot(tree), tree->hashAlgorithm->digestSize);
+	printf("%s\n", root);
 
-	if (sparseMode == SPARSE_MODE_ON) {
-		// Source block is zero, but destination block exists
-		// and it has a different checksum (because if the checksums
-		// were equal - this function wouldn't have called);
-		// This means previous data is not zero and must be overwritten explicitly.
-		if (isSourceBlockZero && storedMD4) {
-			shouldWriteBlock = 1;
+	merkleClose(tree);
+	return 0;
+}
 
-		// Source block is zero, but destination block doesn't exists - we can just seek
-		// and make it sparse.
-		} else if (isSourceBlockZero) {
-			// Actually seek here does nothing, but we still do just to check for possible error.
-			if (fseeko(dest, readBytes, SEEK_CUR) == -1) {
-				printAndFail("Failed to sparse seek in file: %s\n", strerror(errno));
-			}
-			shouldWriteBlock = 0;
+// Reads back the destination blocks in [from, to) and compares them with the
+// checksum tree, after making sure the tree's nodes above them still add up
+// to its root. Returns 1 if any block differs.
+int verifyRange(char *destFilename, char *merkleFilename, uint64_t from, uint64_t to, int reportMode) {
+	MerkleTree *tree = openMerkleTree(merkleFilename);
+	int digestSize = tree->hashAlgorithm->digestSize;
+
+	uint64_t first = from / tree->blockSize;
+	uint64_t last = to == UINT64_MAX ? tree->blocksCount : (to + tree->blockSize - 1) / tree->blockSize;
+	if (last > tree->blocksCount) {
+		last = tree->blocksCount;
+	}
 
-		// Source block is not zero.
-		} else {
-			shouldWriteBlock = 1;
-		}
+	if (first < last && merkleVerify(tree, first, last - 1) == -1) {
+		printAndFail("Checksum tree %s doesn't add up to its root; remove it and run bigsync again to rebuild it\n", merkleFilename);
+	}
 
-	// In no sparse mode we have to always overwrite destination block.
-	} else {
-		shouldWriteBlock = 1;
+	int destFd = open(destFilename, O_RDONLY);
+	if (destFd == -1) {
+		printAndFail("Cannot open %s: %s\n", destFilename, strerror(errno));
 	}
 
-	if (shouldWriteBlock) {
-		if (fwrite(block, 1, readBytes, dest) != readBytes) {
-			printAndFail("Failed to write to file: %s\n", strerror(errno));
-		}
+	char *block = malloc(tree->blockSize);
+	if (block == NULL) {
+		printAndFail("Cannot allocate memory: %s\n", strerror(errno));
+	}
 
-		if (fsync(fileno(dest)) == -1) {
-			printAndFail("Failed to sync destination file: %s\n", strerror(errno));
+	uint64_t differentCount = 0;
+	uint64_t index;
+	for (index = first; index < last; index++) {
+		off_t offset = index * tree->blockSize;
+		uint64_t length = tree->sourceSize - offset < tree->blockSize ? tree->sourceSize - offset : tree->blockSize;
+
+		// a destination that is too short reads as zeros, and won't match
+		if (utilReadZeroFilled(destFd, block, length, offset) == -1) {
+			printAndFail("Cannot read %s: %s\n", destFilename, strerror(errno));
 		}
-	}
-}
 
-void updateMD4InChecksumsFile(char *readingMD4, FILE *checksumsFile, int doReplaceLastChecksumOrAdd) {
-	char writeMD4[34];
-	sprintf(writeMD4, "%s\n", readingMD4);
+		unsigned char digest[HASH_MAX_DIGEST_SIZE];
+		hashBuffer(tree->hashAlgorithm, (unsigned char *) block, length, digest);
 
-	if (doReplaceLastChecksumOrAdd == CHECKSUM_REPLACE) {
-		if (fseeko(checksumsFile, -33, SEEK_CUR) == -1) {
-			printAndFail("Failed to seek on file: %s\n", strerror(errno));
+		if (memcmp(digest, merkleNode(tree, 0, index), digestSize) != 0) {
+			differentCount++;
+			if (reportMode != REPORT_MODE_QUIET) {
+				printf("Block %" PRIu64 " at %" PRIu64 " differs\n", index, (uint64_t) offset);
+			}
 		}
 	}
 
-	if (fputs(writeMD4, checksumsFile) == EOF) {
-		printAndFail("Failed to write to file: %s\n", strerror(errno));
+	if (reportMode != REPORT_MODE_QUIET) {
+		printf("Verified %" PRIu64 " block(s) of %s, %" PRIu64 " differ\n", last > first ? last - first : 0,
+			destFilename, differentCount);
 	}
-}
-
-void truncateAndCloseChecksumsFile(FILE *checksumsFile, char *checksumsFilename) {
-	uint64_t checksumsFileTruncation = ftell(checksumsFile);
-	if (ftruncate(fileno(checksumsFile), checksumsFileTruncation) == -1) {
-		printAndFail("Failed to truncate file %s: %s\n", checksumsFilename, strerror(errno));
+	if (reportMode == REPORT_MODE_VERBOSE) {
+		char root[HASH_MAX_HEX_SIZE];
+		hashToHex(root, (unsigned char *) merkleRoot(tree), digestSize);
+		printf("Root = %s\n", root);
 	}
-	fclose(checksumsFile);
+
+	free(block);
+	close(destFd);
+	merkleClose(tree);
+	return differentCount > 0 ? 1 : 0;
 }
 
 char *createDestFilenamePath(char *destFilenameArgument, char *sourceFilename) {
@@ -318,28 +490,211 @@ char *createDestFilenamePath(char *destFilenameArgument, char *sourceFilename) {
 	return destFilenameNormalized;
 }
 
-void checkForErrorAndExit(FILE *file, char *fileName) {
-	if (ferror(file)) {
-		printAndFail("Cannot read %s at %" PRId64 ": %s\n", fileName, ftello(file), strerror(errno));
+Store *openStore(char *storeDirectory, const HashAlgorithm *hashAlgorithm) {
+	char storeError[STORE_ERROR_SIZE];
+
+	Store *store = storeOpen(storeDirectory, hashAlgorithm, storeError);
+	if (store == NULL) {
+		printAndFail("%s\n", storeError);
 	}
+	return store;
 }
 
-void calcMD4(char *block, uint64_t size, char *md4Result) {
-	unsigned char digest[16];
-	MD4_CTX mdContext;
-	MD4Init (&mdContext);
-	MD4Update (&mdContext, block, size);
-	MD4Final (digest, &mdContext);
+// --restore: puts the source of a --cdc or --store destination back
+// together, checking every chunk against its digest on the way.
+int restoreChunks(char *destFilename, char *checksumsFilename, char *storeDirectory, char *restoreFilename, int reportMode) {
+	char checksumsError[CHECKSUMS_ERROR_SIZE];
+	Store *store = NULL;
 
-	char md4[33];
-	bzero(md4, 33);
+	if (fileSize(checksumsFilename) <= 0) {
+		printAndFail("Cannot open %s: nothing to restore from\n", checksumsFilename);
+	}
+
+	Checksums *checksums = checksumsOpen(checksumsFilename, hashAlgorithmById(HASH_MD4), 1, checksumsError);
+	if (checksums == NULL) {
+		printAndFail("%s\n", checksumsError);
+	}
+	if (!(checksums->flags & CHECKSUMS_FLAG_CHUNKS)) {
+		printAndFail("%s is a copy of its source already, not a container of chunks\n", destFilename);
+	}
+
+	int destFd;
+	if (checksums->flags & CHECKSUMS_FLAG_STORE) {
+		if (storeDirectory == NULL) {
+			printAndFail("%s is kept in a store, which has to be given with --store\n", checksumsFilename);
+		}
+		store = openStore(storeDirectory, checksums->hashAlgorithm);
+		destFd = store->packFd;
+		destFilename = storeDirectory;
+	} else {
+		destFd = open(destFilename, O_RDONLY);
+		if (destFd == -1) {
+			printAndFail("Cannot open %s: %s\n", destFilename, strerror(errno));
+		}
+	}
+
+	FILE *restoreFile = fopen(restoreFilename, "w");
+	if (restoreFile == NULL) {
+		printAndFail("Cannot create %s: %s\n", restoreFilename, strerror(errno));
+	}
+
+	unsigned char *chunk = NULL;
+	uint64_t chunkCapacity = 0;
+	unsigned char *uncompressed = NULL;
+	uint64_t uncompressedCapacity = 0;
+	uint64_t position = 0;
+	uint64_t i;
+
+	for (i = 0; i < checksums->blocksCount; i++) {
+		uint64_t offset, length;
+		checksumsGetChunk(checksums, i, &offset, &length);
+
+		if (length > chunkCapacity) {
+			free(chunk);
+			chunk = malloc(length);
+			if (chunk == NULL) {
+				printAndFail("Cannot allocate memory: %s\n", strerror(errno));
+			}
+			chunkCapacity = length;
+		}
+
+		uint64_t done = 0;
+		while (done < length) {
+			ssize_t readBytes = pread(destFd, chunk + done, length - done, offset + done);
+			if (readBytes <= 0) {
+				printAndFail("Cannot read chunk %" PRIu64 " from %s: %s\n", i, destFilename,
+					readBytes == 0 ? "file is too short" : strerror(errno));
+			}
+			done += readBytes;
+		}
+
+		unsigned char *data = chunk;
+		if (checksums->flags & CHECKSUMS_FLAG_COMPRESSED) {
+			// nothing compresses more than 255 to 1, so a bigger length is damage
+			uint64_t uncompressedLength = length >= COMPRESS_FRAME_HEADER_SIZE ? compressFrameLength(chunk) : 0;
+			if (length < COMPRESS_FRAME_HEADER_SIZE || uncompressedLength / 256 > length) {
+				printAndFail("Chunk %" PRIu64 " at %" PRIu64 " of %s is damaged\n", i, offset, destFilename);
+			}
+
+			if (uncompressedLength > uncompressedCapacity) {
+				free(uncompressed);
+				uncompressed = malloc(uncompressedLength);
+				if (uncompressed == NULL) {
+					printAndFail("Cannot allocate memory: %s\n", strerror(errno));
+				}
+				uncompressedCapacity = uncompressedLength;
+			}
+
+			if (decompressFrame(chunk, length, uncompressed, uncompressedCapacity) == -1) {
+				printAndFail("Chunk %" PRIu64 " at %" PRIu64 " of %s is damaged\n", i, offset, destFilename);
+			}
+			data = uncompressed;
+			length = uncompressedLength;
+		}
+
+		unsigned char digest[HASH_MAX_DIGEST_SIZE];
+		hashBuffer(checksums->hashAlgorithm, data, length, digest);
+		if (memcmp(digest, checksumsGet(checksums, i), checksums->hashAlgorithm->digestSize) != 0) {
+			printAndFail("Chunk %" PRIu64 " at %" PRIu64 " of %s is damaged\n", i, offset, destFilename);
+		}
+
+		if (fwrite(data, 1, length, restoreFile) != length) {
+			printAndFail("Failed to write to file %s: %s\n", restoreFilename, strerror(errno));
+		}
+		position += length;
+	}
+
+	if (position != checksums->sourceSize) {
+		printAndFail("Chunks of %s add up to %" PRIu64 " bytes rather than %" PRIu64 "\n", destFilename,
+			position, checksums->sourceSize);
+	}
+
+	if (fflush(restoreFile) == EOF || fsync(fileno(restoreFile)) == -1 || fclose(restoreFile) == EOF) {
+		printAndFail("Failed to write to file %s: %s\n", restoreFilename, strerror(errno));
+	}
+
+	if (reportMode != REPORT_MODE_QUIET) {
+		char positionHR[100];
+		makeHumanReadableSize(positionHR, position);
+		printf("Restored %s from %" PRIu64 " chunk(s) of %s\n", positionHR, checksums->blocksCount, destFilename);
+	}
+
+	free(chunk);
+	free(uncompressed);
+	if (store) {
+		storeClose(store);
+	} else {
+		close(destFd);
+	}
+	checksumsClose(checksums, checksums->blocksCount, checksums->sourceSize);
+	return 0;
+}
+
+void loadGenerations(char *checksumsFilename, Generations *generations) {
+	char generationsError[GENERATION_ERROR_SIZE];
+
+	if (generationsLoad(checksumsFilename, generations, generationsError) == -1) {
+		printAndFail("%s\n", generationsError);
+	}
+}
+
+// --list-generations
+int listGenerations(char *destFilename, char *checksumsFilename) {
+	Generations generations;
+	loadGenerations(checksumsFilename, &generations);
+
+	if (generations.count == 0) {
+		printf("No generations of %s are kept\n", destFilename);
+	}
 
 	int i;
-	for (i = 0; i < 16; i++) {
-		sprintf(md4, "%s%02x", md4, digest[i]);
+	for (i = 0; i < generations.count; i++) {
+		Generation *generation = generations.list[i];
+		char createdAt[64];
+		char sourceSizeHR[100];
+
+		strftime(createdAt, sizeof(createdAt), "%Y-%m-%d %H:%M:%S", localtime(&generation->createdAt));
+		makeHumanReadableSize(sourceSizeHR, generation->sourceSize);
+		printf("%u  %s  %s, %zu block(s) changed since%s\n", generation->number, createdAt, sourceSizeHR,
+			generation->recordsCount, generation->isComplete ? "" : " (interrupted)");
+	}
+
+	generationsFree(&generations);
+	return 0;
+}
+
+// --restore with --generation: writes out the destination as it was before
+// the run after that generation.
+int restoreGeneration(char *destFilename, char *checksumsFilename, uint32_t number, char *restoreFilename, int reportMode) {
+	char generationsError[GENERATION_ERROR_SIZE];
+	Generations generations;
+	loadGenerations(checksumsFilename, &generations);
+
+	int destFd = open(destFilename, O_RDONLY);
+	if (destFd == -1) {
+		printAndFail("Cannot open %s: %s\n", destFilename, strerror(errno));
+	}
+
+	int restoreFd = open(restoreFilename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (restoreFd == -1) {
+		printAndFail("Cannot create %s: %s\n", restoreFilename, strerror(errno));
+	}
+
+	if (generationsRestore(&generations, number, destFd, restoreFd, generationsError) == -1) {
+		printAndFail("Cannot restore generation %u of %s: %s\n", number, destFilename, generationsError);
+	}
+
+	if (close(restoreFd) == -1) {
+		printAndFail("Failed to write to file %s: %s\n", restoreFilename, strerror(errno));
+	}
+	close(destFd);
+
+	if (reportMode != REPORT_MODE_QUIET) {
+		printf("Restored generation %u of %s\n", number, destFilename);
 	}
 
-	strncpy(md4Result, md4, 33);
+	generationsFree(&generations);
+	return 0;
 }
 
 int main(int argc, char *argv[]) {
@@ -350,29 +705,56 @@ int main(int argc, char *argv[]) {
 
 	int shouldAssumeZeroSourceSize = 0;
 
- 	off_t sourceSize = 0;
 	char *sourceFilename = NULL;
-	FILE *sourceFile = NULL;
-
 	char *destFilenameArgument = NULL;
-	FILE *destFile = NULL;
-
-	char *checksumsFilename = NULL;
-	FILE *checksumsFile = NULL;
-
-	char *block = NULL;
-	uint64_t readBytes = 0;
-	off_t totalBytesRead = 0;
 
-	off_t totalBytesWritten = 0;
-	off_t totalBlocksChanged = 0;
+	int shouldResume = 1;
+	int shouldUseExtentHints = 0;
+	int ioEngine = ENGINE_IO_STDIO;
+	int queueDepth = ENGINE_DEFAULT_QUEUE_DEPTH;
+	int shouldUseDirectIO = 0;
+	int shouldDropCache = 0;
+	uint64_t crashAfterBlocks = 0;
+	int syncPolicy = SYNC_POLICY_PER_BLOCK;
+	uint64_t syncEveryBytes = 0;
+	int isSyncPolicyGiven = 0;
+	int shouldServe = 0;
+	char *rsh = REMOTE_DEFAULT_RSH;
+	char *remoteCommand = REMOTE_DEFAULT_COMMAND;
+	int compressCodec = -1;
+	uint64_t readLimit = 0;
+	uint64_t writeLimit = 0;
+	uint64_t iopsLimit = 0;
+	char *schedule = NULL;
+	Throttle *throttle = NULL;
+	char *statsJsonTarget = NULL;
+	int statsJsonFd = -1;
+	char *prometheusFilename = NULL;
 
-	off_t blockSize = 1024 * 1024 * 15;
-
-	char readingMD4[34];
-	char storedMD4[34];
-
-	char sourceSizeHR[100];
+	char *checksumsFilename = NULL;
+	int threadsCount = engineDefaultThreadsCount();
+
+	uint64_t blockSize = ENGINE_DEFAULT_BLOCK_SIZE;
+	int isBlockSizeGiven = 0;
+	uint32_t leafSize = 0;
+	int isLeafSizeGiven = 0;
+	int shouldVerifyRange = 0;
+	uint64_t verifyFrom = 0;
+	uint64_t verifyTo = 0;
+	int shouldShowRoot = 0;
+	char *merkleFilename = NULL;
+	char *batchPath = NULL;
+	int batchJobsCount = DEFAULT_BATCH_JOBS;
+	int batchDeviceJobsCount = DEFAULT_DEVICE_JOBS;
+	Batch *batch = NULL;
+	int shouldUseChunks = 0;
+	char *restoreFilename = NULL;
+	char *storeDirectory = NULL;
+	int keepGenerations = -1;
+	uint32_t generationNumber = 0;
+	int shouldListGenerations = 0;
+
+	const HashAlgorithm *hashAlgorithm = NULL;
 
 	struct timeval startedAt;
 	struct timeval endedAt;
@@ -393,16 +775,88 @@ int main(int argc, char *argv[]) {
 		{ "rebuild",   no_argument,       NULL,       'r' },
 		{ "notruncate", no_argument,      NULL,       't' },
 		{ "checksum",  required_argument, NULL,       'c' },
+		{ "threads",   required_argument, NULL,       'j' },
+		{ "hash",      required_argument, NULL,       'H' },
+		{ "sync-policy", required_argument, NULL,     'P' },
+		{ "no-resume", no_argument,       NULL,       'R' },
+		{ "leafsize",  required_argument, NULL,       'L' },
+		{ "extent-hints", no_argument,    NULL,       'E' },
+		{ "io-engine", required_argument, NULL,       'I' },
+		{ "queue-depth", required_argument, NULL,     'Q' },
+		{ "direct",    no_argument,       NULL,       'D' },
+		{ "fadvise",   no_argument,       NULL,       'F' },
+		{ "batch",     required_argument, NULL,       'B' },
+		{ "jobs",      required_argument, NULL,       'J' },
+		{ "device-jobs", required_argument, NULL,     'K' },
+		{ "verify-range", required_argument, NULL,    'Y' },
+		{ "root",      no_argument,       NULL,       'T' },
+		{ "cdc",       no_argument,       NULL,       'C' },
+		{ "restore",   required_argument, NULL,       'U' },
+		{ "store",     required_argument, NULL,       'G' },
+		{ "keep-generations", required_argument, NULL, 'M' },
+		{ "generation", required_argument, NULL,      'N' },
+		{ "list-generations", no_argument, NULL,      'A' },
+		{ "serve",     no_argument,       NULL,       'W' },
+		{ "rsh",       required_argument, NULL,       'X' },
+		{ "remote-command", required_argument, NULL,  'Z' },
+		{ "compress",  required_argument, NULL,       'O' },
+		{ "read-limit", required_argument, NULL,      'e' },
+		{ "write-limit", required_argument, NULL,     'w' },
+		{ "iops-limit", required_argument, NULL,      'i' },
+		{ "schedule",  required_argument, NULL,       'y' },
+		{ "stats-json", required_argument, NULL,      'f' },
+		{ "prometheus", required_argument, NULL,      'g' },
 		{ "zero",      no_argument,       NULL,       '@' }, // test-only mode
+		{ "crash-after", required_argument, NULL,     '!' }, // test-only mode
 		{ NULL,        0,                 NULL,       0   }
 	};
 
-	while ((ch = getopt_long(argc, argv, "s:d:b:hvqStc:@", longopts, NULL)) != -1) {
+	while ((ch = getopt_long(argc, argv, "s:d:b:hvqStc:j:H:P:RL:EI:Q:DFB:J:K:Y:TCU:G:M:N:AWX:Z:O:e:w:i:y:f:g:@!:", longopts, NULL)) != -1) {
 		switch (ch) {
 			case '@':
 				shouldAssumeZeroSourceSize = 1;
 				break;
 
+			case '!':
+				crashAfterBlocks = strtoull(optarg, NULL, 10);
+				break;
+
+			case 'R':
+				shouldResume = 0;
+				break;
+
+			case 'E':
+				shouldUseExtentHints = 1;
+				break;
+
+			case 'D':
+				// whatever O_DIRECT can't do goes through the page cache,
+				// and shouldn't stay there either
+				shouldUseDirectIO = 1;
+				shouldDropCache = 1;
+				break;
+
+			case 'F':
+				shouldDropCache = 1;
+				break;
+
+			case 'I':
+				if (strcmp(optarg, "stdio") == 0) {
+					ioEngine = ENGINE_IO_STDIO;
+				} else if (strcmp(optarg, "uring") == 0) {
+					ioEngine = ENGINE_IO_URING;
+				} else {
+					printAndFail("I/O engine must be \"stdio\" or \"uring\"\n");
+				}
+				break;
+
+			case 'Q':
+				queueDepth = atoi(optarg);
+				if (queueDepth < 1 || queueDepth > 4096) {
+					printAndFail("Queue depth must be between 1 and 4096\n");
+				}
+				break;
+
 			case 's':
 				sourceFilename = strdup(optarg);
 				break;
@@ -412,14 +866,125 @@ int main(int argc, char *argv[]) {
 				break;
 
 			case 'b':
+				isBlockSizeGiven = 1;
 				if (strncmp(optarg, "_", 1) == 0) {
 					blockSize = 100000;
+				} else if (strcmp(optarg, "auto") == 0) {
+					blockSize = ENGINE_BLOCK_SIZE_AUTO;
 				} else {
 					blockSize = atoi(optarg);
 					blockSize = blockSize * 1024 * 1024;
 				}
 				break;
 
+			case 'B':
+				batchPath = strdup(optarg);
+				break;
+
+			case 'J':
+				batchJobsCount = atoi(optarg);
+				if (batchJobsCount < 1) {
+					printAndFail("Number of jobs must be a positive number\n");
+				}
+				break;
+
+			case 'K':
+				batchDeviceJobsCount = atoi(optarg);
+				if (batchDeviceJobsCount < 1) {
+					printAndFail("Number of jobs per device must be a positive number\n");
+				}
+				break;
+
+			case 'Y':
+				shouldVerifyRange = 1;
+				parseRange(optarg, &verifyFrom, &verifyTo);
+				break;
+
+			case 'T':
+				shouldShowRoot = 1;
+				break;
+
+			case 'C':
+				shouldUseChunks = 1;
+				break;
+
+			case 'U':
+				restoreFilename = strdup(optarg);
+				break;
+
+			case 'G':
+				storeDirectory = strdup(optarg);
+				break;
+
+			case 'M':
+				keepGenerations = atoi(optarg);
+				if (keepGenerations < 0) {
+					printAndFail("Number of generations to keep can't be negative\n");
+				}
+				break;
+
+			case 'N':
+				generationNumber = strtoul(optarg, NULL, 10);
+				if (generationNumber == 0) {
+					printAndFail("Generations are numbered from 1\n");
+				}
+				break;
+
+			case 'A':
+				shouldListGenerations = 1;
+				break;
+
+			case 'W':
+				shouldServe = 1;
+				break;
+
+			case 'X':
+				rsh = strdup(optarg);
+				break;
+
+			case 'Z':
+				remoteCommand = strdup(optarg);
+				break;
+
+			case 'O':
+				compressCodec = compressCodecByName(optarg);
+				if (compressCodec == -1) {
+					printAndFail("Unknown compression \"%s\", supported are: none, lz4, lz4hc\n", optarg);
+				}
+				break;
+
+			case 'e':
+				readLimit = parseRate(optarg, "Read limit");
+				break;
+
+			case 'w':
+				writeLimit = parseRate(optarg, "Write limit");
+				break;
+
+			case 'i':
+				if (atoll(optarg) < 1) {
+					printAndFail("IOPS limit must be a positive number\n");
+				}
+				iopsLimit = atoll(optarg);
+				break;
+
+			case 'y':
+				schedule = strdup(optarg);
+				break;
+
+			case 'f':
+				statsJsonTarget = strdup(optarg);
+				break;
+
+			case 'g':
+				prometheusFilename = strdup(optarg);
+				break;
+
+			case 'L':
+				isLeafSizeGiven = 1;
+				leafSize = atoi(optarg) * 1024;
+				break;
+
 			case 'v':
 				reportMode = REPORT_MODE_VERBOSE;
 				break;
@@ -444,6 +1009,25 @@ int main(int argc, char *argv[]) {
 				checksumsFilename = strdup(optarg);
 				break;
 
+			case 'j':
+				threadsCount = atoi(optarg);
+				if (threadsCount < 1) {
+					printAndFail("Number of threads must be a positive number\n");
+				}
+				break;
+
+			case 'P':
+				syncPolicy = parseSyncPolicy(optarg, &syncEveryBytes);
+				isSyncPolicyGiven = 1;
+				break;
+
+			case 'H':
+				hashAlgorithm = hashAlgorithmByName(optarg);
+				if (hashAlgorithm == NULL) {
+					printAndFail("Unknown hash \"%s\", supported are: %s\n", optarg, hashAlgorithmNames());
+				}
+				break;
+
 			case 'V':
 				showVersion();
 				exit(1);
@@ -457,153 +1041,197 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
-	if (sourceFilename == NULL || destFilenameArgument == NULL) {
-		showHelp();
-		exit(1);
+	if (readLimit || writeLimit || iopsLimit) {
+		char throttleError[THROTTLE_ERROR_SIZE];
+		throttle = throttleCreate(readLimit, writeLimit, iopsLimit);
+		if (throttle == NULL) {
+			printAndFail("Cannot allocate memory: %s\n", strerror(errno));
+		}
+		if (schedule && throttleSetSchedule(throttle, schedule, throttleError) == -1) {
+			printAndFail("%s\n", throttleError);
+		}
+	} else if (schedule) {
+		printAndFail("--schedule says when --read-limit, --write-limit or --iops-limit apply, give one of them\n");
 	}
 
-	char *destFilename = createDestFilenamePath(destFilenameArgument, sourceFilename);
-
-	sourceSize = fileSize(sourceFilename);
-	if (shouldAssumeZeroSourceSize) {
-		sourceSize = 0;
+	// opened once, so that the runs of a batch share it
+	if (statsJsonTarget) {
+		char statsError[STATS_ERROR_SIZE];
+		statsJsonFd = statsOpenJson(statsJsonTarget, statsError);
+		if (statsJsonFd == -1) {
+			printAndFail("%s\n", statsError);
+		}
 	}
 
-	if (sourceSize < 0) {
-		printAndFail("File %s does not exists or could not be read\n", sourceFilename);
+	// the other end of a remote destination, talking over stdin and stdout
+	if (shouldServe) {
+		return remoteServe(STDIN_FILENO, STDOUT_FILENO);
 	}
 
-	makeHumanReadableSize(sourceSizeHR, sourceSize);
-
-	gettimeofday(&startedAt, &tzp);
+	int isRemote = destFilenameArgument && remoteIsPath(destFilenameArgument);
 
-	if (reportMode == REPORT_MODE_VERBOSE) {
-		showStartingInfo(sourceFilename, destFilename, sourceSize, blockSize);
-	}
-
-	if (!shouldOnlyRebuildChecksumsFile) {
-		if (fileSize(destFilename) < 0) {
-			if (!createEmptyFile(destFilename)) {
-				printAndFail("Cannot create %s: %s\n", destFilename, strerror(errno));
+	// these only look at the destination and its checksum tree
+	if ((shouldVerifyRange || shouldShowRoot || restoreFilename || shouldListGenerations) && destFilenameArgument) {
+		if (isRemote) {
+			printAndFail("This only works on a local destination\n");
+		}
+		char *destFilename = sourceFilename ?
+			createDestFilenamePath(destFilenameArgument, sourceFilename) : strdup(destFilenameArgument);
+		if (storeDirectory == NULL && (checksumsPeekFlags(destFilename) & CHECKSUMS_FLAG_STORE)) {
+			printAndFail("%s is kept in a store, which has to be given with --store\n", destFilename);
+		}
+		if (checksumsFilename == NULL) {
+			// with a store, the destination is the list of its blocks
+			if (storeDirectory) {
+				checksumsFilename = strdup(destFilename);
+			} else {
+				asprintf(&checksumsFilename, "%s.bigsync", destFilename);
 			}
 		}
+		asprintf(&merkleFilename, "%s.merkle", checksumsFilename);
 
-		destFile = fopen(destFilename, "r+");
-		if (destFile == NULL) {
-			printAndFail("Cannot open %s: %s\n", destFilename, strerror(errno));
+		if (shouldListGenerations) {
+			return listGenerations(destFilename, checksumsFilename);
 		}
-
-	} else {
-		printf("Note: only rebuilding checksum file\n");
-	}
-
-	sourceFile = fopen(sourceFilename, "r");
-	if (sourceFile == NULL) {
-		printAndFail("Cannot open %s: %s\n", sourceFilename, strerror(errno));
-	}
-
-	if (checksumsFilename == NULL) {
-		asprintf(&checksumsFilename, "%s.bigsync", destFilename);
+		if (restoreFilename && generationNumber) {
+			return restoreGeneration(destFilename, checksumsFilename, generationNumber, restoreFilename, reportMode);
+		}
+		if (restoreFilename) {
+			return restoreChunks(destFilename, checksumsFilename, storeDirectory, restoreFilename, reportMode);
+		}
+		if (shouldShowRoot) {
+			return showMerkleRoot(merkleFilename);
+		}
+		return verifyRange(destFilename, merkleFilename, verifyFrom, verifyTo, reportMode);
 	}
 
-	if (fileSize(checksumsFilename) < 0) {
-		if (!createEmptyFile(checksumsFilename)) {
-			printAndFail("Cannot create %s: %s\n", checksumsFilename, strerror(errno));
+	if (batchPath) {
+		if (sourceFilename || checksumsFilename) {
+			printAndFail("--batch takes the place of --source, and every file gets a checksum file of its own\n");
+		}
+		if (isRemote) {
+			printAndFail("--batch needs a local destination directory\n");
+		}
+		if (prometheusFilename) {
+			printAndFail("--prometheus describes a single run, use --stats-json with --batch\n");
 		}
 
-	} else {
-		if (fileSize(checksumsFilename) % 33 > 0) {
-			printAndFail("Size of checksums file %s is not dividable by 33, therefore it's broken.\n", checksumsFilename);
+		char batchError[CHECKSUMS_ERROR_SIZE];
+		batch = batchCreate();
+		if (batch == NULL) {
+			printAndFail("Cannot allocate memory: %s\n", strerror(errno));
+		}
+		if (batchLoad(batch, batchPath, destFilenameArgument, batchError, sizeof(batchError)) == -1) {
+			printAndFail("%s\n", batchError);
 		}
-	}
 
-	checksumsFile = fopen(checksumsFilename, "r+");
-	if (checksumsFile == NULL) {
-		printAndFail("Cannot open %s: %s\n", checksumsFilename, strerror(errno));
+	} else if (sourceFilename == NULL || destFilenameArgument == NULL) {
+		showHelp();
+		exit(1);
 	}
 
-	block = malloc(blockSize);
-	bzero(block, blockSize);
-
-	char zeroBlockMD4[33];
-	calcMD4(block, (uint64_t) blockSize, zeroBlockMD4);
-
-	while((readBytes = fread(block, 1, blockSize, sourceFile))) {
-		checkForErrorAndExit(sourceFile, sourceFilename);
-		totalBytesRead += readBytes;
-
-		readingMD4[0] = 0;
-		calcMD4(block, (uint64_t) readBytes, readingMD4);
-
-		storedMD4[0] = 0;
-		if (fgets(storedMD4, 34, checksumsFile)) {
-			storedMD4[32] = 0;
-
-			if (strncmp(storedMD4, readingMD4, 32) == 0) {
-				showProgress((uint64_t) ftello(sourceFile), sourceSize, readingMD4, storedMD4, PROGRESS_SAME, reportMode);
-
-			} else {
-				showProgress((uint64_t) ftello(sourceFile), sourceSize, readingMD4, storedMD4, PROGRESS_DIFFERENT, reportMode);
-
-				if (!shouldOnlyRebuildChecksumsFile) {
-					updateBlockInFile(block, sourceFile, destFile, readBytes, sparseMode, readingMD4, storedMD4, zeroBlockMD4);
-				}
-				updateMD4InChecksumsFile(readingMD4, checksumsFile, CHECKSUM_REPLACE);
-
-				totalBytesWritten += readBytes;
-				totalBlocksChanged++;
-			}
-
-		} else {
-			checkForErrorAndExit(checksumsFile, checksumsFilename);
-			showProgress(ftello(sourceFile), sourceSize, readingMD4, NULL, PROGRESS_NOT_EXISTENT, reportMode);
-
-			updateMD4InChecksumsFile(readingMD4, checksumsFile, CHECKSUM_ADD);
-
-			if (!shouldOnlyRebuildChecksumsFile) {
-				updateBlockInFile(block, sourceFile, destFile, readBytes, sparseMode, readingMD4, NULL, zeroBlockMD4);
-			}
-
-			totalBytesWritten += readBytes;
-			totalBlocksChanged++;
-		}
+	char *destFilename = NULL;
+	if (batch == NULL) {
+		destFilename = isRemote ?
+			strdup(destFilenameArgument) : createDestFilenamePath(destFilenameArgument, sourceFilename);
 	}
 
-	free(block);
-	showProgressEnd(reportMode);
-
-	off_t lastSourceFileOffset = ftello(sourceFile);
-
-	fclose(sourceFile);
-
-	truncateAndCloseChecksumsFile(checksumsFile, checksumsFilename);
-
-	// Append a single char and cut it off later, so that the file will be of the right size even if the last blocks were sparse
-	if (sparseMode == SPARSE_MODE_ON && !shouldOnlyRebuildChecksumsFile) {
-		if (reportMode == REPORT_MODE_VERBOSE) {
-			printf("Fixing sparse file\n");
-		}
+	gettimeofday(&startedAt, &tzp);
 
-		char trailer[1] = "Z";
-		fseeko(destFile, lastSourceFileOffset, SEEK_SET);
-		fwrite(trailer, 1, 1, destFile);
-		fclose(destFile);
+	Engine *engine = engineCreate(threadsCount);
+	if (engine == NULL) {
+		printAndFail("Cannot allocate memory: %s\n", strerror(errno));
+	}
+	engineSetHash(engine, hashAlgorithm);
+	engineSetBlockSize(engine, isBlockSizeGiven ? blockSize : 0);
+	if (isLeafSizeGiven) {
+		engineSetLeafSize(engine, leafSize);
 	}
+	engineSetChecksumsFile(engine, checksumsFilename);
+	engineSetSparse(engine, sparseMode == SPARSE_MODE_ON);
+	engineSetTruncate(engine, truncateMode == TRUNCATE_MODE_ON);
+	engineSetRebuildOnly(engine, shouldOnlyRebuildChecksumsFile);
+	engineSetResume(engine, shouldResume);
+	engineSetExtentHints(engine, shouldUseExtentHints);
+	engineSetIoEngine(engine, ioEngine, queueDepth);
+	engineSetCachePolicy(engine, shouldUseDirectIO, shouldDropCache);
+	if (isSyncPolicyGiven) {
+		engineSetSyncPolicy(engine, syncPolicy, syncEveryBytes);
+	}
+	engineSetChunks(engine, shouldUseChunks);
+	engineSetStore(engine, storeDirectory);
+	engineSetKeepGenerations(engine, keepGenerations);
+	engineSetCompression(engine, compressCodec);
+	engineSetRemoteShell(engine, rsh, remoteCommand);
+	engineSetThrottle(engine, throttle);
+	engineSetStats(engine, statsJsonFd, prometheusFilename);
+	// The files of a batch are synced quietly, only their outcome is told.
+	// Their engines share the context from threads of their own, so there it
+	// has to stay as it is: no counting blocks for --crash-after.
+	ProgressContext progressContext = { batch ? REPORT_MODE_QUIET : reportMode, batch ? 0 : crashAfterBlocks, 0 };
+	engineSetCallbacks(engine, showEngineProgress, showEngineNote, &progressContext);
+	engineSetSourceSizeUnknown(engine, shouldAssumeZeroSourceSize);
+
+	if (batch) {
+		if (batchRun(batch, engine, batchJobsCount, batchDeviceJobsCount, reportMode == REPORT_MODE_QUIET) == -1) {
+			printAndFail("Cannot start the batch: %s\n", strerror(errno));
+		}
+		engineDestroy(engine);
+
+		gettimeofday(&endedAt, &tzp);
+		if (reportMode != REPORT_MODE_QUIET) {
+			printf("Files synced = %d\nFiles failed = %d\n", batch->filesSynced, batch->filesFailed);
+			showGrandTotal(batch->totals.bytesRead, batch->totals.bytesWritten, batch->totals.blocksChanged);
+			showThrottled(throttle);
+			showElapsedTime(endedAt.tv_sec - startedAt.tv_sec);
+		}
 
-	if (reportMode == REPORT_MODE_VERBOSE) {
-		printf("Truncating file %s to %" PRId64 "\n", destFilename, (uint64_t) lastSourceFileOffset);
+		int result = batch->filesFailed > 0 ? 1 : 0;
+		batchDestroy(batch);
+		return result;
 	}
 
-	if (!shouldOnlyRebuildChecksumsFile && truncateMode) {
-		if (truncate(destFilename, lastSourceFileOffset) < 0) {
-			printAndFail("Failed to truncate %s: %s\n", destFilename, strerror(errno));
-		}
+	EngineTotals totals;
+	if (engineSync(engine, sourceFilename, destFilename, &totals) == -1) {
+		printAndFail("%s\n", engineError(engine));
 	}
+	engineDestroy(engine);
 
+	showProgressEnd(reportMode);
 	gettimeofday(&endedAt, &tzp);
 
 	if (reportMode == REPORT_MODE_VERBOSE) {
-		showGrandTotal(totalBytesRead, totalBytesWritten, totalBlocksChanged);
+		showGrandTotal(totals.bytesRead, totals.bytesWritten, totals.blocksChanged);
+
+		if (totals.isChunked) {
+			char containerSizeHR[100];
+			makeHumanReadableSize(containerSizeHR, totals.containerSize);
+			printf("Chunks = %" PRIu64 ", %" PRIu64 " of them new\n%s = %s\n", totals.chunksCount,
+				totals.blocksChanged, storeDirectory ? "Store" : "Container", containerSizeHR);
+		} else {
+			char merkleRootHex[HASH_MAX_HEX_SIZE];
+			hashToHex(merkleRootHex, totals.root, totals.digestSize);
+			printf("Root = %s\n", merkleRootHex);
+			if (sparseMode == SPARSE_MODE_ON) {
+				char totalBytesPunchedHR[100];
+				makeHumanReadableSize(totalBytesPunchedHR, totals.bytesPunched);
+				printf("Total punched = %s\n", totalBytesPunchedHR);
+			}
+			if (totals.isUsingExtentHints) {
+				printf("Total blocks skipped by extent hints = %" PRIu64 "\n", totals.blocksSkipped);
+			}
+			if (isRemote) {
+				char totalBytesSentHR[100];
+				makeHumanReadableSize(totalBytesSentHR, totals.bytesSent);
+				if (compressCodec > COMPRESS_NONE && totals.bytesToSend > 0) {
+					printf("Total sent = %s, %" PRIu64 "%% of the data with %s\n", totalBytesSentHR,
+						totals.bytesSent * 100 / totals.bytesToSend, compressCodecName(compressCodec));
+				} else {
+					printf("Total sent = %s\n", totalBytesSentHR);
+				}
+			}
+		}
+		showThrottled(throttle);
 		showElapsedTime(endedAt.tv_sec - startedAt.tv_sec);
 	}
 
@@ -0,0 +1,246 @@
+// BLAKE3 (CC0 / Apache 2.0), a straightforward portable port of the
+// reference implementation: one chunk at a time, no SIMD.
+
+#include <string.h>
+#include "blake3.h"
+
+#define CHUNK_START (1 << 0)
+#define CHUNK_END (1 << 1)
+#define PARENT (1 << 2)
+#define ROOT (1 << 3)
+
+static const uint32_t blake3IV[8] = {
+	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+	0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const uint8_t blake3MessagePermutation[16] = {
+	2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8
+};
+
+typedef struct {
+	uint32_t inputChainingValue[8];
+	uint32_t blockWords[16];
+	uint64_t counter;
+	uint32_t blockLength;
+	uint32_t flags;
+} Blake3Output;
+
+static inline uint32_t rotateRight(uint32_t x, int n) {
+	return (x >> n) | (x << (32 - n));
+}
+
+static inline void g(uint32_t *state, int a, int b, int c, int d, uint32_t mx, uint32_t my) {
+	state[a] = state[a] + state[b] + mx;
+	state[d] = rotateRight(state[d] ^ state[a], 16);
+	state[c] = state[c] + state[d];
+	state[b] = rotateRight(state[b] ^ state[c], 12);
+	state[a] = state[a] + state[b] + my;
+	state[d] = rotateRight(state[d] ^ state[a], 8);
+	state[c] = state[c] + state[d];
+	state[b] = rotateRight(state[b] ^ state[c], 7);
+}
+
+static void blake3Round(uint32_t *state, const uint32_t *m) {
+	g(state, 0, 4, 8, 12, m[0], m[1]);
+	g(state, 1, 5, 9, 13, m[2], m[3]);
+	g(state, 2, 6, 10, 14, m[4], m[5]);
+	g(state, 3, 7, 11, 15, m[6], m[7]);
+
+	g(state, 0, 5, 10, 15, m[8], m[9]);
+	g(state, 1, 6, 11, 12, m[10], m[11]);
+	g(state, 2, 7, 8, 13, m[12], m[13]);
+	g(state, 3, 4, 9, 14, m[14], m[15]);
+}
+
+static void blake3Compress(const uint32_t chainingValue[8], const uint32_t blockWords[16],
+	uint64_t counter, uint32_t blockLength, uint32_t flags, uint32_t out[16]) {
+
+	uint32_t state[16] = {
+		chainingValue[0], chainingValue[1], chainingValue[2], chainingValue[3],
+		chainingValue[4], chainingValue[5], chainingValue[6], chainingValue[7],
+		blake3IV[0], blake3IV[1], blake3IV[2], blake3IV[3],
+		(uint32_t) counter, (uint32_t) (counter >> 32), blockLength, flags
+	};
+
+	uint32_t m[16];
+	uint32_t permuted[16];
+	memcpy(m, blockWords, sizeof(m));
+
+	int round, i;
+	for (round = 0; round < 7; round++) {
+		blake3Round(state, m);
+		if (round == 6) {
+			break;
+		}
+		for (i = 0; i < 16; i++) {
+			permuted[i] = m[blake3MessagePermutation[i]];
+		}
+		memcpy(m, permuted, sizeof(m));
+	}
+
+	for (i = 0; i < 8; i++) {
+		out[i] = state[i] ^ state[i + 8];
+		out[i + 8] = state[i + 8] ^ chainingValue[i];
+	}
+}
+
+static void wordsFromBytes(const unsigned char *bytes, size_t length, uint32_t *words) {
+	size_t i;
+	for (i = 0; i < length / 4; i++) {
+		const unsigned char *p = bytes + i * 4;
+		words[i] = (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+	}
+}
+
+static void blake3OutputChainingValue(const Blake3Output *output, uint32_t chainingValue[8]) {
+	uint32_t out[16];
+	blake3Compress(output->inputChainingValue, output->blockWords, output->counter,
+		output->blockLength, output->flags, out);
+	memcpy(chainingValue, out, 8 * sizeof(uint32_t));
+}
+
+static void blake3OutputRootBytes(const Blake3Output *output, unsigned char *bytes, size_t length) {
+	uint64_t counter = 0;
+	size_t written = 0;
+
+	while (written < length) {
+		uint32_t words[16];
+		blake3Compress(output->inputChainingValue, output->blockWords, counter,
+			output->blockLength, output->flags | ROOT, words);
+
+		int i;
+		for (i = 0; i < 16 && written < length; i++) {
+			int j;
+			for (j = 0; j < 4 && written < length; j++) {
+				bytes[written++] = (unsigned char) (words[i] >> (8 * j));
+			}
+		}
+		counter++;
+	}
+}
+
+static void blake3ChunkStateInit(Blake3ChunkState *chunkState, const uint32_t keyWords[8],
+	uint64_t chunkCounter, uint32_t flags) {
+
+	memcpy(chunkState->chainingValue, keyWords, 8 * sizeof(uint32_t));
+	chunkState->chunkCounter = chunkCounter;
+	memset(chunkState->block, 0, BLAKE3_BLOCK_LEN);
+	chunkState->blockLength = 0;
+	chunkState->blocksCompressed = 0;
+	chunkState->flags = flags;
+}
+
+static size_t blake3ChunkStateLength(const Blake3ChunkState *chunkState) {
+	return BLAKE3_BLOCK_LEN * (size_t) chunkState->blocksCompressed + chunkState->blockLength;
+}
+
+static uint32_t blake3ChunkStateStartFlag(const Blake3ChunkState *chunkState) {
+	return chunkState->blocksCompressed == 0 ? CHUNK_START : 0;
+}
+
+static void blake3ChunkStateUpdate(Blake3ChunkState *chunkState, const unsigned char *input, size_t length) {
+	while (length > 0) {
+		if (chunkState->blockLength == BLAKE3_BLOCK_LEN) {
+			uint32_t blockWords[16];
+			uint32_t out[16];
+			wordsFromBytes(chunkState->block, BLAKE3_BLOCK_LEN, blockWords);
+			blake3Compress(chunkState->chainingValue, blockWords, chunkState->chunkCounter,
+				BLAKE3_BLOCK_LEN, chunkState->flags | blake3ChunkStateStartFlag(chunkState), out);
+			memcpy(chunkState->chainingValue, out, 8 * sizeof(uint32_t));
+			chunkState->blocksCompressed++;
+			memset(chunkState->block, 0, BLAKE3_BLOCK_LEN);
+			chunkState->blockLength = 0;
+		}
+
+		size_t take = BLAKE3_BLOCK_LEN - chunkState->blockLength;
+		if (take > length) {
+			take = length;
+		}
+		memcpy(chunkState->block + chunkState->blockLength, input, take);
+		chunkState->blockLength += take;
+		input += take;
+		length -= take;
+	}
+}
+
+static void blake3ChunkStateOutput(const Blake3ChunkState *chunkState, Blake3Output *output) {
+	memcpy(output->inputChainingValue, chunkState->chainingValue, 8 * sizeof(uint32_t));
+	wordsFromBytes(chunkState->block, BLAKE3_BLOCK_LEN, output->blockWords);
+	output->counter = chunkState->chunkCounter;
+	output->blockLength = chunkState->blockLength;
+	output->flags = chunkState->flags | blake3ChunkStateStartFlag(chunkState) | CHUNK_END;
+}
+
+static void blake3ParentOutput(const uint32_t left[8], const uint32_t right[8],
+	const uint32_t keyWords[8], uint32_t flags, Blake3Output *output) {
+
+	memcpy(output->inputChainingValue, keyWords, 8 * sizeof(uint32_t));
+	memcpy(output->blockWords, left, 8 * sizeof(uint32_t));
+	memcpy(output->blockWords + 8, right, 8 * sizeof(uint32_t));
+	output->counter = 0;
+	output->blockLength = BLAKE3_BLOCK_LEN;
+	output->flags = PARENT | flags;
+}
+
+void blake3Init(Blake3Hasher *hasher) {
+	memcpy(hasher->keyWords, blake3IV, sizeof(blake3IV));
+	blake3ChunkStateInit(&hasher->chunkState, hasher->keyWords, 0, 0);
+	hasher->chainingValueStackLength = 0;
+	hasher->flags = 0;
+}
+
+static void blake3AddChunkChainingValue(Blake3Hasher *hasher, uint32_t chainingValue[8], uint64_t totalChunks) {
+	// merge completed subtrees: the number of trailing zero bits in the chunk
+	// count is the number of subtrees that just got their right half
+	while ((totalChunks & 1) == 0) {
+		Blake3Output parent;
+		hasher->chainingValueStackLength--;
+		blake3ParentOutput(hasher->chainingValueStack[hasher->chainingValueStackLength], chainingValue,
+			hasher->keyWords, hasher->flags, &parent);
+		blake3OutputChainingValue(&parent, chainingValue);
+		totalChunks >>= 1;
+	}
+
+	memcpy(hasher->chainingValueStack[hasher->chainingValueStackLength], chainingValue, 8 * sizeof(uint32_t));
+	hasher->chainingValueStackLength++;
+}
+
+void blake3Update(Blake3Hasher *hasher, const unsigned char *input, size_t length) {
+	while (length > 0) {
+		if (blake3ChunkStateLength(&hasher->chunkState) == BLAKE3_CHUNK_LEN) {
+			Blake3Output output;
+			uint32_t chainingValue[8];
+			blake3ChunkStateOutput(&hasher->chunkState, &output);
+			blake3OutputChainingValue(&output, chainingValue);
+
+			uint64_t totalChunks = hasher->chunkState.chunkCounter + 1;
+			blake3AddChunkChainingValue(hasher, chainingValue, totalChunks);
+			blake3ChunkStateInit(&hasher->chunkState, hasher->keyWords, totalChunks, hasher->flags);
+		}
+
+		size_t take = BLAKE3_CHUNK_LEN - blake3ChunkStateLength(&hasher->chunkState);
+		if (take > length) {
+			take = length;
+		}
+		blake3ChunkStateUpdate(&hasher->chunkState, input, take);
+		input += take;
+		length -= take;
+	}
+}
+
+void blake3Final(Blake3Hasher *hasher, unsigned char *output, size_t outputLength) {
+	Blake3Output current;
+	blake3ChunkStateOutput(&hasher->chunkState, &current);
+
+	int parentNodesRemaining = hasher->chainingValueStackLength;
+	while (parentNodesRemaining > 0) {
+		uint32_t chainingValue[8];
+		parentNodesRemaining--;
+		blake3OutputChainingValue(&current, chainingValue);
+		blake3ParentOutput(hasher->chainingValueStack[parentNodesRemaining], chainingValue,
+			hasher->keyWords, hasher->flags, &current);
+	}
+
+	blake3OutputRootBytes(&current, output, outputLength);
+}
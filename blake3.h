@@ -0,0 +1,33 @@
+#ifndef BIGSYNC_BLAKE3_H
+#define BIGSYNC_BLAKE3_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BLAKE3_OUT_LEN 32
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_MAX_DEPTH 54
+
+typedef struct {
+	uint32_t chainingValue[8];
+	uint64_t chunkCounter;
+	unsigned char block[BLAKE3_BLOCK_LEN];
+	uint8_t blockLength;
+	uint8_t blocksCompressed;
+	uint32_t flags;
+} Blake3ChunkState;
+
+typedef struct {
+	Blake3ChunkState chunkState;
+	uint32_t keyWords[8];
+	uint32_t chainingValueStack[BLAKE3_MAX_DEPTH][8];
+	uint8_t chainingValueStackLength;
+	uint32_t flags;
+} Blake3Hasher;
+
+void blake3Init(Blake3Hasher *hasher);
+void blake3Update(Blake3Hasher *hasher, const unsigned char *input, size_t length);
+void blake3Final(Blake3Hasher *hasher, unsigned char *output, size_t outputLength);
+
+#endif
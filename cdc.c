@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "cdc.h"
+
+static uint64_t gearTable[256];
+static pthread_once_t gearTableOnce = PTHREAD_ONCE_INIT;
+
+// The table is part of the on-disk format: other values would put the
+// boundaries elsewhere and nothing stored could be reused. It comes from
+// splitmix64 with a fixed seed.
+static void fillGearTable(void) {
+	uint64_t state = 0x6269677379e63ULL;
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		state += 0x9e3779b97f4a7c15ULL;
+		uint64_t value = state;
+		value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+		gearTable[i] = value ^ (value >> 31);
+	}
+}
+
+// The Gear hash shifts left with every byte, so its top bits are the ones
+// that depend on the most bytes; the masks look at those.
+static uint64_t topBits(int count) {
+	return count <= 0 ? 0 : ~0ULL << (64 - count);
+}
+
+// averageSize is rounded down to a power of two (of at least 64 bytes).
+void chunkerInit(Chunker *chunker, uint64_t averageSize) {
+	pthread_once(&gearTableOnce, fillGearTable);
+
+	int bits = 6;
+	while (bits < 40 && (2ULL << bits) <= averageSize) {
+		bits++;
+	}
+
+	chunker->averageSize = 1ULL << bits;
+	chunker->minSize = chunker->averageSize / 4;
+	chunker->maxSize = chunker->averageSize * 4;
+	chunker->strictMask = topBits(bits + 1);
+	chunker->looseMask = topBits(bits - 1);
+}
+
+// Chunks of exactly size bytes, the last one excepted.
+void chunkerInitFixed(Chunker *chunker, uint64_t size) {
+	chunker->averageSize = size;
+	chunker->minSize = size;
+	chunker->maxSize = size;
+	chunker->strictMask = 0;
+	chunker->looseMask = 0;
+}
+
+// Returns the length of the chunk at the start of data. Unless isEnd, there
+// have to be at least maxSize bytes (or the chunk could be cut short).
+size_t chunkerNext(Chunker *chunker, const unsigned char *data, size_t length, int isEnd) {
+	(void) isEnd;
+
+	if (length <= chunker->minSize) {
+		return length;
+	}
+
+	size_t limit = length < chunker->maxSize ? length : chunker->maxSize;
+	size_t normal = limit < chunker->averageSize ? limit : chunker->averageSize;
+	uint64_t hash = 0;
+	size_t i = chunker->minSize;
+
+	for (; i < normal; i++) {
+		hash = (hash << 1) + gearTable[data[i]];
+		if (!(hash & chunker->strictMask)) {
+			return i + 1;
+		}
+	}
+
+	for (; i < limit; i++) {
+		hash = (hash << 1) + gearTable[data[i]];
+		if (!(hash & chunker->looseMask)) {
+			return i + 1;
+		}
+	}
+
+	return limit;
+}
+
+static uint64_t slotOf(ChunkIndex *index, const unsigned char *digest) {
+	uint64_t key = 0;
+	int size = index->digestSize < 8 ? index->digestSize : 8;
+	memcpy(&key, digest, size);
+
+	// digests are random already, this only mixes in the short ones
+	key *= 0x9e3779b97f4a7c15ULL;
+	return (key >> 17) & (index->capacity - 1);
+}
+
+static int chunkIndexResize(ChunkIndex *index, uint64_t capacity) {
+	ChunkIndexEntry *entries = calloc(capacity, sizeof(ChunkIndexEntry));
+	if (entries == NULL) {
+		return -1;
+	}
+
+	ChunkIndexEntry *oldEntries = index->entries;
+	uint64_t oldCapacity = index->capacity;
+	index->entries = entries;
+	index->capacity = capacity;
+
+	uint64_t i;
+	for (i = 0; i < oldCapacity; i++) {
+		if (oldEntries[i].isUsed) {
+			uint64_t slot = slotOf(index, oldEntries[i].digest);
+			while (entries[slot].isUsed) {
+				slot = (slot + 1) & (capacity - 1);
+			}
+			entries[slot] = oldEntries[i];
+		}
+	}
+
+	free(oldEntries);
+	return 0;
+}
+
+ChunkIndex *chunkIndexCreate(int digestSize, uint64_t expectedCount) {
+	ChunkIndex *index = calloc(1, sizeof(ChunkIndex));
+	if (index == NULL) {
+		return NULL;
+	}
+	index->digestSize = digestSize;
+
+	uint64_t capacity = 1024;
+	while (capacity < expectedCount * 2) {
+		capacity *= 2;
+	}
+
+	if (chunkIndexResize(index, capacity) == -1) {
+		free(index);
+		return NULL;
+	}
+	return index;
+}
+
+ChunkIndexEntry *chunkIndexFind(ChunkIndex *index, const unsigned char *digest) {
+	uint64_t slot = slotOf(index, digest);
+
+	while (index->entries[slot].isUsed) {
+		if (memcmp(index->entries[slot].digest, digest, index->digestSize) == 0) {
+			return &index->entries[slot];
+		}
+		slot = (slot + 1) & (index->capacity - 1);
+	}
+	return NULL;
+}
+
+// Keeps the first location known for a digest.
+int chunkIndexAdd(ChunkIndex *index, const unsigned char *digest, uint64_t offset, uint64_t length) {
+	if (chunkIndexFind(index, digest)) {
+		return 0;
+	}
+
+	if ((index->count + 1) * 2 > index->capacity && chunkIndexResize(index, index->capacity * 2) == -1) {
+		return -1;
+	}
+
+	uint64_t slot = slotOf(index, digest);
+	while (index->entries[slot].isUsed) {
+		slot = (slot + 1) & (index->capacity - 1);
+	}
+
+	ChunkIndexEntry *entry = &index->entries[slot];
+	memcpy(entry->digest, digest, index->digestSize);
+	entry->offset = offset;
+	entry->length = length;
+	entry->isUsed = 1;
+	index->count++;
+	return 0;
+}
+
+void chunkIndexDestroy(ChunkIndex *index) {
+	free(index->entries);
+	free(index);
+}
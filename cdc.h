@@ -0,0 +1,47 @@
+#ifndef BIGSYNC_CDC_H
+#define BIGSYNC_CDC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "hash.h"
+
+// Content-defined chunking. Chunk boundaries are put where a Gear rolling
+// hash of the last bytes hits a pattern, so they move along with the data
+// when bytes are inserted or removed, and only the chunks around the change
+// come out different. Boundaries are normalized (harder to hit below the
+// average size, easier above it) to keep chunk sizes close to the average.
+
+typedef struct {
+	uint64_t averageSize;
+	uint64_t minSize;
+	uint64_t maxSize;
+	uint64_t strictMask;
+	uint64_t looseMask;
+} Chunker;
+
+void chunkerInit(Chunker *chunker, uint64_t averageSize);
+void chunkerInitFixed(Chunker *chunker, uint64_t size);
+size_t chunkerNext(Chunker *chunker, const unsigned char *data, size_t length, int isEnd);
+
+// Where the chunks with a given digest are kept in the container.
+typedef struct {
+	unsigned char digest[HASH_MAX_DIGEST_SIZE];
+	uint64_t offset;
+	uint64_t length;
+	uint32_t file; // for users keeping chunks in several files, set by them
+	int isUsed;
+} ChunkIndexEntry;
+
+typedef struct {
+	ChunkIndexEntry *entries;
+	uint64_t capacity;
+	uint64_t count;
+	int digestSize;
+} ChunkIndex;
+
+ChunkIndex *chunkIndexCreate(int digestSize, uint64_t expectedCount);
+ChunkIndexEntry *chunkIndexFind(ChunkIndex *index, const unsigned char *digest);
+int chunkIndexAdd(ChunkIndex *index, const unsigned char *digest, uint64_t offset, uint64_t length);
+void chunkIndexDestroy(ChunkIndex *index);
+
+#endif
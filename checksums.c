@@ -0,0 +1,625 @@
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <inttypes.h>
+#include "checksums.h"
+#include "util.h"
+
+#define TEXT_HEADER_PREFIX "#bigsync "
+
+#define MINIMAL_CAPACITY 1024
+
+static void writeHeader(Checksums *checksums) {
+	unsigned char *header = checksums->map;
+
+	memcpy(header, CHECKSUMS_MAGIC, CHECKSUMS_MAGIC_SIZE);
+	put32(header + 8, CHECKSUMS_VERSION);
+	put32(header + 12, CHECKSUMS_HEADER_SIZE);
+	put64(header + 16, checksums->blockSize);
+	put64(header + 24, checksums->sourceSize);
+	put64(header + 32, checksums->blocksCount);
+	put32(header + 40, checksums->hashAlgorithm->id);
+	put32(header + 44, checksums->hashAlgorithm->digestSize);
+	put32(header + 48, checksums->recordSize);
+	put32(header + 52, checksums->flags);
+	put32(header + 56, checksums->extentHintRuns);
+	put32(header + 60, checksums->leafSize);
+	put32(header + 64, checksums->historyRuns);
+	put32(header + 68, checksums->changedRatio);
+}
+
+// Where the leaves count goes in a record; the digests follow it.
+static size_t leavesOffset(Checksums *checksums) {
+	return checksums->hashAlgorithm->digestSize + (checksums->flags & CHECKSUMS_FLAG_EXTENT_HINTS ? 8 : 0);
+}
+
+static void setLayout(Checksums *checksums) {
+	checksums->leavesPerBlock = 0;
+	if (checksums->flags & CHECKSUMS_FLAG_CHUNKS) {
+		checksums->recordSize = checksums->hashAlgorithm->digestSize + 16;
+		return;
+	}
+
+	if (checksums->flags & CHECKSUMS_FLAG_LEAVES) {
+		checksums->leavesPerBlock = (checksums->blockSize + checksums->leafSize - 1) / checksums->leafSize;
+	}
+
+	checksums->recordSize = leavesOffset(checksums);
+	if (checksums->flags & CHECKSUMS_FLAG_LEAVES) {
+		checksums->recordSize += 4 + checksums->leavesPerBlock * checksums->hashAlgorithm->digestSize;
+	}
+}
+
+static unsigned char *recordAt(Checksums *checksums, uint64_t index) {
+	return checksums->map + CHECKSUMS_HEADER_SIZE + index * checksums->recordSize;
+}
+
+static int mapChecksums(Checksums *checksums, uint64_t capacity) {
+	size_t mapSize = CHECKSUMS_HEADER_SIZE + capacity * checksums->recordSize;
+
+	if (ftruncate(checksums->fd, mapSize) == -1) {
+		return -1;
+	}
+
+	if (checksums->map) {
+		munmap(checksums->map, checksums->mapSize);
+		checksums->map = NULL;
+	}
+
+	void *map = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, checksums->fd, 0);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+
+	checksums->map = map;
+	checksums->mapSize = mapSize;
+	checksums->capacity = capacity;
+	return 0;
+}
+
+// Converts a text checksums file (one hex digest per line, optionally after a
+// "#bigsync hash=<name>" line; headerless files are md4) into the binary
+// format. The text format never recorded the block size, so the current one
+// is assumed. The new file replaces the old one atomically.
+static int migrateTextChecksums(char *filename, uint64_t blockSize, char *error) {
+	FILE *text = fopen(filename, "r");
+	if (text == NULL) {
+		setError(error, "Cannot open %s: %s", filename, strerror(errno));
+		return -1;
+	}
+
+	const HashAlgorithm *hashAlgorithm = hashAlgorithmById(HASH_MD4);
+	char line[HASH_MAX_HEX_SIZE + 100];
+
+	if (fgets(line, sizeof(line), text) && strncmp(line, TEXT_HEADER_PREFIX, strlen(TEXT_HEADER_PREFIX)) == 0) {
+		char *name = strstr(line, "hash=");
+		if (name == NULL) {
+			setError(error, "Checksums file %s has a broken header", filename);
+			fclose(text);
+			return -1;
+		}
+		name += strlen("hash=");
+		name[strcspn(name, " \n")] = 0;
+
+		hashAlgorithm = hashAlgorithmByName(name);
+		if (hashAlgorithm == NULL) {
+			setError(error, "Checksums file %s was made with an unknown hash \"%s\"", filename, name);
+			fclose(text);
+			return -1;
+		}
+	} else {
+		rewind(text);
+	}
+
+	char *temporaryFilename = NULL;
+	if (asprintf(&temporaryFilename, "%s.tmp", filename) < 0) {
+		setError(error, "Out of memory");
+		fclose(text);
+		return -1;
+	}
+
+	Checksums binary;
+	memset(&binary, 0, sizeof(Checksums));
+	binary.hashAlgorithm = hashAlgorithm;
+	binary.recordSize = hashAlgorithm->digestSize;
+	binary.blockSize = blockSize;
+
+	binary.fd = open(temporaryFilename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (binary.fd == -1 || mapChecksums(&binary, MINIMAL_CAPACITY) == -1) {
+		setError(error, "Cannot create %s: %s", temporaryFilename, strerror(errno));
+		goto fail;
+	}
+
+	int hexLength = hashAlgorithm->digestSize * 2;
+	while (fgets(line, sizeof(line), text)) {
+		if ((int) strlen(line) != hexLength + 1 || line[hexLength] != '\n') {
+			setError(error, "Checksums file %s is broken at checksum %" PRIu64, filename, binary.blocksCount + 1);
+			goto fail;
+		}
+
+		if (binary.blocksCount == binary.capacity && mapChecksums(&binary, binary.capacity * 2) == -1) {
+			setError(error, "Cannot write %s: %s", temporaryFilename, strerror(errno));
+			goto fail;
+		}
+
+		unsigned char *record = binary.map + CHECKSUMS_HEADER_SIZE + binary.blocksCount * binary.recordSize;
+		if (hashFromHex(line, hashAlgorithm->digestSize, record) == -1) {
+			setError(error, "Checksums file %s is broken at checksum %" PRIu64, filename, binary.blocksCount + 1);
+			goto fail;
+		}
+		binary.blocksCount++;
+	}
+
+	if (ferror(text)) {
+		setError(error, "Cannot read %s: %s", filename, strerror(errno));
+		goto fail;
+	}
+
+	writeHeader(&binary);
+	munmap(binary.map, binary.mapSize);
+	binary.map = NULL;
+
+	if (ftruncate(binary.fd, CHECKSUMS_HEADER_SIZE + binary.blocksCount * binary.recordSize) == -1 ||
+		fsync(binary.fd) == -1 ||
+		rename(temporaryFilename, filename) == -1) {
+
+		setError(error, "Cannot write %s: %s", temporaryFilename, strerror(errno));
+		goto fail;
+	}
+
+	close(binary.fd);
+	fclose(text);
+	free(temporaryFilename);
+	return 0;
+
+fail:
+	if (binary.map) {
+		munmap(binary.map, binary.mapSize);
+	}
+	if (binary.fd != -1) {
+		close(binary.fd);
+	}
+	unlink(temporaryFilename);
+	free(temporaryFilename);
+	fclose(text);
+	return -1;
+}
+
+static int readHeader(Checksums *checksums, off_t fileSize, char *error) {
+	unsigned char header[72];
+
+	if (pread(checksums->fd, header, sizeof(header), 0) != sizeof(header)) {
+		setError(error, "Cannot read %s: %s", checksums->filename, strerror(errno));
+		return -1;
+	}
+
+	if (get32(header + 8) != CHECKSUMS_VERSION || get32(header + 12) != CHECKSUMS_HEADER_SIZE) {
+		setError(error, "Checksums file %s was made by a newer version of bigsync", checksums->filename);
+		return -1;
+	}
+
+	checksums->blockSize = get64(header + 16);
+	checksums->sourceSize = get64(header + 24);
+	checksums->blocksCount = get64(header + 32);
+	checksums->hashAlgorithm = hashAlgorithmById(get32(header + 40));
+	checksums->recordSize = get32(header + 48);
+	checksums->flags = get32(header + 52);
+	checksums->extentHintRuns = get32(header + 56);
+	checksums->leafSize = get32(header + 60);
+	checksums->historyRuns = get32(header + 64);
+	checksums->changedRatio = get32(header + 68);
+
+	if (checksums->hashAlgorithm == NULL) {
+		setError(error, "Checksums file %s was made with an unknown hash", checksums->filename);
+		return -1;
+	}
+
+	if ((int) get32(header + 44) != checksums->hashAlgorithm->digestSize ||
+		checksums->recordSize < checksums->hashAlgorithm->digestSize ||
+		((checksums->flags & CHECKSUMS_FLAG_EXTENT_HINTS) && checksums->recordSize < checksums->hashAlgorithm->digestSize + 8) ||
+		((checksums->flags & CHECKSUMS_FLAG_LEAVES) && checksums->leafSize == 0) ||
+		checksums->blockSize == 0 ||
+		(uint64_t) fileSize < CHECKSUMS_HEADER_SIZE + checksums->blocksCount * checksums->recordSize) {
+
+		setError(error, "Checksums file %s is broken", checksums->filename);
+		return -1;
+	}
+
+	// records may have room to spare, but not too little
+	int recordSize = checksums->recordSize;
+	setLayout(checksums);
+	if (recordSize < checksums->recordSize) {
+		setError(error, "Checksums file %s is broken", checksums->filename);
+		return -1;
+	}
+	checksums->recordSize = recordSize;
+
+	return 0;
+}
+
+// The flags of a binary checksums file, or 0 if filename isn't one.
+uint32_t checksumsPeekFlags(char *filename) {
+	unsigned char header[56];
+	uint32_t flags = 0;
+
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		return 0;
+	}
+	if (pread(fd, header, sizeof(header), 0) == sizeof(header) &&
+		memcmp(header, CHECKSUMS_MAGIC, CHECKSUMS_MAGIC_SIZE) == 0) {
+		flags = get32(header + 52);
+	}
+	close(fd);
+	return flags;
+}
+
+// Opens (creating or migrating if needed) the checksums file. hashAlgorithm
+// and blockSize are only used for brand new files; the caller compares them
+// with what the file says and calls checksumsReset() if they don't fit.
+Checksums *checksumsOpen(char *filename, const HashAlgorithm *hashAlgorithm, uint64_t blockSize, char *error) {
+	Checksums *checksums = calloc(1, sizeof(Checksums));
+	if (checksums == NULL) {
+		setError(error, "Out of memory");
+		return NULL;
+	}
+
+	checksums->filename = filename;
+
+	checksums->fd = open(filename, O_RDWR | O_CREAT, 0644);
+	if (checksums->fd == -1) {
+		setError(error, "Cannot open %s: %s", filename, strerror(errno));
+		free(checksums);
+		return NULL;
+	}
+
+	struct stat fileStat;
+	if (fstat(checksums->fd, &fileStat) == -1) {
+		setError(error, "Cannot open %s: %s", filename, strerror(errno));
+		goto fail;
+	}
+
+	if (fileStat.st_size == 0) {
+		if (checksumsReset(checksums, hashAlgorithm, blockSize) == -1) {
+			setError(error, "Cannot write %s: %s", filename, strerror(errno));
+			goto fail;
+		}
+		return checksums;
+	}
+
+	char magic[CHECKSUMS_MAGIC_SIZE];
+	memset(magic, 0, sizeof(magic));
+	if (pread(checksums->fd, magic, sizeof(magic), 0) == -1) {
+		setError(error, "Cannot read %s: %s", filename, strerror(errno));
+		goto fail;
+	}
+
+	if (memcmp(magic, CHECKSUMS_MAGIC, CHECKSUMS_MAGIC_SIZE) != 0) {
+		close(checksums->fd);
+		checksums->fd = -1;
+
+		if (migrateTextChecksums(filename, blockSize, error) == -1) {
+			goto fail;
+		}
+		checksums->wasMigrated = 1;
+
+		checksums->fd = open(filename, O_RDWR);
+		if (checksums->fd == -1 || fstat(checksums->fd, &fileStat) == -1) {
+			setError(error, "Cannot open %s: %s", filename, strerror(errno));
+			goto fail;
+		}
+	}
+
+	if (readHeader(checksums, fileStat.st_size, error) == -1) {
+		goto fail;
+	}
+
+	uint64_t capacity = checksums->blocksCount < MINIMAL_CAPACITY ? MINIMAL_CAPACITY : checksums->blocksCount;
+	if (mapChecksums(checksums, capacity) == -1) {
+		setError(error, "Cannot map %s: %s", filename, strerror(errno));
+		goto fail;
+	}
+
+	return checksums;
+
+fail:
+	if (checksums->fd != -1) {
+		close(checksums->fd);
+	}
+	free(checksums);
+	return NULL;
+}
+
+// Drops all stored checksums and starts over with the given parameters.
+int checksumsReset(Checksums *checksums, const HashAlgorithm *hashAlgorithm, uint64_t blockSize) {
+	checksums->hashAlgorithm = hashAlgorithm;
+	checksums->blockSize = blockSize;
+	checksums->blocksCount = 0;
+	checksums->sourceSize = 0;
+	checksums->flags = 0;
+	checksums->extentHintRuns = 0;
+	checksums->leafSize = 0;
+	checksums->historyRuns = 0;
+	checksums->changedRatio = 0;
+	setLayout(checksums);
+
+	if (ftruncate(checksums->fd, 0) == -1) {
+		return -1;
+	}
+
+	if (mapChecksums(checksums, MINIMAL_CAPACITY) == -1) {
+		return -1;
+	}
+
+	writeHeader(checksums);
+	return 0;
+}
+
+// Grows the file up front so that appending blocksCount records won't remap.
+int checksumsReserve(Checksums *checksums, uint64_t blocksCount) {
+	if (blocksCount <= checksums->capacity) {
+		return 0;
+	}
+	return mapChecksums(checksums, blocksCount);
+}
+
+unsigned char *checksumsGet(Checksums *checksums, uint64_t index) {
+	if (index >= checksums->blocksCount) {
+		return NULL;
+	}
+	return recordAt(checksums, index);
+}
+
+// Replaces the checksum of an existing block or appends the next one.
+int checksumsSet(Checksums *checksums, uint64_t index, const unsigned char *digest) {
+	if (index > checksums->blocksCount) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (index == checksums->blocksCount) {
+		if (index == checksums->capacity && mapChecksums(checksums, checksums->capacity * 2) == -1) {
+			return -1;
+		}
+		checksums->blocksCount++;
+		put64(checksums->map + 32, checksums->blocksCount);
+		memset(recordAt(checksums, index), 0, checksums->recordSize);
+	}
+
+	memcpy(recordAt(checksums, index), digest, checksums->hashAlgorithm->digestSize);
+
+	// the leaves are of whatever the block held before
+	if (checksums->flags & CHECKSUMS_FLAG_LEAVES) {
+		put32(recordAt(checksums, index) + leavesOffset(checksums), 0);
+	}
+
+	return 0;
+}
+
+// Rewrites the file with a different record layout. Digests, and hints and
+// leaves the new layout still has room for, are kept; anything new starts out
+// unknown. Like migration, this goes through a temporary file so that an
+// interruption can't leave records half moved.
+static int rewriteRecords(Checksums *checksums, uint32_t flags, uint32_t leafSize) {
+	char *temporaryFilename = NULL;
+	if (asprintf(&temporaryFilename, "%s.tmp", checksums->filename) < 0) {
+		return -1;
+	}
+
+	Checksums rewritten = *checksums;
+	rewritten.map = NULL;
+	rewritten.flags = flags;
+	rewritten.leafSize = flags & CHECKSUMS_FLAG_LEAVES ? leafSize : 0;
+	setLayout(&rewritten);
+
+	int shouldKeepHints = checksums->flags & flags & CHECKSUMS_FLAG_EXTENT_HINTS;
+	int shouldKeepLeaves = (checksums->flags & flags & CHECKSUMS_FLAG_LEAVES) && checksums->leafSize == rewritten.leafSize;
+
+	rewritten.fd = open(temporaryFilename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (rewritten.fd == -1 || mapChecksums(&rewritten, checksums->capacity) == -1) {
+		goto fail;
+	}
+
+	uint64_t i;
+	for (i = 0; i < checksums->blocksCount; i++) {
+		int digestSize = checksums->hashAlgorithm->digestSize;
+		memcpy(recordAt(&rewritten, i), recordAt(checksums, i), digestSize);
+		if (shouldKeepHints) {
+			memcpy(recordAt(&rewritten, i) + digestSize, recordAt(checksums, i) + digestSize, 8);
+		}
+		if (shouldKeepLeaves) {
+			memcpy(recordAt(&rewritten, i) + leavesOffset(&rewritten), recordAt(checksums, i) + leavesOffset(checksums),
+				4 + checksums->leavesPerBlock * digestSize);
+		}
+	}
+	writeHeader(&rewritten);
+
+	if (msync(rewritten.map, rewritten.mapSize, MS_SYNC) == -1 ||
+		fsync(rewritten.fd) == -1 ||
+		rename(temporaryFilename, checksums->filename) == -1) {
+		goto fail;
+	}
+
+	munmap(checksums->map, checksums->mapSize);
+	close(checksums->fd);
+	*checksums = rewritten;
+
+	free(temporaryFilename);
+	return 0;
+
+fail:
+	if (rewritten.map) {
+		munmap(rewritten.map, rewritten.mapSize);
+	}
+	if (rewritten.fd != -1) {
+		int savedErrno = errno;
+		close(rewritten.fd);
+		unlink(temporaryFilename);
+		errno = savedErrno;
+	}
+	free(temporaryFilename);
+	return -1;
+}
+
+// Makes room for an extent hint after every digest.
+int checksumsEnableExtentHints(Checksums *checksums) {
+	return rewriteRecords(checksums, checksums->flags | CHECKSUMS_FLAG_EXTENT_HINTS, checksums->leafSize);
+}
+
+uint64_t checksumsGetExtentHint(Checksums *checksums, uint64_t index) {
+	if (!(checksums->flags & CHECKSUMS_FLAG_EXTENT_HINTS) || index >= checksums->blocksCount) {
+		return 0;
+	}
+	return get64(recordAt(checksums, index) + checksums->hashAlgorithm->digestSize);
+}
+
+void checksumsSetExtentHint(Checksums *checksums, uint64_t index, uint64_t extentHint) {
+	if (!(checksums->flags & CHECKSUMS_FLAG_EXTENT_HINTS) || index >= checksums->blocksCount) {
+		return;
+	}
+	put64(recordAt(checksums, index) + checksums->hashAlgorithm->digestSize, extentHint);
+}
+
+// Makes room for the digests of every leafSize bytes of a block, or drops
+// them with a leafSize of 0. Leaves of another size are forgotten.
+int checksumsSetLeafSize(Checksums *checksums, uint32_t leafSize) {
+	uint32_t flags = leafSize ? checksums->flags | CHECKSUMS_FLAG_LEAVES : checksums->flags & ~CHECKSUMS_FLAG_LEAVES;
+	if (flags == checksums->flags && leafSize == checksums->leafSize) {
+		return 0;
+	}
+	return rewriteRecords(checksums, flags, leafSize);
+}
+
+// Returns how many leaf digests of the block are known (0 without leaves)
+// and points digests at them.
+uint32_t checksumsGetLeaves(Checksums *checksums, uint64_t index, unsigned char **digests) {
+	if (!(checksums->flags & CHECKSUMS_FLAG_LEAVES) || index >= checksums->blocksCount) {
+		return 0;
+	}
+
+	unsigned char *leaves = recordAt(checksums, index) + leavesOffset(checksums);
+	uint32_t count = get32(leaves);
+	if (count > checksums->leavesPerBlock) {
+		return 0;
+	}
+
+	*digests = leaves + 4;
+	return count;
+}
+
+void checksumsSetLeaves(Checksums *checksums, uint64_t index, const unsigned char *digests, uint32_t count) {
+	if (!(checksums->flags & CHECKSUMS_FLAG_LEAVES) || index >= checksums->blocksCount || count > checksums->leavesPerBlock) {
+		return;
+	}
+
+	unsigned char *leaves = recordAt(checksums, index) + leavesOffset(checksums);
+	memcpy(leaves + 4, digests, count * checksums->hashAlgorithm->digestSize);
+	put32(leaves, count);
+}
+
+// Drops all stored checksums and starts a chunk map; flags are
+// CHECKSUMS_FLAG_CHUNKS and any of the flags that go with it.
+int checksumsResetChunks(Checksums *checksums, const HashAlgorithm *hashAlgorithm, uint64_t averageSize, uint32_t flags) {
+	if (checksumsReset(checksums, hashAlgorithm, averageSize) == -1) {
+		return -1;
+	}
+
+	checksums->flags = flags | CHECKSUMS_FLAG_CHUNKS;
+	setLayout(checksums);
+	if (mapChecksums(checksums, MINIMAL_CAPACITY) == -1) {
+		return -1;
+	}
+
+	writeHeader(checksums);
+	return 0;
+}
+
+void checksumsGetChunk(Checksums *checksums, uint64_t index, uint64_t *offset, uint64_t *length) {
+	*offset = 0;
+	*length = 0;
+	if (!(checksums->flags & CHECKSUMS_FLAG_CHUNKS) || index >= checksums->blocksCount) {
+		return;
+	}
+
+	unsigned char *record = recordAt(checksums, index) + checksums->hashAlgorithm->digestSize;
+	*offset = get64(record);
+	*length = get64(record + 8);
+}
+
+int checksumsSetChunk(Checksums *checksums, uint64_t index, const unsigned char *digest, uint64_t offset, uint64_t length) {
+	if (!(checksums->flags & CHECKSUMS_FLAG_CHUNKS)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (checksumsSet(checksums, index, digest) == -1) {
+		return -1;
+	}
+
+	unsigned char *record = recordAt(checksums, index) + checksums->hashAlgorithm->digestSize;
+	put64(record, offset);
+	put64(record + 8, length);
+	return 0;
+}
+
+// Adds a run that compared comparedCount stored blocks and found
+// changedCount of them changed to the history of the file. Later runs count
+// for a quarter, so that the ratio follows how the source is used now.
+void checksumsRecordRun(Checksums *checksums, uint64_t comparedCount, uint64_t changedCount) {
+	if (comparedCount == 0) {
+		return;
+	}
+
+	uint32_t ratio = (uint32_t) (changedCount * 1000000 / comparedCount);
+	if (checksums->historyRuns == 0) {
+		checksums->changedRatio = ratio;
+	} else {
+		checksums->changedRatio = (uint32_t) (((uint64_t) checksums->changedRatio * 3 + ratio) / 4);
+	}
+	if (checksums->historyRuns < UINT32_MAX) {
+		checksums->historyRuns++;
+	}
+	writeHeader(checksums);
+}
+
+int checksumsSync(Checksums *checksums) {
+	return msync(checksums->map, checksums->mapSize, MS_SYNC);
+}
+
+// Forgets checksums past blocksCount (the source got shorter), stores the
+// final header and trims the file.
+int checksumsClose(Checksums *checksums, uint64_t blocksCount, uint64_t sourceSize) {
+	int result = 0;
+
+	if (blocksCount < checksums->blocksCount) {
+		checksums->blocksCount = blocksCount;
+	}
+	checksums->sourceSize = sourceSize;
+	writeHeader(checksums);
+
+	if (msync(checksums->map, checksums->mapSize, MS_SYNC) == -1 || munmap(checksums->map, checksums->mapSize) == -1) {
+		result = -1;
+	}
+
+	if (ftruncate(checksums->fd, CHECKSUMS_HEADER_SIZE + checksums->blocksCount * checksums->recordSize) == -1 ||
+		fsync(checksums->fd) == -1) {
+		result = -1;
+	}
+
+	if (close(checksums->fd) == -1) {
+		result = -1;
+	}
+
+	free(checksums);
+	return result;
+}
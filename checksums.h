@@ -0,0 +1,101 @@
+#ifndef BIGSYNC_CHECKSUMS_H
+#define BIGSYNC_CHECKSUMS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "hash.h"
+
+#define CHECKSUMS_MAGIC "BIGSYNC\032"
+#define CHECKSUMS_MAGIC_SIZE 8
+#define CHECKSUMS_VERSION 2
+#define CHECKSUMS_HEADER_SIZE 4096
+#define CHECKSUMS_ERROR_SIZE 512
+
+#define CHECKSUMS_FLAG_EXTENT_HINTS 1
+#define CHECKSUMS_FLAG_LEAVES 2
+#define CHECKSUMS_FLAG_CHUNKS 4
+#define CHECKSUMS_FLAG_STORE 8
+#define CHECKSUMS_FLAG_FIXED_CHUNKS 16
+#define CHECKSUMS_FLAG_COMPRESSED 32
+
+// Binary checksums file, version 2. All integers are little-endian.
+//
+//   0  magic        8 bytes, "BIGSYNC\032"
+//   8  version      uint32
+//  12  headerSize   uint32, records start here (one page)
+//  16  blockSize    uint64
+//  24  sourceSize   uint64, size of the source after the last run
+//  32  blocksCount  uint64
+//  40  hash         uint32, HASH_* id
+//  44  digestSize   uint32
+//  48  recordSize   uint32
+//  52  flags        uint32, CHECKSUMS_FLAG_*
+//  56  extentHintRuns uint32, runs that relied on extent hints since the
+//                   last one which read everything
+//  60  leafSize     uint32, with CHECKSUMS_FLAG_LEAVES
+//  64  historyRuns  uint32, runs counted in changedRatio since the block size
+//                   was set
+//  68  changedRatio uint32, millionths of the stored blocks a run found
+//                   changed, a moving average (see checksumsRecordRun());
+//                   files made before these were kept have zeros here
+//
+// followed by blocksCount fixed-width records holding raw digests. The file
+// is mmap()ed, so looking up block N is a pointer addition. With
+// CHECKSUMS_FLAG_EXTENT_HINTS, every digest is followed by the block's extent
+// hint (uint64, 0 if unknown; see extents.h). With CHECKSUMS_FLAG_LEAVES,
+// that is followed by the number of leaves known (uint32, 0 if they aren't)
+// and room for the digests of every leafSize bytes of the block, so that only
+// the leaves that changed have to be written.
+//
+// With CHECKSUMS_FLAG_CHUNKS the destination is a container of chunks cut
+// where the content says (see cdc.h) rather than a copy, blockSize is the
+// average chunk size and the records list the chunks of the source in order:
+// digest, then where the chunk is in the container (uint64) and its length
+// (uint64). Hints and leaves don't apply. With CHECKSUMS_FLAG_STORE as well,
+// the chunks are in the pack of a --store (see store.h) instead, and with
+// CHECKSUMS_FLAG_FIXED_CHUNKS they are cut every blockSize bytes. With
+// CHECKSUMS_FLAG_COMPRESSED every chunk is kept as a compressed frame (see
+// compress.h), and its length is the frame's.
+
+typedef struct {
+	int fd;
+	char *filename;
+	unsigned char *map;
+	size_t mapSize;
+	uint64_t capacity;
+
+	uint64_t blockSize;
+	uint64_t sourceSize;
+	uint64_t blocksCount;
+	const HashAlgorithm *hashAlgorithm;
+	int recordSize;
+	uint32_t flags;
+	uint32_t extentHintRuns;
+	uint32_t leafSize;
+	uint32_t leavesPerBlock;
+	uint32_t historyRuns;
+	uint32_t changedRatio;
+
+	int wasMigrated;
+} Checksums;
+
+uint32_t checksumsPeekFlags(char *filename);
+Checksums *checksumsOpen(char *filename, const HashAlgorithm *hashAlgorithm, uint64_t blockSize, char *error);
+int checksumsReset(Checksums *checksums, const HashAlgorithm *hashAlgorithm, uint64_t blockSize);
+int checksumsReserve(Checksums *checksums, uint64_t blocksCount);
+unsigned char *checksumsGet(Checksums *checksums, uint64_t index);
+int checksumsSet(Checksums *checksums, uint64_t index, const unsigned char *digest);
+int checksumsEnableExtentHints(Checksums *checksums);
+uint64_t checksumsGetExtentHint(Checksums *checksums, uint64_t index);
+void checksumsSetExtentHint(Checksums *checksums, uint64_t index, uint64_t extentHint);
+int checksumsSetLeafSize(Checksums *checksums, uint32_t leafSize);
+uint32_t checksumsGetLeaves(Checksums *checksums, uint64_t index, unsigned char **digests);
+void checksumsSetLeaves(Checksums *checksums, uint64_t index, const unsigned char *digests, uint32_t count);
+int checksumsResetChunks(Checksums *checksums, const HashAlgorithm *hashAlgorithm, uint64_t averageSize, uint32_t flags);
+void checksumsGetChunk(Checksums *checksums, uint64_t index, uint64_t *offset, uint64_t *length);
+int checksumsSetChunk(Checksums *checksums, uint64_t index, const unsigned char *digest, uint64_t offset, uint64_t length);
+void checksumsRecordRun(Checksums *checksums, uint64_t comparedCount, uint64_t changedCount);
+int checksumsSync(Checksums *checksums);
+int checksumsClose(Checksums *checksums, uint64_t blocksCount, uint64_t sourceSize);
+
+#endif
@@ -0,0 +1,443 @@
+#include <stdlib.h>
+#include <string.h>
+#include "compress.h"
+#include "util.h"
+
+// An LZ4 block is a series of sequences: a token (literals count in the high
+// nibble, match length - 4 in the low one, 15 meaning more bytes of 255
+// follow), the literals, a 16 bit offset back to the match, and the rest of
+// the match length. The last sequence has literals only; the last 5 bytes
+// are always literals and the last match starts at least 12 bytes before
+// the end.
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MATCH_FIND_LIMIT 12
+#define MAX_OFFSET 65535
+
+#define HASH_BITS 16
+#define CHAIN_HASH_BITS 15
+#define CHAIN_SIZE 65536
+#define CHAIN_ATTEMPTS 64
+
+// sampled for the entropy estimate
+#define SAMPLE_STRIDES 256
+#define SAMPLE_STRIDE_SIZE 16
+
+static uint32_t read32(const unsigned char *p) {
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static uint32_t hashOf(const unsigned char *p, int bits) {
+	return (read32(p) * 2654435761U) >> (32 - bits);
+}
+
+int compressCodecByName(const char *name) {
+	if (strcmp(name, "none") == 0) {
+		return COMPRESS_NONE;
+	}
+	if (strcmp(name, "lz4") == 0) {
+		return COMPRESS_LZ4;
+	}
+	if (strcmp(name, "lz4hc") == 0) {
+		return COMPRESS_LZ4HC;
+	}
+	return -1;
+}
+
+const char *compressCodecName(int codec) {
+	switch (codec) {
+		case COMPRESS_LZ4:
+			return "lz4";
+		case COMPRESS_LZ4HC:
+			return "lz4hc";
+		default:
+			return "none";
+	}
+}
+
+Compressor *compressorCreate(int codec) {
+	Compressor *compressor = calloc(1, sizeof(Compressor));
+	if (compressor == NULL) {
+		return NULL;
+	}
+	compressor->codec = codec;
+
+	if (codec == COMPRESS_LZ4) {
+		compressor->hashTable = malloc(sizeof(uint32_t) << HASH_BITS);
+		if (compressor->hashTable == NULL) {
+			compressorDestroy(compressor);
+			return NULL;
+		}
+	} else if (codec == COMPRESS_LZ4HC) {
+		compressor->chainHeads = malloc(sizeof(int32_t) << CHAIN_HASH_BITS);
+		compressor->chain = malloc(sizeof(uint16_t) * CHAIN_SIZE);
+		if (compressor->chainHeads == NULL || compressor->chain == NULL) {
+			compressorDestroy(compressor);
+			return NULL;
+		}
+	}
+
+	return compressor;
+}
+
+void compressorDestroy(Compressor *compressor) {
+	free(compressor->hashTable);
+	free(compressor->chainHeads);
+	free(compressor->chain);
+	free(compressor);
+}
+
+// The most a block of length bytes can take compressed.
+size_t compressBound(size_t length) {
+	return length + length / 255 + 16;
+}
+
+static unsigned char *putLength(unsigned char *output, size_t length) {
+	while (length >= 255) {
+		*output++ = 255;
+		length -= 255;
+	}
+	*output++ = (unsigned char) length;
+	return output;
+}
+
+// matchLength 0 makes the last sequence, literals only.
+static unsigned char *putSequence(unsigned char *output, const unsigned char *literals, size_t literalsLength,
+	size_t offset, size_t matchLength) {
+
+	unsigned char *token = output++;
+	*token = (unsigned char) ((literalsLength >= 15 ? 15 : literalsLength) << 4);
+	if (literalsLength >= 15) {
+		output = putLength(output, literalsLength - 15);
+	}
+	memcpy(output, literals, literalsLength);
+	output += literalsLength;
+
+	if (matchLength == 0) {
+		return output;
+	}
+
+	*output++ = (unsigned char) offset;
+	*output++ = (unsigned char) (offset >> 8);
+
+	matchLength -= MIN_MATCH;
+	*token |= matchLength >= 15 ? 15 : matchLength;
+	if (matchLength >= 15) {
+		output = putLength(output, matchLength - 15);
+	}
+	return output;
+}
+
+static size_t matchLengthOf(const unsigned char *position, const unsigned char *match, const unsigned char *limit) {
+	const unsigned char *start = position;
+	while (position < limit && *position == *match) {
+		position++;
+		match++;
+	}
+	return position - start;
+}
+
+static size_t compressFast(Compressor *compressor, const unsigned char *input, size_t length, unsigned char *output) {
+	const unsigned char *end = input + length;
+	const unsigned char *anchor = input;
+	unsigned char *out = output;
+
+	if (length >= MATCH_FIND_LIMIT + 1) {
+		const unsigned char *matchLimit = end - LAST_LITERALS;
+		const unsigned char *findLimit = end - MATCH_FIND_LIMIT;
+		uint32_t *table = compressor->hashTable;
+		const unsigned char *position = input + 1;
+
+		memset(table, 0, sizeof(uint32_t) << HASH_BITS);
+
+		while (position < findLimit) {
+			uint32_t hash = hashOf(position, HASH_BITS);
+			const unsigned char *match = input + table[hash];
+			table[hash] = position - input;
+
+			if (match >= position || position - match > MAX_OFFSET || read32(match) != read32(position)) {
+				// the longer nothing matches, the bigger the steps
+				position += 1 + ((position - anchor) >> 6);
+				continue;
+			}
+
+			while (position > anchor && match > input && position[-1] == match[-1]) {
+				position--;
+				match--;
+			}
+
+			size_t matchLength = MIN_MATCH + matchLengthOf(position + MIN_MATCH, match + MIN_MATCH, matchLimit);
+			out = putSequence(out, anchor, position - anchor, position - match, matchLength);
+			position += matchLength;
+			anchor = position;
+
+			if (position < findLimit) {
+				table[hashOf(position - 2, HASH_BITS)] = position - 2 - input;
+			}
+		}
+	}
+
+	out = putSequence(out, anchor, end - anchor, 0, 0);
+	return out - output;
+}
+
+static void insertIntoChain(Compressor *compressor, const unsigned char *input, size_t position) {
+	uint32_t hash = hashOf(input + position, CHAIN_HASH_BITS);
+	int32_t previous = compressor->chainHeads[hash];
+	size_t delta = previous < 0 ? 0 : position - previous;
+
+	compressor->chain[position % CHAIN_SIZE] = delta > MAX_OFFSET ? 0 : (uint16_t) delta;
+	compressor->chainHeads[hash] = (int32_t) position;
+}
+
+// Walks the chain of earlier positions with the same hash for the longest
+// match of position.
+static size_t findLongestMatch(Compressor *compressor, const unsigned char *input, size_t position,
+	const unsigned char *matchLimit, size_t *matchPosition) {
+
+	int32_t candidate = compressor->chainHeads[hashOf(input + position, CHAIN_HASH_BITS)];
+	size_t best = 0;
+	int attempts = CHAIN_ATTEMPTS;
+
+	while (candidate >= 0 && (size_t) candidate < position && position - candidate <= MAX_OFFSET && attempts-- > 0) {
+		const unsigned char *match = input + candidate;
+		if (match[best] == input[position + best] && read32(match) == read32(input + position)) {
+			size_t length = MIN_MATCH + matchLengthOf(input + position + MIN_MATCH, match + MIN_MATCH, matchLimit);
+			if (length > best) {
+				best = length;
+				*matchPosition = candidate;
+			}
+		}
+
+		uint16_t delta = compressor->chain[candidate % CHAIN_SIZE];
+		if (delta == 0) {
+			break;
+		}
+		candidate -= delta;
+	}
+
+	return best >= MIN_MATCH ? best : 0;
+}
+
+static size_t compressHigh(Compressor *compressor, const unsigned char *input, size_t length, unsigned char *output) {
+	const unsigned char *end = input + length;
+	size_t anchor = 0;
+	unsigned char *out = output;
+
+	if (length >= MATCH_FIND_LIMIT + 1) {
+		const unsigned char *matchLimit = end - LAST_LITERALS;
+		size_t findLimit = length - MATCH_FIND_LIMIT;
+		size_t position = 0;
+		size_t inserted = 0;
+
+		memset(compressor->chainHeads, 0xff, sizeof(int32_t) << CHAIN_HASH_BITS);
+
+		while (position < findLimit) {
+			while (inserted < position) {
+				insertIntoChain(compressor, input, inserted++);
+			}
+
+			size_t matchPosition = 0;
+			size_t matchLength = findLongestMatch(compressor, input, position, matchLimit, &matchPosition);
+			if (matchLength == 0) {
+				position++;
+				continue;
+			}
+
+			// one step of lazy matching: a longer match right after wins
+			if (position + 1 < findLimit) {
+				size_t nextPosition = 0;
+				insertIntoChain(compressor, input, inserted++);
+				size_t nextLength = findLongestMatch(compressor, input, position + 1, matchLimit, &nextPosition);
+				if (nextLength > matchLength + 1) {
+					position++;
+					matchLength = nextLength;
+					matchPosition = nextPosition;
+				}
+			}
+
+			out = putSequence(out, input + anchor, position - anchor, position - matchPosition, matchLength);
+			position += matchLength;
+			anchor = position;
+		}
+	}
+
+	out = putSequence(out, input + anchor, length - anchor, 0, 0);
+	return out - output;
+}
+
+// output has to have room for compressBound(length) bytes.
+size_t compressBlock(Compressor *compressor, const unsigned char *input, size_t length, unsigned char *output) {
+	if (compressor->codec == COMPRESS_LZ4HC) {
+		return compressHigh(compressor, input, length, output);
+	}
+	return compressFast(compressor, input, length, output);
+}
+
+static int getLength(const unsigned char **input, const unsigned char *end, size_t *length) {
+	unsigned char byte;
+	do {
+		if (*input >= end) {
+			return -1;
+		}
+		byte = *(*input)++;
+		*length += byte;
+	} while (byte == 255);
+	return 0;
+}
+
+// Returns 0 if input decompresses to exactly outputLength bytes, -1 if it's
+// damaged.
+int decompressBlock(const unsigned char *input, size_t inputLength, unsigned char *output, size_t outputLength) {
+	const unsigned char *inputEnd = input + inputLength;
+	unsigned char *out = output;
+	unsigned char *outputEnd = output + outputLength;
+
+	while (input < inputEnd) {
+		unsigned char token = *input++;
+
+		size_t literalsLength = token >> 4;
+		if (literalsLength == 15 && getLength(&input, inputEnd, &literalsLength) == -1) {
+			return -1;
+		}
+		if (literalsLength > (size_t) (inputEnd - input) || literalsLength > (size_t) (outputEnd - out)) {
+			return -1;
+		}
+		memcpy(out, input, literalsLength);
+		out += literalsLength;
+		input += literalsLength;
+
+		if (input == inputEnd) {
+			break;
+		}
+
+		if (inputEnd - input < 2) {
+			return -1;
+		}
+		size_t offset = input[0] | (input[1] << 8);
+		input += 2;
+		if (offset == 0 || offset > (size_t) (out - output)) {
+			return -1;
+		}
+
+		size_t matchLength = token & 15;
+		if (matchLength == 15 && getLength(&input, inputEnd, &matchLength) == -1) {
+			return -1;
+		}
+		matchLength += MIN_MATCH;
+		if (matchLength > (size_t) (outputEnd - out)) {
+			return -1;
+		}
+
+		const unsigned char *match = out - offset;
+		if (offset >= matchLength) {
+			memcpy(out, match, matchLength);
+			out += matchLength;
+		} else {
+			// overlapping: the match repeats what it just wrote
+			while (matchLength--) {
+				*out++ = *match++;
+			}
+		}
+	}
+
+	return out == outputEnd ? 0 : -1;
+}
+
+// A cheap look at whether compressing is worth the time: bytes sampled all
+// over the data, and the chance of two of them being equal. Random and
+// already compressed data has every byte value about equally often, so
+// that chance is close to 1/256.
+int compressLooksCompressible(const unsigned char *data, size_t length) {
+	uint32_t counts[256];
+	uint64_t samples = 0;
+
+	if (length < SAMPLE_STRIDES * SAMPLE_STRIDE_SIZE * 2) {
+		return 1;
+	}
+
+	memset(counts, 0, sizeof(counts));
+	size_t step = length / SAMPLE_STRIDES;
+	size_t i, j;
+	for (i = 0; i + SAMPLE_STRIDE_SIZE <= length; i += step) {
+		for (j = 0; j < SAMPLE_STRIDE_SIZE; j++) {
+			counts[data[i + j]]++;
+		}
+		samples += SAMPLE_STRIDE_SIZE;
+	}
+
+	uint64_t sumOfSquares = 0;
+	for (i = 0; i < 256; i++) {
+		sumOfSquares += (uint64_t) counts[i] * counts[i];
+	}
+
+	// the chance is sumOfSquares / samples^2; 5/4 of uniform (about 7.7
+	// bits of entropy per byte) and below isn't worth it
+	return sumOfSquares * 256 * 4 > samples * samples * 5;
+}
+
+size_t compressFrameBound(size_t length) {
+	return COMPRESS_FRAME_HEADER_SIZE + compressBound(length);
+}
+
+// Frames length bytes of input, compressed if that's worth it. frame has to
+// have room for compressFrameBound(length) bytes. Returns the frame's size.
+size_t compressFrame(Compressor *compressor, const unsigned char *input, size_t length, unsigned char *frame) {
+	int codec = COMPRESS_NONE;
+	size_t dataLength = length;
+
+	if (compressor && compressor->codec != COMPRESS_NONE && compressLooksCompressible(input, length)) {
+		size_t compressedLength = compressBlock(compressor, input, length, frame + COMPRESS_FRAME_HEADER_SIZE);
+		if (compressedLength < length - length / 16) {
+			codec = compressor->codec;
+			dataLength = compressedLength;
+		}
+	}
+
+	if (codec == COMPRESS_NONE) {
+		memcpy(frame + COMPRESS_FRAME_HEADER_SIZE, input, length);
+	}
+
+	put32(frame, codec);
+	put32(frame + 4, 0);
+	put64(frame + 8, length);
+	return COMPRESS_FRAME_HEADER_SIZE + dataLength;
+}
+
+// What the frame decompresses to.
+uint64_t compressFrameLength(const unsigned char *frame) {
+	return get64(frame + 8);
+}
+
+// Returns 0 once the frame is decompressed into output, -1 if it's damaged
+// or doesn't fit.
+int decompressFrame(const unsigned char *frame, size_t frameLength, unsigned char *output, size_t outputCapacity) {
+	if (frameLength < COMPRESS_FRAME_HEADER_SIZE) {
+		return -1;
+	}
+
+	uint32_t codec = get32(frame);
+	uint64_t length = get64(frame + 8);
+	const unsigned char *data = frame + COMPRESS_FRAME_HEADER_SIZE;
+	size_t dataLength = frameLength - COMPRESS_FRAME_HEADER_SIZE;
+
+	if (length > outputCapacity) {
+		return -1;
+	}
+
+	if (codec == COMPRESS_NONE) {
+		if (dataLength != length) {
+			return -1;
+		}
+		memcpy(output, data, length);
+		return 0;
+	}
+
+	if (codec != COMPRESS_LZ4 && codec != COMPRESS_LZ4HC) {
+		return -1;
+	}
+	return decompressBlock(data, dataLength, output, length);
+}
@@ -0,0 +1,47 @@
+#ifndef BIGSYNC_COMPRESS_H
+#define BIGSYNC_COMPRESS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define COMPRESS_NONE 0
+#define COMPRESS_LZ4 1
+#define COMPRESS_LZ4HC 2
+
+#define COMPRESS_FRAME_HEADER_SIZE 16
+
+// Block compression in the LZ4 block format, written from its description
+// so there's no dependency on liblz4. "lz4" is the fast greedy compressor,
+// "lz4hc" searches hash chains for longer matches, for a better ratio at a
+// fraction of the speed; both come out in the same format and decompress
+// equally fast.
+//
+// A frame is what gets stored or sent: codec (uint32), reserved (uint32),
+// original length (uint64), little-endian, then the data, compressed or,
+// with COMPRESS_NONE, as it was. Data a sample says is incompressible, and
+// data that doesn't get at least 1/16 smaller, is framed as it is.
+
+typedef struct {
+	int codec;
+	uint32_t *hashTable;
+	int32_t *chainHeads;
+	uint16_t *chain;
+} Compressor;
+
+int compressCodecByName(const char *name);
+const char *compressCodecName(int codec);
+
+Compressor *compressorCreate(int codec);
+void compressorDestroy(Compressor *compressor);
+
+size_t compressBound(size_t length);
+size_t compressBlock(Compressor *compressor, const unsigned char *input, size_t length, unsigned char *output);
+int decompressBlock(const unsigned char *input, size_t inputLength, unsigned char *output, size_t outputLength);
+int compressLooksCompressible(const unsigned char *data, size_t length);
+
+size_t compressFrameBound(size_t length);
+size_t compressFrame(Compressor *compressor, const unsigned char *input, size_t length, unsigned char *frame);
+uint64_t compressFrameLength(const unsigned char *frame);
+int decompressFrame(const unsigned char *frame, size_t frameLength, unsigned char *output, size_t outputCapacity);
+
+#endif
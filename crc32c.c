@@ -0,0 +1,58 @@
+// CRC-32C (Castagnoli), slicing-by-8 tables built on first use.
+
+#include <pthread.h>
+#include "crc32c.h"
+
+#define CRC32C_POLYNOMIAL 0x82F63B78
+
+static uint32_t crc32cTable[8][256];
+static pthread_once_t crc32cTableOnce = PTHREAD_ONCE_INIT;
+
+static void crc32cBuildTable() {
+	int i, j;
+	for (i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (j = 0; j < 8; j++) {
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLYNOMIAL : 0);
+		}
+		crc32cTable[0][i] = crc;
+	}
+
+	for (i = 0; i < 256; i++) {
+		for (j = 1; j < 8; j++) {
+			crc32cTable[j][i] = (crc32cTable[j - 1][i] >> 8) ^ crc32cTable[0][crc32cTable[j - 1][i] & 0xff];
+		}
+	}
+}
+
+// Takes and returns the finalized (inverted) value, so calls can be chained.
+uint32_t crc32cUpdate(uint32_t crc, const unsigned char *input, size_t length) {
+	pthread_once(&crc32cTableOnce, crc32cBuildTable);
+
+	crc = ~crc;
+
+	while (length >= 8) {
+		uint32_t low = crc ^ ((uint32_t) input[0] | ((uint32_t) input[1] << 8) |
+			((uint32_t) input[2] << 16) | ((uint32_t) input[3] << 24));
+		crc = crc32cTable[7][low & 0xff] ^
+			crc32cTable[6][(low >> 8) & 0xff] ^
+			crc32cTable[5][(low >> 16) & 0xff] ^
+			crc32cTable[4][low >> 24] ^
+			crc32cTable[3][input[4]] ^
+			crc32cTable[2][input[5]] ^
+			crc32cTable[1][input[6]] ^
+			crc32cTable[0][input[7]];
+		input += 8;
+		length -= 8;
+	}
+
+	while (length--) {
+		crc = (crc >> 8) ^ crc32cTable[0][(crc ^ *input++) & 0xff];
+	}
+
+	return ~crc;
+}
+
+uint32_t crc32c(const unsigned char *input, size_t length) {
+	return crc32cUpdate(0, input, length);
+}
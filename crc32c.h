@@ -0,0 +1,10 @@
+#ifndef BIGSYNC_CRC32C_H
+#define BIGSYNC_CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+uint32_t crc32cUpdate(uint32_t crc, const unsigned char *input, size_t length);
+uint32_t crc32c(const unsigned char *input, size_t length);
+
+#endif
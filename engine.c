@@ -0,0 +1,1948 @@
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <libgen.h>
+#include <inttypes.h>
+#include "engine.h"
+#include "hr.h"
+#include "checksums.h"
+#include "merkle.h"
+#include "cdc.h"
+#include "compress.h"
+#include "store.h"
+#include "generations.h"
+#include "remote.h"
+#include "writer.h"
+#include "journal.h"
+#include "extents.h"
+#include "uring.h"
+#include "zero.h"
+#include "stats.h"
+#include "pipeline.h"
+#include "reblock.h"
+#include "util.h"
+#include "engine_internal.h"
+
+#define THREADS_LIMIT 8
+
+#define DEFAULT_CHUNK_SIZE (1024 * 1024)
+
+#define JOURNAL_CHECKPOINT_INTERVAL 10
+
+// Blocks added to a store are shared with other runs this often, so that
+// runs going on at the same time find each other's blocks.
+#define STORE_COMMIT_BYTES (64 * 1024 * 1024)
+
+// A remote destination is synced this often unless a sync policy is given,
+// rather than after every block, as each sync waits for the network.
+#define REMOTE_SYNC_EVERY_BYTES (64 * 1024 * 1024)
+
+// Extent hints are trusted for this many runs in a row, then everything is
+// read once more in case the filesystem reused an extent's address.
+#define EXTENT_HINTS_FULL_SCAN_RUNS 10
+
+// --blocksize auto starts a file with the smallest power of two that makes no
+// more than AUTO_BLOCKS_COUNT blocks of it. Once AUTO_HISTORY_RUNS runs were
+// seen, it halves the block size while fewer than AUTO_FINER_RATIO
+// millionths of the blocks change per run (writes shrink with the blocks),
+// and doubles it while more than AUTO_COARSER_RATIO do (they don't, but the
+// checksums file does), within a factor of AUTO_BLOCK_SIZE_RANGE of the
+// first size.
+#define AUTO_BLOCKS_COUNT 65536
+#define AUTO_BLOCK_SIZE_MIN (64 * 1024)
+#define AUTO_BLOCK_SIZE_MAX (64 * 1024 * 1024)
+#define AUTO_BLOCK_SIZE_RANGE 8
+#define AUTO_HISTORY_RUNS 3
+#define AUTO_FINER_RATIO 50000
+#define AUTO_COARSER_RATIO 500000
+
+struct Engine {
+	Pool *pool;
+	int isPoolShared; // made by engineCreateLike()
+
+	const HashAlgorithm *hashAlgorithm; // NULL: the checksums file's, md4 for a new one
+	uint64_t blockSize; // 0: the checksums file's, ENGINE_DEFAULT_BLOCK_SIZE for a new one; or ENGINE_BLOCK_SIZE_AUTO
+	uint32_t leafSize;
+	int isLeafSizeGiven;
+	const char *checksumsFilename; // NULL: <dest>.bigsync, or the destination itself in a store
+
+	int isSparse;
+	int shouldTruncate;
+	int isRebuildOnly;
+	int shouldResume;
+	int shouldUseExtentHints;
+	int ioEngine;
+	int queueDepth;
+	int shouldUseDirectIO;
+	int shouldDropCache;
+	int syncPolicy;
+	uint64_t syncEveryBytes;
+	int isSyncPolicyGiven;
+
+	int shouldUseChunks;
+	const char *storeDirectory;
+	int keepGenerations; // -1: as many as before
+	int compressCodec; // -1: as before
+	const char *rsh;
+	const char *remoteCommand;
+
+	Throttle *throttle;
+	int statsJsonFd;
+	const char *prometheusFilename;
+	int shouldTimeStages;
+
+	EngineProgressFunction progress;
+	EngineNoteFunction note;
+	void *context;
+
+	int isSourceSizeUnknown; // see engine_internal.h
+	uint64_t writeLatencyMicroseconds; // see engine_internal.h
+
+	int errorCode;
+	char error[ENGINE_ERROR_SIZE];
+};
+
+typedef struct {
+	Journal *journal;
+	Checksums *checksums;
+	Generations *generations;
+} JournalContext;
+
+// the lengths a run's zero blocks and leaves can have: a block, the short
+// last block, a leaf, the short last leaf of a block and of the last block
+#define ZERO_DIGESTS 5
+
+typedef struct {
+	uint64_t length;
+	unsigned char digest[HASH_MAX_DIGEST_SIZE];
+} ZeroDigest;
+
+typedef struct {
+	const HashAlgorithm *hashAlgorithm;
+	uint64_t blockSize;
+	uint32_t leafSize;
+	uint32_t leavesPerBlock;
+	ZeroDigest zeroDigests[ZERO_DIGESTS];
+	int zeroDigestsCount;
+} HashingContext;
+
+typedef struct {
+	ExtentMap *extentMap;
+	off_t sourceSize;
+	off_t blockSize;
+	uint64_t *storedHints;
+	uint64_t storedHintsCount;
+} ExtentHintsContext;
+
+// Everything a sync has open, so that one that fails can let go of it all.
+typedef struct {
+	Engine *engine;
+	char *sourceFilename;
+	char *destFilename;
+	char *checksumsFilename;
+	uint64_t sourceSize;
+	int digestSize;
+
+	FILE *sourceFile;
+	FILE *destFile;
+	int destFd;
+	uint64_t destSize; // before the sync, UINT64_MAX when not known
+	int sourceDirectFd;
+	int destDirectFd;
+	Remote *remote;
+	Store *store;
+	Checksums *checksums;
+	Writer *writer;
+	Stats *stats;
+
+	// fixed blocks
+	Uring *readRing;
+	Uring *writeRing;
+	Pipeline *pipeline;
+	char *journalFilename;
+	JournalContext journalContext;
+	Generations generations;
+	int hasGenerations;
+	ExtentHintsContext extentHintsContext;
+	int extentHintsFd;
+	unsigned char *isLeafChanged;
+	Reblocker *reblocker;
+	char *merkleFilename;
+
+	// chunks
+	Compressor *compressor;
+	ChunkIndex *chunkIndex;
+	char *chunkMapFilename;
+	Checksums *chunkMap;
+	unsigned char *buffer;
+	unsigned char *frame;
+} EngineRun;
+
+static int fail(EngineRun *run, int errorCode, const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(run->engine->error, ENGINE_ERROR_SIZE, fmt, ap);
+	va_end(ap);
+	run->engine->errorCode = errorCode;
+	return -1;
+}
+
+static void note(EngineRun *run, int level, const char *fmt, ...) {
+	Engine *engine = run->engine;
+	if (engine->note == NULL) {
+		return;
+	}
+
+	char *message;
+	va_list ap;
+	va_start(ap, fmt);
+	int length = vasprintf(&message, fmt, ap);
+	va_end(ap);
+	if (length < 0) {
+		return;
+	}
+
+	engine->note(engine->context, level, message);
+	free(message);
+}
+
+static void progress(EngineRun *run, uint64_t position, const unsigned char *digest, const unsigned char *storedDigest,
+	int state) {
+
+	Engine *engine = run->engine;
+	if (engine->progress) {
+		engine->progress(engine->context, position, run->sourceSize, digest, storedDigest, run->digestSize, state);
+	}
+}
+
+int engineDefaultThreadsCount(void) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1) {
+		return 1;
+	}
+
+	return cpus > THREADS_LIMIT ? THREADS_LIMIT : (int) cpus;
+}
+
+// The hashing threads are started here and shared by every sync.
+Engine *engineCreate(int threadsCount) {
+	Engine *engine = calloc(1, sizeof(Engine));
+	if (engine == NULL) {
+		return NULL;
+	}
+
+	engine->pool = poolCreate(threadsCount > 0 ? threadsCount : engineDefaultThreadsCount());
+	if (engine->pool == NULL) {
+		free(engine);
+		return NULL;
+	}
+
+	engine->shouldTruncate = 1;
+	engine->shouldResume = 1;
+	engine->ioEngine = ENGINE_IO_STDIO;
+	engine->queueDepth = ENGINE_DEFAULT_QUEUE_DEPTH;
+	engine->syncPolicy = SYNC_POLICY_PER_BLOCK;
+	engine->keepGenerations = -1;
+	engine->compressCodec = -1;
+	engine->rsh = REMOTE_DEFAULT_RSH;
+	engine->remoteCommand = REMOTE_DEFAULT_COMMAND;
+	engine->statsJsonFd = -1;
+	return engine;
+}
+
+// Another engine with the same settings and callbacks, to sync at the same
+// time on another thread. It hashes with the threads of the first one, which
+// has to be destroyed last.
+Engine *engineCreateLike(Engine *engine) {
+	Engine *copy = malloc(sizeof(Engine));
+	if (copy == NULL) {
+		return NULL;
+	}
+
+	*copy = *engine;
+	copy->isPoolShared = 1;
+	copy->errorCode = 0;
+	copy->error[0] = 0;
+	return copy;
+}
+
+void engineSetHash(Engine *engine, const HashAlgorithm *hashAlgorithm) {
+	engine->hashAlgorithm = hashAlgorithm;
+}
+
+void engineSetBlockSize(Engine *engine, uint64_t blockSize) {
+	engine->blockSize = blockSize;
+}
+
+// 0 stops keeping leaves; unless set, the checksums file's stays.
+void engineSetLeafSize(Engine *engine, uint32_t leafSize) {
+	engine->leafSize = leafSize;
+	engine->isLeafSizeGiven = 1;
+}
+
+void engineSetChecksumsFile(Engine *engine, const char *checksumsFilename) {
+	engine->checksumsFilename = checksumsFilename;
+}
+
+void engineSetSparse(Engine *engine, int isSparse) {
+	engine->isSparse = isSparse;
+}
+
+void engineSetTruncate(Engine *engine, int shouldTruncate) {
+	engine->shouldTruncate = shouldTruncate;
+}
+
+void engineSetRebuildOnly(Engine *engine, int isRebuildOnly) {
+	engine->isRebuildOnly = isRebuildOnly;
+}
+
+void engineSetResume(Engine *engine, int shouldResume) {
+	engine->shouldResume = shouldResume;
+}
+
+void engineSetExtentHints(Engine *engine, int shouldUseExtentHints) {
+	engine->shouldUseExtentHints = shouldUseExtentHints;
+}
+
+void engineSetIoEngine(Engine *engine, int ioEngine, int queueDepth) {
+	engine->ioEngine = ioEngine;
+	engine->queueDepth = queueDepth;
+}
+
+void engineSetCachePolicy(Engine *engine, int shouldUseDirectIO, int shouldDropCache) {
+	engine->shouldUseDirectIO = shouldUseDirectIO;
+	engine->shouldDropCache = shouldDropCache;
+}
+
+// Unless set, a remote destination is synced every REMOTE_SYNC_EVERY_BYTES.
+void engineSetSyncPolicy(Engine *engine, int syncPolicy, uint64_t syncEveryBytes) {
+	engine->syncPolicy = syncPolicy;
+	engine->syncEveryBytes = syncEveryBytes;
+	engine->isSyncPolicyGiven = 1;
+}
+
+void engineSetChunks(Engine *engine, int shouldUseChunks) {
+	engine->shouldUseChunks = shouldUseChunks;
+}
+
+void engineSetStore(Engine *engine, const char *storeDirectory) {
+	engine->storeDirectory = storeDirectory;
+}
+
+void engineSetKeepGenerations(Engine *engine, int keepGenerations) {
+	engine->keepGenerations = keepGenerations;
+}
+
+void engineSetCompression(Engine *engine, int codec) {
+	engine->compressCodec = codec;
+}
+
+void engineSetRemoteShell(Engine *engine, const char *rsh, const char *remoteCommand) {
+	engine->rsh = rsh;
+	engine->remoteCommand = remoteCommand;
+}
+
+void engineSetThrottle(Engine *engine, Throttle *throttle) {
+	engine->throttle = throttle;
+}
+
+// jsonFd stays open, so that the syncs of an engine can share it; -1 for
+// no JSON lines.
+void engineSetStats(Engine *engine, int jsonFd, const char *prometheusFilename) {
+	engine->statsJsonFd = jsonFd;
+	engine->prometheusFilename = prometheusFilename;
+}
+
+// Times the stages of every block into the totals, without JSON lines or a
+// Prometheus file to show them.
+void engineSetStageTimes(Engine *engine, int shouldTimeStages) {
+	engine->shouldTimeStages = shouldTimeStages;
+}
+
+void engineSetCallbacks(Engine *engine, EngineProgressFunction progress, EngineNoteFunction note, void *context) {
+	engine->progress = progress;
+	engine->note = note;
+	engine->context = context;
+}
+
+// Pretends not to know the size of the source, as with a pipe, so that the
+// command's tests can go through that path with a regular file. Not meant
+// for anything else.
+void engineSetSourceSizeUnknown(Engine *engine, int isSourceSizeUnknown) {
+	engine->isSourceSizeUnknown = isSourceSizeUnknown;
+}
+
+// Makes every write of the destination that much slower, to see how a sync
+// fares on a slow disk or network without one.
+void engineSetWriteLatency(Engine *engine, uint64_t microseconds) {
+	engine->writeLatencyMicroseconds = microseconds;
+}
+
+static off_t fileSize(const char *filename) {
+ 	struct stat fileStat;
+
+	if (stat(filename,&fileStat) == -1) {
+		return -1;
+	}
+
+	return fileStat.st_size;
+}
+
+static int createEmptyFile(const char *filename) {
+	FILE *f = fopen(filename, "w");
+
+	if (f == NULL) {
+		return 0;
+	}
+
+	fclose(f);
+
+	return 1;
+}
+
+// Without a writer (rebuilding only) only the checksum is updated. With one,
+// the checksum has to wait until the block is durable, which the writer
+// takes care of.
+static int updateBlockInFile(char *block, uint64_t index, off_t offset, Writer *writer, Checksums *checksums,
+	uint64_t readBytes, int isSparse, uint64_t extentHint, int isSourceBlockZero,
+	unsigned char *readingDigest, uint64_t destSize, const WriterLeaves *leaves) {
+
+	if (writer == NULL) {
+		if (checksumsSet(checksums, index, readingDigest) == -1) {
+			return -1;
+		}
+		checksumsSetExtentHint(checksums, index, extentHint);
+		if (leaves) {
+			checksumsSetLeaves(checksums, index, leaves->digests, leaves->count);
+		}
+		return 0;
+	}
+
+	// In sparse mode the writer punches the block's zeros out instead of
+	// writing them, which also deallocates blocks that used to hold data.
+	// A zero block past the end of the destination needs nothing at all, it
+	// reads as zeros once the destination is extended. Not having a stored
+	// checksum says nothing: the checksums file may be new, or just reset,
+	// next to a destination full of old data.
+	int shouldWriteBlock = 1;
+
+	if (isSparse && isSourceBlockZero && (uint64_t) offset >= destSize) {
+		shouldWriteBlock = 0;
+	}
+
+	return writerWriteBlock(writer, index, offset, shouldWriteBlock ? block : NULL, readBytes, readingDigest,
+		extentHint, leaves);
+}
+
+static int commitChecksum(void *context, const WriterPendingCommit *commit) {
+	Checksums *checksums = (Checksums *) context;
+
+	if (checksumsSet(checksums, commit->index, commit->digest) == -1) {
+		return -1;
+	}
+	checksumsSetExtentHint(checksums, commit->index, commit->extentHint);
+	if (commit->leafDigests) {
+		checksumsSetLeaves(checksums, commit->index, commit->leafDigests, commit->leavesCount);
+	}
+	return 0;
+}
+
+// Flags the leaves of a changed block that differ from the stored ones (all
+// of them if those aren't known) and returns how many bytes that makes.
+static uint64_t compareLeaves(Checksums *checksums, uint64_t index, WriterLeaves *leaves, unsigned char *isChanged,
+	uint64_t readBytes) {
+
+	unsigned char *storedLeafDigests = NULL;
+	uint32_t storedCount = checksumsGetLeaves(checksums, index, &storedLeafDigests);
+	uint64_t changedBytes = 0;
+
+	uint32_t i;
+	for (i = 0; i < leaves->count; i++) {
+		isChanged[i] = i >= storedCount ||
+			memcmp(leaves->digests + i * leaves->digestSize, storedLeafDigests + i * leaves->digestSize, leaves->digestSize) != 0;
+
+		if (isChanged[i]) {
+			uint64_t start = (uint64_t) i * leaves->leafSize;
+			changedBytes += readBytes - start < leaves->leafSize ? readBytes - start : leaves->leafSize;
+		}
+	}
+
+	leaves->isChanged = isChanged;
+	return changedBytes;
+}
+
+// Writer hook: make the blocks about to be written known to the journal
+// before the destination is touched.
+static int journalPendingBlocks(void *context, WriterPendingCommit *pending, size_t count, size_t journaledCount) {
+	JournalContext *journalContext = (JournalContext *) context;
+
+	// the old contents of these blocks have to be safe first
+	if (journalContext->generations && generationsSync(journalContext->generations) == -1) {
+		return -1;
+	}
+
+	// A new batch: everything before it has been synced and committed, so
+	// once the checksums are on disk too, it's where to resume from.
+	if (journaledCount == 0) {
+		if (checksumsSync(journalContext->checksums) == -1 ||
+			journalCheckpoint(journalContext->journal, pending[0].index) == -1) {
+			return -1;
+		}
+	}
+
+	if (journalAppend(journalContext->journal, pending + journaledCount, count - journaledCount) == -1) {
+		return -1;
+	}
+
+	return journalSync(journalContext->journal);
+}
+
+static int checkpointJournal(EngineRun *run, uint64_t resumeIndex) {
+	JournalContext *journalContext = &run->journalContext;
+
+	if (checksumsSync(journalContext->checksums) == -1 ||
+		journalCheckpoint(journalContext->journal, resumeIndex) == -1 ||
+		journalSync(journalContext->journal) == -1) {
+
+		return fail(run, ENGINE_ERROR_CHECKSUMS, "Failed to write to file %s: %s", journalContext->journal->filename,
+			strerror(errno));
+	}
+	return 0;
+}
+
+static ssize_t readRemote(void *remote, char *data, size_t length, off_t offset) {
+	return remoteRead(remote, data, length, offset);
+}
+
+// Picks up after an interrupted run. Blocks the journal lists may have been
+// written partially or not at all, so their checksums are taken from what
+// the destination actually holds now; every block before the resume index
+// is known to be done. Sets the block to continue from.
+static int recoverFromJournal(EngineRun *run, uint64_t *resumeIndex) {
+	Checksums *checksums = run->checksums;
+	JournalContents contents;
+
+	*resumeIndex = 0;
+	if (journalRead(run->journalFilename, &contents) == -1) {
+		if (errno != ENOENT) {
+			note(run, ENGINE_NOTE, "ignoring broken journal %s", run->journalFilename);
+		}
+		return 0;
+	}
+
+	if (contents.hashId != checksums->hashAlgorithm->id || contents.blockSize != checksums->blockSize) {
+		journalFreeContents(&contents);
+		return 0;
+	}
+
+	char *block = malloc(checksums->blockSize);
+	if (block == NULL) {
+		journalFreeContents(&contents);
+		return fail(run, ENGINE_ERROR_MEMORY, "Cannot allocate memory: %s", strerror(errno));
+	}
+
+	size_t i;
+	for (i = 0; i < contents.entriesCount; i++) {
+		WriterPendingCommit *entry = &contents.entries[i];
+		if (entry->index > checksums->blocksCount || entry->length > checksums->blockSize) {
+			break;
+		}
+
+		// whatever is past the end of the destination reads as zeros once
+		// it gets truncated to size
+		int readResult = run->remote ?
+			utilReadZeroFilledFrom(readRemote, run->remote, block, entry->length, entry->offset) :
+			utilReadZeroFilled(run->destFd, block, entry->length, entry->offset);
+		if (readResult == -1) {
+			int readError = errno;
+			free(block);
+			journalFreeContents(&contents);
+			return fail(run, ENGINE_ERROR_DEST, "Cannot read destination file: %s", strerror(readError));
+		}
+
+		unsigned char digest[HASH_MAX_DIGEST_SIZE];
+		hashBuffer(checksums->hashAlgorithm, (unsigned char *) block, entry->length, digest);
+		if (checksumsSet(checksums, entry->index, digest) == -1) {
+			int writeError = errno;
+			free(block);
+			journalFreeContents(&contents);
+			return fail(run, ENGINE_ERROR_CHECKSUMS, "Failed to write to file %s: %s", checksums->filename,
+				strerror(writeError));
+		}
+
+		// this is what the destination holds, not what the source extents do
+		checksumsSetExtentHint(checksums, entry->index, 0);
+	}
+
+	free(block);
+
+	*resumeIndex = contents.resumeIndex;
+	if (*resumeIndex > checksums->blocksCount) {
+		*resumeIndex = checksums->blocksCount;
+	}
+
+	note(run, ENGINE_INFO, "Previous run was interrupted: verified %d block(s), resuming at block %" PRIu64,
+		(int) contents.entriesCount, *resumeIndex);
+
+	journalFreeContents(&contents);
+	return 0;
+}
+
+static void addZeroDigest(HashingContext *hashingContext, const unsigned char *zeros, uint64_t length) {
+	int i;
+	for (i = 0; i < hashingContext->zeroDigestsCount; i++) {
+		if (hashingContext->zeroDigests[i].length == length) {
+			return;
+		}
+	}
+
+	if (length == 0 || hashingContext->zeroDigestsCount == ZERO_DIGESTS) {
+		return;
+	}
+
+	ZeroDigest *zeroDigest = &hashingContext->zeroDigests[hashingContext->zeroDigestsCount++];
+	zeroDigest->length = length;
+	hashBuffer(hashingContext->hashAlgorithm, zeros, length, zeroDigest->digest);
+}
+
+// NULL for a length not known up front, such as that of a source that
+// changed size during the run
+static const unsigned char *zeroDigestOf(HashingContext *hashingContext, uint64_t length) {
+	int i;
+	for (i = 0; i < hashingContext->zeroDigestsCount; i++) {
+		if (hashingContext->zeroDigests[i].length == length) {
+			return hashingContext->zeroDigests[i].digest;
+		}
+	}
+	return NULL;
+}
+
+static void hashLeaves(PipelineBlock *block, HashingContext *hashingContext) {
+	int digestSize = hashingContext->hashAlgorithm->digestSize;
+
+	if (block->leafDigests == NULL) {
+		block->leafDigests = malloc((size_t) hashingContext->leavesPerBlock * digestSize);
+		if (block->leafDigests == NULL) {
+			return;
+		}
+	}
+
+	// Full leaves are hashed a batch at a time, which md4 does in parallel.
+	const unsigned char *batch[HASH_BATCH_SIZE];
+	int batchCount = 0;
+	unsigned char *batchDigest = block->leafDigests;
+
+	unsigned char *leafDigest = block->leafDigests;
+	uint64_t position;
+	for (position = 0; position < block->readBytes; position += hashingContext->leafSize) {
+		uint64_t length = block->readBytes - position;
+		if (length >= hashingContext->leafSize) {
+			length = hashingContext->leafSize;
+		}
+
+		const unsigned char *zeroDigest = block->isZero ? zeroDigestOf(hashingContext, length) : NULL;
+		if (zeroDigest) {
+			memcpy(leafDigest, zeroDigest, digestSize);
+		} else if (length == hashingContext->leafSize) {
+			if (batchCount == 0) {
+				batchDigest = leafDigest;
+			}
+			batch[batchCount++] = (unsigned char *) block->data + position;
+			if (batchCount == HASH_BATCH_SIZE) {
+				hashBuffers(hashingContext->hashAlgorithm, batch, length, batchCount, batchDigest);
+				batchCount = 0;
+			}
+		} else {
+			hashBuffer(hashingContext->hashAlgorithm, (unsigned char *) block->data + position, length, leafDigest);
+		}
+		leafDigest += digestSize;
+	}
+
+	if (batchCount) {
+		hashBuffers(hashingContext->hashAlgorithm, batch, hashingContext->leafSize, batchCount, batchDigest);
+	}
+}
+
+// Zero blocks are common in disk images, and checking for zeros is a lot
+// cheaper than hashing them.
+static void hashPipelineBlock(PipelineBlock *block, void *context) {
+	HashingContext *hashingContext = (HashingContext *) context;
+
+	if (!block->isZero) {
+		block->isZero = zeroIsZero((unsigned char *) block->data, block->readBytes);
+	}
+
+	const unsigned char *zeroDigest = block->isZero ? zeroDigestOf(hashingContext, block->readBytes) : NULL;
+	if (zeroDigest) {
+		memcpy(block->digest, zeroDigest, HASH_MAX_DIGEST_SIZE);
+	} else {
+		hashBuffer(hashingContext->hashAlgorithm, (unsigned char *) block->data, block->readBytes, block->digest);
+	}
+
+	if (hashingContext->leafSize) {
+		hashLeaves(block, hashingContext);
+	}
+}
+
+// Pipeline read filter for extent hints. Stored hints are copied before the
+// pipeline starts, as the checksums file may be remapped while it runs.
+static int filterByExtentHints(void *context, uint64_t index, off_t offset, uint64_t *extentHint) {
+	ExtentHintsContext *extentHintsContext = (ExtentHintsContext *) context;
+
+	// the last block may still be growing
+	if (offset + extentHintsContext->blockSize > extentHintsContext->sourceSize) {
+		return PIPELINE_READ;
+	}
+
+	int isHole;
+	extentMapDescribe(extentHintsContext->extentMap, offset, extentHintsContext->blockSize, &isHole, extentHint);
+
+	if (isHole) {
+		return PIPELINE_HOLE;
+	}
+
+	if (*extentHint && index < extentHintsContext->storedHintsCount && extentHintsContext->storedHints[index] == *extentHint) {
+		return PIPELINE_SKIP;
+	}
+
+	return PIPELINE_READ;
+}
+
+static int openDirect(const char *filename, int flags) {
+#ifdef O_DIRECT
+	return open(filename, flags | O_DIRECT);
+#else
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+static void adviseCache(int fd, off_t offset, off_t length, int advice) {
+#ifdef POSIX_FADV_DONTNEED
+	posix_fadvise(fd, offset, length, advice);
+#endif
+}
+
+// Ends the metrics of the sync: the last JSON line, then the Prometheus file.
+static int finishStats(EngineRun *run, EngineTotals *totals) {
+	if (run->stats == NULL) {
+		return 0;
+	}
+
+	statsFinish(run->stats);
+	memcpy(totals->stages, run->stats->stages, sizeof(totals->stages));
+	if (run->engine->prometheusFilename) {
+		char statsError[STATS_ERROR_SIZE];
+		if (statsWritePrometheus(run->stats, run->engine->prometheusFilename, statsError) == -1) {
+			return fail(run, ENGINE_ERROR_DEST, "%s", statsError);
+		}
+	}
+	statsDestroy(run->stats);
+	run->stats = NULL;
+	return 0;
+}
+
+static int commitChunk(void *context, const WriterPendingCommit *commit) {
+	return checksumsSetChunk((Checksums *) context, commit->index, commit->digest, commit->offset, commit->length);
+}
+
+// Chunks: the destination is a container the chunks of the source (cut where
+// its content says, see cdc.h) are appended to, each digest once, and the
+// checksums file lists the chunks that make up the source. Chunks that only
+// moved are found by digest and not written again. The new list goes to a
+// temporary file which replaces the old one once the container is synced,
+// so the old list stays usable until then; the container is never written
+// over, only appended to.
+//
+// A store works the same way, with the store's pack as the container (and
+// the checksums file as the destination), shared by every destination in
+// the store. Its chunks are fixed blocks unless chunks are asked for.
+//
+// With a compressor, the chunks of a container are kept compressed (only
+// those worth it, see compress.h). A chunk found by digest is the same chunk
+// whatever its stored length then.
+static int syncChunks(EngineRun *run, uint64_t averageSize, uint32_t chunksFlags, EngineTotals *totals) {
+	char checksumsError[CHECKSUMS_ERROR_SIZE];
+	Checksums *checksums = run->checksums;
+	Store *store = run->store;
+	Compressor *compressor = run->compressor;
+	Stats *stats = run->stats;
+	Throttle *throttle = run->engine->throttle;
+	char *destFilename = store ? store->directory : run->destFilename;
+	const HashAlgorithm *hashAlgorithm = checksums->hashAlgorithm;
+	int digestSize = hashAlgorithm->digestSize;
+	uint32_t layoutFlags = CHECKSUMS_FLAG_CHUNKS | CHECKSUMS_FLAG_STORE | CHECKSUMS_FLAG_FIXED_CHUNKS |
+		CHECKSUMS_FLAG_COMPRESSED;
+
+	if (compressor) {
+		chunksFlags |= CHECKSUMS_FLAG_COMPRESSED;
+	}
+
+	if ((checksums->flags & layoutFlags) != chunksFlags) {
+		if (checksums->blocksCount > 0) {
+			if (store) {
+				note(run, ENGINE_NOTE, "the destination is now kept in store %s, all blocks will be looked up again",
+					store->directory);
+			} else if (((checksums->flags ^ chunksFlags) & layoutFlags) == CHECKSUMS_FLAG_COMPRESSED) {
+				note(run, ENGINE_NOTE, "the container is now kept %s, all data will be written again",
+					compressor ? "compressed" : "uncompressed");
+			} else {
+				note(run, ENGINE_NOTE, "the destination becomes a container of chunks, all data will be written again");
+			}
+		}
+		// the old checksums must be gone before the data they describe is
+		if (checksumsResetChunks(checksums, hashAlgorithm, averageSize, chunksFlags) == -1 || checksumsSync(checksums) == -1) {
+			return fail(run, ENGINE_ERROR_CHECKSUMS, "Failed to write to file %s: %s", checksums->filename, strerror(errno));
+		}
+		if (store == NULL && ftruncate(run->destFd, 0) == -1) {
+			return fail(run, ENGINE_ERROR_DEST, "Failed to truncate %s: %s", destFilename, strerror(errno));
+		}
+	}
+
+	Chunker chunker;
+	if (chunksFlags & CHECKSUMS_FLAG_FIXED_CHUNKS) {
+		chunkerInitFixed(&chunker, checksums->blockSize);
+	} else {
+		chunkerInit(&chunker, checksums->blockSize);
+	}
+
+	int containerFd = store ? store->packFd : run->destFd;
+	struct stat containerStat;
+	if (fstat(containerFd, &containerStat) == -1) {
+		return fail(run, ENGINE_ERROR_DEST, "Cannot stat %s: %s", destFilename, strerror(errno));
+	}
+	uint64_t containerEnd = containerStat.st_size;
+
+	// chunks the container is known to hold; an interrupted run may have
+	// left more after them, which is just skipped
+	ChunkIndex *chunkIndex = NULL;
+	if (store == NULL) {
+		chunkIndex = run->chunkIndex = chunkIndexCreate(digestSize, checksums->blocksCount);
+		if (chunkIndex == NULL) {
+			return fail(run, ENGINE_ERROR_MEMORY, "Cannot allocate memory: %s", strerror(errno));
+		}
+
+		uint64_t i;
+		for (i = 0; i < checksums->blocksCount; i++) {
+			uint64_t offset, length;
+			checksumsGetChunk(checksums, i, &offset, &length);
+			if (length > 0 && offset + length <= containerEnd &&
+				chunkIndexAdd(chunkIndex, checksumsGet(checksums, i), offset, length) == -1) {
+				return fail(run, ENGINE_ERROR_MEMORY, "Cannot allocate memory: %s", strerror(errno));
+			}
+		}
+	}
+
+	if (asprintf(&run->chunkMapFilename, "%s.tmp", checksums->filename) < 0) {
+		run->chunkMapFilename = NULL;
+		return fail(run, ENGINE_ERROR_MEMORY, "Cannot allocate memory: %s", strerror(errno));
+	}
+	unlink(run->chunkMapFilename);
+
+	Checksums *chunkMap = run->chunkMap = checksumsOpen(run->chunkMapFilename, hashAlgorithm, checksums->blockSize,
+		checksumsError);
+	if (chunkMap == NULL) {
+		return fail(run, ENGINE_ERROR_CHECKSUMS, "%s", checksumsError);
+	}
+	if (checksumsResetChunks(chunkMap, hashAlgorithm, checksums->blockSize, chunksFlags) == -1 ||
+		(run->sourceSize > 0 && checksumsReserve(chunkMap, run->sourceSize / chunker.averageSize + 1) == -1)) {
+		return fail(run, ENGINE_ERROR_CHECKSUMS, "Failed to write to file %s: %s", run->chunkMapFilename, strerror(errno));
+	}
+
+	// nothing refers to the new chunks before the list is renamed into
+	// place, so syncing once at the end is enough
+	size_t maxStoredSize = compressor ? compressFrameBound(chunker.maxSize) : chunker.maxSize;
+	Writer *writer = run->writer = writerCreate(containerFd, SYNC_POLICY_END, 0, maxStoredSize, commitChunk, chunkMap);
+	if (writer == NULL) {
+		return fail(run, ENGINE_ERROR_MEMORY, "Cannot allocate write buffer: %s", strerror(errno));
+	}
+	writerSetThrottle(writer, throttle);
+	writerSetStats(writer, stats);
+	writerSetLatency(writer, run->engine->writeLatencyMicroseconds);
+
+	size_t bufferSize = chunker.maxSize * 2;
+	unsigned char *buffer = run->buffer = malloc(bufferSize);
+	unsigned char *frame = run->frame = compressor ? malloc(maxStoredSize) : NULL;
+	if (buffer == NULL || (compressor && frame == NULL)) {
+		return fail(run, ENGINE_ERROR_MEMORY, "Cannot allocate memory: %s", strerror(errno));
+	}
+
+	size_t start = 0;
+	size_t filled = 0;
+	int isEnd = 0;
+	uint64_t position = 0;
+	uint64_t chunkNumber = 0;
+	uint64_t bytesSinceStoreCommit = 0;
+
+	for (;;) {
+		if (!isEnd && filled - start < chunker.maxSize) {
+			memmove(buffer, buffer + start, filled - start);
+			filled -= start;
+			start = 0;
+
+			while (!isEnd && filled < bufferSize) {
+				throttleRead(throttle, bufferSize - filled);
+				uint64_t readAt = statsNow();
+				size_t readBytes = fread(buffer + filled, 1, bufferSize - filled, run->sourceFile);
+				statsStage(stats, STATS_READ, readAt);
+				statsRead(stats, readBytes);
+				if (readBytes == 0) {
+					if (ferror(run->sourceFile)) {
+						return fail(run, ENGINE_ERROR_SOURCE, "Cannot read %s at %" PRIu64 ": %s", run->sourceFilename,
+							position + filled, strerror(errno));
+					}
+					isEnd = 1;
+				}
+				filled += readBytes;
+				totals->bytesRead += readBytes;
+			}
+		}
+
+		if (start == filled) {
+			break;
+		}
+
+		size_t length = chunkerNext(&chunker, buffer + start, filled - start, isEnd);
+		unsigned char digest[HASH_MAX_DIGEST_SIZE];
+		uint64_t hashedAt = statsNow();
+		hashBuffer(hashAlgorithm, buffer + start, length, digest);
+		statsStage(stats, STATS_HASH, hashedAt);
+		position += length;
+
+		uint64_t comparedAt = statsNow();
+		ChunkIndexEntry *stored = store ? storeFind(store, digest) : chunkIndexFind(chunkIndex, digest);
+		statsStage(stats, STATS_COMPARE, comparedAt);
+		statsBlock(stats, position, !(stored && (compressor || stored->length == length)));
+		int result;
+		if (stored && (compressor || stored->length == length)) {
+			progress(run, position, digest, digest, ENGINE_BLOCK_SAME);
+			result = writerWriteBlock(writer, chunkNumber, stored->offset, NULL, stored->length, digest, 0, NULL);
+		} else {
+			const char *data = (char *) buffer + start;
+			size_t storedLength = length;
+			if (compressor) {
+				storedLength = compressFrame(compressor, buffer + start, length, frame);
+				data = (char *) frame;
+			}
+
+			uint64_t offset = containerEnd;
+			if (store) {
+				result = storeReserve(store, digest, storedLength, &offset);
+			} else {
+				result = chunkIndexAdd(chunkIndex, digest, offset, storedLength);
+				containerEnd += storedLength;
+			}
+			if (result == -1) {
+				return fail(run, ENGINE_ERROR_DEST, "Cannot add a chunk to %s: %s", destFilename, strerror(errno));
+			}
+
+			progress(run, position, digest, NULL, ENGINE_BLOCK_ADDED);
+			result = writerWriteBlock(writer, chunkNumber, offset, data, storedLength, digest, 0, NULL);
+			totals->bytesWritten += storedLength;
+			totals->blocksChanged++;
+			bytesSinceStoreCommit += length;
+		}
+		if (result == 0 && store && bytesSinceStoreCommit >= STORE_COMMIT_BYTES) {
+			result = writerSync(writer) == 0 ? storeCommit(store) : -1;
+			bytesSinceStoreCommit = 0;
+		}
+		if (result == -1) {
+			return fail(run, ENGINE_ERROR_DEST, "Failed to write to file %s: %s", destFilename, strerror(errno));
+		}
+
+		start += length;
+		chunkNumber++;
+	}
+
+	run->writer = NULL;
+	if (writerClose(writer) == -1 || (store && storeCommit(store) == -1)) {
+		return fail(run, ENGINE_ERROR_DEST, "Failed to write to file %s: %s", destFilename, strerror(errno));
+	}
+
+	run->chunkMap = NULL;
+	if (checksumsClose(chunkMap, chunkNumber, position) == -1) {
+		return fail(run, ENGINE_ERROR_CHECKSUMS, "Failed to write file %s: %s", run->chunkMapFilename, strerror(errno));
+	}
+
+	char *checksumsFilename = checksums->filename;
+	if (checksumsClose(checksums, checksums->blocksCount, checksums->sourceSize) == -1) {
+		run->checksums = NULL;
+		return fail(run, ENGINE_ERROR_CHECKSUMS, "Failed to write file %s: %s", run->checksumsFilename, strerror(errno));
+	}
+	run->checksums = NULL;
+	if (rename(run->chunkMapFilename, checksumsFilename) == -1) {
+		return fail(run, ENGINE_ERROR_CHECKSUMS, "Failed to write file %s: %s", run->checksumsFilename, strerror(errno));
+	}
+
+	// block ranges mean nothing in a container
+	char *merkleFilename = NULL;
+	if (asprintf(&merkleFilename, "%s.merkle", run->checksumsFilename) >= 0) {
+		unlink(merkleFilename);
+		free(merkleFilename);
+	}
+
+	totals->isChunked = 1;
+	totals->chunksCount = chunkNumber;
+	totals->containerSize = fstat(containerFd, &containerStat) == 0 ? (uint64_t) containerStat.st_size : containerEnd;
+	return 0;
+}
+
+// Lets go of whatever a sync still holds: all of it when the sync failed,
+// nothing but the file names when it didn't.
+static void releaseRun(EngineRun *run) {
+	statsSetQueue(run->stats, NULL, NULL);
+	if (run->pipeline) {
+		pipelineDestroy(run->pipeline);
+	}
+
+	// what was written so far gets committed, and journaled, as usual
+	if (run->writer) {
+		writerClose(run->writer);
+	}
+	if (run->journalContext.journal) {
+		journalClose(run->journalContext.journal);
+	}
+	if (run->hasGenerations) {
+		generationsFree(&run->generations);
+	}
+
+	if (run->extentHintsContext.extentMap) {
+		extentMapDestroy(run->extentHintsContext.extentMap);
+	}
+	if (run->extentHintsFd != -1) {
+		close(run->extentHintsFd);
+	}
+	free(run->extentHintsContext.storedHints);
+	free(run->isLeafChanged);
+	if (run->readRing) {
+		uringDestroy(run->readRing);
+	}
+	if (run->writeRing) {
+		uringDestroy(run->writeRing);
+	}
+	if (run->sourceDirectFd != -1) {
+		close(run->sourceDirectFd);
+	}
+	if (run->destDirectFd != -1) {
+		close(run->destDirectFd);
+	}
+
+	if (run->chunkIndex) {
+		chunkIndexDestroy(run->chunkIndex);
+	}
+	if (run->chunkMap) {
+		checksumsClose(run->chunkMap, 0, 0);
+		unlink(run->chunkMapFilename);
+	}
+	free(run->chunkMapFilename);
+	free(run->buffer);
+	free(run->frame);
+	if (run->compressor) {
+		compressorDestroy(run->compressor);
+	}
+
+	if (run->reblocker) {
+		reblockerDestroy(run->reblocker);
+	}
+	if (run->checksums) {
+		checksumsClose(run->checksums, run->checksums->blocksCount, run->checksums->sourceSize);
+	}
+	if (run->store) {
+		storeClose(run->store);
+	}
+	if (run->remote) {
+		remoteClose(run->remote);
+	}
+	if (run->destFile) {
+		fclose(run->destFile);
+	}
+	if (run->sourceFile) {
+		fclose(run->sourceFile);
+	}
+
+	// a stream without the "done" line tells of the failure
+	if (run->stats) {
+		statsDestroy(run->stats);
+	}
+
+	free(run->journalFilename);
+	free(run->merkleFilename);
+	free(run->checksumsFilename);
+	free(run->sourceFilename);
+	free(run->destFilename);
+}
+
+static uint64_t autoBlockSizeFor(uint64_t sourceSize, uint32_t leafSize) {
+	uint64_t blockSize = AUTO_BLOCK_SIZE_MIN;
+	while (blockSize < AUTO_BLOCK_SIZE_MAX &&
+		(blockSize * AUTO_BLOCKS_COUNT < sourceSize || blockSize <= (uint64_t) leafSize * 2)) {
+		blockSize *= 2;
+	}
+	return blockSize;
+}
+
+// One step at a time, as the history starts over with every block size.
+static uint64_t autoBlockSize(Checksums *checksums, uint64_t sourceSize, uint32_t leafSize) {
+	uint64_t blockSize = checksums->blockSize;
+	if (checksums->historyRuns < AUTO_HISTORY_RUNS) {
+		return blockSize;
+	}
+
+	uint64_t first = autoBlockSizeFor(sourceSize, leafSize);
+	uint64_t smallest = first / AUTO_BLOCK_SIZE_RANGE;
+	if (smallest < AUTO_BLOCK_SIZE_MIN) {
+		smallest = AUTO_BLOCK_SIZE_MIN;
+	}
+	if (smallest <= (uint64_t) leafSize * 2) {
+		smallest = (uint64_t) leafSize * 2 + 1;
+	}
+	uint64_t largest = first * AUTO_BLOCK_SIZE_RANGE;
+	if (largest > AUTO_BLOCK_SIZE_MAX) {
+		largest = AUTO_BLOCK_SIZE_MAX;
+	}
+
+	// whole pages, in case the block size wasn't a power of two
+	uint64_t smaller = (blockSize / 2) & ~(uint64_t) 4095;
+	if (checksums->changedRatio < AUTO_FINER_RATIO && smaller >= smallest) {
+		return smaller;
+	}
+	if (checksums->changedRatio > AUTO_COARSER_RATIO && blockSize * 2 <= largest) {
+		return blockSize * 2;
+	}
+	return blockSize;
+}
+
+// Generations are of blocks of one size, which then has to stay.
+static int willKeepGenerations(char *checksumsFilename, int keepGenerations) {
+	if (keepGenerations != -1) {
+		return keepGenerations > 0;
+	}
+
+	Generations generations;
+	char generationsError[GENERATION_ERROR_SIZE];
+	int result = generationsLoad(checksumsFilename, &generations, generationsError) == 0 &&
+		generations.count > 0 && generations.list[generations.count - 1]->keep > 0;
+	generationsFree(&generations);
+	return result;
+}
+
+static int syncFile(EngineRun *run, EngineTotals *totals) {
+	Engine *engine = run->engine;
+	char checksumsError[CHECKSUMS_ERROR_SIZE];
+	const HashAlgorithm *hashAlgorithm = engine->hashAlgorithm;
+	uint64_t blockSize = engine->blockSize ? engine->blockSize : ENGINE_DEFAULT_BLOCK_SIZE;
+	int isBlockSizeAuto = engine->blockSize == ENGINE_BLOCK_SIZE_AUTO;
+	int isBlockSizeGiven = engine->blockSize != 0 && !isBlockSizeAuto;
+	int shouldUseChunks = engine->shouldUseChunks;
+	int keepGenerations = engine->keepGenerations;
+	int compressCodec = engine->compressCodec;
+	int syncPolicy = engine->syncPolicy;
+	uint64_t syncEveryBytes = engine->syncEveryBytes;
+	int isRebuildOnly = engine->isRebuildOnly;
+	char *sourceFilename = run->sourceFilename;
+	char *destFilename = run->destFilename;
+	int isRemote = remoteIsPath(destFilename);
+
+	off_t sourceSize = fileSize(sourceFilename);
+	if (sourceSize < 0) {
+		return fail(run, ENGINE_ERROR_SOURCE, "File %s does not exists or could not be read", sourceFilename);
+	}
+	if (engine->isSourceSizeUnknown) {
+		sourceSize = 0;
+	}
+	run->sourceSize = sourceSize;
+	if (isBlockSizeAuto) {
+		blockSize = autoBlockSizeFor(sourceSize, engine->isLeafSizeGiven ? engine->leafSize : 0);
+	}
+
+	if (engine->statsJsonFd != -1 || engine->prometheusFilename || engine->shouldTimeStages) {
+		run->stats = statsCreate(sourceFilename, destFilename, sourceSize);
+		if (run->stats == NULL) {
+			return fail(run, ENGINE_ERROR_MEMORY, "Cannot allocate memory: %s", strerror(errno));
+		}
+		statsSetThrottle(run->stats, engine->throttle);
+		if (engine->statsJsonFd != -1 && statsStartJson(run->stats, engine->statsJsonFd) == -1) {
+			return fail(run, ENGINE_ERROR_MEMORY, "Cannot start reporting stats: %s", strerror(errno));
+		}
+	}
+	Stats *stats = run->stats;
+
+	if (engine->storeDirectory) {
+		if (isRebuildOnly) {
+			return fail(run, ENGINE_ERROR_USAGE, "A destination in a store can't be rebuilt without writing to the store");
+		}
+		if (hashAlgorithm && hashAlgorithm->digestSize < 8) {
+			return fail(run, ENGINE_ERROR_USAGE, "%s checksums are too short to tell blocks apart in a store, use another --hash",
+				hashAlgorithm->name);
+		}
+		if (compressCodec > COMPRESS_NONE) {
+			return fail(run, ENGINE_ERROR_USAGE, "A store keeps its blocks as they are, --compress doesn't apply to it");
+		}
+
+		char storeError[STORE_ERROR_SIZE];
+		run->store = storeOpen(engine->storeDirectory, hashAlgorithm, storeError);
+		if (run->store == NULL) {
+			return fail(run, ENGINE_ERROR_DEST, "%s", storeError);
+		}
+		hashAlgorithm = run->store->hashAlgorithm;
+
+	} else if (isRemote) {
+		if (engine->checksumsFilename == NULL) {
+			return fail(run, ENGINE_ERROR_USAGE,
+				"The checksum file of a remote destination is kept here, and has to be given with --checksum");
+		}
+		if (shouldUseChunks || keepGenerations > 0 || engine->shouldUseDirectIO) {
+			return fail(run, ENGINE_ERROR_USAGE, "--cdc, --keep-generations and --direct need a local destination");
+		}
+
+		if (!isRebuildOnly) {
+			char remoteError[REMOTE_ERROR_SIZE];
+			char *sourceName = strdup(sourceFilename);
+			if (sourceName == NULL) {
+				return fail(run, ENGINE_ERROR_MEMORY, "Cannot allocate memory: %s", strerror(errno));
+			}
+			run->remote = remoteConnect(engine->rsh, engine->remoteCommand, destFilename, basename(sourceName), remoteError);
+			free(sourceName);
+			if (run->remote == NULL) {
+				return fail(run, ENGINE_ERROR_DEST, "%s", remoteError);
+			}
+			if (compressCodec > COMPRESS_NONE && remoteSetCompression(run->remote, compressCodec) == -1) {
+				return fail(run, ENGINE_ERROR_MEMORY, "Cannot allocate memory: %s", strerror(errno));
+			}
+
+			// every sync is a round trip
+			if (!engine->isSyncPolicyGiven) {
+				syncPolicy = SYNC_POLICY_EVERY_MB;
+				syncEveryBytes = REMOTE_SYNC_EVERY_BYTES;
+			}
+		} else {
+			note(run, ENGINE_NOTE, "only rebuilding checksum file");
+		}
+
+	} else if (checksumsPeekFlags(destFilename) & CHECKSUMS_FLAG_STORE) {
+		return fail(run, ENGINE_ERROR_USAGE, "%s is kept in a store, which has to be given with --store", destFilename);
+
+	} else if (!isRebuildOnly) {
+		if (fileSize(destFilename) < 0) {
+			if (!createEmptyFile(destFilename)) {
+				return fail(run, ENGINE_ERROR_DEST, "Cannot create %s: %s", destFilename, strerror(errno));
+			}
+		}
+
+		run->destFile = fopen(destFilename, "r+");
+		if (run->destFile == NULL) {
+			return fail(run, ENGINE_ERROR_DEST, "Cannot open %s: %s", destFilename, strerror(errno));
+		}
+		run->destFd = fileno(run->destFile);
+
+		struct stat destStat;
+		if (fstat(run->destFd, &destStat) == 0 && S_ISREG(destStat.st_mode)) {
+			run->destSize = destStat.st_size;
+		}
+
+	} else {
+		note(run, ENGINE_NOTE, "only rebuilding checksum file");
+	}
+	Remote *remote = run->remote;
+	Store *store = run->store;
+	int destFd = run->destFd;
+
+	run->sourceFile = fopen(sourceFilename, "r");
+	if (run->sourceFile == NULL) {
+		return fail(run, ENGINE_ERROR_SOURCE, "Cannot open %s: %s", sourceFilename, strerror(errno));
+	}
+	FILE *sourceFile = run->sourceFile;
+
+	if (engine->shouldUseDirectIO) {
+		run->sourceDirectFd = openDirect(sourceFilename, O_RDONLY);
+		if (run->sourceDirectFd == -1) {
+			note(run, ENGINE_NOTE, "cannot open %s with O_DIRECT (%s), reading through the page cache", sourceFilename,
+				strerror(errno));
+		}
+	}
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	if (engine->shouldDropCache) {
+		adviseCache(fileno(sourceFile), 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+#endif
+
+	int result;
+	if (engine->checksumsFilename) {
+		run->checksumsFilename = strdup(engine->checksumsFilename);
+		result = run->checksumsFilename ? 0 : -1;
+	} else if (store) {
+		run->checksumsFilename = strdup(destFilename);
+		result = run->checksumsFilename ? 0 : -1;
+	} else {
+		result = asprintf(&run->checksumsFilename, "%s.bigsync", destFilename);
+	}
+	if (result < 0) {
+		run->checksumsFilename = NULL;
+		return fail(run, ENGINE_ERROR_MEMORY, "Cannot allocate memory: %s", strerror(errno));
+	}
+	char *checksumsFilename = run->checksumsFilename;
+
+	run->checksums = checksumsOpen(checksumsFilename,
+		hashAlgorithm ? hashAlgorithm : hashAlgorithmById(HASH_MD4), blockSize, checksumsError);
+	if (run->checksums == NULL) {
+		return fail(run, ENGINE_ERROR_CHECKSUMS, "%s", checksumsError);
+	}
+	Checksums *checksums = run->checksums;
+
+	if (checksums->wasMigrated) {
+		note(run, ENGINE_INFO, "Converted checksums file %s to binary format", checksumsFilename);
+	}
+
+	// A checksums file knows its hash and block size, so they only have to be
+	// given once. Asking for a different hash means starting over.
+	uint64_t reblockSize = 0;
+	uint32_t leafSize = engine->isLeafSizeGiven ? engine->leafSize : checksums->leafSize;
+	if ((checksums->flags & CHECKSUMS_FLAG_STORE) && store == NULL) {
+		return fail(run, ENGINE_ERROR_USAGE, "%s is kept in a store, which has to be given with --store", checksumsFilename);
+	}
+
+	// the blocks of a store are fixed ones, unless chunking by content was
+	// asked for, now or before
+	uint32_t chunksFlags = CHECKSUMS_FLAG_CHUNKS;
+	if (store) {
+		chunksFlags |= CHECKSUMS_FLAG_STORE;
+		if (!shouldUseChunks && (checksums->flags & (CHECKSUMS_FLAG_CHUNKS | CHECKSUMS_FLAG_FIXED_CHUNKS)) != CHECKSUMS_FLAG_CHUNKS) {
+			chunksFlags |= CHECKSUMS_FLAG_FIXED_CHUNKS;
+		}
+		shouldUseChunks = 1;
+	}
+	if (checksums->flags & CHECKSUMS_FLAG_CHUNKS) {
+		shouldUseChunks = 1;
+	}
+	if (compressCodec > COMPRESS_NONE && !shouldUseChunks && !isRemote) {
+		return fail(run, ENGINE_ERROR_USAGE, "A copy is kept as it is, --compress needs a remote destination or --cdc");
+	}
+
+	if (hashAlgorithm != NULL && hashAlgorithm != checksums->hashAlgorithm) {
+		if (checksums->blocksCount > 0) {
+			note(run, ENGINE_NOTE, "checksums file was made with %s, all blocks will be rewritten with %s",
+				checksums->hashAlgorithm->name, hashAlgorithm->name);
+		}
+		if (checksumsReset(checksums, hashAlgorithm, blockSize) == -1) {
+			return fail(run, ENGINE_ERROR_CHECKSUMS, "Failed to write to file %s: %s", checksumsFilename, strerror(errno));
+		}
+
+	} else if (isBlockSizeGiven || isBlockSizeAuto) {
+		uint64_t wantedBlockSize = blockSize;
+		if (isBlockSizeAuto && checksums->blocksCount > 0) {
+			wantedBlockSize = shouldUseChunks ? checksums->blockSize : autoBlockSize(checksums, sourceSize, leafSize);
+		}
+
+		// The sync goes on with the old block size while the checksums of
+		// the new one are made (see reblock.h), unless everything is written
+		// anyway or generations of the old blocks are kept.
+		if (wantedBlockSize != checksums->blockSize) {
+			int canReblock = checksums->blocksCount > 0 && !shouldUseChunks && !isRebuildOnly &&
+				!willKeepGenerations(checksumsFilename, keepGenerations);
+
+			if (canReblock) {
+				reblockSize = wantedBlockSize;
+			} else if (isBlockSizeAuto && checksums->blocksCount > 0) {
+				note(run, ENGINE_INFO, "Keeping the block size, as it can't be changed without writing every block");
+			} else {
+				if (checksums->blocksCount > 0) {
+					note(run, ENGINE_NOTE, "checksums file was made with a different block size, all blocks will be rewritten");
+				}
+				if (checksumsReset(checksums, checksums->hashAlgorithm, wantedBlockSize) == -1) {
+					return fail(run, ENGINE_ERROR_CHECKSUMS, "Failed to write to file %s: %s", checksumsFilename,
+						strerror(errno));
+				}
+			}
+		}
+	}
+
+	hashAlgorithm = checksums->hashAlgorithm;
+	blockSize = checksums->blockSize;
+	int digestSize = run->digestSize = hashAlgorithm->digestSize;
+
+	if (shouldUseChunks) {
+		if (isRemote) {
+			return fail(run, ENGINE_ERROR_USAGE, "A container of chunks needs a local destination");
+		}
+		// chunks are told apart by their checksum alone
+		if (digestSize < 8) {
+			return fail(run, ENGINE_ERROR_USAGE, "%s checksums are too short to tell chunks apart, use another --hash",
+				hashAlgorithm->name);
+		}
+		if (keepGenerations > 0) {
+			return fail(run, ENGINE_ERROR_USAGE, "Generations can't be kept of a container of chunks");
+		}
+		if (isRebuildOnly) {
+			return fail(run, ENGINE_ERROR_USAGE, "A container of chunks can't be rebuilt without writing it");
+		}
+
+		uint64_t averageSize = isBlockSizeGiven || (checksums->flags & CHECKSUMS_FLAG_CHUNKS) ? blockSize : DEFAULT_CHUNK_SIZE;
+		note(run, ENGINE_INFO, "Chunking %s into %s, %s chunk size = %" PRIu64 " bytes", sourceFilename,
+			store ? store->directory : destFilename,
+			chunksFlags & CHECKSUMS_FLAG_FIXED_CHUNKS ? "fixed" : "average", averageSize);
+
+		// a compressed container stays compressed unless told otherwise
+		if (compressCodec == -1 && (checksums->flags & CHECKSUMS_FLAG_COMPRESSED)) {
+			compressCodec = COMPRESS_LZ4;
+		}
+		if (compressCodec > COMPRESS_NONE) {
+			run->compressor = compressorCreate(compressCodec);
+			if (run->compressor == NULL) {
+				return fail(run, ENGINE_ERROR_MEMORY, "Cannot allocate memory: %s", strerror(errno));
+			}
+		}
+
+		if (syncChunks(run, averageSize, chunksFlags, totals) == -1) {
+			return -1;
+		}
+		return finishStats(run, totals);
+	}
+
+	if (leafSize >= blockSize || (reblockSize && leafSize >= reblockSize)) {
+		return fail(run, ENGINE_ERROR_USAGE, "Leaf size has to be smaller than the block size");
+	}
+	if (checksumsSetLeafSize(checksums, leafSize) == -1) {
+		return fail(run, ENGINE_ERROR_CHECKSUMS, "Failed to write to file %s: %s", checksumsFilename, strerror(errno));
+	}
+
+	if (sourceSize > 0 && checksumsReserve(checksums, (sourceSize + blockSize - 1) / blockSize) == -1) {
+		return fail(run, ENGINE_ERROR_CHECKSUMS, "Failed to grow file %s: %s", checksumsFilename, strerror(errno));
+	}
+
+	char sourceSizeHR[100];
+	char blockSizeHR[100];
+	makeHumanReadableSize(sourceSizeHR, sourceSize);
+	makeHumanReadableSize(blockSizeHR, blockSize);
+	note(run, ENGINE_INFO, "%s -> %s, %s, block size = %s, hash = %s", sourceFilename, destFilename, sourceSizeHR,
+		blockSizeHR, hashAlgorithm->name);
+
+	if (reblockSize) {
+		run->reblocker = reblockerCreate(checksumsFilename, checksums, reblockSize, leafSize, checksumsError);
+		if (run->reblocker == NULL) {
+			return fail(run, ENGINE_ERROR_CHECKSUMS, "%s", checksumsError);
+		}
+
+		char reblockSizeHR[100];
+		makeHumanReadableSize(reblockSizeHR, reblockSize);
+		note(run, ENGINE_INFO, "Changing the block size to %s: checksums of the new blocks are made from this run's reads",
+			reblockSizeHR);
+	}
+
+	HashingContext hashingContext;
+	memset(&hashingContext, 0, sizeof(HashingContext));
+	hashingContext.hashAlgorithm = hashAlgorithm;
+	hashingContext.blockSize = blockSize;
+
+	char *block = calloc(1, blockSize);
+	if (block == NULL) {
+		return fail(run, ENGINE_ERROR_MEMORY, "Cannot allocate memory: %s", strerror(errno));
+	}
+	uint64_t tailLength = sourceSize % blockSize;
+	addZeroDigest(&hashingContext, (unsigned char *) block, blockSize);
+	addZeroDigest(&hashingContext, (unsigned char *) block, tailLength);
+	if (leafSize) {
+		hashingContext.leafSize = leafSize;
+		hashingContext.leavesPerBlock = checksums->leavesPerBlock;
+		addZeroDigest(&hashingContext, (unsigned char *) block, leafSize);
+		addZeroDigest(&hashingContext, (unsigned char *) block, blockSize % leafSize);
+		addZeroDigest(&hashingContext, (unsigned char *) block, tailLength % leafSize);
+	}
+	free(block);
+
+	unsigned char *isLeafChanged = NULL;
+	if (leafSize) {
+		isLeafChanged = run->isLeafChanged = malloc(checksums->leavesPerBlock);
+		if (isLeafChanged == NULL) {
+			return fail(run, ENGINE_ERROR_MEMORY, "Cannot allocate memory: %s", strerror(errno));
+		}
+	}
+
+	int queueDepth = engine->queueDepth;
+	if (engine->ioEngine == ENGINE_IO_URING) {
+		run->readRing = uringCreate(queueDepth);
+		if (run->readRing && !isRebuildOnly && remote == NULL) {
+			run->writeRing = uringCreate(queueDepth);
+			if (run->writeRing == NULL) {
+				uringDestroy(run->readRing);
+				run->readRing = NULL;
+			}
+		}
+
+		if (run->readRing == NULL) {
+			note(run, ENGINE_NOTE, "io_uring is not available (%s), using stdio", strerror(errno));
+		}
+	}
+
+	Writer *writer = NULL;
+	Generations *generations = &run->generations;
+	int isKeepingGenerations = 0;
+	uint64_t resumeIndex = 0;
+	time_t lastCheckpointAt = 0;
+
+	if (!isRebuildOnly) {
+		writer = run->writer = writerCreate(destFd, syncPolicy, syncEveryBytes, blockSize, commitChecksum, checksums);
+		if (writer == NULL || (run->writeRing && writerSetUring(writer, run->writeRing, queueDepth) == -1)) {
+			return fail(run, ENGINE_ERROR_MEMORY, "Cannot allocate write buffer: %s", strerror(errno));
+		}
+		if (remote) {
+			writerSetRemote(writer, remote);
+		}
+		writerSetThrottle(writer, engine->throttle);
+		writerSetStats(writer, stats);
+		writerSetLatency(writer, engine->writeLatencyMicroseconds);
+
+		if (engine->shouldUseDirectIO) {
+			run->destDirectFd = openDirect(destFilename, O_WRONLY);
+			if (run->destDirectFd == -1) {
+				note(run, ENGINE_NOTE, "cannot open %s with O_DIRECT (%s), writing through the page cache", destFilename,
+					strerror(errno));
+			}
+		}
+		writerSetCachePolicy(writer, run->destDirectFd, engine->shouldDropCache);
+
+		if (engine->isSparse) {
+			struct stat destStat;
+			if (remote) {
+				writerSetHolePunching(writer, remote->blockSize);
+			} else if (fstat(destFd, &destStat) == 0 && destStat.st_blksize > 0) {
+				writerSetHolePunching(writer, destStat.st_blksize);
+			}
+		}
+
+		if (asprintf(&run->journalFilename, "%s.journal", checksumsFilename) < 0) {
+			run->journalFilename = NULL;
+			return fail(run, ENGINE_ERROR_MEMORY, "Cannot allocate memory: %s", strerror(errno));
+		}
+		if (recoverFromJournal(run, &resumeIndex) == -1) {
+			return -1;
+		}
+		// the new blocks need all of the source
+		if (!engine->shouldResume || run->reblocker || (sourceSize > 0 && resumeIndex * blockSize >= (uint64_t) sourceSize)) {
+			resumeIndex = 0;
+		}
+
+		run->journalContext.checksums = checksums;
+		run->journalContext.generations = NULL;
+		run->journalContext.journal = journalCreate(run->journalFilename, hashAlgorithm->id, blockSize);
+		if (run->journalContext.journal == NULL) {
+			return fail(run, ENGINE_ERROR_CHECKSUMS, "Cannot create %s: %s", run->journalFilename, strerror(errno));
+		}
+		if (checkpointJournal(run, resumeIndex) == -1) {
+			return -1;
+		}
+		lastCheckpointAt = time(NULL);
+
+		// the number of generations to keep sticks, like the hash
+		if (keepGenerations == 0) {
+			if (generationsRemoveAll(checksumsFilename) == -1) {
+				return fail(run, ENGINE_ERROR_CHECKSUMS, "Failed to remove the generations of %s: %s", destFilename,
+					strerror(errno));
+			}
+
+		} else {
+			char generationsError[GENERATION_ERROR_SIZE];
+			if (generationsLoad(checksumsFilename, generations, generationsError) == -1) {
+				return fail(run, ENGINE_ERROR_CHECKSUMS, "%s", generationsError);
+			}
+			run->hasGenerations = 1;
+
+			Generation *newest = generations->count ? generations->list[generations->count - 1] : NULL;
+			if (keepGenerations == -1 && newest) {
+				keepGenerations = newest->keep;
+			}
+			if (newest && (newest->blockSize != blockSize || newest->hashAlgorithm != hashAlgorithm)) {
+				note(run, ENGINE_NOTE, "generations of %s were kept with another block size or hash, removing them",
+					destFilename);
+				generationsFree(generations);
+				run->hasGenerations = 0;
+				if (generationsRemoveAll(checksumsFilename) == -1) {
+					return fail(run, ENGINE_ERROR_CHECKSUMS, "Failed to remove the generations of %s: %s", destFilename,
+						strerror(errno));
+				}
+				if (generationsLoad(checksumsFilename, generations, generationsError) == -1) {
+					return fail(run, ENGINE_ERROR_CHECKSUMS, "%s", generationsError);
+				}
+				run->hasGenerations = 1;
+			}
+
+			if (keepGenerations > 0) {
+				if (remote) {
+					return fail(run, ENGINE_ERROR_USAGE, "Generations are kept of %s, which needs a local destination",
+						checksumsFilename);
+				}
+				if (generationsBegin(generations, hashAlgorithm, blockSize, checksums->sourceSize, keepGenerations,
+					destFd, generationsError) == -1) {
+					return fail(run, ENGINE_ERROR_CHECKSUMS, "%s", generationsError);
+				}
+				isKeepingGenerations = 1;
+				run->journalContext.generations = generations;
+			} else {
+				generationsFree(generations);
+				run->hasGenerations = 0;
+			}
+		}
+
+		writerSetJournal(writer, journalPendingBlocks, &run->journalContext);
+	}
+
+	ExtentHintsContext *extentHintsContext = &run->extentHintsContext;
+	if (engine->shouldUseExtentHints) {
+		if (!(checksums->flags & CHECKSUMS_FLAG_EXTENT_HINTS) && checksumsEnableExtentHints(checksums) == -1) {
+			return fail(run, ENGINE_ERROR_CHECKSUMS, "Failed to write to file %s: %s", checksumsFilename, strerror(errno));
+		}
+
+		struct stat sourceStat;
+		run->extentHintsFd = open(sourceFilename, O_RDONLY);
+		if (run->extentHintsFd != -1 && fstat(run->extentHintsFd, &sourceStat) == 0 && S_ISREG(sourceStat.st_mode)) {
+			extentHintsContext->extentMap = extentMapCreate(run->extentHintsFd);
+			extentHintsContext->sourceSize = sourceStat.st_size;
+			extentHintsContext->blockSize = blockSize;
+		}
+
+		if (extentHintsContext->extentMap == NULL) {
+			note(run, ENGINE_NOTE, "cannot get extents of %s, reading all of it", sourceFilename);
+
+		} else if (isRebuildOnly || run->reblocker || checksums->extentHintRuns >= EXTENT_HINTS_FULL_SCAN_RUNS) {
+			// read everything, but record fresh hints
+			checksums->extentHintRuns = 0;
+
+		} else {
+			checksums->extentHintRuns++;
+			extentHintsContext->storedHintsCount = checksums->blocksCount;
+			extentHintsContext->storedHints = malloc(checksums->blocksCount * sizeof(uint64_t) + 1);
+			if (extentHintsContext->storedHints == NULL) {
+				return fail(run, ENGINE_ERROR_MEMORY, "Cannot allocate memory: %s", strerror(errno));
+			}
+
+			uint64_t i;
+			for (i = 0; i < checksums->blocksCount; i++) {
+				extentHintsContext->storedHints[i] = checksumsGetExtentHint(checksums, i);
+			}
+		}
+
+		if (extentHintsContext->extentMap) {
+			note(run, ENGINE_INFO, "Using extent hints%s%s",
+				extentMapIsCopyOnWrite(extentHintsContext->extentMap) ? " (copy-on-write file)" : " (shared extents only)",
+				extentHintsContext->storedHints ? "" : ", reading everything this time");
+		}
+	}
+	totals->isUsingExtentHints = extentHintsContext->extentMap != NULL;
+
+	// one block being read, one being written and one per hashing thread
+	int blocksCount = poolThreadsCount(engine->pool) + 2;
+	Pipeline *pipeline = run->pipeline = pipelineCreate(sourceFile, run->sourceDirectFd, blockSize, resumeIndex,
+		blocksCount, engine->pool, hashPipelineBlock, &hashingContext,
+		extentHintsContext->extentMap ? filterByExtentHints : NULL, extentHintsContext, run->readRing, queueDepth,
+		engine->throttle, stats);
+	if (pipeline == NULL) {
+		return fail(run, ENGINE_ERROR_MEMORY, "Cannot allocate %d blocks of memory: %s", blocksCount, strerror(errno));
+	}
+	statsSetQueue(stats, pipelineQueuedBlocks, pipeline);
+
+	uint64_t blocksCompared = 0;
+	uint64_t blocksDiffering = 0;
+	PipelineBlock *pipelineBlock;
+	while ((pipelineBlock = pipelineNextBlock(pipeline))) {
+		block = pipelineBlock->data;
+		uint64_t readBytes = pipelineBlock->readBytes;
+		uint64_t position = (uint64_t) pipelineBlock->offset + readBytes;
+		unsigned char *readingDigest = pipelineBlock->digest;
+
+		unsigned char *storedDigest = checksumsGet(checksums, pipelineBlock->index);
+
+		WriterLeaves leaves;
+		WriterLeaves *blockLeaves = NULL;
+		if (leafSize && pipelineBlock->leafDigests && pipelineBlock->readMode != PIPELINE_SKIP) {
+			leaves.leafSize = leafSize;
+			leaves.count = (readBytes + leafSize - 1) / leafSize;
+			leaves.digestSize = digestSize;
+			leaves.digests = pipelineBlock->leafDigests;
+			leaves.isChanged = NULL;
+			blockLeaves = &leaves;
+		}
+
+		// only blocks with a stored hint, and so a stored checksum, are skipped
+		if (pipelineBlock->readMode == PIPELINE_SKIP) {
+			memcpy(readingDigest, storedDigest, digestSize);
+			totals->blocksSkipped++;
+		} else if (pipelineBlock->readMode == PIPELINE_READ) {
+			totals->bytesRead += readBytes;
+		}
+
+		if (run->reblocker && reblockerAdd(run->reblocker, (unsigned char *) block, readBytes, pipelineBlock->isZero) == -1) {
+			return fail(run, ENGINE_ERROR_CHECKSUMS, "Failed to write to file %s: %s", run->reblocker->filename,
+				strerror(errno));
+		}
+
+		uint64_t comparedAt = statsNow();
+		if (storedDigest) {
+			blocksCompared++;
+			if (memcmp(storedDigest, readingDigest, digestSize) == 0) {
+				progress(run, position, readingDigest, storedDigest, ENGINE_BLOCK_SAME);
+
+				if (pipelineBlock->readMode != PIPELINE_SKIP) {
+					checksumsSetExtentHint(checksums, pipelineBlock->index, pipelineBlock->extentHint);
+				}
+
+				// leaves only just asked for, or lost to a crash
+				unsigned char *storedLeafDigests;
+				if (blockLeaves && checksumsGetLeaves(checksums, pipelineBlock->index, &storedLeafDigests) != blockLeaves->count) {
+					checksumsSetLeaves(checksums, pipelineBlock->index, blockLeaves->digests, blockLeaves->count);
+				}
+				statsStage(stats, STATS_COMPARE, comparedAt);
+				statsBlock(stats, position, 0);
+
+			} else {
+				progress(run, position, readingDigest, storedDigest, ENGINE_BLOCK_CHANGED);
+				blocksDiffering++;
+
+				uint64_t changedBytes = readBytes;
+				if (blockLeaves && writer) {
+					changedBytes = compareLeaves(checksums, pipelineBlock->index, blockLeaves, isLeafChanged, readBytes);
+				}
+				statsStage(stats, STATS_COMPARE, comparedAt);
+				statsBlock(stats, position, 1);
+
+				if (isKeepingGenerations && generationsKeep(generations, pipelineBlock->index, storedDigest) == -1) {
+					return fail(run, ENGINE_ERROR_CHECKSUMS, "Failed to keep the old contents of block %" PRIu64 " of %s: %s",
+						pipelineBlock->index, destFilename, strerror(errno));
+				}
+
+				if (updateBlockInFile(block, pipelineBlock->index, pipelineBlock->offset, writer, checksums,
+					readBytes, engine->isSparse, pipelineBlock->extentHint, pipelineBlock->isZero, readingDigest,
+					run->destSize, blockLeaves) == -1) {
+					return fail(run, writer ? ENGINE_ERROR_DEST : ENGINE_ERROR_CHECKSUMS, "Failed to write to file %s: %s",
+						writer ? destFilename : checksumsFilename, strerror(errno));
+				}
+
+				totals->bytesWritten += changedBytes;
+				totals->blocksChanged++;
+			}
+
+		} else {
+			progress(run, position, readingDigest, NULL, ENGINE_BLOCK_ADDED);
+			statsStage(stats, STATS_COMPARE, comparedAt);
+			statsBlock(stats, position, 1);
+
+			if (updateBlockInFile(block, pipelineBlock->index, pipelineBlock->offset, writer, checksums,
+				readBytes, engine->isSparse, pipelineBlock->extentHint, pipelineBlock->isZero, readingDigest,
+				run->destSize, blockLeaves) == -1) {
+				return fail(run, writer ? ENGINE_ERROR_DEST : ENGINE_ERROR_CHECKSUMS, "Failed to write to file %s: %s",
+					writer ? destFilename : checksumsFilename, strerror(errno));
+			}
+
+			totals->bytesWritten += readBytes;
+			totals->blocksChanged++;
+		}
+
+		// Nothing waiting for a sync: safe to move the resume point forward
+		// even if no block has changed in a while.
+		if (writer && writer->pendingCount == 0 && time(NULL) - lastCheckpointAt >= JOURNAL_CHECKPOINT_INTERVAL) {
+			if (checkpointJournal(run, pipelineBlock->index + 1) == -1) {
+				return -1;
+			}
+			lastCheckpointAt = time(NULL);
+		}
+
+#ifdef POSIX_FADV_DONTNEED
+		if (engine->shouldDropCache && pipelineBlock->readMode == PIPELINE_READ) {
+			adviseCache(fileno(sourceFile), pipelineBlock->offset, readBytes, POSIX_FADV_DONTNEED);
+		}
+#endif
+
+		pipelineReleaseBlock(pipeline, pipelineBlock);
+	}
+
+	if (pipelineError(pipeline)) {
+		errno = pipelineError(pipeline);
+		return fail(run, ENGINE_ERROR_SOURCE, "Cannot read %s at %" PRId64 ": %s", sourceFilename,
+			(uint64_t) pipelineEndOffset(pipeline), strerror(errno));
+	}
+
+	off_t lastSourceFileOffset = pipelineEndOffset(pipeline);
+
+	statsSetQueue(stats, NULL, NULL);
+	pipelineDestroy(pipeline);
+	run->pipeline = NULL;
+
+	totals->bytesPunched = writer ? writer->punchedBytes : 0;
+
+	run->writer = NULL;
+	if (writer && writerClose(writer) == -1) {
+		return fail(run, ENGINE_ERROR_DEST, "Failed to write to file %s: %s", destFilename, strerror(errno));
+	}
+
+	if (isKeepingGenerations) {
+		char generationsError[GENERATION_ERROR_SIZE];
+		uint64_t index;
+
+		// and those the truncation below cuts off
+		for (index = (lastSourceFileOffset + blockSize - 1) / blockSize; engine->shouldTruncate && index < checksums->blocksCount; index++) {
+			unsigned char *storedDigest = checksumsGet(checksums, index);
+			if (storedDigest && generationsKeep(generations, index, storedDigest) == -1) {
+				return fail(run, ENGINE_ERROR_CHECKSUMS, "Failed to keep the old contents of block %" PRIu64 " of %s: %s",
+					index, destFilename, strerror(errno));
+			}
+		}
+
+		if (generationsSync(generations) == -1) {
+			return fail(run, ENGINE_ERROR_CHECKSUMS, "Failed to write to file %s: %s", generations->current->filename,
+				strerror(errno));
+		}
+		if (generationsEnd(generations, lastSourceFileOffset, generationsError) == -1) {
+			return fail(run, ENGINE_ERROR_CHECKSUMS, "%s", generationsError);
+		}
+
+		if (generations->current) {
+			char bytesKeptHR[100];
+			char bytesReadHR[100];
+			makeHumanReadableSize(bytesKeptHR, generations->bytesKept);
+			makeHumanReadableSize(bytesReadHR, generations->bytesRead);
+			note(run, ENGINE_INFO, "Generation = %u, %s kept, %s read back from the destination",
+				generations->current->number, bytesKeptHR, bytesReadHR);
+		}
+	}
+
+	uint64_t lastBlocksCount = (lastSourceFileOffset + blockSize - 1) / blockSize;
+	if (lastBlocksCount > checksums->blocksCount) {
+		lastBlocksCount = checksums->blocksCount;
+	}
+
+	if (asprintf(&run->merkleFilename, "%s.merkle", checksumsFilename) < 0) {
+		run->merkleFilename = NULL;
+		return fail(run, ENGINE_ERROR_MEMORY, "Cannot allocate memory: %s", strerror(errno));
+	}
+	char *merkleFilename = run->merkleFilename;
+
+	// new blocks get a tree of their own, and a history of their own
+	if (run->reblocker == NULL) {
+		if (merkleUpdate(merkleFilename, checksums, lastBlocksCount, lastSourceFileOffset, totals->root) == -1) {
+			return fail(run, ENGINE_ERROR_CHECKSUMS, "Failed to write file %s: %s", merkleFilename, strerror(errno));
+		}
+		checksumsRecordRun(checksums, blocksCompared, blocksDiffering);
+	}
+	totals->digestSize = digestSize;
+
+	run->checksums = NULL;
+	if (checksumsClose(checksums, (lastSourceFileOffset + blockSize - 1) / blockSize, lastSourceFileOffset) == -1) {
+		return fail(run, ENGINE_ERROR_CHECKSUMS, "Failed to write file %s: %s", checksumsFilename, strerror(errno));
+	}
+
+	if (run->reblocker) {
+		if (reblockerFinish(run->reblocker, lastSourceFileOffset, merkleFilename, totals->root) == -1) {
+			return fail(run, ENGINE_ERROR_CHECKSUMS, "Failed to write file %s: %s", run->reblocker->filename,
+				strerror(errno));
+		}
+		reblockerDestroy(run->reblocker);
+		run->reblocker = NULL;
+	}
+
+	if (writer) {
+		Journal *journal = run->journalContext.journal;
+		run->journalContext.journal = NULL;
+		if (journalRemove(journal) == -1) {
+			return fail(run, ENGINE_ERROR_CHECKSUMS, "Failed to remove %s: %s", run->journalFilename, strerror(errno));
+		}
+	}
+
+	// Zero blocks at the end were left out, so the file can still be short
+	if (engine->isSparse && remote) {
+		if (remote->isRegular && remoteTruncate(remote, lastSourceFileOffset, 1) == -1) {
+			return fail(run, ENGINE_ERROR_DEST, "Failed to extend %s: %s", destFilename, strerror(errno));
+		}
+
+	} else if (engine->isSparse && !isRebuildOnly) {
+		struct stat destStat;
+		if (fstat(destFd, &destStat) == -1) {
+			return fail(run, ENGINE_ERROR_DEST, "Cannot stat %s: %s", destFilename, strerror(errno));
+		}
+
+		if (S_ISREG(destStat.st_mode) && destStat.st_size < lastSourceFileOffset) {
+			note(run, ENGINE_INFO, "Extending sparse file %s to %" PRId64, destFilename, (uint64_t) lastSourceFileOffset);
+			if (ftruncate(destFd, lastSourceFileOffset) == -1 || fsync(destFd) == -1) {
+				return fail(run, ENGINE_ERROR_DEST, "Failed to extend %s: %s", destFilename, strerror(errno));
+			}
+		}
+	}
+
+	note(run, ENGINE_INFO, "Truncating file %s to %" PRId64, destFilename, (uint64_t) lastSourceFileOffset);
+
+	if (!isRebuildOnly && engine->shouldTruncate) {
+		if (remote ? remoteTruncate(remote, lastSourceFileOffset, 0) == -1 : truncate(destFilename, lastSourceFileOffset) < 0) {
+			return fail(run, ENGINE_ERROR_DEST, "Failed to truncate %s: %s", destFilename, strerror(errno));
+		}
+	}
+
+	if (remote) {
+		totals->bytesSent = remote->bytesSent;
+		totals->bytesToSend = remote->bytesWritten;
+		run->remote = NULL;
+		if (remoteClose(remote) == -1) {
+			return fail(run, ENGINE_ERROR_DEST, "Failed to finish writing to %s: %s", destFilename, strerror(errno));
+		}
+	}
+
+	return finishStats(run, totals);
+}
+
+// Syncs sourceFilename into destFilename, a file ("host:path" for a remote
+// one) or, with a store, the name to list the source under in it. Returns
+// -1 on failure, with the engine's errorCode and error set.
+int engineSync(Engine *engine, const char *sourceFilename, const char *destFilename, EngineTotals *totals) {
+	EngineRun run;
+	memset(&run, 0, sizeof(EngineRun));
+	run.engine = engine;
+	run.destFd = -1;
+	run.destSize = UINT64_MAX;
+	run.sourceDirectFd = -1;
+	run.destDirectFd = -1;
+	run.extentHintsFd = -1;
+
+	memset(totals, 0, sizeof(EngineTotals));
+	engine->errorCode = 0;
+	engine->error[0] = 0;
+
+	int result;
+	run.sourceFilename = strdup(sourceFilename);
+	run.destFilename = strdup(destFilename);
+	if (run.sourceFilename == NULL || run.destFilename == NULL) {
+		result = fail(&run, ENGINE_ERROR_MEMORY, "Cannot allocate memory: %s", strerror(errno));
+	} else {
+		result = syncFile(&run, totals);
+	}
+
+	releaseRun(&run);
+	return result;
+}
+
+int engineErrorCode(Engine *engine) {
+	return engine->errorCode;
+}
+
+const char *engineError(Engine *engine) {
+	return engine->error;
+}
+
+int engineThreadsCount(Engine *engine) {
+	return poolThreadsCount(engine->pool);
+}
+
+void engineDestroy(Engine *engine) {
+	if (!engine->isPoolShared) {
+		poolDestroy(engine->pool);
+	}
+	free(engine);
+}
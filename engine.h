@@ -0,0 +1,113 @@
+#ifndef BIGSYNC_ENGINE_H
+#define BIGSYNC_ENGINE_H
+
+#include <stdint.h>
+#include "hash.h"
+#include "pool.h"
+#include "throttle.h"
+#include "stats.h"
+
+#define ENGINE_ERROR_SIZE 512
+
+// what went wrong, in engine->errorCode
+#define ENGINE_ERROR_USAGE 1     // settings that don't go together
+#define ENGINE_ERROR_SOURCE 2    // the source can't be opened or read
+#define ENGINE_ERROR_DEST 3      // the destination, its store or its remote end
+#define ENGINE_ERROR_CHECKSUMS 4 // the checksums file, journal, tree or generations
+#define ENGINE_ERROR_MEMORY 5
+
+#define ENGINE_IO_STDIO 0
+#define ENGINE_IO_URING 1
+
+#define ENGINE_DEFAULT_BLOCK_SIZE (15 * 1024 * 1024)
+#define ENGINE_BLOCK_SIZE_AUTO UINT64_MAX
+#define ENGINE_DEFAULT_QUEUE_DEPTH 16
+
+// what happened to a block, for the progress function
+#define ENGINE_BLOCK_SAME 0
+#define ENGINE_BLOCK_CHANGED 1
+#define ENGINE_BLOCK_ADDED 2
+
+// how much a note matters: ENGINE_NOTE is worth telling unless asked to be
+// quiet, ENGINE_INFO only when asked for details
+#define ENGINE_NOTE 0
+#define ENGINE_INFO 1
+
+// The sync of one file into one destination, the way the bigsync command
+// does it, for programs that run many of them: settings stay with the engine
+// from one sync to the next, and so do its hashing threads. A sync never
+// exits; it returns -1 with engineErrorCode() and engineError() (one line,
+// no newline) set, having closed whatever it opened. What it had written by
+// then is journaled as usual, so the next sync of the same destination
+// picks up from there.
+//
+// String settings are kept as pointers and have to stay valid while the
+// engine syncs. An engine does one sync at a time; run several engines for
+// more, on threads of their own; engineCreateLike() makes ones that share
+// the first one's hashing threads.
+
+// Called for every block (or chunk) once it has been compared; storedDigest
+// is NULL for ENGINE_BLOCK_ADDED. size is 0 when the source's isn't known.
+typedef void (*EngineProgressFunction)(void *context, uint64_t position, uint64_t size,
+	const unsigned char *digest, const unsigned char *storedDigest, int digestSize, int state);
+
+// Called with what the command prints as notes and in verbose mode.
+typedef void (*EngineNoteFunction)(void *context, int level, const char *message);
+
+typedef struct {
+	uint64_t bytesRead;
+	uint64_t bytesWritten;
+	uint64_t blocksChanged; // chunks written, in a container or store
+
+	int isChunked;
+	uint64_t chunksCount;
+	uint64_t containerSize; // of the store's pack with a store
+
+	uint64_t blocksSkipped; // by extent hints
+	int isUsingExtentHints;
+	uint64_t bytesPunched;
+	uint64_t bytesSent; // to a remote destination, after compression
+	uint64_t bytesToSend;
+
+	unsigned char root[HASH_MAX_DIGEST_SIZE]; // of the checksum tree, not for containers
+	int digestSize;
+
+	StatsStage stages[STATS_STAGES]; // when stats were kept, see engineSetStageTimes()
+} EngineTotals;
+
+// Settings, set with the functions below, and what went wrong last.
+typedef struct Engine Engine;
+
+int engineDefaultThreadsCount(void);
+
+Engine *engineCreate(int threadsCount);
+Engine *engineCreateLike(Engine *engine);
+void engineSetHash(Engine *engine, const HashAlgorithm *hashAlgorithm);
+void engineSetBlockSize(Engine *engine, uint64_t blockSize);
+void engineSetLeafSize(Engine *engine, uint32_t leafSize);
+void engineSetChecksumsFile(Engine *engine, const char *checksumsFilename);
+void engineSetSparse(Engine *engine, int isSparse);
+void engineSetTruncate(Engine *engine, int shouldTruncate);
+void engineSetRebuildOnly(Engine *engine, int isRebuildOnly);
+void engineSetResume(Engine *engine, int shouldResume);
+void engineSetExtentHints(Engine *engine, int shouldUseExtentHints);
+void engineSetIoEngine(Engine *engine, int ioEngine, int queueDepth);
+void engineSetCachePolicy(Engine *engine, int shouldUseDirectIO, int shouldDropCache);
+void engineSetSyncPolicy(Engine *engine, int syncPolicy, uint64_t syncEveryBytes);
+void engineSetChunks(Engine *engine, int shouldUseChunks);
+void engineSetStore(Engine *engine, const char *storeDirectory);
+void engineSetKeepGenerations(Engine *engine, int keepGenerations);
+void engineSetCompression(Engine *engine, int codec);
+void engineSetRemoteShell(Engine *engine, const char *rsh, const char *remoteCommand);
+void engineSetThrottle(Engine *engine, Throttle *throttle);
+void engineSetStats(Engine *engine, int jsonFd, const char *prometheusFilename);
+void engineSetStageTimes(Engine *engine, int shouldTimeStages);
+void engineSetCallbacks(Engine *engine, EngineProgressFunction progress, EngineNoteFunction note, void *context);
+
+int engineSync(Engine *engine, const char *sourceFilename, const char *destFilename, EngineTotals *totals);
+int engineErrorCode(Engine *engine);
+const char *engineError(Engine *engine);
+int engineThreadsCount(Engine *engine);
+void engineDestroy(Engine *engine);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef BIGSYNC_ENGINE_INTERNAL_H
+#define BIGSYNC_ENGINE_INTERNAL_H
+
+#include <stdint.h>
+#include "engine.h"
+
+// Settings for the command's tests and for make bench, not part of what
+// libbigsync offers other programs.
+
+void engineSetSourceSizeUnknown(Engine *engine, int isSourceSizeUnknown);
+void engineSetWriteLatency(Engine *engine, uint64_t microseconds);
+
+#endif
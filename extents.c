@@ -0,0 +1,216 @@
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/vfs.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <linux/magic.h>
+#endif
+#include "xxh64.h"
+#include "extents.h"
+
+#define EXTENTS_PER_QUERY 512
+#define EXTENTS_WINDOW (1024ULL * 1024 * 1024)
+
+struct ExtentMap {
+	int fd;
+	int hasFiemap;
+	int isCopyOnWrite;
+#ifdef __linux__
+	struct fiemap *fiemap;
+#endif
+	uint64_t windowStart;
+	uint64_t windowEnd;
+};
+
+#ifdef __linux__
+
+// Extents whose address says nothing about their data: not allocated yet,
+// stored inside metadata, or not reported precisely.
+#define UNSTABLE_EXTENT_FLAGS (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_DATA_INLINE | \
+	FIEMAP_EXTENT_DATA_TAIL | FIEMAP_EXTENT_NOT_ALIGNED)
+
+static int isCopyOnWriteFile(int fd) {
+	struct statfs fsStat;
+	if (fstatfs(fd, &fsStat) == -1 || (uint32_t) fsStat.f_type != (uint32_t) BTRFS_SUPER_MAGIC) {
+		return 0;
+	}
+
+	int flags = 0;
+	if (ioctl(fd, FS_IOC_GETFLAGS, &flags) == -1) {
+		return 0;
+	}
+
+	return (flags & FS_NOCOW_FL) ? 0 : 1;
+}
+
+// Fetches the extents of [offset, offset + length), or as many of them as fit;
+// windowStart..windowEnd is then the range the buffer fully describes.
+static int queryExtents(ExtentMap *map, uint64_t offset, uint64_t length) {
+	struct fiemap *fiemap = map->fiemap;
+
+	memset(fiemap, 0, sizeof(struct fiemap));
+	fiemap->fm_start = offset;
+	fiemap->fm_length = length;
+	fiemap->fm_flags = FIEMAP_FLAG_SYNC;
+	fiemap->fm_extent_count = EXTENTS_PER_QUERY;
+
+	if (ioctl(map->fd, FS_IOC_FIEMAP, fiemap) == -1) {
+		return -1;
+	}
+
+	map->windowStart = offset;
+	map->windowEnd = offset + length;
+
+	if (fiemap->fm_mapped_extents > 0) {
+		struct fiemap_extent *last = &fiemap->fm_extents[fiemap->fm_mapped_extents - 1];
+		if (last->fe_flags & FIEMAP_EXTENT_LAST) {
+			map->windowEnd = UINT64_MAX;
+		} else if (fiemap->fm_mapped_extents == EXTENTS_PER_QUERY && last->fe_logical + last->fe_length < map->windowEnd) {
+			map->windowEnd = last->fe_logical + last->fe_length;
+		}
+	}
+
+	return 0;
+}
+
+static void describeExtents(ExtentMap *map, uint64_t start, uint64_t end, int *isHole, uint64_t *hint) {
+	struct fiemap *fiemap = map->fiemap;
+	Xxh64State state;
+	int extentsCount = 0;
+	int isAllUnwritten = 1;
+	int isProvable = 1;
+	uint32_t i;
+
+	xxh64Init(&state, 0);
+
+	for (i = 0; i < fiemap->fm_mapped_extents; i++) {
+		struct fiemap_extent *extent = &fiemap->fm_extents[i];
+		if (extent->fe_logical >= end || extent->fe_logical + extent->fe_length <= start) {
+			continue;
+		}
+
+		extentsCount++;
+
+		if (!(extent->fe_flags & FIEMAP_EXTENT_UNWRITTEN)) {
+			isAllUnwritten = 0;
+		}
+
+		if ((extent->fe_flags & UNSTABLE_EXTENT_FLAGS) ||
+			(!map->isCopyOnWrite && !(extent->fe_flags & FIEMAP_EXTENT_SHARED))) {
+			isProvable = 0;
+		}
+
+		// only the part inside the block counts, so that a neighbouring block
+		// splitting a shared extent doesn't invalidate this one
+		uint64_t logical = extent->fe_logical < start ? start : extent->fe_logical;
+		uint64_t logicalEnd = extent->fe_logical + extent->fe_length > end ? end : extent->fe_logical + extent->fe_length;
+		uint64_t fingerprint[4] = {
+			logical - start,
+			extent->fe_physical + (logical - extent->fe_logical),
+			logicalEnd - logical,
+			extent->fe_flags & ~FIEMAP_EXTENT_LAST
+		};
+		xxh64Update(&state, (const unsigned char *) fingerprint, sizeof(fingerprint));
+	}
+
+	if (extentsCount == 0 || isAllUnwritten) {
+		*isHole = 1;
+		return;
+	}
+
+	if (isProvable) {
+		*hint = xxh64Final(&state);
+		if (*hint == 0) {
+			*hint = 1;
+		}
+	}
+}
+
+#endif
+
+ExtentMap *extentMapCreate(int fd) {
+	ExtentMap *map = calloc(1, sizeof(ExtentMap));
+	if (map == NULL) {
+		return NULL;
+	}
+
+	map->fd = fd;
+
+#ifdef __linux__
+	map->fiemap = malloc(sizeof(struct fiemap) + EXTENTS_PER_QUERY * sizeof(struct fiemap_extent));
+	if (map->fiemap == NULL) {
+		free(map);
+		return NULL;
+	}
+
+	if (queryExtents(map, 0, 1) == 0) {
+		map->hasFiemap = 1;
+		map->isCopyOnWrite = isCopyOnWriteFile(fd);
+		map->windowStart = map->windowEnd = 0;
+		return map;
+	}
+
+	free(map->fiemap);
+	map->fiemap = NULL;
+#endif
+
+#ifdef SEEK_DATA
+	if (lseek(fd, 0, SEEK_DATA) != -1 || errno == ENXIO) {
+		return map;
+	}
+#endif
+
+	free(map);
+	errno = ENOTSUP;
+	return NULL;
+}
+
+// Tells whether [offset, offset + length) holds only zeros without data on
+// disk, and otherwise its extent hint (0 when the extents can't vouch for
+// the data).
+void extentMapDescribe(ExtentMap *map, off_t offset, uint64_t length, int *isHole, uint64_t *hint) {
+	uint64_t start = offset;
+	uint64_t end = offset + length;
+
+	*isHole = 0;
+	*hint = 0;
+
+#ifdef __linux__
+	if (map->hasFiemap) {
+		if (start < map->windowStart || end > map->windowEnd) {
+			if (queryExtents(map, start, length > EXTENTS_WINDOW ? length : EXTENTS_WINDOW) == -1 || end > map->windowEnd) {
+				return;
+			}
+		}
+		describeExtents(map, start, end, isHole, hint);
+		return;
+	}
+#endif
+
+#ifdef SEEK_DATA
+	off_t data = lseek(map->fd, offset, SEEK_DATA);
+	if ((data == -1 && errno == ENXIO) || (data != -1 && (uint64_t) data >= end)) {
+		*isHole = 1;
+	}
+#endif
+}
+
+int extentMapIsCopyOnWrite(ExtentMap *map) {
+	return map->isCopyOnWrite;
+}
+
+void extentMapDestroy(ExtentMap *map) {
+#ifdef __linux__
+	free(map->fiemap);
+#endif
+	free(map);
+}
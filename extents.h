@@ -0,0 +1,28 @@
+#ifndef BIGSYNC_EXTENTS_H
+#define BIGSYNC_EXTENTS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Describes how a file's blocks sit on disk, so that blocks which can't have
+// changed since the last run don't have to be read at all.
+//
+// A block's extent hint fingerprints its extents (logical position, physical
+// address, length and flags). It is only given out (non-zero) when a write to
+// the block would be guaranteed to change it, which is the case on
+// copy-on-write filesystems (btrfs, unless the file is nodatacow) and for
+// extents shared with a reflink copy or snapshot on any filesystem. Anything
+// else, like a plain ext4 file rewritten in place, gets 0: "read it".
+//
+// Blocks that are entirely holes or preallocated-but-unwritten extents are
+// reported as holes on every filesystem that supports FIEMAP or SEEK_DATA.
+
+typedef struct ExtentMap ExtentMap;
+
+// Returns NULL (with errno set) if the file can't be described at all.
+ExtentMap *extentMapCreate(int fd);
+void extentMapDescribe(ExtentMap *map, off_t offset, uint64_t length, int *isHole, uint64_t *hint);
+int extentMapIsCopyOnWrite(ExtentMap *map);
+void extentMapDestroy(ExtentMap *map);
+
+#endif
@@ -0,0 +1,736 @@
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <inttypes.h>
+#include "generations.h"
+#include "util.h"
+
+static size_t recordSize(Generation *generation) {
+	return 32 + generation->hashAlgorithm->digestSize;
+}
+
+static void encodeRecord(Generation *generation, const GenerationRecord *record, unsigned char *p) {
+	put64(p, record->index);
+	put64(p + 8, record->length);
+	put64(p + 16, record->offset);
+	put32(p + 24, record->generation);
+	put32(p + 28, 0);
+	memcpy(p + 32, record->digest, generation->hashAlgorithm->digestSize);
+}
+
+static void decodeRecord(Generation *generation, const unsigned char *p, GenerationRecord *record) {
+	memset(record, 0, sizeof(GenerationRecord));
+	record->index = get64(p);
+	record->length = get64(p + 8);
+	record->offset = get64(p + 16);
+	record->generation = get32(p + 24);
+	memcpy(record->digest, p + 32, generation->hashAlgorithm->digestSize);
+}
+
+static int writeHeader(Generation *generation, int isComplete, uint64_t indexOffset) {
+	unsigned char header[72];
+	memset(header, 0, sizeof(header));
+
+	memcpy(header, GENERATION_MAGIC, GENERATION_MAGIC_SIZE);
+	put32(header + 8, generation->hashAlgorithm->id);
+	put32(header + 12, generation->hashAlgorithm->digestSize);
+	put64(header + 16, generation->blockSize);
+	put64(header + 24, generation->sourceSize);
+	put32(header + 32, generation->number);
+	put32(header + 36, isComplete);
+	put64(header + 40, indexOffset);
+	put64(header + 48, generation->recordsCount);
+	put64(header + 56, (uint64_t) generation->createdAt);
+	put32(header + 64, generation->keep);
+
+	generation->isComplete = isComplete;
+	return utilWriteAll(generation->fd, header, sizeof(header), 0);
+}
+
+static int addRecord(Generation *generation, const GenerationRecord *record) {
+	if (generation->recordsCount == generation->recordsCapacity) {
+		size_t capacity = generation->recordsCapacity ? generation->recordsCapacity * 2 : 64;
+		GenerationRecord *records = realloc(generation->records, capacity * sizeof(GenerationRecord));
+		if (records == NULL) {
+			return -1;
+		}
+		generation->records = records;
+		generation->recordsCapacity = capacity;
+	}
+	generation->records[generation->recordsCount++] = *record;
+	return 0;
+}
+
+static void freeGeneration(Generation *generation) {
+	if (generation->fd != -1) {
+		close(generation->fd);
+	}
+	free(generation->filename);
+	free(generation->records);
+	free(generation);
+}
+
+// Goes through the log of a file a crash left without its index, up to the
+// first record that doesn't add up.
+static int scanLog(Generation *generation, off_t fileSize) {
+	size_t size = recordSize(generation);
+	unsigned char encoded[32 + HASH_MAX_DIGEST_SIZE];
+	char *block = malloc(generation->blockSize);
+	off_t position = GENERATION_HEADER_SIZE;
+
+	if (block == NULL) {
+		return -1;
+	}
+
+	while (position + (off_t) size <= fileSize) {
+		GenerationRecord record;
+		if (utilReadAll(generation->fd, encoded, size, position) == -1) {
+			break;
+		}
+		decodeRecord(generation, encoded, &record);
+
+		if (record.length == 0 || record.length > generation->blockSize || record.generation > generation->number) {
+			break;
+		}
+
+		if (record.generation == generation->number) {
+			unsigned char digest[HASH_MAX_DIGEST_SIZE];
+			if (record.offset != (uint64_t) position + size || position + size + record.length > (uint64_t) fileSize ||
+				utilReadAll(generation->fd, block, record.length, record.offset) == -1) {
+				break;
+			}
+			hashBuffer(generation->hashAlgorithm, (unsigned char *) block, record.length, digest);
+			if (memcmp(digest, record.digest, generation->hashAlgorithm->digestSize) != 0) {
+				break;
+			}
+			position += record.length;
+		}
+		position += size;
+
+		if (addRecord(generation, &record) == -1) {
+			free(block);
+			return -1;
+		}
+	}
+
+	generation->end = position;
+	free(block);
+	return 0;
+}
+
+static Generation *loadGeneration(char *filename, uint32_t number, char *error) {
+	Generation *generation = calloc(1, sizeof(Generation));
+	unsigned char header[72];
+	struct stat fileStat;
+
+	if (generation == NULL) {
+		setError(error, "Out of memory");
+		free(filename);
+		return NULL;
+	}
+	generation->filename = filename;
+
+	generation->fd = open(filename, O_RDWR);
+	if (generation->fd == -1 && (errno == EACCES || errno == EROFS)) {
+		generation->fd = open(filename, O_RDONLY);
+	}
+	if (generation->fd == -1 || fstat(generation->fd, &fileStat) == -1) {
+		setError(error, "Cannot open %s: %s", filename, strerror(errno));
+		goto fail;
+	}
+
+	if (utilReadAll(generation->fd, header, sizeof(header), 0) == -1 ||
+		memcmp(header, GENERATION_MAGIC, GENERATION_MAGIC_SIZE) != 0 ||
+		(generation->hashAlgorithm = hashAlgorithmById(get32(header + 8))) == NULL ||
+		(int) get32(header + 12) != generation->hashAlgorithm->digestSize ||
+		get32(header + 32) != number) {
+
+		setError(error, "Generation file %s is broken", filename);
+		goto fail;
+	}
+
+	generation->blockSize = get64(header + 16);
+	generation->sourceSize = get64(header + 24);
+	generation->number = number;
+	generation->createdAt = (time_t) get64(header + 56);
+	generation->keep = get32(header + 64);
+	generation->isComplete = get32(header + 36);
+
+	if (generation->blockSize == 0) {
+		setError(error, "Generation file %s is broken", filename);
+		goto fail;
+	}
+
+	if (!generation->isComplete) {
+		if (scanLog(generation, fileStat.st_size) == -1) {
+			setError(error, "Out of memory");
+			goto fail;
+		}
+		return generation;
+	}
+
+	uint64_t indexOffset = get64(header + 40);
+	uint64_t recordsCount = get64(header + 48);
+	size_t size = recordSize(generation);
+	if (indexOffset < GENERATION_HEADER_SIZE || indexOffset + recordsCount * size != (uint64_t) fileStat.st_size) {
+		setError(error, "Generation file %s is broken", filename);
+		goto fail;
+	}
+
+	unsigned char *index = malloc(recordsCount * size + 1);
+	if (index == NULL) {
+		setError(error, "Out of memory");
+		goto fail;
+	}
+	if (utilReadAll(generation->fd, index, recordsCount * size, indexOffset) == -1) {
+		setError(error, "Cannot read %s: %s", filename, strerror(errno));
+		free(index);
+		goto fail;
+	}
+
+	uint64_t i;
+	for (i = 0; i < recordsCount; i++) {
+		GenerationRecord record;
+		decodeRecord(generation, index + i * size, &record);
+		if (addRecord(generation, &record) == -1) {
+			setError(error, "Out of memory");
+			free(index);
+			goto fail;
+		}
+	}
+	free(index);
+
+	generation->end = indexOffset;
+	return generation;
+
+fail:
+	freeGeneration(generation);
+	return NULL;
+}
+
+static int compareNumbers(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *) a;
+	uint32_t y = *(const uint32_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+// Numbers of the generation files next to base, in order.
+static int listNumbers(const char *base, uint32_t **numbers) {
+	char *directoryCopy = strdup(base);
+	char *nameCopy = strdup(base);
+	char *prefix = NULL;
+	int count = 0;
+	int capacity = 0;
+
+	*numbers = NULL;
+	if (directoryCopy == NULL || nameCopy == NULL || asprintf(&prefix, "%s.gen.", basename(nameCopy)) < 0) {
+		free(directoryCopy);
+		free(nameCopy);
+		return -1;
+	}
+
+	DIR *directory = opendir(dirname(directoryCopy));
+	if (directory) {
+		struct dirent *entry;
+		size_t prefixLength = strlen(prefix);
+
+		while ((entry = readdir(directory))) {
+			char *end;
+			if (strncmp(entry->d_name, prefix, prefixLength) != 0 || entry->d_name[prefixLength] == 0) {
+				continue;
+			}
+			unsigned long number = strtoul(entry->d_name + prefixLength, &end, 10);
+			if (*end != 0 || number == 0 || number > UINT32_MAX) {
+				continue;
+			}
+
+			if (count == capacity) {
+				capacity = capacity ? capacity * 2 : 16;
+				uint32_t *grown = realloc(*numbers, capacity * sizeof(uint32_t));
+				if (grown == NULL) {
+					count = -1;
+					break;
+				}
+				*numbers = grown;
+			}
+			(*numbers)[count++] = (uint32_t) number;
+		}
+		closedir(directory);
+	}
+
+	if (count > 0) {
+		qsort(*numbers, count, sizeof(uint32_t), compareNumbers);
+	}
+
+	free(prefix);
+	free(directoryCopy);
+	free(nameCopy);
+	return count;
+}
+
+static char *filenameOf(const char *base, uint32_t number) {
+	char *filename = NULL;
+	if (asprintf(&filename, "%s.gen.%u", base, number) < 0) {
+		return NULL;
+	}
+	return filename;
+}
+
+// Loads every generation kept next to base (the checksums file).
+int generationsLoad(const char *base, Generations *generations, char *error) {
+	uint32_t *numbers;
+
+	memset(generations, 0, sizeof(Generations));
+	generations->destFd = -1;
+	generations->base = strdup(base);
+
+	int count = listNumbers(base, &numbers);
+	if (generations->base == NULL || count < 0) {
+		setError(error, "Cannot list the generations of %s: %s", base, strerror(errno));
+		return -1;
+	}
+
+	generations->list = calloc(count + 1, sizeof(Generation *));
+	if (generations->list == NULL) {
+		setError(error, "Out of memory");
+		free(numbers);
+		return -1;
+	}
+
+	int i;
+	for (i = 0; i < count; i++) {
+		char *filename = filenameOf(base, numbers[i]);
+		Generation *generation = filename ? loadGeneration(filename, numbers[i], error) : NULL;
+		if (generation == NULL) {
+			if (filename == NULL) {
+				setError(error, "Out of memory");
+			}
+			free(numbers);
+			return -1;
+		}
+		generations->list[generations->count++] = generation;
+	}
+
+	free(numbers);
+	return 0;
+}
+
+void generationsFree(Generations *generations) {
+	int i;
+	for (i = 0; i < generations->count; i++) {
+		freeGeneration(generations->list[i]);
+	}
+	if (generations->known) {
+		chunkIndexDestroy(generations->known);
+	}
+	free(generations->list);
+	free(generations->block);
+	free(generations->base);
+	memset(generations, 0, sizeof(Generations));
+}
+
+int generationsRemoveAll(const char *base) {
+	uint32_t *numbers;
+	int count = listNumbers(base, &numbers);
+	int result = count < 0 ? -1 : 0;
+
+	int i;
+	for (i = 0; i < count; i++) {
+		char *filename = filenameOf(base, numbers[i]);
+		if (filename == NULL || unlink(filename) == -1) {
+			result = -1;
+		}
+		free(filename);
+	}
+
+	free(numbers);
+	return result;
+}
+
+// Writes the index after the log, which makes the file complete.
+static int writeIndex(Generation *generation) {
+	size_t size = recordSize(generation);
+	unsigned char *index = malloc(generation->recordsCount * size + 1);
+	if (index == NULL) {
+		return -1;
+	}
+
+	size_t i;
+	for (i = 0; i < generation->recordsCount; i++) {
+		encodeRecord(generation, &generation->records[i], index + i * size);
+	}
+
+	int result = -1;
+	if (utilWriteAll(generation->fd, index, generation->recordsCount * size, generation->end) == 0 &&
+		ftruncate(generation->fd, generation->end + generation->recordsCount * size) == 0 &&
+		fsync(generation->fd) == 0 &&
+		writeHeader(generation, 1, generation->end) == 0 &&
+		fsync(generation->fd) == 0) {
+
+		result = 0;
+	}
+
+	free(index);
+	return result;
+}
+
+// 32 bit digests are too likely to collide over a large destination to be
+// taken for the data.
+static int canReuseDigests(const HashAlgorithm *hashAlgorithm) {
+	return hashAlgorithm->digestSize >= 8;
+}
+
+static int rememberData(Generations *generations, const GenerationRecord *record) {
+	if (!canReuseDigests(generations->current->hashAlgorithm) || chunkIndexFind(generations->known, record->digest)) {
+		return 0;
+	}
+	if (chunkIndexAdd(generations->known, record->digest, record->offset, record->length) == -1) {
+		return -1;
+	}
+	chunkIndexFind(generations->known, record->digest)->file = record->generation;
+	return 0;
+}
+
+// Starts the generation this run closes: the destination as it is now,
+// sourceSize bytes long, read from destFd.
+int generationsBegin(Generations *generations, const HashAlgorithm *hashAlgorithm, uint64_t blockSize,
+	uint64_t sourceSize, uint32_t keep, int destFd, char *error) {
+
+	Generation *generation = calloc(1, sizeof(Generation));
+	if (generation == NULL) {
+		setError(error, "Out of memory");
+		return -1;
+	}
+
+	generation->number = generations->count ? generations->list[generations->count - 1]->number + 1 : 1;
+	generation->hashAlgorithm = hashAlgorithm;
+	generation->blockSize = blockSize;
+	generation->sourceSize = sourceSize;
+	generation->keep = keep;
+	generation->createdAt = time(NULL);
+	generation->end = GENERATION_HEADER_SIZE;
+	generation->filename = filenameOf(generations->base, generation->number);
+
+	generation->fd = generation->filename ? open(generation->filename, O_RDWR | O_CREAT | O_TRUNC, 0644) : -1;
+	if (generation->fd == -1 || writeHeader(generation, 0, 0) == -1) {
+		setError(error, "Cannot create %s: %s", generation->filename ? generation->filename : generations->base,
+			strerror(errno));
+		freeGeneration(generation);
+		return -1;
+	}
+
+	// a run that was interrupted left its generation without an index
+	int i;
+	for (i = 0; i < generations->count; i++) {
+		if (!generations->list[i]->isComplete && writeIndex(generations->list[i]) == -1) {
+			setError(error, "Failed to write %s: %s", generations->list[i]->filename, strerror(errno));
+			freeGeneration(generation);
+			return -1;
+		}
+	}
+
+	generations->list[generations->count++] = generation;
+	generations->current = generation;
+	generations->destFd = destFd;
+	generations->isDirty = 1;
+
+	generations->block = calloc(1, blockSize);
+	generations->known = chunkIndexCreate(hashAlgorithm->digestSize, 0);
+	if (generations->block == NULL || generations->known == NULL) {
+		setError(error, "Out of memory");
+		return -1;
+	}
+	hashBuffer(hashAlgorithm, (unsigned char *) generations->block, blockSize, generations->zeroDigest);
+
+	for (i = 0; i < generations->count - 1; i++) {
+		Generation *kept = generations->list[i];
+		size_t j;
+		for (j = 0; j < kept->recordsCount; j++) {
+			if (kept->records[j].generation == kept->number && rememberData(generations, &kept->records[j]) == -1) {
+				setError(error, "Out of memory");
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// Saves the current contents of a block, whose stored digest is given,
+// before it is written over: as a zero block, as a reference to a copy some
+// generation already holds, or else read from the destination.
+int generationsKeep(Generations *generations, uint64_t index, const unsigned char *digest) {
+	Generation *generation = generations->current;
+	uint64_t offset = index * generation->blockSize;
+	int digestSize = generation->hashAlgorithm->digestSize;
+
+	if (offset >= generation->sourceSize) {
+		return 0;
+	}
+
+	GenerationRecord record;
+	memset(&record, 0, sizeof(GenerationRecord));
+	record.index = index;
+	record.length = generation->sourceSize - offset < generation->blockSize ?
+		generation->sourceSize - offset : generation->blockSize;
+	memcpy(record.digest, digest, digestSize);
+
+	ChunkIndexEntry *known = canReuseDigests(generation->hashAlgorithm) ? chunkIndexFind(generations->known, digest) : NULL;
+	int isData = 0;
+
+	if (record.length == generation->blockSize && memcmp(digest, generations->zeroDigest, digestSize) == 0) {
+		record.generation = 0;
+	} else if (known && known->length == record.length) {
+		record.generation = known->file;
+		record.offset = known->offset;
+	} else {
+		// whatever is past the end of the destination reads as zeros
+		if (utilReadZeroFilled(generations->destFd, generations->block, record.length, offset) == -1) {
+			return -1;
+		}
+		generations->bytesRead += record.length;
+
+		// what it actually holds, should it differ from what was stored
+		hashBuffer(generation->hashAlgorithm, (unsigned char *) generations->block, record.length, record.digest);
+		record.generation = generation->number;
+		record.offset = generation->end + recordSize(generation);
+		isData = 1;
+	}
+
+	unsigned char encoded[32 + HASH_MAX_DIGEST_SIZE];
+	encodeRecord(generation, &record, encoded);
+	if (utilWriteAll(generation->fd, encoded, recordSize(generation), generation->end) == -1) {
+		return -1;
+	}
+	generation->end += recordSize(generation);
+
+	if (isData) {
+		if (utilWriteAll(generation->fd, generations->block, record.length, generation->end) == -1) {
+			return -1;
+		}
+		generation->end += record.length;
+		generations->bytesKept += record.length;
+
+		if (rememberData(generations, &record) == -1) {
+			return -1;
+		}
+	}
+
+	generations->isDirty = 1;
+	return addRecord(generation, &record);
+}
+
+// Has to be called before the blocks kept so far are written over.
+int generationsSync(Generations *generations) {
+	if (!generations->isDirty) {
+		return 0;
+	}
+	if (fsync(generations->current->fd) == -1) {
+		return -1;
+	}
+	generations->isDirty = 0;
+	return 0;
+}
+
+// Copies the data generation refers to in victim, which is about to go,
+// into its own file.
+static int takeOver(Generation *generation, Generation *victim, char *block) {
+	size_t i;
+	int isChanged = 0;
+
+	for (i = 0; i < generation->recordsCount; i++) {
+		GenerationRecord *record = &generation->records[i];
+		if (record->generation != victim->number) {
+			continue;
+		}
+
+		if (!isChanged) {
+			if (writeHeader(generation, 0, 0) == -1 || fsync(generation->fd) == -1) {
+				return -1;
+			}
+			isChanged = 1;
+		}
+
+		unsigned char digest[HASH_MAX_DIGEST_SIZE];
+		if (utilReadAll(victim->fd, block, record->length, record->offset) == -1) {
+			return -1;
+		}
+		hashBuffer(generation->hashAlgorithm, (unsigned char *) block, record->length, digest);
+		if (memcmp(digest, record->digest, generation->hashAlgorithm->digestSize) != 0) {
+			errno = EIO;
+			return -1;
+		}
+
+		record->generation = generation->number;
+		record->offset = generation->end + recordSize(generation);
+
+		unsigned char encoded[32 + HASH_MAX_DIGEST_SIZE];
+		encodeRecord(generation, record, encoded);
+		if (utilWriteAll(generation->fd, encoded, recordSize(generation), generation->end) == -1 ||
+			utilWriteAll(generation->fd, block, record->length, record->offset) == -1) {
+			return -1;
+		}
+		generation->end = record->offset + record->length;
+	}
+
+	return isChanged ? writeIndex(generation) : 0;
+}
+
+// Completes the generation of this run, unless the run left the destination,
+// now sourceSize bytes long, as it was, and drops the oldest generations past
+// the number to keep.
+int generationsEnd(Generations *generations, uint64_t sourceSize, char *error) {
+	Generation *generation = generations->current;
+	uint32_t keep = generation->keep;
+
+	if (generation->recordsCount == 0 && generation->sourceSize == sourceSize) {
+		unlink(generation->filename);
+		freeGeneration(generation);
+		generations->count--;
+		generations->current = NULL;
+	} else if (writeIndex(generation) == -1) {
+		setError(error, "Failed to write %s: %s", generation->filename, strerror(errno));
+		return -1;
+	}
+
+	while ((uint32_t) generations->count > keep && generations->count > 0) {
+		Generation *victim = generations->list[0];
+
+		int i;
+		for (i = 1; i < generations->count; i++) {
+			Generation *kept = generations->list[i];
+			char *block = malloc(kept->blockSize);
+			int result = block ? takeOver(kept, victim, block) : -1;
+			free(block);
+			if (result == -1) {
+				setError(error, "Failed to move data from %s into %s: %s", victim->filename, kept->filename, strerror(errno));
+				return -1;
+			}
+		}
+
+		if (unlink(victim->filename) == -1) {
+			setError(error, "Failed to remove %s: %s", victim->filename, strerror(errno));
+			return -1;
+		}
+		freeGeneration(victim);
+		memmove(generations->list, generations->list + 1, (generations->count - 1) * sizeof(Generation *));
+		generations->count--;
+	}
+
+	return 0;
+}
+
+static Generation *findGeneration(Generations *generations, uint32_t number) {
+	int i;
+	for (i = 0; i < generations->count; i++) {
+		if (generations->list[i]->number == number) {
+			return generations->list[i];
+		}
+	}
+	return NULL;
+}
+
+// Writes generation number out to restoreFd: every block from the oldest
+// delta from that generation on that has it, or else from the destination.
+int generationsRestore(Generations *generations, uint32_t number, int destFd, int restoreFd, char *error) {
+	int first;
+	for (first = 0; first < generations->count && generations->list[first]->number != number; first++);
+	if (first == generations->count) {
+		setError(error, "There is no generation %u", number);
+		return -1;
+	}
+
+	Generation *target = generations->list[first];
+	uint64_t blockSize = target->blockSize;
+	uint64_t blocksCount = (target->sourceSize + blockSize - 1) / blockSize;
+	GenerationRecord **sources = calloc(blocksCount + 1, sizeof(GenerationRecord *));
+	char *block = malloc(blockSize);
+	int result = -1;
+
+	if (sources == NULL || block == NULL) {
+		setError(error, "Out of memory");
+		goto done;
+	}
+
+	int i;
+	for (i = generations->count - 1; i >= first; i--) {
+		Generation *generation = generations->list[i];
+		if (generation->blockSize != blockSize || generation->hashAlgorithm != target->hashAlgorithm) {
+			setError(error, "Generation %u was made with another block size or hash", generation->number);
+			goto done;
+		}
+
+		size_t j;
+		for (j = 0; j < generation->recordsCount; j++) {
+			if (generation->records[j].index < blocksCount) {
+				sources[generation->records[j].index] = &generation->records[j];
+			}
+		}
+	}
+
+	uint64_t index;
+	for (index = 0; index < blocksCount; index++) {
+		uint64_t offset = index * blockSize;
+		uint64_t length = target->sourceSize - offset < blockSize ? target->sourceSize - offset : blockSize;
+		GenerationRecord *record = sources[index];
+
+		bzero(block, length);
+		if (record && record->length != length) {
+			setError(error, "Block %" PRIu64 " of generation %u is broken", index, number);
+			goto done;
+		}
+
+		if (record && record->generation) {
+			Generation *holder = findGeneration(generations, record->generation);
+			unsigned char digest[HASH_MAX_DIGEST_SIZE];
+			if (holder == NULL) {
+				setError(error, "Generation %u, which block %" PRIu64 " is in, is gone", record->generation, index);
+				goto done;
+			}
+			if (utilReadAll(holder->fd, block, length, record->offset) == -1) {
+				setError(error, "Cannot read %s: %s", holder->filename, strerror(errno));
+				goto done;
+			}
+			hashBuffer(holder->hashAlgorithm, (unsigned char *) block, length, digest);
+			if (memcmp(digest, record->digest, holder->hashAlgorithm->digestSize) != 0) {
+				setError(error, "Block %" PRIu64 " in %s is damaged", index, holder->filename);
+				goto done;
+			}
+
+		} else if (record == NULL) {
+			// unchanged since; what is past the end of the destination
+			// reads as zeros
+			if (utilReadZeroFilled(destFd, block, length, offset) == -1) {
+				setError(error, "Cannot read the destination: %s", strerror(errno));
+				goto done;
+			}
+		}
+
+		if (utilWriteAll(restoreFd, block, length, offset) == -1) {
+			setError(error, "Cannot write: %s", strerror(errno));
+			goto done;
+		}
+	}
+
+	if (ftruncate(restoreFd, target->sourceSize) == -1 || fsync(restoreFd) == -1) {
+		setError(error, "Cannot write: %s", strerror(errno));
+		goto done;
+	}
+	result = 0;
+
+done:
+	free(sources);
+	free(block);
+	return result;
+}
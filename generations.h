@@ -0,0 +1,97 @@
+#ifndef BIGSYNC_GENERATIONS_H
+#define BIGSYNC_GENERATIONS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include "hash.h"
+#include "cdc.h"
+
+#define GENERATION_MAGIC "BSGENER\001"
+#define GENERATION_MAGIC_SIZE 8
+#define GENERATION_HEADER_SIZE 4096
+#define GENERATION_ERROR_SIZE 512
+
+// Earlier states of a destination (--keep-generations). Before a run writes
+// over a block, the block's old contents go into the delta file of the
+// generation the run closes, "<checksums>.gen.<number>"; a generation is
+// the destination as it was before the run after it. Restoring one takes
+// the current destination and the deltas of it and every later generation,
+// the oldest delta of a block winning. All integers are little-endian.
+//
+//   0  magic          8 bytes
+//   8  hash           uint32, HASH_* id
+//  12  digestSize     uint32
+//  16  blockSize      uint64
+//  24  sourceSize     uint64, size of the destination back then
+//  32  number         uint32
+//  36  isComplete     uint32, set once the index is written
+//  40  indexOffset    uint64
+//  48  recordsCount   uint64
+//  56  createdAt      uint64, seconds since the epoch
+//  64  keep           uint32, generations to keep
+//
+// followed by a log of records, each followed by the block's data if it is
+// kept in this file. A record is: block index (uint64), length (uint64),
+// offset of the data (uint64), number of the generation whose file holds
+// the data, 0 for a zero block (uint32), reserved (uint32), digest. Blocks
+// whose contents an earlier generation already holds refer to it instead,
+// without reading the destination. A complete file ends with its index: all
+// records again, without data. A file a crash left incomplete is read by
+// going through its log; as every record is synced before its block is
+// overwritten, it still describes the destination correctly. For a block
+// that has several records, the last one is the valid one.
+
+typedef struct {
+	uint64_t index;
+	uint64_t length;
+	uint64_t offset;
+	uint32_t generation;
+	unsigned char digest[HASH_MAX_DIGEST_SIZE];
+} GenerationRecord;
+
+typedef struct {
+	uint32_t number;
+	char *filename;
+	int fd;
+	const HashAlgorithm *hashAlgorithm;
+	uint64_t blockSize;
+	uint64_t sourceSize;
+	uint32_t keep;
+	int isComplete;
+	time_t createdAt;
+	off_t end;
+
+	GenerationRecord *records;
+	size_t recordsCount;
+	size_t recordsCapacity;
+} Generation;
+
+typedef struct {
+	char *base;
+	Generation **list; // oldest first, the one being written last
+	int count;
+
+	Generation *current;
+	ChunkIndex *known; // digests of data kept in any generation
+	int destFd;
+	unsigned char zeroDigest[HASH_MAX_DIGEST_SIZE];
+	char *block;
+	int isDirty;
+	uint64_t bytesKept;
+	uint64_t bytesRead;
+} Generations;
+
+int generationsLoad(const char *base, Generations *generations, char *error);
+void generationsFree(Generations *generations);
+int generationsRemoveAll(const char *base);
+
+int generationsBegin(Generations *generations, const HashAlgorithm *hashAlgorithm, uint64_t blockSize,
+	uint64_t sourceSize, uint32_t keep, int destFd, char *error);
+int generationsKeep(Generations *generations, uint64_t index, const unsigned char *digest);
+int generationsSync(Generations *generations);
+int generationsEnd(Generations *generations, uint64_t sourceSize, char *error);
+
+int generationsRestore(Generations *generations, uint32_t number, int destFd, int restoreFd, char *error);
+
+#endif
@@ -0,0 +1,167 @@
+#include <string.h>
+#include "hash.h"
+#include "crc32c.h"
+#include "md4lanes.h"
+
+// md4 must stay first: checksum files without a header are md4.
+static const HashAlgorithm hashAlgorithms[] = {
+	{ HASH_MD4,    "md4",    16 },
+	{ HASH_XXH64,  "xxh64",  8  },
+	{ HASH_BLAKE3, "blake3", 32 },
+	{ HASH_CRC32C, "crc32c", 4  },
+	{ -1,          NULL,     0  }
+};
+
+const HashAlgorithm *hashAlgorithmById(int id) {
+	const HashAlgorithm *algorithm;
+	for (algorithm = hashAlgorithms; algorithm->name; algorithm++) {
+		if (algorithm->id == id) {
+			return algorithm;
+		}
+	}
+	return NULL;
+}
+
+const HashAlgorithm *hashAlgorithmByName(const char *name) {
+	const HashAlgorithm *algorithm;
+	for (algorithm = hashAlgorithms; algorithm->name; algorithm++) {
+		if (strcmp(algorithm->name, name) == 0) {
+			return algorithm;
+		}
+	}
+	return NULL;
+}
+
+const char *hashAlgorithmNames() {
+	return "md4, xxh64, blake3, crc32c";
+}
+
+void hashInit(HashContext *context, const HashAlgorithm *algorithm) {
+	context->algorithm = algorithm;
+
+	switch (algorithm->id) {
+		case HASH_MD4:
+			MD4Init(&context->state.md4);
+			break;
+
+		case HASH_XXH64:
+			xxh64Init(&context->state.xxh64, 0);
+			break;
+
+		case HASH_BLAKE3:
+			blake3Init(&context->state.blake3);
+			break;
+
+		case HASH_CRC32C:
+			context->state.crc32c = 0;
+			break;
+	}
+}
+
+void hashUpdate(HashContext *context, const unsigned char *input, uint64_t length) {
+	switch (context->algorithm->id) {
+		case HASH_MD4:
+			// MD4Update takes an unsigned int length
+			while (length > 0) {
+				unsigned int part = length > 0x40000000 ? 0x40000000 : (unsigned int) length;
+				MD4Update(&context->state.md4, (unsigned char *) input, part);
+				input += part;
+				length -= part;
+			}
+			break;
+
+		case HASH_XXH64:
+			xxh64Update(&context->state.xxh64, input, length);
+			break;
+
+		case HASH_BLAKE3:
+			blake3Update(&context->state.blake3, input, length);
+			break;
+
+		case HASH_CRC32C:
+			context->state.crc32c = crc32cUpdate(context->state.crc32c, input, length);
+			break;
+	}
+}
+
+// Digests are stored big-endian for the integer hashes so that their hex form
+// reads the same as the usual xxhsum/crc32c tools print them.
+void hashFinal(HashContext *context, unsigned char *digest) {
+	int i;
+
+	switch (context->algorithm->id) {
+		case HASH_MD4:
+			MD4Final(digest, &context->state.md4);
+			break;
+
+		case HASH_XXH64: {
+			uint64_t value = xxh64Final(&context->state.xxh64);
+			for (i = 0; i < 8; i++) {
+				digest[i] = (unsigned char) (value >> (56 - 8 * i));
+			}
+			break;
+		}
+
+		case HASH_BLAKE3:
+			blake3Final(&context->state.blake3, digest, BLAKE3_OUT_LEN);
+			break;
+
+		case HASH_CRC32C:
+			for (i = 0; i < 4; i++) {
+				digest[i] = (unsigned char) (context->state.crc32c >> (24 - 8 * i));
+			}
+			break;
+	}
+}
+
+void hashBuffer(const HashAlgorithm *algorithm, const unsigned char *input, uint64_t length, unsigned char *digest) {
+	HashContext context;
+	hashInit(&context, algorithm);
+	hashUpdate(&context, input, length);
+	hashFinal(&context, digest);
+}
+
+void hashBuffers(const HashAlgorithm *algorithm, const unsigned char **inputs, uint64_t length, int count, unsigned char *digests) {
+	if (algorithm->id == HASH_MD4 && length < MD4_LANES_MAX_LENGTH) {
+		md4Lanes(inputs, (size_t) length, count, digests);
+		return;
+	}
+
+	int i;
+	for (i = 0; i < count; i++) {
+		hashBuffer(algorithm, inputs[i], length, digests + (size_t) i * algorithm->digestSize);
+	}
+}
+
+static const char hexDigits[] = "0123456789abcdef";
+
+// One more than the value of a hex digit of either case (1-16), so that 0,
+// where the table isn't filled in, means "not a hex digit"
+static const unsigned char hexValues[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16
+};
+
+void hashToHex(char *hex, const unsigned char *digest, int digestSize) {
+	int i;
+	for (i = 0; i < digestSize; i++) {
+		hex[i * 2] = hexDigits[digest[i] >> 4];
+		hex[i * 2 + 1] = hexDigits[digest[i] & 0x0f];
+	}
+	hex[digestSize * 2] = 0;
+}
+
+int hashFromHex(const char *hex, int digestSize, unsigned char *digest) {
+	int i;
+	for (i = 0; i < digestSize; i++) {
+		int high = hexValues[(unsigned char) hex[i * 2]] - 1;
+		int low = hexValues[(unsigned char) hex[i * 2 + 1]] - 1;
+		if (high < 0 || low < 0) {
+			return -1;
+		}
+		digest[i] = (unsigned char) ((high << 4) | low);
+	}
+	return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef BIGSYNC_HASH_H
+#define BIGSYNC_HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "md4_global.h"
+#include "md4.h"
+#include "xxh64.h"
+#include "blake3.h"
+
+#define HASH_MD4 0
+#define HASH_XXH64 1
+#define HASH_BLAKE3 2
+#define HASH_CRC32C 3
+
+#define HASH_MAX_DIGEST_SIZE 32
+#define HASH_MAX_HEX_SIZE (HASH_MAX_DIGEST_SIZE * 2 + 1)
+
+// how many buffers to give hashBuffers() at once
+#define HASH_BATCH_SIZE 16
+
+typedef struct {
+	int id;
+	const char *name;
+	int digestSize;
+} HashAlgorithm;
+
+typedef struct {
+	const HashAlgorithm *algorithm;
+	union {
+		MD4_CTX md4;
+		Xxh64State xxh64;
+		Blake3Hasher blake3;
+		uint32_t crc32c;
+	} state;
+} HashContext;
+
+const HashAlgorithm *hashAlgorithmById(int id);
+const HashAlgorithm *hashAlgorithmByName(const char *name);
+const char *hashAlgorithmNames();
+
+void hashInit(HashContext *context, const HashAlgorithm *algorithm);
+void hashUpdate(HashContext *context, const unsigned char *input, uint64_t length);
+void hashFinal(HashContext *context, unsigned char *digest);
+void hashBuffer(const HashAlgorithm *algorithm, const unsigned char *input, uint64_t length, unsigned char *digest);
+
+// Hashes count inputs of the same length, digests stored one after another.
+// md4 hashes several at once where the CPU allows.
+void hashBuffers(const HashAlgorithm *algorithm, const unsigned char **inputs, uint64_t length, int count, unsigned char *digests);
+
+// Hex digests for text checksums files and output: hashToHex() writes
+// digestSize * 2 lowercase digits and a terminating zero, hashFromHex() reads
+// either case and returns -1 on anything else.
+void hashToHex(char *hex, const unsigned char *digest, int digestSize);
+int hashFromHex(const char *hex, int digestSize, unsigned char *digest);
+
+#endif
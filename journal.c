@@ -0,0 +1,171 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include "journal.h"
+#include "util.h"
+#include "crc32c.h"
+
+// Reads a journal left behind by an interrupted run. Returns -1 with errno
+// ENOENT if there is none, or with EINVAL if even its header is unusable.
+int journalRead(char *filename, JournalContents *contents) {
+	memset(contents, 0, sizeof(JournalContents));
+
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		return -1;
+	}
+
+	unsigned char header[JOURNAL_HEADER_SIZE];
+	if (read(fd, header, JOURNAL_HEADER_SIZE) != JOURNAL_HEADER_SIZE ||
+		memcmp(header, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE) != 0 ||
+		crc32c(header, 40) != get32(header + 40)) {
+
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	contents->hashId = get32(header + 8);
+	contents->blockSize = get64(header + 16);
+	contents->resumeIndex = get64(header + 24);
+
+	unsigned char entry[JOURNAL_ENTRY_SIZE];
+	size_t capacity = 0;
+
+	while (read(fd, entry, JOURNAL_ENTRY_SIZE) == JOURNAL_ENTRY_SIZE) {
+		if (crc32c(entry, JOURNAL_ENTRY_SIZE - 4) != get32(entry + JOURNAL_ENTRY_SIZE - 4)) {
+			break;
+		}
+
+		if (contents->entriesCount == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			WriterPendingCommit *entries = realloc(contents->entries, capacity * sizeof(WriterPendingCommit));
+			if (entries == NULL) {
+				journalFreeContents(contents);
+				close(fd);
+				return -1;
+			}
+			contents->entries = entries;
+		}
+
+		WriterPendingCommit *commit = &contents->entries[contents->entriesCount++];
+		commit->index = get64(entry);
+		commit->offset = get64(entry + 8);
+		commit->length = get64(entry + 16);
+		memcpy(commit->digest, entry + 24, HASH_MAX_DIGEST_SIZE);
+		commit->extentHint = 0;
+		commit->leafDigests = NULL;
+		commit->leavesCount = 0;
+	}
+
+	close(fd);
+	return 0;
+}
+
+void journalFreeContents(JournalContents *contents) {
+	free(contents->entries);
+	contents->entries = NULL;
+	contents->entriesCount = 0;
+}
+
+Journal *journalCreate(char *filename, int hashId, uint64_t blockSize) {
+	Journal *journal = calloc(1, sizeof(Journal));
+	if (journal == NULL) {
+		return NULL;
+	}
+
+	journal->filename = filename;
+	journal->hashId = hashId;
+	journal->blockSize = blockSize;
+
+	journal->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (journal->fd == -1) {
+		free(journal);
+		return NULL;
+	}
+
+	return journal;
+}
+
+// Records that everything before resumeIndex is done and drops all entries.
+// Not durable until journalSync().
+int journalCheckpoint(Journal *journal, uint64_t resumeIndex) {
+	unsigned char header[JOURNAL_HEADER_SIZE];
+	memset(header, 0, sizeof(header));
+
+	memcpy(header, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE);
+	put32(header + 8, journal->hashId);
+	put64(header + 16, journal->blockSize);
+	put64(header + 24, resumeIndex);
+	put32(header + 40, crc32c(header, 40));
+
+	if (pwrite(journal->fd, header, JOURNAL_HEADER_SIZE, 0) != JOURNAL_HEADER_SIZE) {
+		return -1;
+	}
+
+	if (ftruncate(journal->fd, JOURNAL_HEADER_SIZE) == -1) {
+		return -1;
+	}
+
+	journal->size = JOURNAL_HEADER_SIZE;
+	return 0;
+}
+
+int journalAppend(Journal *journal, WriterPendingCommit *entries, size_t count) {
+	if (count == 0) {
+		return 0;
+	}
+
+	unsigned char *buffer = calloc(count, JOURNAL_ENTRY_SIZE);
+	if (buffer == NULL) {
+		return -1;
+	}
+
+	size_t i;
+	for (i = 0; i < count; i++) {
+		unsigned char *entry = buffer + i * JOURNAL_ENTRY_SIZE;
+		put64(entry, entries[i].index);
+		put64(entry + 8, entries[i].offset);
+		put64(entry + 16, entries[i].length);
+		memcpy(entry + 24, entries[i].digest, HASH_MAX_DIGEST_SIZE);
+		put32(entry + JOURNAL_ENTRY_SIZE - 4, crc32c(entry, JOURNAL_ENTRY_SIZE - 4));
+	}
+
+	ssize_t size = count * JOURNAL_ENTRY_SIZE;
+	ssize_t written = pwrite(journal->fd, buffer, size, journal->size);
+	free(buffer);
+
+	if (written != size) {
+		return -1;
+	}
+
+	journal->size += size;
+	return 0;
+}
+
+int journalSync(Journal *journal) {
+	return fsync(journal->fd);
+}
+
+// The run is complete: nothing to resume or verify any more.
+int journalRemove(Journal *journal) {
+	int result = close(journal->fd);
+
+	if (unlink(journal->filename) == -1) {
+		result = -1;
+	}
+
+	free(journal);
+	return result;
+}
+
+// Leaves the journal for the next run to recover from.
+int journalClose(Journal *journal) {
+	int result = close(journal->fd);
+	free(journal);
+	return result;
+}
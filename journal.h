@@ -0,0 +1,53 @@
+#ifndef BIGSYNC_JOURNAL_H
+#define BIGSYNC_JOURNAL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "hash.h"
+#include "writer.h"
+
+#define JOURNAL_MAGIC "BSJRNL\0\002"
+#define JOURNAL_MAGIC_SIZE 8
+#define JOURNAL_HEADER_SIZE 64
+#define JOURNAL_ENTRY_SIZE (8 + 8 + 8 + HASH_MAX_DIGEST_SIZE + 4)
+
+// Write-ahead journal kept next to the checksums file while a sync runs.
+//
+// The header says where to resume: every block before resumeIndex has been
+// written, synced and has its checksum stored. It is followed by one entry
+// per block that may have been written to the destination since then, each
+// synced to disk before the destination is touched. An entry or header that
+// fails its crc32c is a torn write and is ignored.
+//
+//   header: magic[8], hash uint32, reserved uint32, blockSize uint64,
+//           resumeIndex uint64, crc32c uint32 of the preceding 40 bytes
+//   entry:  index uint64, offset uint64, length uint64, digest[32],
+//           crc32c uint32 of the preceding 56 bytes
+
+typedef struct {
+	int fd;
+	char *filename;
+	int hashId;
+	uint64_t blockSize;
+	off_t size;
+} Journal;
+
+typedef struct {
+	int hashId;
+	uint64_t blockSize;
+	uint64_t resumeIndex;
+	WriterPendingCommit *entries;
+	size_t entriesCount;
+} JournalContents;
+
+int journalRead(char *filename, JournalContents *contents);
+void journalFreeContents(JournalContents *contents);
+
+Journal *journalCreate(char *filename, int hashId, uint64_t blockSize);
+int journalCheckpoint(Journal *journal, uint64_t resumeIndex);
+int journalAppend(Journal *journal, WriterPendingCommit *entries, size_t count);
+int journalSync(Journal *journal);
+int journalRemove(Journal *journal);
+int journalClose(Journal *journal);
+
+#endif
@@ -23,9 +23,20 @@
    documentation and/or software.
  */
 
+#include <string.h>
+#include <stdint.h>
 #include "md4_global.h"
 #include "md4.h"
 
+/* Derived from the RSA Data Security, Inc. MD4 Message-Digest Algorithm:
+   message words are loaded straight from the input and runs of whole
+   blocks are transformed without going through the context.
+
+   UINT4 is an unsigned long, so on 64-bit hosts the arithmetic, and the
+   state carried from block to block, is 64-bit: not standard MD4, but what
+   every md4 checksums file has been made with there. Keep it that way.
+ */
+
 /* Constants for MD4Transform routine.
  */
 #define S11 3
@@ -41,13 +52,9 @@
 #define S33 11
 #define S34 15
 
-static void MD4Transform PROTO_LIST ((UINT4 [4], unsigned char [64]));
+static void MD4Blocks (UINT4 [4], const unsigned char *, unsigned int);
 static void Encode PROTO_LIST
   ((unsigned char *, UINT4 *, unsigned int));
-static void Decode PROTO_LIST
-  ((UINT4 *, unsigned char *, unsigned int));
-static void MD4_memcpy PROTO_LIST ((POINTER, POINTER, unsigned int));
-static void MD4_memset PROTO_LIST ((POINTER, int, unsigned int));
 
 static unsigned char PADDING[64] = {
   0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
@@ -120,12 +127,16 @@ unsigned int inputLen;                     /* length of input block */
   /* Transform as many times as possible.
    */
   if (inputLen >= partLen) {
-    MD4_memcpy
-      ((POINTER)&context->buffer[index], (POINTER)input, partLen);
-    MD4Transform (context->state, context->buffer);
+    if (index) {
+      memcpy (&context->buffer[index], input, partLen);
+      MD4Blocks (context->state, context->buffer, 1);
+      i = partLen;
+    }
+    else
+      i = 0;
 
-    for (i = partLen; i + 63 < inputLen; i += 64)
-      MD4Transform (context->state, &input[i]);
+    MD4Blocks (context->state, &input[i], (inputLen - i) / 64);
+    i += (inputLen - i) & ~63U;
 
     index = 0;
   }
@@ -133,9 +144,7 @@ unsigned int inputLen;                     /* length of input block */
     i = 0;
 
   /* Buffer remaining input */
-  MD4_memcpy
-    ((POINTER)&context->buffer[index], (POINTER)&input[i],
-     inputLen-i);
+  memcpy (&context->buffer[index], &input[i], inputLen-i);
 }
 
 /* MD4 finalization. Ends an MD4 message-digest operation, writing the
@@ -164,82 +173,102 @@ MD4_CTX *context;                                        /* context */
 
   /* Zeroize sensitive information.
    */
-  MD4_memset ((POINTER)context, 0, sizeof (*context));
+  memset (context, 0, sizeof (*context));
 
 }
 
-/* MD4 basic transformation. Transforms state based on block.
+/* Loads the little-endian message word at p.
  */
-static void MD4Transform (state, block)
-UINT4 state[4];
-unsigned char block[64];
+static inline UINT4 Load (const unsigned char *p)
 {
-  UINT4 a = state[0], b = state[1], c = state[2], d = state[3], x[16];
-
-  Decode (x, block, 64);
-
-  /* Round 1 */
-  FF (a, b, c, d, x[ 0], S11); /* 1 */
-  FF (d, a, b, c, x[ 1], S12); /* 2 */
-  FF (c, d, a, b, x[ 2], S13); /* 3 */
-  FF (b, c, d, a, x[ 3], S14); /* 4 */
-  FF (a, b, c, d, x[ 4], S11); /* 5 */
-  FF (d, a, b, c, x[ 5], S12); /* 6 */
-  FF (c, d, a, b, x[ 6], S13); /* 7 */
-  FF (b, c, d, a, x[ 7], S14); /* 8 */
-  FF (a, b, c, d, x[ 8], S11); /* 9 */
-  FF (d, a, b, c, x[ 9], S12); /* 10 */
-  FF (c, d, a, b, x[10], S13); /* 11 */
-  FF (b, c, d, a, x[11], S14); /* 12 */
-  FF (a, b, c, d, x[12], S11); /* 13 */
-  FF (d, a, b, c, x[13], S12); /* 14 */
-  FF (c, d, a, b, x[14], S13); /* 15 */
-  FF (b, c, d, a, x[15], S14); /* 16 */
-
-  /* Round 2 */
-  GG (a, b, c, d, x[ 0], S21); /* 17 */
-  GG (d, a, b, c, x[ 4], S22); /* 18 */
-  GG (c, d, a, b, x[ 8], S23); /* 19 */
-  GG (b, c, d, a, x[12], S24); /* 20 */
-  GG (a, b, c, d, x[ 1], S21); /* 21 */
-  GG (d, a, b, c, x[ 5], S22); /* 22 */
-  GG (c, d, a, b, x[ 9], S23); /* 23 */
-  GG (b, c, d, a, x[13], S24); /* 24 */
-  GG (a, b, c, d, x[ 2], S21); /* 25 */
-  GG (d, a, b, c, x[ 6], S22); /* 26 */
-  GG (c, d, a, b, x[10], S23); /* 27 */
-  GG (b, c, d, a, x[14], S24); /* 28 */
-  GG (a, b, c, d, x[ 3], S21); /* 29 */
-  GG (d, a, b, c, x[ 7], S22); /* 30 */
-  GG (c, d, a, b, x[11], S23); /* 31 */
-  GG (b, c, d, a, x[15], S24); /* 32 */
-
-  /* Round 3 */
-  HH (a, b, c, d, x[ 0], S31); /* 33 */
-  HH (d, a, b, c, x[ 8], S32); /* 34 */
-  HH (c, d, a, b, x[ 4], S33); /* 35 */
-  HH (b, c, d, a, x[12], S34); /* 36 */
-  HH (a, b, c, d, x[ 2], S31); /* 37 */
-  HH (d, a, b, c, x[10], S32); /* 38 */
-  HH (c, d, a, b, x[ 6], S33); /* 39 */
-  HH (b, c, d, a, x[14], S34); /* 40 */
-  HH (a, b, c, d, x[ 1], S31); /* 41 */
-  HH (d, a, b, c, x[ 9], S32); /* 42 */
-  HH (c, d, a, b, x[ 5], S33); /* 43 */
-  HH (b, c, d, a, x[13], S34); /* 44 */
-  HH (a, b, c, d, x[ 3], S31); /* 45 */
-  HH (d, a, b, c, x[11], S32); /* 46 */
-  HH (c, d, a, b, x[ 7], S33); /* 47 */
-  HH (b, c, d, a, x[15], S34); /* 48 */
-
-  state[0] += a;
-  state[1] += b;
-  state[2] += c;
-  state[3] += d;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  uint32_t word;
+
+  memcpy (&word, p, 4);
+  return word;
+#else
+  return ((UINT4)p[0]) | (((UINT4)p[1]) << 8) |
+    (((UINT4)p[2]) << 16) | (((UINT4)p[3]) << 24);
+#endif
+}
 
-  /* Zeroize sensitive information.
-   */
-  MD4_memset ((POINTER)x, 0, sizeof (x));
+/* MD4 basic transformation. Transforms state based on count blocks.
+ */
+static void MD4Blocks (UINT4 state[4], const unsigned char *block, unsigned int count)
+{
+  UINT4 a, b, c, d;
+  UINT4 x0, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13, x14, x15;
+
+  for (; count > 0; count--, block += 64) {
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+
+    x0 = Load (block); x1 = Load (block + 4); x2 = Load (block + 8); x3 = Load (block + 12);
+    x4 = Load (block + 16); x5 = Load (block + 20); x6 = Load (block + 24); x7 = Load (block + 28);
+    x8 = Load (block + 32); x9 = Load (block + 36); x10 = Load (block + 40); x11 = Load (block + 44);
+    x12 = Load (block + 48); x13 = Load (block + 52); x14 = Load (block + 56); x15 = Load (block + 60);
+
+    /* Round 1 */
+    FF (a, b, c, d, x0, S11); /* 1 */
+    FF (d, a, b, c, x1, S12); /* 2 */
+    FF (c, d, a, b, x2, S13); /* 3 */
+    FF (b, c, d, a, x3, S14); /* 4 */
+    FF (a, b, c, d, x4, S11); /* 5 */
+    FF (d, a, b, c, x5, S12); /* 6 */
+    FF (c, d, a, b, x6, S13); /* 7 */
+    FF (b, c, d, a, x7, S14); /* 8 */
+    FF (a, b, c, d, x8, S11); /* 9 */
+    FF (d, a, b, c, x9, S12); /* 10 */
+    FF (c, d, a, b, x10, S13); /* 11 */
+    FF (b, c, d, a, x11, S14); /* 12 */
+    FF (a, b, c, d, x12, S11); /* 13 */
+    FF (d, a, b, c, x13, S12); /* 14 */
+    FF (c, d, a, b, x14, S13); /* 15 */
+    FF (b, c, d, a, x15, S14); /* 16 */
+
+    /* Round 2 */
+    GG (a, b, c, d, x0, S21); /* 17 */
+    GG (d, a, b, c, x4, S22); /* 18 */
+    GG (c, d, a, b, x8, S23); /* 19 */
+    GG (b, c, d, a, x12, S24); /* 20 */
+    GG (a, b, c, d, x1, S21); /* 21 */
+    GG (d, a, b, c, x5, S22); /* 22 */
+    GG (c, d, a, b, x9, S23); /* 23 */
+    GG (b, c, d, a, x13, S24); /* 24 */
+    GG (a, b, c, d, x2, S21); /* 25 */
+    GG (d, a, b, c, x6, S22); /* 26 */
+    GG (c, d, a, b, x10, S23); /* 27 */
+    GG (b, c, d, a, x14, S24); /* 28 */
+    GG (a, b, c, d, x3, S21); /* 29 */
+    GG (d, a, b, c, x7, S22); /* 30 */
+    GG (c, d, a, b, x11, S23); /* 31 */
+    GG (b, c, d, a, x15, S24); /* 32 */
+
+    /* Round 3 */
+    HH (a, b, c, d, x0, S31); /* 33 */
+    HH (d, a, b, c, x8, S32); /* 34 */
+    HH (c, d, a, b, x4, S33); /* 35 */
+    HH (b, c, d, a, x12, S34); /* 36 */
+    HH (a, b, c, d, x2, S31); /* 37 */
+    HH (d, a, b, c, x10, S32); /* 38 */
+    HH (c, d, a, b, x6, S33); /* 39 */
+    HH (b, c, d, a, x14, S34); /* 40 */
+    HH (a, b, c, d, x1, S31); /* 41 */
+    HH (d, a, b, c, x9, S32); /* 42 */
+    HH (c, d, a, b, x5, S33); /* 43 */
+    HH (b, c, d, a, x13, S34); /* 44 */
+    HH (a, b, c, d, x3, S31); /* 45 */
+    HH (d, a, b, c, x11, S32); /* 46 */
+    HH (c, d, a, b, x7, S33); /* 47 */
+    HH (b, c, d, a, x15, S34); /* 48 */
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+  }
 }
 
 /* Encodes input (UINT4) into output (unsigned char). Assumes len is
@@ -259,47 +288,3 @@ unsigned int len;
     output[j+3] = (unsigned char)((input[i] >> 24) & 0xff);
   }
 }
-
-/* Decodes input (unsigned char) into output (UINT4). Assumes len is
-     a multiple of 4.
-
- */
-static void Decode (output, input, len)
-
-UINT4 *output;
-unsigned char *input;
-unsigned int len;
-{
-  unsigned int i, j;
-
-  for (i = 0, j = 0; j < len; i++, j += 4)
-    output[i] = ((UINT4)input[j]) | (((UINT4)input[j+1]) << 8) |
-      (((UINT4)input[j+2]) << 16) | (((UINT4)input[j+3]) << 24);
-}
-
-/* Note: Replace "for loop" with standard memcpy if possible.
- */
-static void MD4_memcpy (output, input, len)
-POINTER output;
-POINTER input;
-unsigned int len;
-{
-  unsigned int i;
-
-  for (i = 0; i < len; i++)
-    output[i] = input[i];
-}
-
-/* Note: Replace "for loop" with standard memset if possible.
- */
-static void MD4_memset (output, value, len)
-POINTER output;
-int value;
-unsigned int len;
-{
-  unsigned int i;
-
-  for (i = 0; i < len; i++)
-    ((char *)output)[i] = (char)value;
-}
-
@@ -0,0 +1,346 @@
+// Multi-buffer md4, with AVX2 and AVX-512 versions picked on first use.
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "md4_global.h"
+#include "md4.h"
+#include "md4lanes.h"
+
+#if defined(__x86_64__) && defined(__LP64__) && defined(__GNUC__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// state word by word, lane by lane
+typedef uint64_t Md4LanesState[4][MD4_LANES_MAX];
+
+typedef void (*Md4LanesFunction)(Md4LanesState state, const unsigned char **inputs, size_t blocksCount);
+
+static Md4LanesFunction md4LanesFunction;
+static int md4LanesWidth;
+static pthread_once_t md4LanesOnce = PTHREAD_ONCE_INIT;
+
+#ifdef HAVE_X86_SIMD
+
+// The rounds of md4.c, for a vector type: ADD, AND, OR, XOR, F, G, SHL and
+// SHR are defined by each kernel. The rotation shifts 64-bit lanes as
+// md4.c does 64-bit words, bits past 32 included.
+#define LANES_STEP(a, f, b, c, d, x, k, s) { \
+		a = ADD(a, ADD(f(b, c, d), ADD(x, k))); \
+		a = OR(SHL(a, s), SHR(a, 32 - (s))); \
+	}
+
+#define LANES_ROUNDS(a, b, c, d, x, zero, k2, k3) { \
+		LANES_STEP(a, F, b, c, d, x[0], zero, 3); \
+		LANES_STEP(d, F, a, b, c, x[1], zero, 7); \
+		LANES_STEP(c, F, d, a, b, x[2], zero, 11); \
+		LANES_STEP(b, F, c, d, a, x[3], zero, 19); \
+		LANES_STEP(a, F, b, c, d, x[4], zero, 3); \
+		LANES_STEP(d, F, a, b, c, x[5], zero, 7); \
+		LANES_STEP(c, F, d, a, b, x[6], zero, 11); \
+		LANES_STEP(b, F, c, d, a, x[7], zero, 19); \
+		LANES_STEP(a, F, b, c, d, x[8], zero, 3); \
+		LANES_STEP(d, F, a, b, c, x[9], zero, 7); \
+		LANES_STEP(c, F, d, a, b, x[10], zero, 11); \
+		LANES_STEP(b, F, c, d, a, x[11], zero, 19); \
+		LANES_STEP(a, F, b, c, d, x[12], zero, 3); \
+		LANES_STEP(d, F, a, b, c, x[13], zero, 7); \
+		LANES_STEP(c, F, d, a, b, x[14], zero, 11); \
+		LANES_STEP(b, F, c, d, a, x[15], zero, 19); \
+		\
+		LANES_STEP(a, G, b, c, d, x[0], k2, 3); \
+		LANES_STEP(d, G, a, b, c, x[4], k2, 5); \
+		LANES_STEP(c, G, d, a, b, x[8], k2, 9); \
+		LANES_STEP(b, G, c, d, a, x[12], k2, 13); \
+		LANES_STEP(a, G, b, c, d, x[1], k2, 3); \
+		LANES_STEP(d, G, a, b, c, x[5], k2, 5); \
+		LANES_STEP(c, G, d, a, b, x[9], k2, 9); \
+		LANES_STEP(b, G, c, d, a, x[13], k2, 13); \
+		LANES_STEP(a, G, b, c, d, x[2], k2, 3); \
+		LANES_STEP(d, G, a, b, c, x[6], k2, 5); \
+		LANES_STEP(c, G, d, a, b, x[10], k2, 9); \
+		LANES_STEP(b, G, c, d, a, x[14], k2, 13); \
+		LANES_STEP(a, G, b, c, d, x[3], k2, 3); \
+		LANES_STEP(d, G, a, b, c, x[7], k2, 5); \
+		LANES_STEP(c, G, d, a, b, x[11], k2, 9); \
+		LANES_STEP(b, G, c, d, a, x[15], k2, 13); \
+		\
+		LANES_STEP(a, H, b, c, d, x[0], k3, 3); \
+		LANES_STEP(d, H, a, b, c, x[8], k3, 9); \
+		LANES_STEP(c, H, d, a, b, x[4], k3, 11); \
+		LANES_STEP(b, H, c, d, a, x[12], k3, 15); \
+		LANES_STEP(a, H, b, c, d, x[2], k3, 3); \
+		LANES_STEP(d, H, a, b, c, x[10], k3, 9); \
+		LANES_STEP(c, H, d, a, b, x[6], k3, 11); \
+		LANES_STEP(b, H, c, d, a, x[14], k3, 15); \
+		LANES_STEP(a, H, b, c, d, x[1], k3, 3); \
+		LANES_STEP(d, H, a, b, c, x[9], k3, 9); \
+		LANES_STEP(c, H, d, a, b, x[5], k3, 11); \
+		LANES_STEP(b, H, c, d, a, x[13], k3, 15); \
+		LANES_STEP(a, H, b, c, d, x[3], k3, 3); \
+		LANES_STEP(d, H, a, b, c, x[11], k3, 9); \
+		LANES_STEP(c, H, d, a, b, x[7], k3, 11); \
+		LANES_STEP(b, H, c, d, a, x[15], k3, 15); \
+	}
+
+// Words 4 * j to 4 * j + 3 of four inputs, transposed so that each vector
+// holds one word of every input.
+__attribute__((target("sse2")))
+static void loadWords(const unsigned char **inputs, size_t offset, __m128i *words) {
+	__m128i r0 = _mm_loadu_si128((const __m128i *) (inputs[0] + offset));
+	__m128i r1 = _mm_loadu_si128((const __m128i *) (inputs[1] + offset));
+	__m128i r2 = _mm_loadu_si128((const __m128i *) (inputs[2] + offset));
+	__m128i r3 = _mm_loadu_si128((const __m128i *) (inputs[3] + offset));
+
+	__m128i t0 = _mm_unpacklo_epi32(r0, r1);
+	__m128i t1 = _mm_unpacklo_epi32(r2, r3);
+	__m128i t2 = _mm_unpackhi_epi32(r0, r1);
+	__m128i t3 = _mm_unpackhi_epi32(r2, r3);
+
+	words[0] = _mm_unpacklo_epi64(t0, t1);
+	words[1] = _mm_unpackhi_epi64(t0, t1);
+	words[2] = _mm_unpacklo_epi64(t2, t3);
+	words[3] = _mm_unpackhi_epi64(t2, t3);
+}
+
+#define ADD(x, y) _mm256_add_epi64(x, y)
+#define OR(x, y) _mm256_or_si256(x, y)
+#define SHL(x, s) _mm256_slli_epi64(x, s)
+#define SHR(x, s) _mm256_srli_epi64(x, s)
+#define F(x, y, z) _mm256_or_si256(_mm256_and_si256(x, y), _mm256_andnot_si256(x, z))
+#define G(x, y, z) _mm256_or_si256(_mm256_and_si256(x, _mm256_or_si256(y, z)), _mm256_and_si256(y, z))
+#define H(x, y, z) _mm256_xor_si256(_mm256_xor_si256(x, y), z)
+
+__attribute__((target("avx2")))
+static void md4LanesAvx2(Md4LanesState state, const unsigned char **inputs, size_t blocksCount) {
+	__m256i a = _mm256_loadu_si256((const __m256i *) state[0]);
+	__m256i b = _mm256_loadu_si256((const __m256i *) state[1]);
+	__m256i c = _mm256_loadu_si256((const __m256i *) state[2]);
+	__m256i d = _mm256_loadu_si256((const __m256i *) state[3]);
+	__m256i zero = _mm256_setzero_si256();
+	__m256i k2 = _mm256_set1_epi64x(0x5a827999);
+	__m256i k3 = _mm256_set1_epi64x(0x6ed9eba1);
+
+	size_t offset;
+	for (offset = 0; offset < blocksCount * 64; offset += 64) {
+		__m256i x[16];
+		int j;
+		for (j = 0; j < 4; j++) {
+			__m128i words[4];
+			loadWords(inputs, offset + 16 * j, words);
+			x[4 * j] = _mm256_cvtepu32_epi64(words[0]);
+			x[4 * j + 1] = _mm256_cvtepu32_epi64(words[1]);
+			x[4 * j + 2] = _mm256_cvtepu32_epi64(words[2]);
+			x[4 * j + 3] = _mm256_cvtepu32_epi64(words[3]);
+		}
+
+		__m256i aa = a, bb = b, cc = c, dd = d;
+		LANES_ROUNDS(a, b, c, d, x, zero, k2, k3);
+		a = ADD(a, aa);
+		b = ADD(b, bb);
+		c = ADD(c, cc);
+		d = ADD(d, dd);
+	}
+
+	_mm256_storeu_si256((__m256i *) state[0], a);
+	_mm256_storeu_si256((__m256i *) state[1], b);
+	_mm256_storeu_si256((__m256i *) state[2], c);
+	_mm256_storeu_si256((__m256i *) state[3], d);
+}
+
+#undef ADD
+#undef OR
+#undef SHL
+#undef SHR
+#undef F
+#undef G
+#undef H
+
+#define ADD(x, y) _mm512_add_epi64(x, y)
+#define OR(x, y) _mm512_or_si512(x, y)
+#define SHL(x, s) _mm512_slli_epi64(x, s)
+#define SHR(x, s) _mm512_srli_epi64(x, s)
+#define F(x, y, z) _mm512_ternarylogic_epi64(x, y, z, 0xca)
+#define G(x, y, z) _mm512_ternarylogic_epi64(x, y, z, 0xe8)
+#define H(x, y, z) _mm512_ternarylogic_epi64(x, y, z, 0x96)
+
+__attribute__((target("avx512f")))
+static void md4LanesAvx512(Md4LanesState state, const unsigned char **inputs, size_t blocksCount) {
+	__m512i a = _mm512_loadu_si512(state[0]);
+	__m512i b = _mm512_loadu_si512(state[1]);
+	__m512i c = _mm512_loadu_si512(state[2]);
+	__m512i d = _mm512_loadu_si512(state[3]);
+	__m512i zero = _mm512_setzero_si512();
+	__m512i k2 = _mm512_set1_epi64(0x5a827999);
+	__m512i k3 = _mm512_set1_epi64(0x6ed9eba1);
+
+	size_t offset;
+	for (offset = 0; offset < blocksCount * 64; offset += 64) {
+		__m512i x[16];
+		int j;
+		for (j = 0; j < 4; j++) {
+			__m128i low[4], high[4];
+			loadWords(inputs, offset + 16 * j, low);
+			loadWords(inputs + 4, offset + 16 * j, high);
+
+			int k;
+			for (k = 0; k < 4; k++) {
+				x[4 * j + k] = _mm512_cvtepu32_epi64(_mm256_set_m128i(high[k], low[k]));
+			}
+		}
+
+		__m512i aa = a, bb = b, cc = c, dd = d;
+		LANES_ROUNDS(a, b, c, d, x, zero, k2, k3);
+		a = ADD(a, aa);
+		b = ADD(b, bb);
+		c = ADD(c, cc);
+		d = ADD(d, dd);
+	}
+
+	_mm512_storeu_si512(state[0], a);
+	_mm512_storeu_si512(state[1], b);
+	_mm512_storeu_si512(state[2], c);
+	_mm512_storeu_si512(state[3], d);
+}
+
+#undef ADD
+#undef OR
+#undef SHL
+#undef SHR
+#undef F
+#undef G
+#undef H
+
+#endif
+
+static void md4LanesPickFunction() {
+	md4LanesFunction = NULL;
+	md4LanesWidth = 1;
+
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		md4LanesFunction = md4LanesAvx512;
+		md4LanesWidth = 8;
+	} else if (__builtin_cpu_supports("avx2")) {
+		md4LanesFunction = md4LanesAvx2;
+		md4LanesWidth = 4;
+	}
+#endif
+}
+
+int md4LanesUse(int kernel) {
+	pthread_once(&md4LanesOnce, md4LanesPickFunction);
+
+	switch (kernel) {
+		case MD4_LANES_SCALAR:
+			md4LanesFunction = NULL;
+			md4LanesWidth = 1;
+			return 0;
+
+#ifdef HAVE_X86_SIMD
+		case MD4_LANES_AVX2:
+			if (__builtin_cpu_supports("avx2")) {
+				md4LanesFunction = md4LanesAvx2;
+				md4LanesWidth = 4;
+				return 0;
+			}
+			break;
+
+		case MD4_LANES_AVX512:
+			if (__builtin_cpu_supports("avx512f")) {
+				md4LanesFunction = md4LanesAvx512;
+				md4LanesWidth = 8;
+				return 0;
+			}
+			break;
+#endif
+	}
+
+	return -1;
+}
+
+static void md4One(const unsigned char *input, size_t length, unsigned char *digest) {
+	MD4_CTX context;
+
+	MD4Init(&context);
+	MD4Update(&context, (unsigned char *) input, (unsigned int) length);
+	MD4Final(digest, &context);
+}
+
+// Hashes inputs[0] to inputs[width - 1]; the first count of them are real.
+static void md4LanesGroup(const unsigned char **inputs, size_t length, int count, int width, unsigned char *digests) {
+	Md4LanesState state;
+	int lane;
+	for (lane = 0; lane < width; lane++) {
+		state[0][lane] = 0x67452301;
+		state[1][lane] = 0xefcdab89;
+		state[2][lane] = 0x98badcfe;
+		state[3][lane] = 0x10325476;
+	}
+
+	md4LanesFunction(state, inputs, length / 64);
+
+	// The padding and length, as MD4Final() adds them after a single
+	// MD4Update(): the bit count is two words of which only the low 32 bits
+	// are kept.
+	unsigned char tails[MD4_LANES_MAX][128];
+	const unsigned char *tailInputs[MD4_LANES_MAX];
+	size_t tailLength = length % 64;
+	size_t paddedLength = tailLength < 56 ? 64 : 128;
+	uint64_t bits = (uint64_t) length << 3;
+	uint64_t highBits = length >> 29;
+
+	for (lane = 0; lane < width; lane++) {
+		unsigned char *tail = tails[lane];
+		memcpy(tail, inputs[lane] + length - tailLength, tailLength);
+		memset(tail + tailLength, 0, paddedLength - tailLength);
+		tail[tailLength] = 0x80;
+
+		int i;
+		for (i = 0; i < 4; i++) {
+			tail[paddedLength - 8 + i] = (unsigned char) (bits >> (8 * i));
+			tail[paddedLength - 4 + i] = (unsigned char) (highBits >> (8 * i));
+		}
+		tailInputs[lane] = tail;
+	}
+
+	md4LanesFunction(state, tailInputs, paddedLength / 64);
+
+	for (lane = 0; lane < count; lane++) {
+		int word;
+		for (word = 0; word < 4; word++) {
+			int i;
+			for (i = 0; i < 4; i++) {
+				digests[lane * 16 + word * 4 + i] = (unsigned char) (state[word][lane] >> (8 * i));
+			}
+		}
+	}
+}
+
+void md4Lanes(const unsigned char **inputs, size_t length, int count, unsigned char *digests) {
+	pthread_once(&md4LanesOnce, md4LanesPickFunction);
+
+	int done = 0;
+	if (md4LanesFunction && length < MD4_LANES_MAX_LENGTH) {
+		int width = md4LanesWidth;
+
+		// the lanes of a last, short group repeat its first input
+		while (count - done > 1) {
+			const unsigned char *group[MD4_LANES_MAX];
+			int groupCount = count - done < width ? count - done : width;
+			int lane;
+			for (lane = 0; lane < width; lane++) {
+				group[lane] = inputs[done + (lane < groupCount ? lane : 0)];
+			}
+
+			md4LanesGroup(group, length, groupCount, width, digests + done * 16);
+			done += groupCount;
+		}
+	}
+
+	for (; done < count; done++) {
+		md4One(inputs[done], length, digests + done * 16);
+	}
+}
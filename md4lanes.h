@@ -0,0 +1,26 @@
+#ifndef BIGSYNC_MD4LANES_H
+#define BIGSYNC_MD4LANES_H
+
+#include <stddef.h>
+
+#define MD4_LANES_SCALAR 0
+#define MD4_LANES_AVX2 1
+#define MD4_LANES_AVX512 2
+
+// The most inputs a kernel hashes at once.
+#define MD4_LANES_MAX 8
+
+// Longer inputs would be split by hashUpdate(), which changes their digest.
+#define MD4_LANES_MAX_LENGTH 0x40000000
+
+// md4 of several inputs of the same length at once, each in a lane of a
+// vector register, digests stored 16 bytes apart. The digests are the ones
+// MD4Init(), MD4Update() and MD4Final() make: 64-bit words on 64-bit hosts
+// (see md4.c), so lanes are 64-bit, 4 of them with AVX2 and 8 with AVX-512.
+void md4Lanes(const unsigned char **inputs, size_t length, int count, unsigned char *digests);
+
+// For tests and benchmarks: use this kernel rather than the fastest one, or
+// -1 if the CPU doesn't have it.
+int md4LanesUse(int kernel);
+
+#endif
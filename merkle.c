@@ -0,0 +1,306 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include "merkle.h"
+#include "util.h"
+
+// Works out where the levels go for tree->blocksCount blocks; returns the
+// size of the file.
+static size_t layOut(MerkleTree *tree) {
+	size_t offset = MERKLE_HEADER_SIZE;
+	uint64_t count = tree->blocksCount;
+
+	tree->levelsCount = 0;
+	while (count > 0) {
+		tree->levelCounts[tree->levelsCount] = count;
+		tree->levelOffsets[tree->levelsCount] = offset;
+		tree->levelsCount++;
+		offset += count * tree->hashAlgorithm->digestSize;
+
+		if (count == 1) {
+			break;
+		}
+		count = (count + 1) / 2;
+	}
+
+	return offset;
+}
+
+static unsigned char *nodeAt(MerkleTree *tree, int level, uint64_t index) {
+	return tree->map + tree->levelOffsets[level] + index * tree->hashAlgorithm->digestSize;
+}
+
+// Children of a node sit next to each other, so they are hashed in one go.
+static void computeNode(MerkleTree *tree, int level, uint64_t index, unsigned char *digest) {
+	int digestSize = tree->hashAlgorithm->digestSize;
+	unsigned char *children = nodeAt(tree, level - 1, index * 2);
+
+	if (index * 2 + 1 >= tree->levelCounts[level - 1]) {
+		memcpy(digest, children, digestSize);
+		return;
+	}
+
+	hashBuffer(tree->hashAlgorithm, children, digestSize * 2, digest);
+}
+
+static void computeRoot(MerkleTree *tree, unsigned char *digest) {
+	unsigned char top[HASH_MAX_DIGEST_SIZE];
+	unsigned char sizes[16];
+
+	if (tree->levelsCount > 0) {
+		memcpy(top, nodeAt(tree, tree->levelsCount - 1, 0), tree->hashAlgorithm->digestSize);
+	} else {
+		hashBuffer(tree->hashAlgorithm, (const unsigned char *) "", 0, top);
+	}
+	put64(sizes, tree->blockSize);
+	put64(sizes + 8, tree->sourceSize);
+
+	HashContext context;
+	hashInit(&context, tree->hashAlgorithm);
+	hashUpdate(&context, top, tree->hashAlgorithm->digestSize);
+	hashUpdate(&context, sizes, sizeof(sizes));
+	hashFinal(&context, digest);
+}
+
+static void writeHeader(MerkleTree *tree, int isDirty) {
+	unsigned char *header = tree->map;
+
+	memcpy(header, MERKLE_MAGIC, MERKLE_MAGIC_SIZE);
+	put32(header + 8, tree->hashAlgorithm->id);
+	put32(header + 12, isDirty);
+	put64(header + 16, tree->blockSize);
+	put64(header + 24, tree->sourceSize);
+	put64(header + 32, tree->blocksCount);
+}
+
+// An existing tree of the same shape that was completely written only needs
+// the paths above the blocks that changed.
+static int canUpdateInPlace(MerkleTree *tree, size_t fileSize) {
+	unsigned char header[40];
+	struct stat fileStat;
+
+	if (pread(tree->fd, header, sizeof(header), 0) != sizeof(header) || fstat(tree->fd, &fileStat) == -1) {
+		return 0;
+	}
+
+	return memcmp(header, MERKLE_MAGIC, MERKLE_MAGIC_SIZE) == 0 &&
+		(int) get32(header + 8) == tree->hashAlgorithm->id &&
+		get32(header + 12) == 0 &&
+		get64(header + 16) == tree->blockSize &&
+		get64(header + 32) == tree->blocksCount &&
+		(size_t) fileStat.st_size == fileSize;
+}
+
+// Brings the tree in line with the first blocksCount digests of the checksums
+// file and copies out its new root. The tree is marked dirty on disk while its
+// nodes change, so a crash midway means a full rebuild next time rather than
+// a wrong root.
+int merkleUpdate(char *filename, Checksums *checksums, uint64_t blocksCount, uint64_t sourceSize, unsigned char *root) {
+	MerkleTree tree;
+	memset(&tree, 0, sizeof(MerkleTree));
+	tree.hashAlgorithm = checksums->hashAlgorithm;
+	tree.blockSize = checksums->blockSize;
+	tree.blocksCount = blocksCount;
+	tree.sourceSize = sourceSize;
+
+	int digestSize = tree.hashAlgorithm->digestSize;
+	uint64_t *changed = NULL;
+	uint64_t changedCount = 0;
+	uint64_t changedCapacity = 0;
+	int result = -1;
+
+	tree.fd = open(filename, O_RDWR | O_CREAT, 0644);
+	if (tree.fd == -1) {
+		return -1;
+	}
+
+	size_t fileSize = layOut(&tree);
+	int isUpdate = canUpdateInPlace(&tree, fileSize);
+
+	if (!isUpdate && (ftruncate(tree.fd, 0) == -1 || ftruncate(tree.fd, fileSize) == -1)) {
+		goto done;
+	}
+
+	void *map = mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, tree.fd, 0);
+	if (map == MAP_FAILED) {
+		goto done;
+	}
+	tree.map = map;
+	tree.mapSize = fileSize;
+
+	writeHeader(&tree, 1);
+	if (msync(tree.map, MERKLE_HEADER_SIZE, MS_SYNC) == -1) {
+		goto done;
+	}
+
+	uint64_t i;
+	for (i = 0; i < blocksCount; i++) {
+		unsigned char *digest = checksumsGet(checksums, i);
+		if (isUpdate && memcmp(nodeAt(&tree, 0, i), digest, digestSize) == 0) {
+			continue;
+		}
+		memcpy(nodeAt(&tree, 0, i), digest, digestSize);
+
+		if (isUpdate) {
+			if (changedCount == changedCapacity) {
+				uint64_t capacity = changedCapacity ? changedCapacity * 2 : 1024;
+				uint64_t *grown = realloc(changed, capacity * sizeof(uint64_t));
+				if (grown == NULL) {
+					goto done;
+				}
+				changed = grown;
+				changedCapacity = capacity;
+			}
+			changed[changedCount++] = i;
+		}
+	}
+
+	int level;
+	for (level = 1; level < tree.levelsCount; level++) {
+		if (!isUpdate) {
+			for (i = 0; i < tree.levelCounts[level]; i++) {
+				computeNode(&tree, level, i, nodeAt(&tree, level, i));
+			}
+			continue;
+		}
+
+		// changed indices are in order, so siblings' parents are neighbours
+		uint64_t parentsCount = 0;
+		for (i = 0; i < changedCount; i++) {
+			uint64_t parent = changed[i] / 2;
+			if (parentsCount == 0 || changed[parentsCount - 1] != parent) {
+				changed[parentsCount++] = parent;
+				computeNode(&tree, level, parent, nodeAt(&tree, level, parent));
+			}
+		}
+		changedCount = parentsCount;
+	}
+
+	computeRoot(&tree, tree.map + 40);
+	memcpy(root, tree.map + 40, digestSize);
+
+	if (msync(tree.map, tree.mapSize, MS_SYNC) == -1) {
+		goto done;
+	}
+	writeHeader(&tree, 0);
+	if (msync(tree.map, MERKLE_HEADER_SIZE, MS_SYNC) == -1) {
+		goto done;
+	}
+
+	result = 0;
+
+done:
+	if (result == -1) {
+		int savedErrno = errno;
+		if (tree.map) {
+			munmap(tree.map, tree.mapSize);
+		}
+		close(tree.fd);
+		free(changed);
+		errno = savedErrno;
+		return -1;
+	}
+
+	munmap(tree.map, tree.mapSize);
+	free(changed);
+	return close(tree.fd);
+}
+
+// Opens a tree for reading. Returns NULL with errno EINVAL if it is broken
+// or was left half updated.
+MerkleTree *merkleOpen(char *filename) {
+	MerkleTree *tree = calloc(1, sizeof(MerkleTree));
+	if (tree == NULL) {
+		return NULL;
+	}
+
+	unsigned char header[40];
+	struct stat fileStat;
+
+	tree->fd = open(filename, O_RDONLY);
+	if (tree->fd == -1) {
+		free(tree);
+		return NULL;
+	}
+
+	if (pread(tree->fd, header, sizeof(header), 0) != sizeof(header) || fstat(tree->fd, &fileStat) == -1) {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	tree->hashAlgorithm = hashAlgorithmById(get32(header + 8));
+	tree->blockSize = get64(header + 16);
+	tree->sourceSize = get64(header + 24);
+	tree->blocksCount = get64(header + 32);
+
+	if (memcmp(header, MERKLE_MAGIC, MERKLE_MAGIC_SIZE) != 0 || tree->hashAlgorithm == NULL || get32(header + 12) != 0 ||
+		tree->blockSize == 0 || tree->blocksCount > (uint64_t) fileStat.st_size ||
+		(size_t) fileStat.st_size != layOut(tree)) {
+
+		errno = EINVAL;
+		goto fail;
+	}
+
+	void *map = mmap(NULL, fileStat.st_size, PROT_READ, MAP_SHARED, tree->fd, 0);
+	if (map == MAP_FAILED) {
+		goto fail;
+	}
+	tree->map = map;
+	tree->mapSize = fileStat.st_size;
+	return tree;
+
+fail:
+	close(tree->fd);
+	free(tree);
+	return NULL;
+}
+
+const unsigned char *merkleRoot(MerkleTree *tree) {
+	return tree->map + 40;
+}
+
+const unsigned char *merkleNode(MerkleTree *tree, int level, uint64_t index) {
+	if (level >= tree->levelsCount || index >= tree->levelCounts[level]) {
+		return NULL;
+	}
+	return nodeAt(tree, level, index);
+}
+
+// Checks that the stored block digests first to last hash up to the root,
+// touching only the nodes on their way up. Returns -1 if they don't.
+int merkleVerify(MerkleTree *tree, uint64_t first, uint64_t last) {
+	unsigned char digest[HASH_MAX_DIGEST_SIZE];
+	int digestSize = tree->hashAlgorithm->digestSize;
+
+	if (tree->blocksCount > 0 && last >= tree->blocksCount) {
+		last = tree->blocksCount - 1;
+	}
+
+	int level;
+	for (level = 1; level < tree->levelsCount && first <= last; level++) {
+		first /= 2;
+		last /= 2;
+
+		uint64_t i;
+		for (i = first; i <= last; i++) {
+			computeNode(tree, level, i, digest);
+			if (memcmp(digest, nodeAt(tree, level, i), digestSize) != 0) {
+				return -1;
+			}
+		}
+	}
+
+	computeRoot(tree, digest);
+	return memcmp(digest, merkleRoot(tree), digestSize) == 0 ? 0 : -1;
+}
+
+void merkleClose(MerkleTree *tree) {
+	munmap(tree->map, tree->mapSize);
+	close(tree->fd);
+	free(tree);
+}
@@ -0,0 +1,55 @@
+#ifndef BIGSYNC_MERKLE_H
+#define BIGSYNC_MERKLE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "hash.h"
+#include "checksums.h"
+
+#define MERKLE_MAGIC "BSMERKL\001"
+#define MERKLE_MAGIC_SIZE 8
+#define MERKLE_HEADER_SIZE 4096
+#define MERKLE_MAX_LEVELS 65
+
+// Merkle tree over the block digests of a checksums file, kept next to it
+// ("<checksums>.merkle"). Two copies are equal if their roots are, and a
+// range of blocks can be checked against the root without reading the rest.
+// All integers are little-endian.
+//
+//   0  magic        8 bytes
+//   8  hash         uint32, HASH_* id
+//  12  isDirty      uint32, set while nodes are being updated
+//  16  blockSize    uint64
+//  24  sourceSize   uint64
+//  32  blocksCount  uint64
+//  40  root         digest
+//
+// followed by the levels of the tree, starting with the block digests. Every
+// level has half as many nodes as the one below, rounded up, up to a single
+// top node. A node is the hash of its two children, or its only child as it
+// is. The root is the hash of the top node (the empty hash without blocks),
+// blockSize and sourceSize, so equal roots mean equal files.
+
+typedef struct {
+	int fd;
+	unsigned char *map;
+	size_t mapSize;
+
+	const HashAlgorithm *hashAlgorithm;
+	uint64_t blockSize;
+	uint64_t sourceSize;
+	uint64_t blocksCount;
+
+	int levelsCount;
+	uint64_t levelCounts[MERKLE_MAX_LEVELS];
+	size_t levelOffsets[MERKLE_MAX_LEVELS];
+} MerkleTree;
+
+int merkleUpdate(char *filename, Checksums *checksums, uint64_t blocksCount, uint64_t sourceSize, unsigned char *root);
+MerkleTree *merkleOpen(char *filename);
+const unsigned char *merkleRoot(MerkleTree *tree);
+const unsigned char *merkleNode(MerkleTree *tree, int level, uint64_t index);
+int merkleVerify(MerkleTree *tree, uint64_t first, uint64_t last);
+void merkleClose(MerkleTree *tree);
+
+#endif
@@ -0,0 +1,665 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "pipeline.h"
+
+// Three-stage block pipeline:
+//
+//   reader thread  -> fread()s the source into a ring of block buffers (or
+//                     pread()s it through O_DIRECT), or keeps queueDepth
+//                     reads in flight with io_uring;
+//   hashing pool   -> checksums every block as soon as it has been read;
+//   consumer       -> pipelineNextBlock() hands blocks out strictly in file
+//                     order, so the caller can compare and write them exactly
+//                     as the old single-threaded loop did.
+//
+// A block buffer is recycled only after the consumer releases it, so memory
+// use is bounded by blocksCount * blockSize. Reading may start at any block
+// (startIndex) to resume an interrupted run, and an optional read filter may
+// rule out reading (and hashing) blocks known to be holes or unchanged.
+
+#define BLOCK_FREE 0
+#define BLOCK_HASHING 1
+#define BLOCK_HASHED 2
+#define BLOCK_READING 3
+
+// io_uring reads a block in pieces of this size, so that a deep queue doesn't
+// need as many block buffers
+#define PIPELINE_URING_READ_SIZE (1024 * 1024)
+
+// block buffers are good for O_DIRECT
+#define PIPELINE_ALIGNMENT 4096
+
+typedef struct {
+	uint64_t submittedBytes;
+	uint64_t dataEnd;
+	int pendingReads;
+} PipelineBlockReads;
+
+typedef struct {
+	PipelineBlock *block; // NULL if the slot is free
+	int fd;
+	uint64_t position;
+	uint64_t length;
+	uint64_t submittedAt;
+} PipelineRead;
+
+struct Pipeline {
+	FILE *source;
+	off_t blockSize;
+	uint64_t startIndex;
+	Pool *pool;
+	PipelineHashFunction hashFunction;
+	void *hashContext;
+	PipelineReadFilter readFilter;
+	void *filterContext;
+
+	PipelineBlock *blocks;
+	int blocksCount;
+
+	int directFd;
+
+	Uring *uring;
+	int queueDepth;
+	PipelineRead *reads;
+	Throttle *throttle;
+	Stats *stats;
+	PipelineBlockReads *blockReads;
+
+	pthread_t reader;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+
+	uint64_t nextIndex;
+	uint64_t totalBlocks;
+	off_t totalBytesRead;
+	int isEOF;
+	int isStopping;
+	int readError;
+};
+
+static void pipelineHashTask(void *argument) {
+	PipelineBlock *block = (PipelineBlock *) argument;
+	Pipeline *pipeline = block->pipeline;
+
+	uint64_t startedAt = statsNow();
+	pipeline->hashFunction(block, pipeline->hashContext);
+	statsStage(pipeline->stats, STATS_HASH, startedAt);
+
+	pthread_mutex_lock(&pipeline->lock);
+	block->state = BLOCK_HASHED;
+	pthread_cond_broadcast(&pipeline->changed);
+	pthread_mutex_unlock(&pipeline->lock);
+}
+
+static void pipelineFinishReading(Pipeline *pipeline, uint64_t totalBlocks, int readError) {
+	pthread_mutex_lock(&pipeline->lock);
+	pipeline->isEOF = 1;
+	pipeline->totalBlocks = totalBlocks;
+	pipeline->readError = readError;
+	pthread_cond_broadcast(&pipeline->changed);
+	pthread_mutex_unlock(&pipeline->lock);
+}
+
+// The block has its data (or needs none): hash it, or pass it straight on.
+static void pipelineBlockRead(Pipeline *pipeline, PipelineBlock *block) {
+	if (block->readMode == PIPELINE_SKIP) {
+		pthread_mutex_lock(&pipeline->lock);
+		block->state = BLOCK_HASHED;
+		pthread_cond_broadcast(&pipeline->changed);
+		pthread_mutex_unlock(&pipeline->lock);
+		return;
+	}
+
+	pthread_mutex_lock(&pipeline->lock);
+	block->state = BLOCK_HASHING;
+	pthread_mutex_unlock(&pipeline->lock);
+
+	if (poolSubmit(pipeline->pool, pipelineHashTask, block) < 0) {
+		pipelineHashTask(block);
+	}
+}
+
+static int pipelineFilterBlock(Pipeline *pipeline, PipelineBlock *block, uint64_t index, off_t offset) {
+	block->index = index;
+	block->offset = offset;
+	block->extentHint = 0;
+	block->isZero = 0;
+	block->readMode = PIPELINE_READ;
+
+	if (pipeline->readFilter) {
+		block->readMode = pipeline->readFilter(pipeline->filterContext, index, offset, &block->extentHint);
+	}
+
+	if (block->readMode != PIPELINE_READ) {
+		block->readBytes = pipeline->blockSize;
+		if (block->readMode == PIPELINE_HOLE) {
+			memset(block->data, 0, block->readBytes);
+			block->isZero = 1;
+		}
+	}
+
+	return block->readMode;
+}
+
+// Reads as much of [offset, offset + length) as there is. O_DIRECT refuses
+// what isn't aligned, like the rest of the block after a short read; the
+// buffered descriptor takes over then.
+static ssize_t pipelineReadDirect(Pipeline *pipeline, char *data, size_t length, off_t offset) {
+	size_t done = 0;
+
+	while (done < length) {
+		ssize_t readBytes = pread(pipeline->directFd, data + done, length - done, offset + done);
+		if (readBytes < 0 && errno == EINVAL) {
+			readBytes = pread(fileno(pipeline->source), data + done, length - done, offset + done);
+		}
+
+		if (readBytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+
+		if (readBytes == 0) {
+			break;
+		}
+		done += readBytes;
+	}
+
+	return done;
+}
+
+static void *pipelineReader(void *argument) {
+	Pipeline *pipeline = (Pipeline *) argument;
+	int isSeekNeeded = pipeline->startIndex > 0;
+	uint64_t index;
+
+	for (index = pipeline->startIndex; ; index++) {
+		PipelineBlock *block = &pipeline->blocks[index % pipeline->blocksCount];
+
+		pthread_mutex_lock(&pipeline->lock);
+		while (block->state != BLOCK_FREE && !pipeline->isStopping) {
+			pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+		}
+		int isStopping = pipeline->isStopping;
+		pthread_mutex_unlock(&pipeline->lock);
+
+		if (isStopping) {
+			pipelineFinishReading(pipeline, index, 0);
+			return NULL;
+		}
+
+		uint64_t readBytes = pipeline->blockSize;
+		uint64_t startedAt = 0;
+		if (pipelineFilterBlock(pipeline, block, index, pipeline->totalBytesRead) == PIPELINE_READ) {
+			throttleRead(pipeline->throttle, pipeline->blockSize);
+			startedAt = statsNow();
+		}
+
+		if (block->readMode == PIPELINE_READ && pipeline->directFd >= 0) {
+			ssize_t directBytes = pipelineReadDirect(pipeline, block->data, pipeline->blockSize, pipeline->totalBytesRead);
+			if (directBytes <= 0) {
+				pipelineFinishReading(pipeline, index, directBytes < 0 ? errno : 0);
+				return NULL;
+			}
+
+			readBytes = block->readBytes = directBytes;
+
+		} else if (block->readMode == PIPELINE_READ) {
+			if (isSeekNeeded && fseeko(pipeline->source, pipeline->totalBytesRead, SEEK_SET) == -1) {
+				pipelineFinishReading(pipeline, index, errno);
+				return NULL;
+			}
+			isSeekNeeded = 0;
+
+			readBytes = fread(block->data, 1, pipeline->blockSize, pipeline->source);
+			if (ferror(pipeline->source)) {
+				pipelineFinishReading(pipeline, index, errno ? errno : EIO);
+				return NULL;
+			}
+
+			if (readBytes == 0) {
+				pipelineFinishReading(pipeline, index, 0);
+				return NULL;
+			}
+
+			block->readBytes = readBytes;
+
+		} else {
+			isSeekNeeded = 1;
+		}
+
+		if (block->readMode == PIPELINE_READ) {
+			statsStage(pipeline->stats, STATS_READ, startedAt);
+			statsRead(pipeline->stats, readBytes);
+		}
+		pipeline->totalBytesRead += readBytes;
+		pipelineBlockRead(pipeline, block);
+	}
+}
+
+static int pipelineFreeReadSlot(Pipeline *pipeline) {
+	int i;
+	for (i = 0; i < pipeline->queueDepth; i++) {
+		if (pipeline->reads[i].block == NULL) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+typedef struct {
+	uint64_t endIndex;
+	off_t endOffset;
+	int readError;
+	uint64_t lostIndex; // the first block that won't be passed on for an error
+} PipelineUringState;
+
+static void pipelineLoseBlock(PipelineUringState *state, PipelineBlock *block) {
+	if (block->index < state->lostIndex) {
+		state->lostIndex = block->index;
+	}
+}
+
+// The ring failed with reads in flight. The kernel may still be filling
+// their buffers, so there's no safe way to free them: they are leaked, and
+// their blocks stay as they are until the pipeline is destroyed.
+static void pipelineAbandonReads(Pipeline *pipeline, PipelineUringState *state) {
+	int i;
+	for (i = 0; i < pipeline->queueDepth; i++) {
+		PipelineBlock *block = pipeline->reads[i].block;
+		if (block) {
+			pipelineLoseBlock(state, block);
+			block->data = NULL;
+			pipeline->reads[i].block = NULL;
+		}
+	}
+}
+
+// All pieces of a block are back: pass it on, or drop it if it turned out
+// to be past the end of the file.
+static void pipelineUringBlockDone(Pipeline *pipeline, PipelineBlock *block, PipelineUringState *state) {
+	PipelineBlockReads *blockReads = &pipeline->blockReads[block - pipeline->blocks];
+
+	block->readBytes = blockReads->dataEnd;
+
+	if (block->readBytes < (uint64_t) pipeline->blockSize) {
+		uint64_t endIndex = block->readBytes ? block->index + 1 : block->index;
+		off_t endOffset = block->offset + block->readBytes;
+
+		// a short block and the empty one after it both say where the end is
+		if (endIndex < state->endIndex || (endIndex == state->endIndex && endOffset < state->endOffset)) {
+			state->endIndex = endIndex;
+			state->endOffset = endOffset;
+		}
+	}
+
+	if (state->readError || block->index >= state->endIndex) {
+		if (state->readError) {
+			pipelineLoseBlock(state, block);
+		}
+		pthread_mutex_lock(&pipeline->lock);
+		block->state = BLOCK_FREE;
+		pthread_cond_broadcast(&pipeline->changed);
+		pthread_mutex_unlock(&pipeline->lock);
+		return;
+	}
+
+	pipelineBlockRead(pipeline, block);
+}
+
+// Same as pipelineReader(), but with io_uring: blocks are read in pieces,
+// up to queueDepth of them at once, and each block is handed to the hashing
+// pool as soon as all of its pieces have arrived. The end of the file is the
+// first piece that reads nothing.
+static void *pipelineUringReader(void *argument) {
+	Pipeline *pipeline = (Pipeline *) argument;
+	int fd = pipeline->directFd >= 0 ? pipeline->directFd : fileno(pipeline->source);
+	uint64_t index = pipeline->startIndex;
+	off_t lastOffset = pipeline->totalBytesRead;
+	PipelineBlock *current = NULL;
+	int inFlight = 0;
+	int isStopping = 0;
+
+	PipelineUringState state;
+	state.endIndex = UINT64_MAX;
+	state.endOffset = 0;
+	state.readError = 0;
+	state.lostIndex = UINT64_MAX;
+
+	for (;;) {
+		while (!state.readError && !isStopping && inFlight < pipeline->queueDepth) {
+			if (current) {
+				PipelineBlockReads *blockReads = &pipeline->blockReads[current - pipeline->blocks];
+
+				// no point in reading the rest of a block past the end
+				if (blockReads->dataEnd < blockReads->submittedBytes || current->index >= state.endIndex) {
+					blockReads->submittedBytes = pipeline->blockSize;
+					if (blockReads->pendingReads == 0) {
+						pipelineUringBlockDone(pipeline, current, &state);
+					}
+					current = NULL;
+					continue;
+				}
+
+			} else {
+				if (index >= state.endIndex) {
+					break;
+				}
+
+				PipelineBlock *block = &pipeline->blocks[index % pipeline->blocksCount];
+
+				pthread_mutex_lock(&pipeline->lock);
+				int isFree = block->state == BLOCK_FREE;
+				isStopping = pipeline->isStopping;
+				pthread_mutex_unlock(&pipeline->lock);
+
+				if (!isFree || isStopping) {
+					break;
+				}
+
+				off_t offset = index * pipeline->blockSize;
+				index++;
+
+				if (pipelineFilterBlock(pipeline, block, index - 1, offset) != PIPELINE_READ) {
+					lastOffset = offset + pipeline->blockSize;
+					pipelineBlockRead(pipeline, block);
+					continue;
+				}
+
+				pthread_mutex_lock(&pipeline->lock);
+				block->state = BLOCK_READING;
+				pthread_mutex_unlock(&pipeline->lock);
+
+				PipelineBlockReads *blockReads = &pipeline->blockReads[block - pipeline->blocks];
+				blockReads->submittedBytes = 0;
+				blockReads->dataEnd = pipeline->blockSize;
+				blockReads->pendingReads = 0;
+				current = block;
+			}
+
+			PipelineBlockReads *blockReads = &pipeline->blockReads[current - pipeline->blocks];
+			PipelineRead *read = &pipeline->reads[pipelineFreeReadSlot(pipeline)];
+			read->block = current;
+			read->fd = fd;
+			read->position = blockReads->submittedBytes;
+			read->length = pipeline->blockSize - read->position;
+			if (read->length > PIPELINE_URING_READ_SIZE) {
+				read->length = PIPELINE_URING_READ_SIZE;
+			}
+			throttleRead(pipeline->throttle, read->length);
+			read->submittedAt = statsNow();
+
+			if (uringRead(pipeline->uring, read->fd, current->data + read->position, read->length,
+				current->offset + read->position, read - pipeline->reads) == -1) {
+
+				read->block = NULL;
+				state.readError = errno;
+				break;
+			}
+
+			inFlight++;
+			blockReads->pendingReads++;
+			blockReads->submittedBytes += read->length;
+			if (blockReads->submittedBytes == (uint64_t) pipeline->blockSize) {
+				current = NULL;
+			}
+		}
+
+		if (inFlight == 0) {
+			if (state.readError || isStopping || (current == NULL && index >= state.endIndex)) {
+				break;
+			}
+
+			// every buffer is waiting to be hashed or consumed
+			PipelineBlock *block = &pipeline->blocks[index % pipeline->blocksCount];
+			pthread_mutex_lock(&pipeline->lock);
+			while (block->state != BLOCK_FREE && !pipeline->isStopping) {
+				pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+			}
+			isStopping = pipeline->isStopping;
+			pthread_mutex_unlock(&pipeline->lock);
+			continue;
+		}
+
+		uint64_t slot;
+		int result;
+		// uringWait() tries again by itself after EAGAIN or EBUSY
+		if (uringWait(pipeline->uring, &slot, &result) == -1) {
+			if (!state.readError) {
+				state.readError = errno;
+			}
+			pipelineAbandonReads(pipeline, &state);
+			break;
+		}
+		inFlight--;
+
+		PipelineRead *read = &pipeline->reads[slot];
+		PipelineBlock *block = read->block;
+		PipelineBlockReads *blockReads = &pipeline->blockReads[block - pipeline->blocks];
+
+		if (result > 0) {
+			statsRead(pipeline->stats, result);
+		}
+
+		// O_DIRECT refused an unaligned piece: read it buffered
+		if (result == -EINVAL && read->fd != fileno(pipeline->source)) {
+			read->fd = fileno(pipeline->source);
+			result = -EAGAIN;
+		}
+
+		// interrupted, or a short read: ask for the rest
+		if (result == -EINTR || result == -EAGAIN || (result > 0 && (uint64_t) result < read->length)) {
+			if (result > 0) {
+				read->position += result;
+				read->length -= result;
+			}
+			if (uringRead(pipeline->uring, read->fd, block->data + read->position, read->length,
+				block->offset + read->position, slot) == 0) {
+				inFlight++;
+				continue;
+			}
+			result = -errno;
+		}
+
+		read->block = NULL;
+		blockReads->pendingReads--;
+
+		if (result >= 0) {
+			statsStage(pipeline->stats, STATS_READ, read->submittedAt);
+		}
+
+		if (result < 0) {
+			if (!state.readError) {
+				state.readError = -result;
+			}
+		} else if (result == 0 && read->position < blockReads->dataEnd) {
+			blockReads->dataEnd = read->position;
+		}
+
+		if (blockReads->pendingReads == 0 && blockReads->submittedBytes == (uint64_t) pipeline->blockSize) {
+			if (block->offset + (off_t) blockReads->dataEnd > lastOffset) {
+				lastOffset = block->offset + blockReads->dataEnd;
+			}
+			pipelineUringBlockDone(pipeline, block, &state);
+		}
+	}
+
+	// a block half submitted when reading stopped is never read to the end
+	if (state.readError && current) {
+		pipelineLoseBlock(&state, current);
+	}
+
+	uint64_t totalBlocks = state.endIndex == UINT64_MAX ? index : state.endIndex;
+	if (state.lostIndex < totalBlocks) {
+		totalBlocks = state.lostIndex;
+	}
+
+	pipeline->totalBytesRead = state.endIndex == UINT64_MAX ? lastOffset : state.endOffset;
+	pipelineFinishReading(pipeline, totalBlocks, state.readError);
+	return NULL;
+}
+
+static void pipelineFree(Pipeline *pipeline) {
+	int i;
+	for (i = 0; pipeline->blocks && i < pipeline->blocksCount; i++) {
+		free(pipeline->blocks[i].data);
+		free(pipeline->blocks[i].leafDigests);
+	}
+	free(pipeline->blocks);
+	free(pipeline->reads);
+	free(pipeline->blockReads);
+	free(pipeline);
+}
+
+// With a ring (uring != NULL), the source is read through it with queueDepth
+// reads in flight, and enough extra blocks are allocated to keep them busy.
+// directFd, unless -1, is the source opened with O_DIRECT to read from
+// instead of the FILE. Every read waits for the throttle first, and is
+// counted in stats.
+Pipeline *pipelineCreate(FILE *source, int directFd, off_t blockSize, uint64_t startIndex, int blocksCount, Pool *pool,
+	PipelineHashFunction hashFunction, void *hashContext, PipelineReadFilter readFilter, void *filterContext,
+	Uring *uring, int queueDepth, Throttle *throttle, Stats *stats) {
+
+	Pipeline *pipeline = calloc(1, sizeof(Pipeline));
+	if (pipeline == NULL) {
+		return NULL;
+	}
+
+	pipeline->source = source;
+	pipeline->directFd = directFd;
+	pipeline->blockSize = blockSize;
+	pipeline->startIndex = startIndex;
+	pipeline->nextIndex = startIndex;
+	pipeline->totalBlocks = startIndex;
+	pipeline->totalBytesRead = startIndex * blockSize;
+	pipeline->pool = pool;
+	pipeline->hashFunction = hashFunction;
+	pipeline->hashContext = hashContext;
+	pipeline->readFilter = readFilter;
+	pipeline->filterContext = filterContext;
+	pipeline->blocksCount = blocksCount < 2 ? 2 : blocksCount;
+	pipeline->uring = uring;
+	pipeline->queueDepth = queueDepth < 1 ? 1 : queueDepth;
+	pipeline->throttle = throttle;
+	pipeline->stats = stats;
+
+	if (uring) {
+		pipeline->blocksCount += ((uint64_t) pipeline->queueDepth * PIPELINE_URING_READ_SIZE + blockSize - 1) / blockSize;
+		pipeline->reads = calloc(pipeline->queueDepth, sizeof(PipelineRead));
+		pipeline->blockReads = calloc(pipeline->blocksCount, sizeof(PipelineBlockReads));
+		if (pipeline->reads == NULL || pipeline->blockReads == NULL) {
+			pipelineFree(pipeline);
+			return NULL;
+		}
+	}
+
+	pipeline->blocks = calloc(pipeline->blocksCount, sizeof(PipelineBlock));
+	if (pipeline->blocks == NULL) {
+		pipelineFree(pipeline);
+		return NULL;
+	}
+
+	int i;
+	for (i = 0; i < pipeline->blocksCount; i++) {
+		if (posix_memalign((void **) &pipeline->blocks[i].data, PIPELINE_ALIGNMENT, blockSize) != 0) {
+			errno = ENOMEM;
+			pipelineFree(pipeline);
+			return NULL;
+		}
+		pipeline->blocks[i].state = BLOCK_FREE;
+		pipeline->blocks[i].pipeline = pipeline;
+	}
+
+	pthread_mutex_init(&pipeline->lock, NULL);
+	pthread_cond_init(&pipeline->changed, NULL);
+
+	if (pthread_create(&pipeline->reader, NULL, uring ? pipelineUringReader : pipelineReader, pipeline) != 0) {
+		pthread_mutex_destroy(&pipeline->lock);
+		pthread_cond_destroy(&pipeline->changed);
+		pipelineFree(pipeline);
+		return NULL;
+	}
+
+	return pipeline;
+}
+
+// Returns the next block in file order once it's been read and hashed, or
+// NULL when the source is exhausted (check pipelineError() then).
+PipelineBlock *pipelineNextBlock(Pipeline *pipeline) {
+	PipelineBlock *block = &pipeline->blocks[pipeline->nextIndex % pipeline->blocksCount];
+
+	pthread_mutex_lock(&pipeline->lock);
+	for (;;) {
+		if (block->state == BLOCK_HASHED && block->index == pipeline->nextIndex) {
+			pipeline->nextIndex++;
+			pthread_mutex_unlock(&pipeline->lock);
+			return block;
+		}
+
+		if (pipeline->isEOF && pipeline->nextIndex >= pipeline->totalBlocks) {
+			pthread_mutex_unlock(&pipeline->lock);
+			return NULL;
+		}
+
+		pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+	}
+}
+
+void pipelineReleaseBlock(Pipeline *pipeline, PipelineBlock *block) {
+	pthread_mutex_lock(&pipeline->lock);
+	block->state = BLOCK_FREE;
+	pthread_cond_broadcast(&pipeline->changed);
+	pthread_mutex_unlock(&pipeline->lock);
+}
+
+// Blocks being read or hashed, or waiting to be consumed (a
+// StatsQueueFunction).
+int pipelineQueuedBlocks(void *context) {
+	Pipeline *pipeline = (Pipeline *) context;
+	int queued = 0;
+	int i;
+
+	pthread_mutex_lock(&pipeline->lock);
+	for (i = 0; i < pipeline->blocksCount; i++) {
+		if (pipeline->blocks[i].state != BLOCK_FREE) {
+			queued++;
+		}
+	}
+	pthread_mutex_unlock(&pipeline->lock);
+	return queued;
+}
+
+int pipelineError(Pipeline *pipeline) {
+	return pipeline->readError;
+}
+
+off_t pipelineEndOffset(Pipeline *pipeline) {
+	return pipeline->totalBytesRead;
+}
+
+void pipelineDestroy(Pipeline *pipeline) {
+	pthread_mutex_lock(&pipeline->lock);
+	pipeline->isStopping = 1;
+	pthread_cond_broadcast(&pipeline->changed);
+	pthread_mutex_unlock(&pipeline->lock);
+
+	pthread_join(pipeline->reader, NULL);
+
+	// blocks still queued in the pool point into our buffers
+	int i;
+	pthread_mutex_lock(&pipeline->lock);
+	for (i = 0; i < pipeline->blocksCount; i++) {
+		while (pipeline->blocks[i].state == BLOCK_HASHING) {
+			pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+		}
+	}
+	pthread_mutex_unlock(&pipeline->lock);
+
+	pthread_mutex_destroy(&pipeline->lock);
+	pthread_cond_destroy(&pipeline->changed);
+	pipelineFree(pipeline);
+}
@@ -0,0 +1,52 @@
+#ifndef BIGSYNC_PIPELINE_H
+#define BIGSYNC_PIPELINE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "pool.h"
+#include "hash.h"
+#include "uring.h"
+#include "throttle.h"
+#include "stats.h"
+
+typedef struct PipelineBlock {
+	char *data;
+	uint64_t index;
+	off_t offset;
+	uint64_t readBytes;
+	unsigned char digest[HASH_MAX_DIGEST_SIZE];
+	unsigned char *leafDigests; // up to the hash function, freed with the pipeline
+	int readMode;
+	int isZero; // known to be all zeros; the hash function may find out too
+	uint64_t extentHint;
+	int state;
+	struct Pipeline *pipeline;
+} PipelineBlock;
+
+typedef void (*PipelineHashFunction)(PipelineBlock *block, void *hashContext);
+
+#define PIPELINE_READ 0
+#define PIPELINE_HOLE 1
+#define PIPELINE_SKIP 2
+
+// Consulted by the reader before every block. Returns PIPELINE_READ,
+// PIPELINE_HOLE (the block is known to be all zeros: it is hashed but not
+// read) or PIPELINE_SKIP (the block is known to be unchanged: it is neither
+// read nor hashed; its digest is left as is). Only full blocks may be left
+// unread. Blocks come out with readMode and extentHint set accordingly.
+typedef int (*PipelineReadFilter)(void *filterContext, uint64_t index, off_t offset, uint64_t *extentHint);
+
+typedef struct Pipeline Pipeline;
+
+Pipeline *pipelineCreate(FILE *source, int directFd, off_t blockSize, uint64_t startIndex, int blocksCount, Pool *pool,
+	PipelineHashFunction hashFunction, void *hashContext, PipelineReadFilter readFilter, void *filterContext,
+	Uring *uring, int queueDepth, Throttle *throttle, Stats *stats);
+int pipelineQueuedBlocks(void *context);
+PipelineBlock *pipelineNextBlock(Pipeline *pipeline);
+void pipelineReleaseBlock(Pipeline *pipeline, PipelineBlock *block);
+int pipelineError(Pipeline *pipeline);
+off_t pipelineEndOffset(Pipeline *pipeline);
+void pipelineDestroy(Pipeline *pipeline);
+
+#endif
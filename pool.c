@@ -0,0 +1,130 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "pool.h"
+
+// A plain FIFO thread pool. Tasks are executed in submission order by
+// whichever worker is free first; completion order is up to the caller to
+// sort out (see pipeline.c).
+
+typedef struct PoolTask {
+	PoolTaskFunction function;
+	void *argument;
+	struct PoolTask *next;
+} PoolTask;
+
+struct Pool {
+	pthread_mutex_t lock;
+	pthread_cond_t hasTasks;
+	PoolTask *head;
+	PoolTask *tail;
+	int isStopping;
+	int threadsCount;
+	pthread_t *threads;
+};
+
+static void *poolWorker(void *argument) {
+	Pool *pool = (Pool *) argument;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->head == NULL && !pool->isStopping) {
+			pthread_cond_wait(&pool->hasTasks, &pool->lock);
+		}
+
+		if (pool->head == NULL) {
+			pthread_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+
+		PoolTask *task = pool->head;
+		pool->head = task->next;
+		if (pool->head == NULL) {
+			pool->tail = NULL;
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		task->function(task->argument);
+		free(task);
+	}
+}
+
+Pool *poolCreate(int threadsCount) {
+	if (threadsCount < 1) {
+		threadsCount = 1;
+	}
+
+	Pool *pool = calloc(1, sizeof(Pool));
+	if (pool == NULL) {
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->hasTasks, NULL);
+
+	pool->threads = calloc(threadsCount, sizeof(pthread_t));
+	if (pool->threads == NULL) {
+		free(pool);
+		return NULL;
+	}
+
+	int i;
+	for (i = 0; i < threadsCount; i++) {
+		if (pthread_create(&pool->threads[i], NULL, poolWorker, pool) != 0) {
+			break;
+		}
+	}
+
+	pool->threadsCount = i;
+	if (pool->threadsCount == 0) {
+		free(pool->threads);
+		free(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+int poolSubmit(Pool *pool, PoolTaskFunction function, void *argument) {
+	PoolTask *task = malloc(sizeof(PoolTask));
+	if (task == NULL) {
+		return -1;
+	}
+
+	task->function = function;
+	task->argument = argument;
+	task->next = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail) {
+		pool->tail->next = task;
+	} else {
+		pool->head = task;
+	}
+	pool->tail = task;
+	pthread_cond_signal(&pool->hasTasks);
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+int poolThreadsCount(Pool *pool) {
+	return pool->threadsCount;
+}
+
+// Waits for all queued tasks to finish, then joins the workers.
+void poolDestroy(Pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->isStopping = 1;
+	pthread_cond_broadcast(&pool->hasTasks);
+	pthread_mutex_unlock(&pool->lock);
+
+	int i;
+	for (i = 0; i < pool->threadsCount; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->hasTasks);
+	free(pool->threads);
+	free(pool);
+}
@@ -0,0 +1,13 @@
+#ifndef BIGSYNC_POOL_H
+#define BIGSYNC_POOL_H
+
+typedef void (*PoolTaskFunction)(void *argument);
+
+typedef struct Pool Pool;
+
+Pool *poolCreate(int threadsCount);
+int poolSubmit(Pool *pool, PoolTaskFunction function, void *argument);
+int poolThreadsCount(Pool *pool);
+void poolDestroy(Pool *pool);
+
+#endif
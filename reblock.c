@@ -0,0 +1,157 @@
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include "reblock.h"
+#include "util.h"
+#include "merkle.h"
+
+#define ZEROS_SIZE (64 * 1024)
+
+static const unsigned char zeros[ZEROS_SIZE];
+
+// The new file is <checksums file>.reblock until it is complete. One left
+// over from an interrupted run is started over.
+Reblocker *reblockerCreate(char *checksumsFilename, Checksums *current, uint64_t blockSize, uint32_t leafSize, char *error) {
+	Reblocker *reblocker = calloc(1, sizeof(Reblocker));
+	if (reblocker == NULL) {
+		setError(error, "Out of memory");
+		return NULL;
+	}
+
+	reblocker->blockSize = blockSize;
+	reblocker->targetFilename = checksumsFilename;
+	if (asprintf(&reblocker->filename, "%s.reblock", checksumsFilename) < 0) {
+		reblocker->filename = NULL;
+		setError(error, "Out of memory");
+		reblockerDestroy(reblocker);
+		return NULL;
+	}
+
+	if (unlink(reblocker->filename) == -1 && errno != ENOENT) {
+		setError(error, "Cannot remove %s: %s", reblocker->filename, strerror(errno));
+		reblockerDestroy(reblocker);
+		return NULL;
+	}
+
+	reblocker->checksums = checksumsOpen(reblocker->filename, current->hashAlgorithm, blockSize, error);
+	if (reblocker->checksums == NULL) {
+		reblockerDestroy(reblocker);
+		return NULL;
+	}
+
+	// hints and leaves are of the old blocks, the next run finds them out anew
+	if (((current->flags & CHECKSUMS_FLAG_EXTENT_HINTS) && checksumsEnableExtentHints(reblocker->checksums) == -1) ||
+		checksumsSetLeafSize(reblocker->checksums, leafSize) == -1) {
+
+		setError(error, "Cannot write %s: %s", reblocker->filename, strerror(errno));
+		reblockerDestroy(reblocker);
+		return NULL;
+	}
+
+	hashInit(&reblocker->context, current->hashAlgorithm);
+	return reblocker;
+}
+
+static int finishBlock(Reblocker *reblocker) {
+	unsigned char digest[HASH_MAX_DIGEST_SIZE];
+	hashFinal(&reblocker->context, digest);
+
+	if (checksumsSet(reblocker->checksums, reblocker->index, digest) == -1) {
+		return -1;
+	}
+
+	reblocker->index++;
+	reblocker->filled = 0;
+	hashInit(&reblocker->context, reblocker->checksums->hashAlgorithm);
+	return 0;
+}
+
+// Adds the next length bytes of the source, which is all zeros with isZero
+// (data may not even have been read then).
+int reblockerAdd(Reblocker *reblocker, const unsigned char *data, uint64_t length, int isZero) {
+	while (length > 0) {
+		uint64_t part = reblocker->blockSize - reblocker->filled;
+		if (part > length) {
+			part = length;
+		}
+		if (isZero && part > ZEROS_SIZE) {
+			part = ZEROS_SIZE;
+		}
+
+		hashUpdate(&reblocker->context, isZero ? zeros : data, part);
+		reblocker->filled += part;
+		length -= part;
+		if (!isZero) {
+			data += part;
+		}
+
+		if (reblocker->filled == reblocker->blockSize && finishBlock(reblocker) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Stores the last, short block, makes the merkle tree of the new blocks and
+// puts the new files in place of the old ones; the old checksums file has to
+// be closed by now. The tree is made next to the old one and only moved once
+// the checksums file is in place: should that fail, the old tree still
+// matches the old checksums file. Should moving the tree fail, the old one
+// goes, and the next sync makes it anew.
+int reblockerFinish(Reblocker *reblocker, uint64_t sourceSize, char *merkleFilename, unsigned char *root) {
+	if (reblocker->filled > 0 && finishBlock(reblocker) == -1) {
+		return -1;
+	}
+
+	if (asprintf(&reblocker->merkleFilename, "%s.reblock", merkleFilename) < 0) {
+		reblocker->merkleFilename = NULL;
+		errno = ENOMEM;
+		return -1;
+	}
+
+	Checksums *checksums = reblocker->checksums;
+	if ((unlink(reblocker->merkleFilename) == -1 && errno != ENOENT) ||
+		merkleUpdate(reblocker->merkleFilename, checksums, reblocker->index, sourceSize, root) == -1) {
+
+		return -1;
+	}
+
+	reblocker->checksums = NULL;
+	if (checksumsClose(checksums, reblocker->index, sourceSize) == -1 ||
+		rename(reblocker->filename, reblocker->targetFilename) == -1) {
+
+		return -1;
+	}
+
+	if (rename(reblocker->merkleFilename, merkleFilename) == -1) {
+		int renameError = errno;
+		unlink(merkleFilename);
+		errno = renameError;
+		return -1;
+	}
+	free(reblocker->merkleFilename);
+	reblocker->merkleFilename = NULL;
+	return 0;
+}
+
+// Without reblockerFinish() first, the new file is thrown away.
+void reblockerDestroy(Reblocker *reblocker) {
+	if (reblocker->checksums) {
+		checksumsClose(reblocker->checksums, reblocker->index, 0);
+	}
+	if (reblocker->filename) {
+		unlink(reblocker->filename);
+		free(reblocker->filename);
+	}
+	if (reblocker->merkleFilename) {
+		unlink(reblocker->merkleFilename);
+		free(reblocker->merkleFilename);
+	}
+	free(reblocker);
+}
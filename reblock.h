@@ -0,0 +1,27 @@
+#ifndef BIGSYNC_REBLOCK_H
+#define BIGSYNC_REBLOCK_H
+
+#include <stdint.h>
+#include "checksums.h"
+
+// Makes the checksums file for another block size out of the source as a
+// sync reads it, so that the block size can change without writing the
+// whole destination again. The sync itself goes on with the old block size,
+// and the new file replaces the old one once it is complete.
+typedef struct {
+	Checksums *checksums;
+	char *filename;
+	char *targetFilename;
+	char *merkleFilename; // the new tree, until it is in place
+	HashContext context;
+	uint64_t blockSize;
+	uint64_t index;
+	uint64_t filled;
+} Reblocker;
+
+Reblocker *reblockerCreate(char *checksumsFilename, Checksums *current, uint64_t blockSize, uint32_t leafSize, char *error);
+int reblockerAdd(Reblocker *reblocker, const unsigned char *data, uint64_t length, int isZero);
+int reblockerFinish(Reblocker *reblocker, uint64_t sourceSize, char *merkleFilename, unsigned char *root);
+void reblockerDestroy(Reblocker *reblocker);
+
+#endif
@@ -0,0 +1,695 @@
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include "remote.h"
+#include "util.h"
+
+// big enough for many blocks' worth of writes to leave in one go
+#define REMOTE_BUFFER_SIZE (1024 * 1024)
+
+// a sanity limit on what the receiver is asked to hold at once
+#define REMOTE_MAX_LENGTH (1024 * 1024 * 1024)
+
+#define REMOTE_MAX_PATH 65536
+
+static int readExactly(FILE *file, void *buffer, size_t length) {
+	if (length > 0 && fread(buffer, 1, length, file) != length) {
+		if (!ferror(file)) {
+			errno = EPIPE;
+		}
+		return -1;
+	}
+	return 0;
+}
+
+static int writeExactly(FILE *file, const void *buffer, size_t length) {
+	if (length > 0 && fwrite(buffer, 1, length, file) != length) {
+		return -1;
+	}
+	return 0;
+}
+
+// "host:path", as with scp: a colon before the first slash.
+int remoteIsPath(const char *path) {
+	const char *colon = strchr(path, ':');
+	const char *slash = strchr(path, '/');
+	return colon && colon != path && (slash == NULL || colon < slash);
+}
+
+static int sendRequest(Remote *remote, char type, uint64_t first, uint64_t second) {
+	unsigned char request[17];
+	request[0] = (unsigned char) type;
+	put64(request + 1, first);
+	put64(request + 9, second);
+	return writeExactly(remote->out, request, sizeof(request));
+}
+
+// Reads the answer to a request; an 'E' comes back as -1 with the
+// receiver's errno.
+static int readReply(Remote *remote, uint64_t *value) {
+	unsigned char reply[8];
+
+	if (fflush(remote->out) == EOF) {
+		return -1;
+	}
+
+	int type = fgetc(remote->in);
+	if (type == 'E') {
+		if (readExactly(remote->in, reply, 4) == -1) {
+			return -1;
+		}
+		errno = get32(reply) ? (int) get32(reply) : EIO;
+		return -1;
+	}
+	if (type != 'O') {
+		errno = type == EOF ? EPIPE : EPROTO;
+		return -1;
+	}
+
+	if (readExactly(remote->in, reply, 8) == -1) {
+		return -1;
+	}
+	if (value) {
+		*value = get64(reply);
+	}
+	return 0;
+}
+
+static int sendHello(Remote *remote, const char *path, const char *sourceName) {
+	unsigned char field[4];
+
+	put32(field, REMOTE_PROTOCOL_VERSION);
+	if (fputc('H', remote->out) == EOF || writeExactly(remote->out, field, 4) == -1) {
+		return -1;
+	}
+
+	put32(field, strlen(path));
+	if (writeExactly(remote->out, field, 4) == -1 || writeExactly(remote->out, path, strlen(path)) == -1) {
+		return -1;
+	}
+
+	put32(field, strlen(sourceName));
+	if (writeExactly(remote->out, field, 4) == -1 || writeExactly(remote->out, sourceName, strlen(sourceName)) == -1) {
+		return -1;
+	}
+
+	return 0;
+}
+
+// Starts the receiver for destination ("host:path") through rsh and opens
+// the file there, creating it if needed. If path is a directory, the file
+// in it named sourceName is used.
+Remote *remoteConnect(const char *rsh, const char *command, const char *destination, const char *sourceName,
+	char *error) {
+
+	const char *colon = strchr(destination, ':');
+	const char *path = *(colon + 1) ? colon + 1 : ".";
+	char *commandLine = NULL;
+	int toReceiver[2] = { -1, -1 };
+	int fromReceiver[2] = { -1, -1 };
+
+	Remote *remote = calloc(1, sizeof(Remote));
+	if (remote == NULL || asprintf(&commandLine, "%s %.*s %s --serve", rsh, (int) (colon - destination),
+		destination, command) < 0) {
+
+		setError(error, "Out of memory");
+		free(remote);
+		return NULL;
+	}
+	remote->pid = -1;
+
+	// a receiver that went away shows up as EPIPE, not as a signal
+	signal(SIGPIPE, SIG_IGN);
+
+	if (pipe(toReceiver) == -1 || pipe(fromReceiver) == -1) {
+		setError(error, "Cannot create pipes: %s", strerror(errno));
+		goto fail;
+	}
+
+	remote->pid = fork();
+	if (remote->pid == -1) {
+		setError(error, "Cannot start \"%s\": %s", commandLine, strerror(errno));
+		goto fail;
+	}
+
+	if (remote->pid == 0) {
+		dup2(toReceiver[0], STDIN_FILENO);
+		dup2(fromReceiver[1], STDOUT_FILENO);
+		close(toReceiver[0]);
+		close(toReceiver[1]);
+		close(fromReceiver[0]);
+		close(fromReceiver[1]);
+		execl("/bin/sh", "sh", "-c", commandLine, (char *) NULL);
+		_exit(127);
+	}
+
+	close(toReceiver[0]);
+	close(fromReceiver[1]);
+	toReceiver[0] = -1;
+	fromReceiver[1] = -1;
+
+	remote->out = fdopen(toReceiver[1], "w");
+	remote->in = fdopen(fromReceiver[0], "r");
+	remote->outBuffer = malloc(REMOTE_BUFFER_SIZE);
+	if (remote->out == NULL || remote->in == NULL || remote->outBuffer == NULL) {
+		setError(error, "Out of memory");
+		goto fail;
+	}
+	toReceiver[1] = -1;
+	fromReceiver[0] = -1;
+	setvbuf(remote->out, remote->outBuffer, _IOFBF, REMOTE_BUFFER_SIZE);
+
+	if (sendHello(remote, path, sourceName) == -1 || fflush(remote->out) == EOF) {
+		setError(error, "Cannot connect to the receiver for %s, is bigsync there? (%s)", destination, strerror(errno));
+		goto fail;
+	}
+
+	int type = fgetc(remote->in);
+	unsigned char reply[20];
+	if (type == 'E' && readExactly(remote->in, reply, 4) == 0) {
+		setError(error, "Cannot open %s: %s", destination, strerror((int) get32(reply)));
+		goto fail;
+	}
+	if (type != 'O' || readExactly(remote->in, reply, sizeof(reply)) == -1) {
+		setError(error, "Cannot connect to the receiver for %s, is bigsync there?", destination);
+		goto fail;
+	}
+
+	remote->size = get64(reply);
+	remote->blockSize = get64(reply + 8);
+	remote->isRegular = get32(reply + 16);
+
+	free(commandLine);
+	return remote;
+
+fail:
+	if (toReceiver[0] != -1) {
+		close(toReceiver[0]);
+	}
+	if (toReceiver[1] != -1) {
+		close(toReceiver[1]);
+	}
+	if (fromReceiver[0] != -1) {
+		close(fromReceiver[0]);
+	}
+	if (fromReceiver[1] != -1) {
+		close(fromReceiver[1]);
+	}
+	free(commandLine);
+	remoteClose(remote);
+	return NULL;
+}
+
+// Compresses what's written from now on with codec, COMPRESS_NONE to stop.
+int remoteSetCompression(Remote *remote, int codec) {
+	if (remote->compressor) {
+		compressorDestroy(remote->compressor);
+		remote->compressor = NULL;
+	}
+	if (codec == COMPRESS_NONE) {
+		return 0;
+	}
+
+	remote->compressor = compressorCreate(codec);
+	if (remote->frame == NULL) {
+		remote->frame = malloc(compressFrameBound(REMOTE_BUFFER_SIZE));
+	}
+	if (remote->compressor == NULL || remote->frame == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	return 0;
+}
+
+static int sendData(Remote *remote, const char *data, size_t length, off_t offset) {
+	if (sendRequest(remote, 'W', offset, length) == -1 || writeExactly(remote->out, data, length) == -1) {
+		return -1;
+	}
+	remote->bytesSent += length;
+	return 0;
+}
+
+int remoteWrite(Remote *remote, const char *data, size_t length, off_t offset) {
+	remote->bytesWritten += length;
+
+	if (remote->compressor == NULL) {
+		return sendData(remote, data, length, offset);
+	}
+
+	// compressed a buffer's worth at a time, so the receiver never needs more
+	while (length > 0) {
+		size_t part = length < REMOTE_BUFFER_SIZE ? length : REMOTE_BUFFER_SIZE;
+		size_t frameLength = compressFrame(remote->compressor, (const unsigned char *) data, part, remote->frame);
+
+		if (frameLength >= part) {
+			// didn't compress: the frame would only add its header
+			if (sendData(remote, data, part, offset) == -1) {
+				return -1;
+			}
+		} else {
+			if (sendRequest(remote, 'C', offset, frameLength) == -1 ||
+				writeExactly(remote->out, remote->frame, frameLength) == -1) {
+
+				return -1;
+			}
+			remote->bytesSent += frameLength;
+		}
+
+		data += part;
+		offset += part;
+		length -= part;
+	}
+	return 0;
+}
+
+int remotePunch(Remote *remote, off_t offset, size_t length) {
+	return sendRequest(remote, 'P', offset, length);
+}
+
+// Returns once everything sent so far is on the receiver's disk.
+int remoteSync(Remote *remote) {
+	if (sendRequest(remote, 'S', 0, 0) == -1) {
+		return -1;
+	}
+	return readReply(remote, NULL);
+}
+
+// Reads up to length bytes; fewer only at the end of the file.
+ssize_t remoteRead(Remote *remote, char *data, size_t length, off_t offset) {
+	uint64_t readBytes;
+
+	if (sendRequest(remote, 'R', offset, length) == -1 || readReply(remote, &readBytes) == -1) {
+		return -1;
+	}
+	if (readBytes > length) {
+		errno = EPROTO;
+		return -1;
+	}
+	if (readExactly(remote->in, data, readBytes) == -1) {
+		return -1;
+	}
+	return readBytes;
+}
+
+// Sets the size of the file, or only extends it if onlyGrow is set.
+int remoteTruncate(Remote *remote, uint64_t size, int onlyGrow) {
+	if (sendRequest(remote, 'T', size, onlyGrow) == -1) {
+		return -1;
+	}
+	return readReply(remote, NULL);
+}
+
+// Lets the receiver finish and waits for it.
+int remoteClose(Remote *remote) {
+	int result = 0;
+
+	if (remote->out && remote->in) {
+		if (fputc('Q', remote->out) == EOF || readReply(remote, NULL) == -1) {
+			result = -1;
+		}
+	}
+	if (remote->out) {
+		fclose(remote->out);
+	}
+	if (remote->in) {
+		fclose(remote->in);
+	}
+
+	if (remote->pid > 0) {
+		int status;
+		while (waitpid(remote->pid, &status, 0) == -1) {
+			if (errno != EINTR) {
+				status = -1;
+				break;
+			}
+		}
+		if (result == 0 && status != 0) {
+			errno = EIO;
+			result = -1;
+		}
+	}
+
+	if (remote->compressor) {
+		compressorDestroy(remote->compressor);
+	}
+	free(remote->frame);
+	free(remote->outBuffer);
+	free(remote);
+	return result;
+}
+
+// --serve: the receiving end
+
+typedef struct {
+	FILE *in;
+	FILE *out;
+	int fd;
+	int error; // the first error since the start, reported by every sync
+	char *buffer;
+	size_t bufferSize;
+	char *uncompressed;
+} Receiver;
+
+static int reply(Receiver *receiver, int error, uint64_t value) {
+	unsigned char message[9];
+
+	if (error) {
+		message[0] = 'E';
+		put32(message + 1, error);
+		return writeExactly(receiver->out, message, 5) == -1 || fflush(receiver->out) == EOF ? -1 : 0;
+	}
+
+	message[0] = 'O';
+	put64(message + 1, value);
+	return writeExactly(receiver->out, message, 9) == -1 || fflush(receiver->out) == EOF ? -1 : 0;
+}
+
+static int reserveBuffer(Receiver *receiver, uint64_t length) {
+	if (length > REMOTE_MAX_LENGTH) {
+		errno = EPROTO;
+		return -1;
+	}
+	if (length > receiver->bufferSize) {
+		char *buffer = realloc(receiver->buffer, length);
+		if (buffer == NULL) {
+			return -1;
+		}
+		receiver->buffer = buffer;
+		receiver->bufferSize = length;
+	}
+	return 0;
+}
+
+static void serveCompressed(Receiver *receiver, off_t offset, uint64_t frameLength) {
+	if (receiver->uncompressed == NULL) {
+		receiver->uncompressed = malloc(REMOTE_BUFFER_SIZE);
+		if (receiver->uncompressed == NULL) {
+			receiver->error = errno;
+			return;
+		}
+	}
+
+	if (decompressFrame((const unsigned char *) receiver->buffer, frameLength, (unsigned char *) receiver->uncompressed,
+		REMOTE_BUFFER_SIZE) == -1) {
+
+		receiver->error = EBADMSG;
+		return;
+	}
+
+	uint64_t length = compressFrameLength((const unsigned char *) receiver->buffer);
+	if (utilWriteAll(receiver->fd, receiver->uncompressed, length, offset) == -1) {
+		receiver->error = errno;
+	}
+}
+
+static int readString(Receiver *receiver, char **string) {
+	unsigned char field[4];
+
+	if (readExactly(receiver->in, field, 4) == -1) {
+		return -1;
+	}
+	uint32_t length = get32(field);
+	if (length > REMOTE_MAX_PATH) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	*string = malloc(length + 1);
+	if (*string == NULL || readExactly(receiver->in, *string, length) == -1) {
+		return -1;
+	}
+	(*string)[length] = 0;
+	return 0;
+}
+
+static int serveHello(Receiver *receiver) {
+	unsigned char field[21];
+	char *path = NULL;
+	char *name = NULL;
+	struct stat fileStat;
+
+	if (readExactly(receiver->in, field, 4) == -1 || readString(receiver, &path) == -1 ||
+		readString(receiver, &name) == -1) {
+
+		free(path);
+		free(name);
+		return -1;
+	}
+
+	int error = 0;
+	if (get32(field) != REMOTE_PROTOCOL_VERSION) {
+		error = EPROTONOSUPPORT;
+	} else {
+		// like a local destination, a directory gets a file of the source's name
+		if (stat(path, &fileStat) == 0 && S_ISDIR(fileStat.st_mode) && name[0] && strchr(name, '/') == NULL) {
+			char *filename;
+			if (asprintf(&filename, "%s/%s", path, name) >= 0) {
+				free(path);
+				path = filename;
+			}
+		}
+
+		receiver->fd = open(path, O_RDWR | O_CREAT, 0644);
+		if (receiver->fd == -1 || fstat(receiver->fd, &fileStat) == -1) {
+			error = errno;
+		}
+	}
+	free(path);
+	free(name);
+
+	if (error) {
+		return reply(receiver, error, 0);
+	}
+
+	field[0] = 'O';
+	put64(field + 1, fileStat.st_size);
+	put64(field + 9, fileStat.st_blksize);
+	put32(field + 17, S_ISREG(fileStat.st_mode));
+	if (writeExactly(receiver->out, field, sizeof(field)) == -1) {
+		return -1;
+	}
+	return fflush(receiver->out) == EOF ? -1 : 0;
+}
+
+static void servePunch(Receiver *receiver, off_t offset, uint64_t length) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+	errno = 0;
+	while (fallocate(receiver->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == -1) {
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno != EOPNOTSUPP && errno != ENOSYS) {
+			receiver->error = errno;
+		}
+		break;
+	}
+	if (receiver->error || errno == 0) {
+		return;
+	}
+#endif
+
+	// no holes here: zeros it is
+	size_t chunk = length < REMOTE_BUFFER_SIZE ? length : REMOTE_BUFFER_SIZE;
+	if (reserveBuffer(receiver, chunk) == -1) {
+		receiver->error = errno;
+		return;
+	}
+	memset(receiver->buffer, 0, chunk);
+
+	while (length > 0) {
+		size_t part = length < chunk ? length : chunk;
+		if (utilWriteAll(receiver->fd, receiver->buffer, part, offset) == -1) {
+			receiver->error = errno;
+			return;
+		}
+		offset += part;
+		length -= part;
+	}
+}
+
+static int serveRead(Receiver *receiver, off_t offset, uint64_t length) {
+	if (reserveBuffer(receiver, length) == -1) {
+		return reply(receiver, errno, 0);
+	}
+
+	uint64_t done = 0;
+	while (done < length) {
+		ssize_t readBytes = pread(receiver->fd, receiver->buffer + done, length - done, offset + done);
+		if (readBytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return reply(receiver, errno, 0);
+		}
+		if (readBytes == 0) {
+			break;
+		}
+		done += readBytes;
+	}
+
+	unsigned char message[9];
+	message[0] = 'O';
+	put64(message + 1, done);
+	if (writeExactly(receiver->out, message, 9) == -1 || writeExactly(receiver->out, receiver->buffer, done) == -1) {
+		return -1;
+	}
+	return fflush(receiver->out) == EOF ? -1 : 0;
+}
+
+static int serveTruncate(Receiver *receiver, uint64_t size, int onlyGrow) {
+	struct stat fileStat;
+
+	if (fstat(receiver->fd, &fileStat) == -1) {
+		return reply(receiver, errno, 0);
+	}
+
+	// a device has the size it has
+	if (S_ISREG(fileStat.st_mode) && (!onlyGrow || (uint64_t) fileStat.st_size < size) &&
+		ftruncate(receiver->fd, size) == -1) {
+
+		return reply(receiver, errno, 0);
+	}
+	if (fsync(receiver->fd) == -1) {
+		return reply(receiver, errno, 0);
+	}
+	return reply(receiver, 0, 0);
+}
+
+// Serves one destination over inFd and outFd until told to quit. Returns
+// the exit status.
+int remoteServe(int inFd, int outFd) {
+	Receiver receiver;
+	memset(&receiver, 0, sizeof(Receiver));
+	receiver.fd = -1;
+
+	receiver.in = fdopen(inFd, "r");
+	receiver.out = fdopen(outFd, "w");
+	char *inBuffer = malloc(REMOTE_BUFFER_SIZE);
+	if (receiver.in == NULL || receiver.out == NULL || inBuffer == NULL) {
+		fprintf(stderr, "bigsync --serve: %s\n", strerror(errno));
+		return 1;
+	}
+	setvbuf(receiver.in, inBuffer, _IOFBF, REMOTE_BUFFER_SIZE);
+
+	int status = -1;
+	while (status == -1) {
+		unsigned char request[16];
+		int type = fgetc(receiver.in);
+
+		if (type == EOF) {
+			// the sender went away without saying goodbye
+			status = 1;
+			break;
+		}
+
+		if (type == 'H') {
+			if (serveHello(&receiver) == -1) {
+				status = 1;
+			}
+			continue;
+		}
+
+		if (type == 'Q') {
+			reply(&receiver, 0, 0);
+			status = receiver.error ? 1 : 0;
+			break;
+		}
+
+		if (readExactly(receiver.in, request, sizeof(request)) == -1) {
+			status = 1;
+			break;
+		}
+		uint64_t first = get64(request);
+		uint64_t second = get64(request + 8);
+		int result;
+
+		if (receiver.fd == -1 && type != 'S') {
+			receiver.error = EBADF;
+		}
+
+		switch (type) {
+			case 'W':
+				if (reserveBuffer(&receiver, second) == -1 || readExactly(receiver.in, receiver.buffer, second) == -1) {
+					status = 1;
+					break;
+				}
+				if (!receiver.error && utilWriteAll(receiver.fd, receiver.buffer, second, first) == -1) {
+					receiver.error = errno;
+				}
+				break;
+
+			case 'C':
+				if (reserveBuffer(&receiver, second) == -1 || readExactly(receiver.in, receiver.buffer, second) == -1) {
+					status = 1;
+					break;
+				}
+				if (!receiver.error) {
+					serveCompressed(&receiver, first, second);
+				}
+				break;
+
+			case 'P':
+				if (!receiver.error) {
+					servePunch(&receiver, first, second);
+				}
+				break;
+
+			case 'S':
+				if (!receiver.error && receiver.fd != -1 && fsync(receiver.fd) == -1) {
+					receiver.error = errno;
+				}
+				if (reply(&receiver, receiver.error, 0) == -1) {
+					status = 1;
+				}
+				break;
+
+			case 'R':
+				if (receiver.fd == -1) {
+					result = reply(&receiver, EBADF, 0);
+				} else {
+					result = serveRead(&receiver, first, second);
+				}
+				if (result == -1) {
+					status = 1;
+				}
+				break;
+
+			case 'T':
+				if (receiver.fd == -1) {
+					result = reply(&receiver, EBADF, 0);
+				} else {
+					result = serveTruncate(&receiver, first, second != 0);
+				}
+				if (result == -1) {
+					status = 1;
+				}
+				break;
+
+			default:
+				fprintf(stderr, "bigsync --serve: unknown request %d\n", type);
+				status = 1;
+				break;
+		}
+	}
+
+	if (receiver.fd != -1) {
+		close(receiver.fd);
+	}
+	fclose(receiver.in);
+	fclose(receiver.out);
+	free(inBuffer);
+	free(receiver.buffer);
+	free(receiver.uncompressed);
+	return status;
+}
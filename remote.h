@@ -0,0 +1,68 @@
+#ifndef BIGSYNC_REMOTE_H
+#define BIGSYNC_REMOTE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "compress.h"
+
+#define REMOTE_PROTOCOL_VERSION 2
+#define REMOTE_ERROR_SIZE 512
+#define REMOTE_DEFAULT_RSH "ssh"
+#define REMOTE_DEFAULT_COMMAND "bigsync"
+
+// A destination on another machine ("host:path"). bigsync runs
+// "<rsh> <host> <command> --serve" there and streams the changed blocks to
+// its stdin; the checksum file stays on this side. Writes and hole punches
+// are only sent, never answered, so they follow each other without waiting
+// for the network; a sync is the one round trip, and it reports the first
+// error the receiver ran into since the start. All integers are
+// little-endian.
+//
+//   'H' version uint32, path length uint32, path, name length uint32, name
+//       (the source's file name, used if path is a directory)
+//       -> 'O' size uint64, st_blksize uint64, isRegular uint32
+//   'W' offset, length, then the data
+//   'C' offset, frame length, then a compressed frame (see compress.h) to
+//       write at offset
+//   'P' offset, length: punch a hole, or write zeros where that can't be done
+//   'S' 0, 0 -> 'O' 0 once everything before is synced
+//   'R' offset, length -> 'O' bytes read uint64, then the data
+//   'T' size, onlyGrow: truncate the file (regular files only) and sync
+//       -> 'O' 0
+//   'Q' -> 'O' 0, and the receiver exits
+//
+// Requests but 'H' and 'Q' carry two uint64 fields. A failed request is
+// answered with 'E' and the errno (uint32) instead of 'O' and its value.
+
+typedef struct {
+	pid_t pid;
+	FILE *out;
+	FILE *in;
+	char *outBuffer;
+
+	uint64_t size;
+	uint64_t blockSize;
+	int isRegular;
+
+	Compressor *compressor;
+	unsigned char *frame;
+
+	uint64_t bytesSent;
+	uint64_t bytesWritten;
+} Remote;
+
+int remoteIsPath(const char *path);
+Remote *remoteConnect(const char *rsh, const char *command, const char *destination, const char *sourceName,
+	char *error);
+int remoteSetCompression(Remote *remote, int codec);
+int remoteWrite(Remote *remote, const char *data, size_t length, off_t offset);
+int remotePunch(Remote *remote, off_t offset, size_t length);
+int remoteSync(Remote *remote);
+ssize_t remoteRead(Remote *remote, char *data, size_t length, off_t offset);
+int remoteTruncate(Remote *remote, uint64_t size, int onlyGrow);
+int remoteClose(Remote *remote);
+
+int remoteServe(int inFd, int outFd);
+
+#endif
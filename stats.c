@@ -0,0 +1,431 @@
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include "stats.h"
+#include "util.h"
+
+static const char *stageNames[STATS_STAGES] = { "read", "hash", "compare", "write", "sync" };
+
+const char *statsStageName(int stage) {
+	return stageNames[stage];
+}
+
+uint64_t statsNow(void) {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t) time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+Stats *statsCreate(const char *source, const char *dest, uint64_t sourceSize) {
+	Stats *stats = calloc(1, sizeof(Stats));
+	if (stats == NULL) {
+		return NULL;
+	}
+
+	stats->source = strdup(source ? source : "");
+	stats->dest = strdup(dest ? dest : "");
+	if (stats->source == NULL || stats->dest == NULL) {
+		free(stats->source);
+		free(stats->dest);
+		free(stats);
+		return NULL;
+	}
+
+	stats->sourceSize = sourceSize;
+	stats->startedAt = statsNow();
+	stats->lastReportedAt = stats->startedAt;
+	stats->jsonFd = -1;
+	pthread_mutex_init(&stats->lock, NULL);
+	pthread_cond_init(&stats->stopped, NULL);
+	return stats;
+}
+
+// A descriptor number to write to as it is, or a file to create.
+int statsOpenJson(const char *target, char *error) {
+	const char *digit = target;
+	while (isdigit((unsigned char) *digit)) {
+		digit++;
+	}
+
+	if (*target && *digit == 0) {
+		int fd = atoi(target);
+		if (fcntl(fd, F_GETFD) == -1) {
+			setError(error, "Cannot write stats to descriptor %d: %s", fd, strerror(errno));
+			return -1;
+		}
+		return fd;
+	}
+
+	// appending, as runs of a batch write to it at the same time
+	int fd = open(target, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (fd == -1) {
+		setError(error, "Cannot create %s: %s", target, strerror(errno));
+	}
+	return fd;
+}
+
+// Waits for the throttle are counted by the throttle.
+void statsSetThrottle(Stats *stats, Throttle *throttle) {
+	if (stats) {
+		stats->throttle = throttle;
+	}
+}
+
+static uint64_t throttledMicroseconds(Stats *stats) {
+	if (stats->throttle == NULL) {
+		return 0;
+	}
+	pthread_mutex_lock(&stats->throttle->lock);
+	uint64_t microseconds = stats->throttle->waitedMicroseconds;
+	pthread_mutex_unlock(&stats->throttle->lock);
+	return microseconds;
+}
+
+// Lines are put together with the lock held.
+
+typedef struct {
+	char *data;
+	size_t length;
+	size_t capacity;
+} Line;
+
+static void append(Line *line, const char *fmt, ...) {
+	va_list ap;
+
+	for (;;) {
+		size_t room = line->capacity - line->length;
+		va_start(ap, fmt);
+		int needed = vsnprintf(line->data + line->length, room, fmt, ap);
+		va_end(ap);
+
+		if (needed < 0) {
+			return;
+		}
+		if ((size_t) needed < room) {
+			line->length += needed;
+			return;
+		}
+
+		size_t capacity = line->capacity * 2 + needed;
+		char *data = realloc(line->data, capacity);
+		if (data == NULL) {
+			return;
+		}
+		line->data = data;
+		line->capacity = capacity;
+	}
+}
+
+static void appendJsonString(Line *line, const char *string) {
+	append(line, "\"");
+	for (; *string; string++) {
+		unsigned char c = (unsigned char) *string;
+		if (c == '"' || c == '\\') {
+			append(line, "\\%c", c);
+		} else if (c < 0x20) {
+			append(line, "\\u%04x", c);
+		} else {
+			append(line, "%c", c);
+		}
+	}
+	append(line, "\"");
+}
+
+static void writeJsonLine(Stats *stats, const char *state) {
+	Line line;
+	line.capacity = 1024;
+	line.length = 0;
+	line.data = malloc(line.capacity);
+	if (line.data == NULL) {
+		return;
+	}
+	line.data[0] = 0;
+
+	uint64_t reportedAt = statsNow();
+	double elapsed = (double) (reportedAt - stats->startedAt) / 1000000;
+	double interval = (double) (reportedAt - stats->lastReportedAt) / 1000000;
+	double readRate = interval > 0 ? (stats->bytesRead - stats->lastBytesRead) / interval : 0;
+	double writeRate = interval > 0 ? (stats->bytesWritten - stats->lastBytesWritten) / interval : 0;
+	double averageRate = elapsed > 0 ? stats->position / elapsed : 0;
+
+	append(&line, "{\"state\":\"%s\",\"time\":%ld,\"elapsed\":%.3f,\"source\":", state, (long) time(NULL), elapsed);
+	appendJsonString(&line, stats->source);
+	append(&line, ",\"dest\":");
+	appendJsonString(&line, stats->dest);
+	append(&line, ",\"size\":%" PRIu64 ",\"position\":%" PRIu64 ",\"percent\":%.1f", stats->sourceSize, stats->position,
+		stats->sourceSize ? (double) stats->position * 100 / stats->sourceSize : 100.0);
+	append(&line, ",\"bytesRead\":%" PRIu64 ",\"bytesWritten\":%" PRIu64 ",\"blocks\":%" PRIu64
+		",\"blocksChanged\":%" PRIu64, stats->bytesRead, stats->bytesWritten, stats->blocksCount, stats->blocksChanged);
+	append(&line, ",\"readRate\":%.0f,\"writeRate\":%.0f", readRate, writeRate);
+	append(&line, ",\"queued\":%d", stats->queue ? stats->queue(stats->queueContext) : 0);
+
+	if (stats->position < stats->sourceSize && averageRate > 0) {
+		append(&line, ",\"eta\":%.0f", (stats->sourceSize - stats->position) / averageRate);
+	} else {
+		append(&line, ",\"eta\":%s", stats->position < stats->sourceSize ? "null" : "0");
+	}
+	append(&line, ",\"throttled\":%.3f", (double) throttledMicroseconds(stats) / 1000000);
+
+	append(&line, ",\"stages\":{");
+	int i;
+	for (i = 0; i < STATS_STAGES; i++) {
+		StatsStage *stage = &stats->stages[i];
+		append(&line, "%s\"%s\":{\"count\":%" PRIu64 ",\"totalUs\":%" PRIu64 ",\"maxUs\":%" PRIu64 "}", i ? "," : "",
+			stageNames[i], stage->count, stage->totalMicroseconds, stage->maxMicroseconds);
+	}
+	append(&line, "}}\n");
+
+	// a broken stream mustn't stop the sync
+	size_t done = 0;
+	while (done < line.length) {
+		ssize_t written = write(stats->jsonFd, line.data + done, line.length - done);
+		if (written < 0 && errno == EINTR) {
+			continue;
+		}
+		if (written <= 0) {
+			break;
+		}
+		done += written;
+	}
+	free(line.data);
+
+	stats->lastReportedAt = reportedAt;
+	stats->lastBytesRead = stats->bytesRead;
+	stats->lastBytesWritten = stats->bytesWritten;
+}
+
+static void *statsReporter(void *argument) {
+	Stats *stats = (Stats *) argument;
+
+	pthread_mutex_lock(&stats->lock);
+	while (!stats->isStopping) {
+		struct timespec wakeAt;
+		clock_gettime(CLOCK_REALTIME, &wakeAt);
+		wakeAt.tv_sec += STATS_JSON_INTERVAL;
+
+		while (!stats->isStopping && pthread_cond_timedwait(&stats->stopped, &stats->lock, &wakeAt) != ETIMEDOUT) {
+		}
+		if (!stats->isStopping) {
+			writeJsonLine(stats, "running");
+		}
+	}
+	pthread_mutex_unlock(&stats->lock);
+	return NULL;
+}
+
+// Starts writing JSON lines to jsonFd.
+int statsStartJson(Stats *stats, int jsonFd) {
+	stats->jsonFd = jsonFd;
+	int result = pthread_create(&stats->reporter, NULL, statsReporter, stats);
+	if (result != 0) {
+		errno = result;
+		return -1;
+	}
+	stats->isReporting = 1;
+	return 0;
+}
+
+// queue is called from the reporting thread; set it to NULL before what it
+// looks at goes away.
+void statsSetQueue(Stats *stats, StatsQueueFunction queue, void *queueContext) {
+	if (stats == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&stats->lock);
+	stats->queue = queue;
+	stats->queueContext = queueContext;
+	pthread_mutex_unlock(&stats->lock);
+}
+
+// Records that a stage which began at startedAt (from statsNow()) is done.
+// A NULL stats records nothing, here and below.
+void statsStage(Stats *stats, int stage, uint64_t startedAt) {
+	if (stats == NULL) {
+		return;
+	}
+
+	uint64_t microseconds = statsNow() - startedAt;
+	pthread_mutex_lock(&stats->lock);
+	stats->stages[stage].count++;
+	stats->stages[stage].totalMicroseconds += microseconds;
+	if (microseconds > stats->stages[stage].maxMicroseconds) {
+		stats->stages[stage].maxMicroseconds = microseconds;
+	}
+	pthread_mutex_unlock(&stats->lock);
+}
+
+void statsRead(Stats *stats, uint64_t bytes) {
+	if (stats == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&stats->lock);
+	stats->bytesRead += bytes;
+	pthread_mutex_unlock(&stats->lock);
+}
+
+void statsWritten(Stats *stats, uint64_t bytes) {
+	if (stats == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&stats->lock);
+	stats->bytesWritten += bytes;
+	pthread_mutex_unlock(&stats->lock);
+}
+
+// A block is done with; position is where it ends in the source.
+void statsBlock(Stats *stats, uint64_t position, int isChanged) {
+	if (stats == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&stats->lock);
+	stats->position = position;
+	stats->blocksCount++;
+	if (isChanged) {
+		stats->blocksChanged++;
+	}
+	pthread_mutex_unlock(&stats->lock);
+}
+
+static void stopReporter(Stats *stats) {
+	if (stats->isReporting) {
+		pthread_mutex_lock(&stats->lock);
+		stats->isStopping = 1;
+		pthread_cond_broadcast(&stats->stopped);
+		pthread_mutex_unlock(&stats->lock);
+		pthread_join(stats->reporter, NULL);
+		stats->isReporting = 0;
+	}
+}
+
+// The run is complete: stops the reporting thread and writes the last line.
+void statsFinish(Stats *stats) {
+	if (stats == NULL) {
+		return;
+	}
+
+	stopReporter(stats);
+
+	pthread_mutex_lock(&stats->lock);
+	stats->queue = NULL;
+	if (stats->jsonFd != -1) {
+		writeJsonLine(stats, "done");
+	}
+	pthread_mutex_unlock(&stats->lock);
+}
+
+static void appendLabel(Line *line, const char *value) {
+	append(line, "dest=\"");
+	for (; *value; value++) {
+		if (*value == '"' || *value == '\\') {
+			append(line, "\\%c", *value);
+		} else if (*value == '\n') {
+			append(line, "\\n");
+		} else {
+			append(line, "%c", *value);
+		}
+	}
+	append(line, "\"");
+}
+
+static void appendMetric(Line *line, const char *name, const char *type, const char *help, const char *dest,
+	const char *stage, double value) {
+
+	if (help) {
+		append(line, "# HELP bigsync_%s %s\n# TYPE bigsync_%s %s\n", name, help, name, type);
+	}
+	append(line, "bigsync_%s{", name);
+	appendLabel(line, dest);
+	if (stage) {
+		append(line, ",stage=\"%s\"", stage);
+	}
+	// whole numbers as they are, %g would round a timestamp or a byte count
+	append(line, value == (double) (uint64_t) value ? "} %.0f\n" : "} %.6f\n", value);
+}
+
+int statsWritePrometheus(Stats *stats, const char *filename, char *error) {
+	Line line;
+	line.capacity = 4096;
+	line.length = 0;
+	line.data = malloc(line.capacity);
+	if (line.data == NULL) {
+		setError(error, "Cannot allocate memory: %s", strerror(errno));
+		return -1;
+	}
+
+	pthread_mutex_lock(&stats->lock);
+	const char *dest = stats->dest;
+	appendMetric(&line, "last_run_timestamp_seconds", "gauge", "When the last run completed.", dest, NULL,
+		(double) time(NULL));
+	appendMetric(&line, "duration_seconds", "gauge", "How long the last run took.", dest, NULL,
+		(double) (statsNow() - stats->startedAt) / 1000000);
+	appendMetric(&line, "source_bytes", "gauge", "Size of the source.", dest, NULL, (double) stats->sourceSize);
+	appendMetric(&line, "read_bytes", "gauge", "Bytes read from the source.", dest, NULL, (double) stats->bytesRead);
+	appendMetric(&line, "written_bytes", "gauge", "Bytes written to the destination.", dest, NULL,
+		(double) stats->bytesWritten);
+	appendMetric(&line, "blocks", "gauge", "Blocks of the source.", dest, NULL, (double) stats->blocksCount);
+	appendMetric(&line, "changed_blocks", "gauge", "Blocks that had to be written.", dest, NULL,
+		(double) stats->blocksChanged);
+	appendMetric(&line, "throttled_seconds", "gauge", "Time spent waiting for the I/O limits.", dest, NULL,
+		(double) throttledMicroseconds(stats) / 1000000);
+
+	int i;
+	for (i = 0; i < STATS_STAGES; i++) {
+		appendMetric(&line, "stage_seconds", "gauge", i ? NULL : "Time spent in each stage of a block.", dest,
+			stageNames[i], (double) stats->stages[i].totalMicroseconds / 1000000);
+	}
+	for (i = 0; i < STATS_STAGES; i++) {
+		appendMetric(&line, "stage_operations", "gauge", i ? NULL : "Times each stage was gone through.", dest,
+			stageNames[i], (double) stats->stages[i].count);
+	}
+	for (i = 0; i < STATS_STAGES; i++) {
+		appendMetric(&line, "stage_max_seconds", "gauge", i ? NULL : "Longest time a stage took.", dest,
+			stageNames[i], (double) stats->stages[i].maxMicroseconds / 1000000);
+	}
+	pthread_mutex_unlock(&stats->lock);
+
+	// the collector mustn't see half a file
+	char *temporaryFilename = NULL;
+	if (asprintf(&temporaryFilename, "%s.tmp", filename) < 0) {
+		free(line.data);
+		setError(error, "Cannot allocate memory: %s", strerror(errno));
+		return -1;
+	}
+
+	int result = -1;
+	FILE *file = fopen(temporaryFilename, "w");
+	if (file) {
+		size_t written = fwrite(line.data, 1, line.length, file);
+		if (fclose(file) == 0 && written == line.length && rename(temporaryFilename, filename) == 0) {
+			result = 0;
+		}
+	}
+	if (result == -1) {
+		setError(error, "Failed to write file %s: %s", filename, strerror(errno));
+		unlink(temporaryFilename);
+	}
+
+	free(temporaryFilename);
+	free(line.data);
+	return result;
+}
+
+// Without statsFinish() first, the run failed and no last line is written.
+void statsDestroy(Stats *stats) {
+	stopReporter(stats);
+	pthread_mutex_destroy(&stats->lock);
+	pthread_cond_destroy(&stats->stopped);
+	free(stats->source);
+	free(stats->dest);
+	free(stats);
+}
@@ -0,0 +1,88 @@
+#ifndef BIGSYNC_STATS_H
+#define BIGSYNC_STATS_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "throttle.h"
+
+#define STATS_ERROR_SIZE 512
+
+#define STATS_READ 0
+#define STATS_HASH 1
+#define STATS_COMPARE 2
+#define STATS_WRITE 3
+#define STATS_SYNC 4
+#define STATS_STAGES 5
+
+// Metrics of a run for monitoring: what it has read and written, how long
+// each stage of a block took, and how full the pipeline is.
+//
+// --stats-json writes a JSON object per line, every STATS_JSON_INTERVAL
+// seconds while the run goes on (with "state": "running") and once at the
+// end ("state": "done"); a stream that ends without "done" belongs to a run
+// that failed. Counters and stage times are totals since the start, rates
+// are over the last interval. Every line is written with a single write(),
+// so the runs of a --batch can share one stream.
+//
+// --prometheus writes the totals at the end in the text format node_exporter's
+// textfile collector reads, to a temporary file renamed into place.
+
+#define STATS_JSON_INTERVAL 1
+
+typedef struct {
+	uint64_t count;
+	uint64_t totalMicroseconds;
+	uint64_t maxMicroseconds;
+} StatsStage;
+
+// How many blocks are read ahead of the one being compared.
+typedef int (*StatsQueueFunction)(void *context);
+
+typedef struct {
+	pthread_mutex_t lock;
+
+	char *source;
+	char *dest;
+	uint64_t sourceSize;
+	uint64_t startedAt; // microseconds, monotonic
+
+	uint64_t position;
+	uint64_t bytesRead;
+	uint64_t bytesWritten;
+	uint64_t blocksCount;
+	uint64_t blocksChanged;
+	Throttle *throttle;
+	StatsStage stages[STATS_STAGES];
+
+	StatsQueueFunction queue;
+	void *queueContext;
+
+	int jsonFd;
+	pthread_t reporter;
+	pthread_cond_t stopped;
+	int isReporting;
+	int isStopping;
+	uint64_t lastReportedAt;
+	uint64_t lastBytesRead;
+	uint64_t lastBytesWritten;
+} Stats;
+
+uint64_t statsNow(void);
+const char *statsStageName(int stage);
+
+Stats *statsCreate(const char *source, const char *dest, uint64_t sourceSize);
+int statsOpenJson(const char *target, char *error);
+int statsStartJson(Stats *stats, int jsonFd);
+void statsSetQueue(Stats *stats, StatsQueueFunction queue, void *queueContext);
+void statsSetThrottle(Stats *stats, Throttle *throttle);
+
+void statsStage(Stats *stats, int stage, uint64_t startedAt);
+void statsRead(Stats *stats, uint64_t bytes);
+void statsWritten(Stats *stats, uint64_t bytes);
+void statsBlock(Stats *stats, uint64_t position, int isChanged);
+
+void statsFinish(Stats *stats);
+int statsWritePrometheus(Stats *stats, const char *filename, char *error);
+void statsDestroy(Stats *stats);
+
+#endif
@@ -0,0 +1,297 @@
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include "store.h"
+#include "util.h"
+
+static size_t recordSize(Store *store) {
+	return store->hashAlgorithm->digestSize + 16;
+}
+
+static int lockIndex(Store *store, int operation) {
+	while (flock(store->indexFd, operation) == -1) {
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int unlockIndex(Store *store) {
+	return flock(store->indexFd, LOCK_UN);
+}
+
+// Picks up the records added since the last look, by this or any other
+// process.
+static int loadIndex(Store *store) {
+	struct stat indexStat;
+	unsigned char buffer[1024 * (HASH_MAX_DIGEST_SIZE + 16)];
+	size_t size = recordSize(store);
+	int result = -1;
+
+	if (lockIndex(store, LOCK_SH) == -1) {
+		return -1;
+	}
+	if (fstat(store->indexFd, &indexStat) == -1) {
+		goto done;
+	}
+
+	off_t end = STORE_INDEX_HEADER_SIZE + (indexStat.st_size - STORE_INDEX_HEADER_SIZE) / size * size;
+	while (store->indexLoaded < end) {
+		size_t length = end - store->indexLoaded < (off_t) (sizeof(buffer) / size * size) ?
+			(size_t) (end - store->indexLoaded) : sizeof(buffer) / size * size;
+
+		ssize_t readBytes = pread(store->indexFd, buffer, length, store->indexLoaded);
+		if (readBytes <= 0) {
+			if (readBytes == 0) {
+				errno = EIO;
+			}
+			goto done;
+		}
+		readBytes = readBytes / size * size;
+
+		ssize_t i;
+		for (i = 0; i < readBytes; i += size) {
+			unsigned char *record = buffer + i;
+			int digestSize = store->hashAlgorithm->digestSize;
+			if (chunkIndexAdd(store->chunkIndex, record, get64(record + digestSize), get64(record + digestSize + 8)) == -1) {
+				goto done;
+			}
+		}
+		store->indexLoaded += readBytes;
+	}
+	result = 0;
+
+done:
+	unlockIndex(store);
+	return result;
+}
+
+// Writes the header of a new index, or checks that of an existing one and
+// drops a record an interruption left half written.
+static int prepareIndex(Store *store, const HashAlgorithm *hashAlgorithm, char *error) {
+	unsigned char header[STORE_INDEX_HEADER_SIZE];
+	struct stat indexStat;
+
+	if (lockIndex(store, LOCK_EX) == -1 || fstat(store->indexFd, &indexStat) == -1) {
+		setError(error, "Cannot lock the index of store %s: %s", store->directory, strerror(errno));
+		return -1;
+	}
+
+	if (indexStat.st_size == 0) {
+		store->hashAlgorithm = hashAlgorithm ? hashAlgorithm : hashAlgorithmById(HASH_MD4);
+		memcpy(header, STORE_INDEX_MAGIC, STORE_INDEX_MAGIC_SIZE);
+		put32(header + 8, store->hashAlgorithm->id);
+		put32(header + 12, store->hashAlgorithm->digestSize);
+
+		if (pwrite(store->indexFd, header, sizeof(header), 0) != sizeof(header) || fsync(store->indexFd) == -1) {
+			setError(error, "Cannot write the index of store %s: %s", store->directory, strerror(errno));
+			goto fail;
+		}
+
+	} else {
+		if (pread(store->indexFd, header, sizeof(header), 0) != sizeof(header) ||
+			memcmp(header, STORE_INDEX_MAGIC, STORE_INDEX_MAGIC_SIZE) != 0 ||
+			(store->hashAlgorithm = hashAlgorithmById(get32(header + 8))) == NULL ||
+			(int) get32(header + 12) != store->hashAlgorithm->digestSize) {
+
+			setError(error, "Store %s has a broken index", store->directory);
+			goto fail;
+		}
+
+		if (hashAlgorithm && hashAlgorithm != store->hashAlgorithm) {
+			setError(error, "Store %s keeps %s checksums, not %s", store->directory,
+				store->hashAlgorithm->name, hashAlgorithm->name);
+			goto fail;
+		}
+
+		off_t records = (indexStat.st_size - STORE_INDEX_HEADER_SIZE) / recordSize(store);
+		off_t wholeSize = STORE_INDEX_HEADER_SIZE + records * recordSize(store);
+		if (wholeSize != indexStat.st_size && ftruncate(store->indexFd, wholeSize) == -1) {
+			setError(error, "Cannot write the index of store %s: %s", store->directory, strerror(errno));
+			goto fail;
+		}
+	}
+
+	unlockIndex(store);
+	return 0;
+
+fail:
+	unlockIndex(store);
+	return -1;
+}
+
+// Opens the store in directory, creating it if needed. hashAlgorithm is the
+// one a new store uses; an existing store has to use the same one. With
+// NULL, an existing store's hash is taken and a new store uses md4.
+Store *storeOpen(const char *directory, const HashAlgorithm *hashAlgorithm, char *error) {
+	Store *store = calloc(1, sizeof(Store));
+	char *filename = NULL;
+
+	if (store == NULL) {
+		setError(error, "Out of memory");
+		return NULL;
+	}
+	store->packFd = -1;
+	store->indexFd = -1;
+	store->directory = strdup(directory);
+
+	if (mkdir(directory, 0755) == -1 && errno != EEXIST) {
+		setError(error, "Cannot create store %s: %s", directory, strerror(errno));
+		goto fail;
+	}
+
+	if (asprintf(&filename, "%s/index", directory) < 0) {
+		filename = NULL;
+		setError(error, "Out of memory");
+		goto fail;
+	}
+	store->indexFd = open(filename, O_RDWR | O_CREAT | O_APPEND, 0644);
+	free(filename);
+	if (store->indexFd == -1) {
+		setError(error, "Cannot open the index of store %s: %s", directory, strerror(errno));
+		goto fail;
+	}
+
+	if (asprintf(&filename, "%s/pack", directory) < 0) {
+		filename = NULL;
+		setError(error, "Out of memory");
+		goto fail;
+	}
+	store->packFd = open(filename, O_RDWR | O_CREAT, 0644);
+	free(filename);
+	if (store->packFd == -1) {
+		setError(error, "Cannot open the pack of store %s: %s", directory, strerror(errno));
+		goto fail;
+	}
+
+	if (prepareIndex(store, hashAlgorithm, error) == -1) {
+		goto fail;
+	}
+
+	store->indexLoaded = STORE_INDEX_HEADER_SIZE;
+	store->chunkIndex = chunkIndexCreate(store->hashAlgorithm->digestSize, 0);
+	if (store->chunkIndex == NULL || loadIndex(store) == -1) {
+		setError(error, "Cannot read the index of store %s: %s", directory, strerror(errno));
+		goto fail;
+	}
+
+	return store;
+
+fail:
+	storeClose(store);
+	return NULL;
+}
+
+// Looks the digest up, also among blocks other processes added meanwhile.
+ChunkIndexEntry *storeFind(Store *store, const unsigned char *digest) {
+	ChunkIndexEntry *entry = chunkIndexFind(store->chunkIndex, digest);
+	if (entry == NULL && loadIndex(store) == 0) {
+		entry = chunkIndexFind(store->chunkIndex, digest);
+	}
+	return entry;
+}
+
+// Hands out length bytes at the end of the pack for a new block, which the
+// caller writes there; storeCommit() adds it to the index once it is synced.
+int storeReserve(Store *store, const unsigned char *digest, uint64_t length, uint64_t *offset) {
+	struct stat packStat;
+
+	if (store->pendingCount == store->pendingCapacity) {
+		size_t capacity = store->pendingCapacity ? store->pendingCapacity * 2 : 64;
+		ChunkIndexEntry *pending = realloc(store->pending, capacity * sizeof(ChunkIndexEntry));
+		if (pending == NULL) {
+			return -1;
+		}
+		store->pending = pending;
+		store->pendingCapacity = capacity;
+	}
+
+	if (lockIndex(store, LOCK_EX) == -1) {
+		return -1;
+	}
+	if (fstat(store->packFd, &packStat) == -1 || ftruncate(store->packFd, packStat.st_size + length) == -1) {
+		int savedErrno = errno;
+		unlockIndex(store);
+		errno = savedErrno;
+		return -1;
+	}
+	unlockIndex(store);
+
+	*offset = packStat.st_size;
+
+	ChunkIndexEntry *entry = &store->pending[store->pendingCount++];
+	memcpy(entry->digest, digest, store->hashAlgorithm->digestSize);
+	entry->offset = *offset;
+	entry->length = length;
+	entry->isUsed = 1;
+
+	// later blocks of the same run find it right away
+	return chunkIndexAdd(store->chunkIndex, digest, *offset, length);
+}
+
+// Syncs the pack and records the blocks written since the last commit.
+int storeCommit(Store *store) {
+	if (store->pendingCount == 0) {
+		return 0;
+	}
+
+	size_t size = recordSize(store);
+	unsigned char *records = malloc(store->pendingCount * size);
+	if (records == NULL) {
+		return -1;
+	}
+
+	int digestSize = store->hashAlgorithm->digestSize;
+	size_t i;
+	for (i = 0; i < store->pendingCount; i++) {
+		unsigned char *record = records + i * size;
+		memcpy(record, store->pending[i].digest, digestSize);
+		put64(record + digestSize, store->pending[i].offset);
+		put64(record + digestSize + 8, store->pending[i].length);
+	}
+
+	int result = -1;
+	if (fsync(store->packFd) == -1 || lockIndex(store, LOCK_EX) == -1) {
+		free(records);
+		return -1;
+	}
+
+	// the index is opened with O_APPEND
+	size_t length = store->pendingCount * size;
+	if (write(store->indexFd, records, length) == (ssize_t) length && fsync(store->indexFd) == 0) {
+		store->pendingCount = 0;
+		result = 0;
+	}
+
+	int savedErrno = errno;
+	unlockIndex(store);
+	free(records);
+	errno = savedErrno;
+	return result;
+}
+
+void storeClose(Store *store) {
+	if (store->chunkIndex) {
+		chunkIndexDestroy(store->chunkIndex);
+	}
+	if (store->packFd != -1) {
+		close(store->packFd);
+	}
+	if (store->indexFd != -1) {
+		close(store->indexFd);
+	}
+	free(store->pending);
+	free(store->directory);
+	free(store);
+}
@@ -0,0 +1,48 @@
+#ifndef BIGSYNC_STORE_H
+#define BIGSYNC_STORE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "hash.h"
+#include "cdc.h"
+
+#define STORE_INDEX_MAGIC "BSSTORE\001"
+#define STORE_INDEX_MAGIC_SIZE 8
+#define STORE_INDEX_HEADER_SIZE 16
+#define STORE_ERROR_SIZE 512
+
+// A content-addressed store shared by many destinations (--store). Blocks
+// are appended to a pack file once per digest, and the destinations are
+// only lists of where their blocks are (see checksums.h). Several bigsyncs
+// may use a store at once; space in the pack is handed out under an flock()
+// of the index, so their appends never overlap.
+//
+// <dir>/pack   the blocks, back to back
+// <dir>/index  8 bytes magic, hash (uint32), digestSize (uint32), then a
+//              record per block: digest, offset (uint64), length (uint64),
+//              all little-endian. Records are only added once their blocks
+//              are synced, so every one of them can be relied on; blocks
+//              whose records never made it are just space lost.
+
+typedef struct {
+	char *directory;
+	int packFd;
+	int indexFd;
+	const HashAlgorithm *hashAlgorithm;
+
+	ChunkIndex *chunkIndex;
+	off_t indexLoaded;
+
+	// reserved and written, not yet in the index file
+	ChunkIndexEntry *pending;
+	size_t pendingCount;
+	size_t pendingCapacity;
+} Store;
+
+Store *storeOpen(const char *directory, const HashAlgorithm *hashAlgorithm, char *error);
+ChunkIndexEntry *storeFind(Store *store, const unsigned char *digest);
+int storeReserve(Store *store, const unsigned char *digest, uint64_t length, uint64_t *offset);
+int storeCommit(Store *store);
+void storeClose(Store *store);
+
+#endif
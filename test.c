@@ -10,12 +10,14 @@
 #include <getopt.h>
 #include <stdarg.h>
 #include <stdint.h>
-#include "md4_global.h"
-#include "md4.h"
+#include "engine.h"
+#include "md4lanes.h"
 
 
 int allTestsPassed=1;
 
+char *extraOptions="";
+
 void printAndFail(char *line) {
 	printf("%s: %s\n", line, strerror(errno));
 	exit(1);
@@ -120,24 +122,19 @@ void calcMD4(char *filename, char *md4Result) {
 	MD4Update (&mdContext, block, size);
 	MD4Final (digest, &mdContext);
 
-	char readingMD4[33];
-	bzero(readingMD4, 33);
-	int i;
-	for (i = 0; i < 16; i++) {
-		sprintf(readingMD4, "%s%02x", readingMD4, digest[i]);
-	}
-	strncpy(md4Result, readingMD4, 33);
+	hashToHex(md4Result, digest, 16);
 }
 
 int syncAndCheckMd4(char *testName, char *sourceFilename, char *destFilename, int isSparse, int isSourceZero) {
 	char md4Source[33];
 	calcMD4(sourceFilename, md4Source);
 
-	char command[100];
-	sprintf(command, "./bigsync --source %s --dest %s --blocksize _ --quiet %s %s",
+	char command[1024];
+	sprintf(command, "./bigsync --source %s --dest %s --blocksize _ --quiet %s %s %s",
 		sourceFilename, destFilename,
 		isSparse ? "--sparse" : "",
-		isSourceZero ? "--zero" : ""
+		isSourceZero ? "--zero" : "",
+		extraOptions
 	);
 
 	system(command);
@@ -159,6 +156,11 @@ void cleanup() {
 	remove("testSource.bin");
 	remove("testDest.bin");
 	remove("testDest.bin.bigsync");
+	remove("testDest.bin.bigsync.journal");
+	remove("testDest.bin.bigsync.merkle");
+	remove("testCopy.bin");
+	remove("testCopy.bin.bigsync");
+	remove("testCopy.bin.bigsync.merkle");
 }
 
 void testSparse() {
@@ -215,6 +217,17 @@ void testSparse() {
 		sparseFailCount++;
 	}
 
+	// the changed block turns to zeros again and its space is given back
+	uint32_t filledBlocksCount = destBlocksCount;
+	changeByte("testSource.bin", 7*1024*1024, 0);
+	syncAndCheckMd4("changed byte back to zero (SPARSE) ", "testSource.bin", "testDest.bin", 1, 0);
+	checkFileSize("changed byte back to zero (SPARSE) (size)", "testDest.bin", 1024*1024*10);
+
+	destBlocksCount = blocksCount("testDest.bin");
+	if (destBlocksCount >= filledBlocksCount) {
+		sparseFailCount++;
+	}
+
 	if (sparseFailCount>0) {
 		printf("\n  Warning: sparse mode was enabled, but the destination file doesn't seem\n"
 			"  to occupy less disk space then the original file. For certain file systems it's\n"
@@ -281,6 +294,780 @@ void testBasic() {
 	checkFileSize("sync single block size", "testSource.bin", 4000);
 }
 
+void testThreads() {
+	extraOptions="--threads 1";
+	testCycle(0);
+	extraOptions="--threads 5";
+	testCycle(1);
+	testZeroSizedSource(0);
+	extraOptions="";
+}
+
+void testSyncPolicies() {
+	extraOptions="--sync-policy end";
+	testCycle(0);
+	testSparse();
+	extraOptions="--sync-policy 1";
+	testCycle(1);
+	extraOptions="";
+}
+
+void interruptSync(char *options) {
+	char command[1024];
+	sprintf(command, "./bigsync --source testSource.bin --dest testDest.bin --blocksize _ --quiet %s", options);
+	system(command);
+}
+
+void testInterrupted(char *syncPolicy) {
+	cleanup();
+
+	char options[200];
+	sprintf(options, "--sync-policy %s --crash-after 4", syncPolicy);
+
+	createZeroFile("testSource.bin", 1000000);
+	addBytes("testSource.bin", 1, 'c');
+	changeByte("testSource.bin", 50, 'c');
+	changeByte("testSource.bin", 550000, 'c');
+	interruptSync(options);
+
+	if (fileSize("testDest.bin.bigsync.journal") > 0) {
+		printf("interrupted with %s (journal): Pass\n", syncPolicy);
+	} else {
+		allTestsPassed=0;
+		printf("interrupted with %s (journal): FAIL\n", syncPolicy);
+	}
+
+	syncAndCheckMd4("resumed", "testSource.bin", "testDest.bin", 0, 0);
+	checkFileSize("resumed", "testDest.bin", 1000001);
+
+	if (fileSize("testDest.bin.bigsync.journal") < 0) {
+		printf("resumed (journal removed): Pass\n");
+	} else {
+		allTestsPassed=0;
+		printf("resumed (journal removed): FAIL\n");
+	}
+
+	// interrupted again while updating an existing destination
+	changeByte("testSource.bin", 150, 'd');
+	changeByte("testSource.bin", 950000, 'd');
+	interruptSync(options);
+	syncAndCheckMd4("resumed update", "testSource.bin", "testDest.bin", 0, 0);
+
+	// the block being written when interrupted is checked, not trusted
+	changeByte("testSource.bin", 350000, 'e');
+	interruptSync(options);
+	changeByte("testDest.bin", 350001, 'x');
+	syncAndCheckMd4("resumed with damaged destination", "testSource.bin", "testDest.bin", 0, 0);
+}
+
+int isBinaryChecksumsFile(char *filename) {
+	char magic[8];
+	FILE *f = fopen(filename, "r");
+	if (!f) {
+		return 0;
+	}
+	size_t readBytes = fread(magic, 1, 8, f);
+	fclose(f);
+	return readBytes == 8 && memcmp(magic, "BIGSYNC\032", 8) == 0;
+}
+
+void testLegacyChecksums() {
+	cleanup();
+
+	createZeroFile("testSource.bin", 4000);
+	changeByte("testSource.bin", 5, 'r');
+	syncAndCheckMd4("legacy checksums initial", "testSource.bin", "testDest.bin", 0, 0);
+
+	// the text format older versions wrote: one md4 per line
+	char md4[33];
+	calcMD4("testSource.bin", md4);
+	FILE *f = fopen("testDest.bin.bigsync", "w");
+	fprintf(f, "%s\n", md4);
+	fclose(f);
+
+	// the destination must be left alone if the old checksum was understood
+	changeByte("testDest.bin", 6, 'x');
+	char command[1024];
+	sprintf(command, "./bigsync --source testSource.bin --dest testDest.bin --blocksize _ --quiet");
+	system(command);
+
+	char md4Dest[33];
+	calcMD4("testDest.bin", md4Dest);
+	if (strcmp(md4, md4Dest) != 0 && isBinaryChecksumsFile("testDest.bin.bigsync")) {
+		printf("legacy checksums migrated: Pass\n");
+	} else {
+		allTestsPassed=0;
+		printf("legacy checksums migrated: FAIL\n");
+	}
+
+	changeByte("testSource.bin", 6, 'x');
+	syncAndCheckMd4("legacy checksums after migration", "testSource.bin", "testDest.bin", 0, 0);
+}
+
+void testZeroTail() {
+	// the short last block turning all zeros has to be written over, not skipped
+	cleanup();
+	createZeroFile("testSource.bin", 150000);
+	changeByte("testSource.bin", 120000, 'c');
+	syncAndCheckMd4("data in short block (SPARSE) ", "testSource.bin", "testDest.bin", 1, 0);
+	changeByte("testSource.bin", 120000, 0);
+	syncAndCheckMd4("zeroed short block (SPARSE) ", "testSource.bin", "testDest.bin", 1, 0);
+	checkFileSize("zeroed short block (SPARSE) (size)", "testDest.bin", 150000);
+}
+
+void testSparseReset() {
+	// a checksums file started over knows nothing of what the destination
+	// holds, so a block turned to zeros has to be written even without a
+	// checksum stored for it
+	cleanup();
+	createZeroFile("testSource.bin", 3000000);
+	changeByte("testSource.bin", 1500000, 'A');
+	syncAndCheckMd4("data before hash switch (SPARSE) ", "testSource.bin", "testDest.bin", 1, 0);
+	changeByte("testSource.bin", 1500000, 0);
+	extraOptions="--hash xxh64";
+	syncAndCheckMd4("zeroed after hash switch (SPARSE) ", "testSource.bin", "testDest.bin", 1, 0);
+
+	// generations keep the old block size from being converted
+	changeByte("testSource.bin", 1500000, 'A');
+	extraOptions="--blocksize 1 --keep-generations 1";
+	syncAndCheckMd4("data before block size change (SPARSE) ", "testSource.bin", "testDest.bin", 1, 0);
+	changeByte("testSource.bin", 1500000, 0);
+	extraOptions="--keep-generations 1";
+	syncAndCheckMd4("zeroed after block size change (SPARSE) ", "testSource.bin", "testDest.bin", 1, 0);
+
+	extraOptions="";
+	system("rm -f testDest.bin.bigsync.gen.*");
+}
+
+void testHashes() {
+	extraOptions="--hash xxh64";
+	testCycle(0);
+	extraOptions="--hash blake3";
+	testCycle(1);
+
+	// switching algorithms on an existing checksums file starts it over
+	extraOptions="--hash crc32c";
+	changeByte("testSource.bin", 7, 'x');
+	syncAndCheckMd4("switched hash", "testSource.bin", "testDest.bin", 1, 0);
+	extraOptions="";
+	changeByte("testSource.bin", 9, 'x');
+	syncAndCheckMd4("stored hash reused", "testSource.bin", "testDest.bin", 1, 0);
+}
+
+void testHex() {
+	unsigned char digest[HASH_MAX_DIGEST_SIZE];
+	unsigned char decoded[HASH_MAX_DIGEST_SIZE];
+	char hex[HASH_MAX_HEX_SIZE];
+	int i;
+	for (i = 0; i < HASH_MAX_DIGEST_SIZE; i++) {
+		digest[i] = (unsigned char) (i * 37 + 5);
+	}
+
+	hashToHex(hex, digest, HASH_MAX_DIGEST_SIZE);
+	int isRoundTrip = hashFromHex(hex, HASH_MAX_DIGEST_SIZE, decoded) == 0 &&
+		memcmp(digest, decoded, HASH_MAX_DIGEST_SIZE) == 0 &&
+		(int) strlen(hex) == HASH_MAX_DIGEST_SIZE * 2 &&
+		strncmp(hex, "052a4f7499", 10) == 0;
+	int isUpperCase = hashFromHex("0A0b", 2, decoded) == 0 && decoded[0] == 0x0a && decoded[1] == 0x0b;
+	int isRejected = hashFromHex("0g", 1, decoded) == -1 && hashFromHex("/0", 1, decoded) == -1 &&
+		hashFromHex("\xc0" "0", 1, decoded) == -1;
+
+	if (isRoundTrip && isUpperCase && isRejected) {
+		printf("hex digests: Pass\n");
+	} else {
+		allTestsPassed=0;
+		printf("hex digests: FAIL\n");
+	}
+}
+
+void testMd4Lanes() {
+	static unsigned char data[17][5000];
+	const unsigned char *inputs[17];
+	int i, j;
+	for (i = 0; i < 17; i++) {
+		for (j = 0; j < 5000; j++) {
+			data[i][j] = (unsigned char) (i * 31 + j * 7 + (j >> 8));
+		}
+		inputs[i] = data[i] + i % 3;
+	}
+
+	const HashAlgorithm *md4 = hashAlgorithmById(HASH_MD4);
+	size_t lengths[] = { 0, 1, 55, 56, 63, 64, 65, 119, 120, 1000, 4096 };
+	// slowest first, so the fastest one is left in use
+	int kernel;
+	for (kernel = MD4_LANES_SCALAR; kernel <= MD4_LANES_AVX512; kernel++) {
+		if (md4LanesUse(kernel) == -1) {
+			continue;
+		}
+
+		int isSame = 1;
+		int l, count;
+		for (l = 0; l < (int) (sizeof(lengths) / sizeof(lengths[0])); l++) {
+			for (count = 1; count <= 17; count++) {
+				unsigned char digests[17 * 16];
+				hashBuffers(md4, inputs, lengths[l], count, digests);
+				for (i = 0; i < count; i++) {
+					unsigned char digest[16];
+					hashBuffer(md4, inputs[i], lengths[l], digest);
+					if (memcmp(digest, digests + i * 16, 16) != 0) {
+						isSame = 0;
+					}
+				}
+			}
+		}
+
+		if (isSame) {
+			printf("md4 lanes kernel %d: Pass\n", kernel);
+		} else {
+			allTestsPassed=0;
+			printf("md4 lanes kernel %d: FAIL\n", kernel);
+		}
+	}
+}
+
+void testExtentHints() {
+	extraOptions="--extent-hints";
+	testCycle(0);
+	testCycle(1);
+
+	// a source with holes, which aren't read at all
+	cleanup();
+	fclose(fopen("testSource.bin", "w"));
+	truncate("testSource.bin", 1000000);
+	changeByte("testSource.bin", 450000, 'c');
+	syncAndCheckMd4("holes in source", "testSource.bin", "testDest.bin", 1, 0);
+	changeByte("testSource.bin", 50, 'c');
+	syncAndCheckMd4("hole filled", "testSource.bin", "testDest.bin", 1, 0);
+
+	// an existing checksums file gets room for the hints
+	extraOptions="";
+	changeByte("testSource.bin", 950000, 'c');
+	syncAndCheckMd4("before extent hints", "testSource.bin", "testDest.bin", 0, 0);
+	extraOptions="--extent-hints";
+	changeByte("testSource.bin", 650000, 'c');
+	syncAndCheckMd4("extent hints enabled", "testSource.bin", "testDest.bin", 0, 0);
+	extraOptions="";
+	changeByte("testSource.bin", 750000, 'c');
+	syncAndCheckMd4("after extent hints", "testSource.bin", "testDest.bin", 0, 0);
+}
+
+void testLeaves() {
+	extraOptions="--leafsize 16";
+	testCycle(0);
+	testCycle(1);
+	testSparse();
+
+	// leaves added to an existing checksums file, a growing and a shrinking
+	// last block
+	cleanup();
+	extraOptions="";
+	createZeroFile("testSource.bin", 250000);
+	changeByte("testSource.bin", 120000, 'c');
+	syncAndCheckMd4("before leaves", "testSource.bin", "testDest.bin", 0, 0);
+	extraOptions="--leafsize 16";
+	changeByte("testSource.bin", 130000, 'c');
+	syncAndCheckMd4("leaves enabled", "testSource.bin", "testDest.bin", 0, 0);
+	changeByte("testSource.bin", 140000, 'c');
+	syncAndCheckMd4("changed leaf", "testSource.bin", "testDest.bin", 0, 0);
+	addBytes("testSource.bin", 20000, 'd');
+	syncAndCheckMd4("grown last block", "testSource.bin", "testDest.bin", 0, 0);
+	truncate("testSource.bin", 230000);
+	syncAndCheckMd4("shrunk last block", "testSource.bin", "testDest.bin", 0, 0);
+	checkFileSize("shrunk last block", "testDest.bin", 230000);
+	extraOptions="--leafsize 0";
+	changeByte("testSource.bin", 150000, 'c');
+	syncAndCheckMd4("leaves dropped", "testSource.bin", "testDest.bin", 0, 0);
+	extraOptions="--leafsize 32 --io-engine uring --sync-policy end";
+	changeByte("testSource.bin", 160000, 'c');
+	syncAndCheckMd4("leaves with uring", "testSource.bin", "testDest.bin", 1, 0);
+	changeByte("testSource.bin", 170000, 0);
+	syncAndCheckMd4("changed leaf with uring", "testSource.bin", "testDest.bin", 1, 0);
+	extraOptions="";
+}
+
+int check(char *testName, int isPassed) {
+	if (isPassed) {
+		printf("%s: Pass\n", testName);
+	} else {
+		allTestsPassed=0;
+		printf("%s: FAIL\n", testName);
+	}
+	return isPassed;
+}
+
+void readRoot(char *destFilename, char *root) {
+	char command[1024];
+	sprintf(command, "./bigsync --dest %s --root", destFilename);
+
+	root[0] = 0;
+	FILE *output = popen(command, "r");
+	if (output) {
+		if (fgets(root, 100, output) == NULL) {
+			root[0] = 0;
+		}
+		pclose(output);
+	}
+}
+
+int isRangeVerified(char *range) {
+	char command[1024];
+	sprintf(command, "./bigsync --dest testDest.bin --quiet --verify-range %s", range);
+	return system(command) == 0;
+}
+
+void testMerkle() {
+	cleanup();
+
+	createZeroFile("testSource.bin", 2500000);
+	changeByte("testSource.bin", 1500000, 'c');
+	syncAndCheckMd4("checksum tree", "testSource.bin", "testDest.bin", 0, 0);
+	syncAndCheckMd4("checksum tree copy", "testSource.bin", "testCopy.bin", 0, 0);
+
+	char root[100];
+	char copyRoot[100];
+	readRoot("testDest.bin", root);
+	readRoot("testCopy.bin", copyRoot);
+	check("equal roots", root[0] && strcmp(root, copyRoot) == 0);
+
+	changeByte("testSource.bin", 700000, 'c');
+	syncAndCheckMd4("checksum tree updated", "testSource.bin", "testDest.bin", 0, 0);
+	readRoot("testDest.bin", root);
+	check("changed root", root[0] && strcmp(root, copyRoot) != 0);
+	syncAndCheckMd4("checksum tree copy updated", "testSource.bin", "testCopy.bin", 0, 0);
+	readRoot("testCopy.bin", copyRoot);
+	check("equal roots again", root[0] && strcmp(root, copyRoot) == 0);
+
+	check("whole destination verified", isRangeVerified(":"));
+	changeByte("testDest.bin", 2200000, 'x');
+	check("damaged block found", !isRangeVerified("2:"));
+	check("undamaged range verified", isRangeVerified("0:2"));
+}
+
+int isSameFile(char *sourceFilename, char *destFilename) {
+	char md4Source[33];
+	char md4Dest[33];
+	calcMD4(sourceFilename, md4Source);
+	calcMD4(destFilename, md4Dest);
+	return strcmp(md4Source, md4Dest) == 0;
+}
+
+void createRandomFile(char *filename, size_t size, unsigned int seed) {
+	FILE *f = fopen(filename, "w");
+	if (!f) {
+		printAndFail("Cannot create file");
+	}
+
+	srand(seed);
+	size_t i;
+	for (i = 0; i < size; i++) {
+		fputc(rand() & 0xff, f);
+	}
+	fclose(f);
+}
+
+// Rewrites the file with count bytes put in at position, moving the rest.
+void insertBytes(char *filename, off_t position, int count, char byte) {
+	off_t size = fileSize(filename);
+	char *data = (char*) malloc(size + count);
+
+	FILE *f = fopen(filename, "r");
+	if (!f || fread(data, 1, size, f) != (size_t) size) {
+		printAndFail("Cannot read data");
+	}
+	fclose(f);
+
+	memmove(data + position + count, data + position, size - position);
+	memset(data + position, byte, count);
+
+	f = fopen(filename, "w");
+	if (!f || fwrite(data, 1, size + count, f) != (size_t) (size + count)) {
+		printAndFail("Cannot write data 4");
+	}
+	fclose(f);
+	free(data);
+}
+
+int byteAt(char *filename, off_t position) {
+	FILE *f = fopen(filename, "r");
+	if (!f) {
+		return -1;
+	}
+	fseek(f, position, SEEK_SET);
+	int byte = fgetc(f);
+	fclose(f);
+	return byte;
+}
+
+uint64_t checksumsBlockSize(char *filename) {
+	unsigned char header[24];
+	FILE *f = fopen(filename, "r");
+	if (!f) {
+		return 0;
+	}
+	size_t readBytes = fread(header, 1, sizeof(header), f);
+	fclose(f);
+	if (readBytes != sizeof(header)) {
+		return 0;
+	}
+
+	uint64_t blockSize = 0;
+	int i;
+	for (i = 7; i >= 0; i--) {
+		blockSize = (blockSize << 8) | header[16 + i];
+	}
+	return blockSize;
+}
+
+void testReblock() {
+	cleanup();
+	createRandomFile("testSource.bin", 3000000, 5);
+	int status = system("./bigsync --source testSource.bin --dest testDest.bin --blocksize 1 --quiet");
+
+	// blocks that are the same aren't written again, so this stays
+	changeByte("testDest.bin", 100, 'x');
+	changeByte("testSource.bin", 2500000, 'c');
+	status |= system("./bigsync --source testSource.bin --dest testDest.bin --blocksize 2 --quiet");
+	status |= system("./bigsync --source testSource.bin --dest testCopy.bin --blocksize 2 --quiet");
+	check("reblocked", status == 0 && byteAt("testDest.bin", 100) == 'x' && byteAt("testDest.bin", 2500000) == 'c' &&
+		checksumsBlockSize("testDest.bin.bigsync") == 2 * 1024 * 1024 &&
+		isSameFile("testDest.bin.bigsync", "testCopy.bin.bigsync") &&
+		isSameFile("testDest.bin.bigsync.merkle", "testCopy.bin.bigsync.merkle"));
+
+	// a source changing all over gets bigger blocks after a few runs
+	cleanup();
+	createRandomFile("testSource.bin", 3000000, 6);
+	status = system("./bigsync --source testSource.bin --dest testDest.bin --blocksize auto --quiet");
+	check("automatic block size", status == 0 && checksumsBlockSize("testDest.bin.bigsync") == 64 * 1024);
+
+	unsigned int seed;
+	for (seed = 7; seed < 11; seed++) {
+		createRandomFile("testSource.bin", 3000000, seed);
+		status |= system("./bigsync --source testSource.bin --dest testDest.bin --blocksize auto --quiet");
+	}
+	check("automatic block size adapted", status == 0 && isSameFile("testSource.bin", "testDest.bin") &&
+		checksumsBlockSize("testDest.bin.bigsync") == 128 * 1024);
+}
+
+int isRestored(char *sourceFilename) {
+	remove("testCopy.bin");
+	int status = system("./bigsync --dest testDest.bin --quiet --restore testCopy.bin");
+	return status == 0 && isSameFile(sourceFilename, "testCopy.bin");
+}
+
+void testChunks() {
+	cleanup();
+
+	createRandomFile("testSource.bin", 3000000, 1);
+	int status = system("./bigsync --source testSource.bin --dest testDest.bin --cdc --blocksize _ --quiet");
+	check("chunks", status == 0 && isRestored("testSource.bin"));
+	off_t containerSize = fileSize("testDest.bin");
+
+	// everything after the insert moves, only the chunk around it is new
+	insertBytes("testSource.bin", 1000, 10, 'c');
+	status = system("./bigsync --source testSource.bin --dest testDest.bin --quiet");
+	check("chunks shifted", status == 0 && isRestored("testSource.bin") &&
+		fileSize("testDest.bin") - containerSize < 500000);
+
+	containerSize = fileSize("testDest.bin");
+	status = system("./bigsync --source testSource.bin --dest testDest.bin --quiet");
+	check("chunks unchanged", status == 0 && fileSize("testDest.bin") == containerSize);
+
+	// a copy made without --cdc becomes a container
+	syncAndCheckMd4("chunks from a copy", "testSource.bin", "testCopy.bin", 0, 0);
+	status = system("./bigsync --source testSource.bin --dest testCopy.bin --cdc --blocksize _ --quiet");
+	check("chunks from a copy restored", status == 0 &&
+		system("./bigsync --dest testCopy.bin --quiet --restore testDest.bin") == 0 &&
+		isSameFile("testSource.bin", "testDest.bin"));
+}
+
+void testStore() {
+	cleanup();
+	system("rm -rf testStore");
+
+	// two images sharing all but a block
+	createRandomFile("testSource.bin", 1000000, 2);
+	int status = system("./bigsync --source testSource.bin --dest testDest.bin --store testStore --blocksize _ --quiet");
+	changeByte("testSource.bin", 500000, 'c');
+	status |= system("./bigsync --source testSource.bin --dest testCopy.bin --store testStore --blocksize _ --quiet");
+	check("store", status == 0 && fileSize("testStore/pack") == 1100000 && fileSize("testCopy.bin") < 10000);
+
+	remove("testDest.bin.restored");
+	status = system("./bigsync --dest testCopy.bin --store testStore --quiet --restore testDest.bin.restored");
+	check("store restored", status == 0 && isSameFile("testSource.bin", "testDest.bin.restored"));
+
+	// the list of blocks mustn't be taken for a copy
+	status = system("./bigsync --source testSource.bin --dest testCopy.bin --quiet 2>/dev/null");
+	check("store required", status != 0 && fileSize("testCopy.bin") < 10000);
+
+	remove("testDest.bin.restored");
+	system("rm -rf testStore");
+}
+
+void testGenerations() {
+	cleanup();
+	system("rm -f testDest.bin.bigsync.gen.* testSource.bin.v*");
+
+	createRandomFile("testSource.bin", 1000000, 3);
+	FILE *f = fopen("testSource.bin", "r");
+	fseek(f, 500000, SEEK_SET);
+	int original = fgetc(f);
+	fclose(f);
+
+	int status = system("./bigsync --source testSource.bin --dest testDest.bin --blocksize _ --keep-generations 2 --quiet");
+	system("cp testSource.bin testSource.bin.v1");
+
+	changeByte("testSource.bin", 500000, 'c');
+	status |= system("./bigsync --source testSource.bin --dest testDest.bin --quiet");
+	system("cp testSource.bin testSource.bin.v2");
+
+	changeByte("testSource.bin", 500000, original);
+	changeByte("testSource.bin", 100, 'c');
+	status |= system("./bigsync --source testSource.bin --dest testDest.bin --quiet");
+	system("cp testSource.bin testSource.bin.v3");
+
+	// the block going back is in generation 2, which has to be moved on as
+	// that one goes (generation 1 is the destination before the first run)
+	changeByte("testSource.bin", 500000, 'c');
+	addBytes("testSource.bin", 50000, 'a');
+	status |= system("./bigsync --source testSource.bin --dest testDest.bin --quiet");
+	check("generations kept", status == 0 && isSameFile("testSource.bin", "testDest.bin") &&
+		fileSize("testDest.bin.bigsync.gen.2") < 0 && fileSize("testDest.bin.bigsync.gen.4") > 0);
+
+	remove("testDest.bin.restored");
+	status = system("./bigsync --dest testDest.bin --generation 3 --restore testDest.bin.restored --quiet");
+	check("generation restored", status == 0 && isSameFile("testSource.bin.v2", "testDest.bin.restored"));
+
+	remove("testDest.bin.restored");
+	status = system("./bigsync --dest testDest.bin --generation 4 --restore testDest.bin.restored --quiet");
+	check("newest generation restored", status == 0 && isSameFile("testSource.bin.v3", "testDest.bin.restored"));
+
+	status = system("./bigsync --source testSource.bin --dest testDest.bin --keep-generations 0 --quiet");
+	check("generations removed", status == 0 && fileSize("testDest.bin.bigsync.gen.4") < 0);
+
+	remove("testDest.bin.restored");
+	system("rm -f testDest.bin.bigsync.gen.* testSource.bin.v*");
+}
+
+// "ssh" to this machine: the host is dropped and the rest run here
+#define LOCAL_RSH "--rsh \"sh -c 'exec \\\"\\$@\\\"'\" --remote-command ./bigsync"
+
+void testRemote() {
+	cleanup();
+
+	createRandomFile("testSource.bin", 1000000, 4);
+	int status = system("./bigsync --source testSource.bin --dest localhost:testDest.bin --checksum testCopy.bin.bigsync "
+		"--blocksize _ --quiet " LOCAL_RSH);
+	check("remote", status == 0 && isSameFile("testSource.bin", "testDest.bin"));
+
+	changeByte("testSource.bin", 500000, 'c');
+	addBytes("testSource.bin", 1000, 'a');
+	status = system("./bigsync --source testSource.bin --dest localhost:testDest.bin --checksum testCopy.bin.bigsync "
+		"--quiet --sparse " LOCAL_RSH);
+	check("remote changed", status == 0 && isSameFile("testSource.bin", "testDest.bin"));
+
+	// the checksum file stays on this side
+	status = system("./bigsync --source testSource.bin --dest localhost:testDest.bin --quiet 2>/dev/null");
+	check("remote needs checksum", status != 0);
+}
+
+// lines of text, which compress well
+void createTextFile(char *name, int linesCount) {
+	FILE *file = fopen(name, "w");
+	int i;
+	for (i = 0; i < linesCount; i++) {
+		fprintf(file, "line %d of a file that compresses, block %d\n", i, i / 1000);
+	}
+	fclose(file);
+}
+
+void testCompression() {
+	cleanup();
+
+	createTextFile("testSource.bin", 50000);
+	int status = system("./bigsync --source testSource.bin --dest localhost:testDest.bin --checksum testCopy.bin.bigsync "
+		"--blocksize _ --quiet --compress lz4hc " LOCAL_RSH);
+	check("compressed remote", status == 0 && isSameFile("testSource.bin", "testDest.bin"));
+
+	changeByte("testSource.bin", 1000000, 'c');
+	status = system("./bigsync --source testSource.bin --dest localhost:testDest.bin --checksum testCopy.bin.bigsync "
+		"--quiet --compress lz4 " LOCAL_RSH);
+	check("compressed remote changed", status == 0 && isSameFile("testSource.bin", "testDest.bin"));
+
+	remove("testDest.bin");
+	remove("testDest.bin.bigsync");
+	status = system("./bigsync --source testSource.bin --dest testDest.bin --cdc --compress lz4 --blocksize _ --quiet");
+	off_t containerSize = fileSize("testDest.bin");
+	check("compressed chunks", status == 0 && containerSize < fileSize("testSource.bin") / 2 &&
+		isRestored("testSource.bin"));
+
+	// stays compressed, and unchanged chunks are found again
+	status = system("./bigsync --source testSource.bin --dest testDest.bin --quiet");
+	check("compressed chunks unchanged", status == 0 && fileSize("testDest.bin") == containerSize);
+
+	status = system("./bigsync --source testSource.bin --dest testDest.bin --compress none --quiet");
+	check("uncompressed chunks", status == 0 && fileSize("testDest.bin") >= fileSize("testSource.bin") &&
+		isRestored("testSource.bin"));
+
+	// a copy is kept as it is
+	status = system("./bigsync --source testSource.bin --dest testCopy.bin --compress lz4 --quiet 2>/dev/null");
+	check("compressed copy refused", status != 0);
+}
+
+void cleanupBatch() {
+	system("rm -rf testBatchSource testBatchDest testBatch.manifest");
+}
+
+void testBatch() {
+	cleanupBatch();
+	mkdir("testBatchSource", 0755);
+	mkdir("testBatchDest", 0755);
+
+	createZeroFile("testBatchSource/a.bin", 250000);
+	createZeroFile("testBatchSource/b.bin", 50000);
+	createZeroFile("testBatchSource/c.bin", 0);
+	changeByte("testBatchSource/a.bin", 120000, 'c');
+
+	int status = system("./bigsync --batch testBatchSource --dest testBatchDest --blocksize _ --quiet --jobs 2 --device-jobs 1");
+	check("batch directory", status == 0 &&
+		isSameFile("testBatchSource/a.bin", "testBatchDest/a.bin") &&
+		isSameFile("testBatchSource/b.bin", "testBatchDest/b.bin") &&
+		isSameFile("testBatchSource/c.bin", "testBatchDest/c.bin"));
+
+	// a manifest, with a file that fails; the others still get synced
+	FILE *manifest = fopen("testBatch.manifest", "w");
+	fprintf(manifest, "# comment\ntestBatchSource/a.bin\ttestBatchDest/renamed.bin\ntestBatchSource/missing.bin\ntestBatchSource/b.bin\n");
+	fclose(manifest);
+	changeByte("testBatchSource/b.bin", 100, 'c');
+
+	status = system("./bigsync --batch testBatch.manifest --dest testBatchDest --blocksize _ --quiet 2>/dev/null");
+	check("batch manifest", status != 0 &&
+		isSameFile("testBatchSource/a.bin", "testBatchDest/renamed.bin") &&
+		isSameFile("testBatchSource/b.bin", "testBatchDest/b.bin"));
+
+	cleanupBatch();
+}
+
+void testIoEngines() {
+	extraOptions="--io-engine uring --queue-depth 3";
+	testCycle(0);
+	testCycle(1);
+	testZeroSizedSource(0);
+	extraOptions="--io-engine uring --sync-policy end";
+	testCycle(0);
+	testSparse();
+	extraOptions="--io-engine uring --extent-hints --sync-policy 1";
+	testCycle(1);
+	extraOptions="";
+}
+
+void testCacheModes() {
+	// --blocksize _ isn't aligned, so every block falls back to the page cache
+	extraOptions="--direct";
+	testCycle(0);
+	extraOptions="--direct --io-engine uring --sync-policy end";
+	testCycle(1);
+	extraOptions="--direct --blocksize 1";
+	testSparse();
+	testZeroSizedSource(0);
+	extraOptions="--direct --blocksize 1 --io-engine uring --sync-policy 2";
+	testZeroSizedSource(1);
+	extraOptions="--fadvise";
+	testCycle(0);
+	extraOptions="";
+}
+
+void testThrottle() {
+	struct timeval startedAt, endedAt;
+	cleanup();
+
+	// 3 MB at 6 MB/s: half a second, less the first burst
+	createRandomFile("testSource.bin", 3000000, 5);
+	gettimeofday(&startedAt, NULL);
+	int status = system("./bigsync --source testSource.bin --dest testDest.bin --blocksize 1 --quiet --read-limit 6M");
+	gettimeofday(&endedAt, NULL);
+	long elapsed = (endedAt.tv_sec - startedAt.tv_sec) * 1000 + (endedAt.tv_usec - startedAt.tv_usec) / 1000;
+	check("read limit", status == 0 && isSameFile("testSource.bin", "testDest.bin") && elapsed >= 350);
+
+	changeByte("testSource.bin", 1500000, 'c');
+	status = system("./bigsync --source testSource.bin --dest testDest.bin --quiet --write-limit 1M --iops-limit 100 "
+		"--io-engine uring --schedule 00:00-12:00,12:00-24:00");
+	check("write limit", status == 0 && isSameFile("testSource.bin", "testDest.bin"));
+
+	status = system("./bigsync --source testSource.bin --dest testDest.bin --quiet --read-limit 1M --schedule 8-18 2>/dev/null");
+	check("schedule refused", status != 0);
+}
+
+void testStats() {
+	cleanup();
+	remove("testStats.json");
+	remove("testStats.prom");
+
+	// xxh64 catches the one byte changed below whatever it is, which the
+	// md4 of 64 bit hosts doesn't always do
+	createRandomFile("testSource.bin", 3000000, 6);
+	int status = system("./bigsync --source testSource.bin --dest testDest.bin --blocksize 1 --hash xxh64 --quiet "
+		"--stats-json testStats.json --prometheus testStats.prom");
+	check("stats", status == 0 && isSameFile("testSource.bin", "testDest.bin") &&
+		system("grep -q '\"state\":\"done\".*\"blocksChanged\":3,' testStats.json") == 0 &&
+		system("grep -q '^bigsync_changed_blocks{.*} 3$' testStats.prom") == 0);
+
+	// to a descriptor, and in chunk mode
+	changeByte("testSource.bin", 1500000, 'x');
+	status = system("./bigsync --source testSource.bin --dest testDest.bin --quiet --stats-json 3 "
+		"3>testStats.json");
+	check("stats to a descriptor", status == 0 && isSameFile("testSource.bin", "testDest.bin") &&
+		system("grep -q '\"state\":\"done\".*\"blocksChanged\":1,' testStats.json") == 0);
+
+	status = system("./bigsync --source testSource.bin --dest testCopy.bin --cdc --quiet --prometheus testStats.prom");
+	check("stats of chunks", status == 0 && system("grep -q '^bigsync_read_bytes{.*} 3000000$' testStats.prom") == 0);
+
+	remove("testStats.json");
+	remove("testStats.prom");
+	remove("testCopy.bin");
+	remove("testCopy.bin.bigsync");
+}
+
+void countEngineBlocks(void *context, uint64_t position, uint64_t size, const unsigned char *digest,
+	const unsigned char *storedDigest, int digestSize, int state) {
+
+	if (state != ENGINE_BLOCK_SAME) {
+		(*(int *) context)++;
+	}
+}
+
+void testEngine() {
+	cleanup();
+
+	int changedCount = 0;
+	EngineTotals totals;
+	Engine *engine = engineCreate(2);
+	// xxh64 catches any one byte change, the md4 of 64 bit hosts doesn't
+	engineSetHash(engine, hashAlgorithmByName("xxh64"));
+	engineSetBlockSize(engine, 1024 * 1024);
+	engineSetCallbacks(engine, countEngineBlocks, NULL, &changedCount);
+
+	createRandomFile("testSource.bin", 3000000, 7);
+	int result = engineSync(engine, "testSource.bin", "testDest.bin", &totals);
+	check("engine", result == 0 && isSameFile("testSource.bin", "testDest.bin") &&
+		changedCount == 3 && totals.blocksChanged == 3 && totals.bytesRead == 3000000);
+
+	// the same engine, again and into another destination
+	changedCount = 0;
+	changeByte("testSource.bin", 1500000, 'x');
+	result = engineSync(engine, "testSource.bin", "testDest.bin", &totals);
+	check("engine reused", result == 0 && isSameFile("testSource.bin", "testDest.bin") &&
+		changedCount == 1 && totals.blocksChanged == 1);
+
+	result = engineSync(engine, "testSource.bin", "testCopy.bin", &totals);
+	check("engine into another destination", result == 0 && isSameFile("testSource.bin", "testCopy.bin"));
+
+	result = engineSync(engine, "testMissing.bin", "testDest.bin", &totals);
+	check("engine error", result == -1 && engineErrorCode(engine) == ENGINE_ERROR_SOURCE &&
+		strstr(engineError(engine), "testMissing.bin") != NULL);
+
+	engineDestroy(engine);
+}
+
 int main(void) {
 	testBasic();
 	testCycle(0);
@@ -288,6 +1075,31 @@ int main(void) {
 	testSparse();
 	testZeroSizedSource(0);
 	testZeroSizedSource(1);
+	testZeroTail();
+	testSparseReset();
+	testThreads();
+	testHashes();
+	testHex();
+	testMd4Lanes();
+	testLegacyChecksums();
+	testSyncPolicies();
+	testInterrupted("per-block");
+	testInterrupted("end");
+	testExtentHints();
+	testLeaves();
+	testMerkle();
+	testReblock();
+	testBatch();
+	testChunks();
+	testStore();
+	testGenerations();
+	testRemote();
+	testCompression();
+	testIoEngines();
+	testCacheModes();
+	testThrottle();
+	testStats();
+	testEngine();
 	cleanup();
 	if (allTestsPassed) {
 		printf("\nAll tests passed.\n");
@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include "throttle.h"
+#include "util.h"
+
+// a bucket holds at most this much of a second's worth
+#define THROTTLE_BURST_FRACTION 10
+
+#define MINUTES_PER_DAY (24 * 60)
+
+static uint64_t now(void) {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t) time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+static void initBucket(TokenBucket *bucket, uint64_t rate) {
+	pthread_mutex_init(&bucket->lock, NULL);
+	bucket->rate = rate;
+	bucket->tokens = (double) rate / THROTTLE_BURST_FRACTION;
+	bucket->refilledAt = now();
+}
+
+// Takes amount out of the bucket and returns how long to wait for it, in
+// microseconds.
+static uint64_t take(TokenBucket *bucket, uint64_t amount) {
+	if (bucket->rate == 0) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&bucket->lock);
+
+	uint64_t time = now();
+	double burst = (double) bucket->rate / THROTTLE_BURST_FRACTION;
+	bucket->tokens += (double) (time - bucket->refilledAt) * bucket->rate / 1000000;
+	if (bucket->tokens > burst) {
+		bucket->tokens = burst;
+	}
+	bucket->refilledAt = time;
+
+	bucket->tokens -= amount;
+	uint64_t wait = bucket->tokens < 0 ? (uint64_t) (-bucket->tokens * 1000000 / bucket->rate) : 0;
+
+	pthread_mutex_unlock(&bucket->lock);
+	return wait;
+}
+
+static void waitFor(Throttle *throttle, uint64_t microseconds) {
+	if (microseconds == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&throttle->lock);
+	throttle->waitedMicroseconds += microseconds;
+	pthread_mutex_unlock(&throttle->lock);
+
+	struct timespec remaining;
+	remaining.tv_sec = microseconds / 1000000;
+	remaining.tv_nsec = (microseconds % 1000000) * 1000;
+	while (nanosleep(&remaining, &remaining) == -1 && errno == EINTR) {
+	}
+}
+
+// A limit of 0 means none.
+Throttle *throttleCreate(uint64_t readLimit, uint64_t writeLimit, uint64_t iopsLimit) {
+	Throttle *throttle = calloc(1, sizeof(Throttle));
+	if (throttle == NULL) {
+		return NULL;
+	}
+
+	initBucket(&throttle->read, readLimit);
+	initBucket(&throttle->write, writeLimit);
+	initBucket(&throttle->requests, iopsLimit);
+	pthread_mutex_init(&throttle->lock, NULL);
+	return throttle;
+}
+
+static int parseTime(const char *text, int *minutes, const char **end) {
+	char *after;
+	long hours = strtol(text, &after, 10);
+	if (after == text || *after != ':' || hours < 0 || hours > 24) {
+		return -1;
+	}
+
+	text = after + 1;
+	long minutesPastHour = strtol(text, &after, 10);
+	if (after - text != 2 || minutesPastHour < 0 || minutesPastHour > 59 || (hours == 24 && minutesPastHour > 0)) {
+		return -1;
+	}
+
+	*minutes = hours * 60 + minutesPastHour;
+	*end = after;
+	return 0;
+}
+
+// "<HH:MM>-<HH:MM>[,...]"; a window may go past midnight ("22:00-06:00").
+int throttleSetSchedule(Throttle *throttle, const char *schedule, char *error) {
+	const char *position = schedule;
+
+	throttle->windowsCount = 0;
+	while (*position) {
+		ThrottleWindow window;
+		if (throttle->windowsCount == THROTTLE_MAX_WINDOWS) {
+			setError(error, "A schedule can have at most %d windows", THROTTLE_MAX_WINDOWS);
+			return -1;
+		}
+
+		if (parseTime(position, &window.from, &position) == -1 || *position++ != '-' ||
+			parseTime(position, &window.to, &position) == -1 || (*position && *position != ',') ||
+			window.from == window.to) {
+
+			setError(error, "Schedule must be given as <HH:MM>-<HH:MM>[,<HH:MM>-<HH:MM>...], not \"%s\"", schedule);
+			return -1;
+		}
+
+		throttle->windows[throttle->windowsCount++] = window;
+		if (*position == ',') {
+			position++;
+		}
+	}
+
+	if (throttle->windowsCount == 0) {
+		setError(error, "Schedule must be given as <HH:MM>-<HH:MM>[,<HH:MM>-<HH:MM>...], not \"%s\"", schedule);
+		return -1;
+	}
+	return 0;
+}
+
+// Whether the limits apply right now.
+int throttleIsActive(Throttle *throttle) {
+	if (throttle->windowsCount == 0) {
+		return 1;
+	}
+
+	time_t seconds = time(NULL);
+	struct tm localTime;
+	localtime_r(&seconds, &localTime);
+	int minutes = (localTime.tm_hour * 60 + localTime.tm_min) % MINUTES_PER_DAY;
+
+	int i;
+	for (i = 0; i < throttle->windowsCount; i++) {
+		ThrottleWindow *window = &throttle->windows[i];
+		if (window->from < window->to ?
+			minutes >= window->from && minutes < window->to :
+			minutes >= window->from || minutes < window->to) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Waits until bytes more may be read from the source, as one request.
+void throttleRead(Throttle *throttle, uint64_t bytes) {
+	if (throttle == NULL || !throttleIsActive(throttle)) {
+		return;
+	}
+
+	uint64_t bytesWait = take(&throttle->read, bytes);
+	uint64_t requestsWait = take(&throttle->requests, 1);
+	waitFor(throttle, bytesWait > requestsWait ? bytesWait : requestsWait);
+}
+
+// Waits until bytes more may be written to the destination, as one request.
+void throttleWrite(Throttle *throttle, uint64_t bytes) {
+	if (throttle == NULL || !throttleIsActive(throttle)) {
+		return;
+	}
+
+	uint64_t bytesWait = take(&throttle->write, bytes);
+	uint64_t requestsWait = take(&throttle->requests, 1);
+	waitFor(throttle, bytesWait > requestsWait ? bytesWait : requestsWait);
+}
+
+void throttleDestroy(Throttle *throttle) {
+	pthread_mutex_destroy(&throttle->read.lock);
+	pthread_mutex_destroy(&throttle->write.lock);
+	pthread_mutex_destroy(&throttle->requests.lock);
+	pthread_mutex_destroy(&throttle->lock);
+	free(throttle);
+}
@@ -0,0 +1,52 @@
+#ifndef BIGSYNC_THROTTLE_H
+#define BIGSYNC_THROTTLE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define THROTTLE_ERROR_SIZE 512
+#define THROTTLE_MAX_WINDOWS 16
+
+// Token buckets limiting how fast the source is read and the destination
+// written, in bytes per second, and how many I/O requests both make per
+// second. A bucket refills at its rate up to a tenth of a second's worth;
+// a request takes what it needs, going into debt if it needs more, and
+// waits until the debt is paid off. So a block larger than the burst still
+// gets through, and the average stays at the rate.
+//
+// A schedule ("08:00-18:00,22:00-23:30", local time) limits only within
+// its windows and lets everything run flat out outside of them. A NULL
+// throttle doesn't limit anything.
+
+typedef struct {
+	pthread_mutex_t lock;
+	uint64_t rate; // per second, 0 for no limit
+	double tokens;
+	uint64_t refilledAt; // microseconds
+} TokenBucket;
+
+typedef struct {
+	int from; // minutes after midnight
+	int to;
+} ThrottleWindow;
+
+typedef struct {
+	TokenBucket read;
+	TokenBucket write;
+	TokenBucket requests;
+
+	ThrottleWindow windows[THROTTLE_MAX_WINDOWS];
+	int windowsCount;
+
+	pthread_mutex_t lock;
+	uint64_t waitedMicroseconds;
+} Throttle;
+
+Throttle *throttleCreate(uint64_t readLimit, uint64_t writeLimit, uint64_t iopsLimit);
+int throttleSetSchedule(Throttle *throttle, const char *schedule, char *error);
+int throttleIsActive(Throttle *throttle);
+void throttleRead(Throttle *throttle, uint64_t bytes);
+void throttleWrite(Throttle *throttle, uint64_t bytes);
+void throttleDestroy(Throttle *throttle);
+
+#endif
@@ -0,0 +1,275 @@
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "uring.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct Uring {
+	int fd;
+
+	void *sqRing;
+	size_t sqRingSize;
+	unsigned *sqHead;
+	unsigned *sqTail;
+	unsigned *sqMask;
+	unsigned *sqArray;
+	unsigned sqEntries;
+	struct io_uring_sqe *sqes;
+	size_t sqesSize;
+
+	void *cqRing;
+	size_t cqRingSize;
+	unsigned *cqHead;
+	unsigned *cqTail;
+	unsigned *cqMask;
+	struct io_uring_cqe *cqes;
+
+	unsigned toSubmit;
+};
+
+// IORING_OP_READ and _WRITE came with 5.6, as did probing for them.
+static int isSupported(int fd) {
+	size_t probeSize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, probeSize);
+	if (probe == NULL) {
+		return 0;
+	}
+
+	int isSupported = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+		probe->last_op >= IORING_OP_WRITE &&
+		(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+		(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+
+	free(probe);
+	return isSupported;
+}
+
+Uring *uringCreate(unsigned entries) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	Uring *uring = calloc(1, sizeof(Uring));
+	if (uring == NULL) {
+		return NULL;
+	}
+	uring->sqRing = uring->cqRing = MAP_FAILED;
+	uring->sqes = MAP_FAILED;
+
+	uring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (uring->fd < 0) {
+		free(uring);
+		return NULL;
+	}
+
+	if (!isSupported(uring->fd)) {
+		close(uring->fd);
+		free(uring);
+		errno = ENOSYS;
+		return NULL;
+	}
+
+	uring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	uring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (uring->cqRingSize > uring->sqRingSize) {
+			uring->sqRingSize = uring->cqRingSize;
+		}
+		uring->cqRingSize = 0;
+	}
+
+	uring->sqRing = mmap(NULL, uring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+	if (uring->sqRing == MAP_FAILED) {
+		goto fail;
+	}
+
+	if (uring->cqRingSize) {
+		uring->cqRing = mmap(NULL, uring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+		if (uring->cqRing == MAP_FAILED) {
+			goto fail;
+		}
+	}
+
+	uring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(NULL, uring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED) {
+		goto fail;
+	}
+
+	char *sq = uring->sqRing;
+	char *cq = uring->cqRingSize ? uring->cqRing : uring->sqRing;
+
+	uring->sqHead = (unsigned *) (sq + params.sq_off.head);
+	uring->sqTail = (unsigned *) (sq + params.sq_off.tail);
+	uring->sqMask = (unsigned *) (sq + params.sq_off.ring_mask);
+	uring->sqArray = (unsigned *) (sq + params.sq_off.array);
+	uring->sqEntries = params.sq_entries;
+
+	uring->cqHead = (unsigned *) (cq + params.cq_off.head);
+	uring->cqTail = (unsigned *) (cq + params.cq_off.tail);
+	uring->cqMask = (unsigned *) (cq + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+	return uring;
+
+fail:
+	uringDestroy(uring);
+	return NULL;
+}
+
+static int queue(Uring *uring, int opcode, int fd, const void *buffer, size_t length, off_t offset, uint64_t userData) {
+	unsigned head = __atomic_load_n(uring->sqHead, __ATOMIC_ACQUIRE);
+	unsigned tail = *uring->sqTail;
+
+	if (tail - head >= uring->sqEntries) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	unsigned index = tail & *uring->sqMask;
+	struct io_uring_sqe *sqe = &uring->sqes[index];
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t) (uintptr_t) buffer;
+	sqe->len = length;
+	sqe->off = offset;
+	sqe->user_data = userData;
+
+	uring->sqArray[index] = index;
+	__atomic_store_n(uring->sqTail, tail + 1, __ATOMIC_RELEASE);
+	uring->toSubmit++;
+	return 0;
+}
+
+int uringRead(Uring *uring, int fd, void *buffer, size_t length, off_t offset, uint64_t userData) {
+	return queue(uring, IORING_OP_READ, fd, buffer, length, offset, userData);
+}
+
+int uringWrite(Uring *uring, int fd, const void *buffer, size_t length, off_t offset, uint64_t userData) {
+	return queue(uring, IORING_OP_WRITE, fd, buffer, length, offset, userData);
+}
+
+static int enter(Uring *uring, unsigned minComplete) {
+	for (;;) {
+		int submitted = syscall(__NR_io_uring_enter, uring->fd, uring->toSubmit, minComplete,
+			minComplete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+		if (submitted < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+
+		uring->toSubmit -= submitted;
+		return 0;
+	}
+}
+
+// The kernel is out of room for completions (EBUSY) or for a moment out of
+// memory (EAGAIN): whatever wasn't submitted stays queued, for the next try.
+static int isTransient(int error) {
+	return error == EAGAIN || error == EBUSY;
+}
+
+int uringSubmit(Uring *uring) {
+	if (uring->toSubmit == 0) {
+		return 0;
+	}
+	if (enter(uring, 0) == -1 && !isTransient(errno)) {
+		return -1;
+	}
+	return 0;
+}
+
+// Submits whatever is queued and waits for one completion. result is what
+// the equivalent syscall would return, or -errno.
+int uringWait(Uring *uring, uint64_t *userData, int *result) {
+	if (uringSubmit(uring) == -1) {
+		return -1;
+	}
+
+	for (;;) {
+		unsigned head = *uring->cqHead;
+		if (head != __atomic_load_n(uring->cqTail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &uring->cqes[head & *uring->cqMask];
+			*userData = cqe->user_data;
+			*result = cqe->res;
+			__atomic_store_n(uring->cqHead, head + 1, __ATOMIC_RELEASE);
+			return 0;
+		}
+
+		if (enter(uring, 1) == -1) {
+			if (!isTransient(errno)) {
+				return -1;
+			}
+			// completions may have come in meanwhile
+			sched_yield();
+		}
+	}
+}
+
+void uringDestroy(Uring *uring) {
+	if (uring->sqes != MAP_FAILED) {
+		munmap(uring->sqes, uring->sqesSize);
+	}
+	if (uring->cqRing != MAP_FAILED) {
+		munmap(uring->cqRing, uring->cqRingSize);
+	}
+	if (uring->sqRing != MAP_FAILED) {
+		munmap(uring->sqRing, uring->sqRingSize);
+	}
+	close(uring->fd);
+	free(uring);
+}
+
+#else
+
+Uring *uringCreate(unsigned entries) {
+	errno = ENOSYS;
+	return NULL;
+}
+
+int uringRead(Uring *uring, int fd, void *buffer, size_t length, off_t offset, uint64_t userData) {
+	errno = ENOSYS;
+	return -1;
+}
+
+int uringWrite(Uring *uring, int fd, const void *buffer, size_t length, off_t offset, uint64_t userData) {
+	errno = ENOSYS;
+	return -1;
+}
+
+int uringSubmit(Uring *uring) {
+	errno = ENOSYS;
+	return -1;
+}
+
+int uringWait(Uring *uring, uint64_t *userData, int *result) {
+	errno = ENOSYS;
+	return -1;
+}
+
+void uringDestroy(Uring *uring) {
+}
+
+#endif
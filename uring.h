@@ -0,0 +1,24 @@
+#ifndef BIGSYNC_URING_H
+#define BIGSYNC_URING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Minimal io_uring wrapper, talking to the kernel directly so there's no
+// dependency on liburing. A ring is not thread-safe: every thread doing I/O
+// gets its own. The caller keeps at most the number of entries the ring was
+// created with in flight.
+
+typedef struct Uring Uring;
+
+// Returns NULL (with errno set) when io_uring isn't available: not Linux, a
+// kernel older than 5.6, or disabled by a sandbox.
+Uring *uringCreate(unsigned entries);
+int uringRead(Uring *uring, int fd, void *buffer, size_t length, off_t offset, uint64_t userData);
+int uringWrite(Uring *uring, int fd, const void *buffer, size_t length, off_t offset, uint64_t userData);
+int uringSubmit(Uring *uring);
+int uringWait(Uring *uring, uint64_t *userData, int *result);
+void uringDestroy(Uring *uring);
+
+#endif
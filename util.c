@@ -0,0 +1,67 @@
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include "util.h"
+
+static ssize_t readFile(void *fd, char *data, size_t length, off_t offset) {
+	return pread(*(int *) fd, data, length, offset);
+}
+
+// All of length bytes or -1, with EIO for a file that ends before them.
+int utilReadAll(int fd, void *buffer, size_t length, off_t offset) {
+	size_t done = 0;
+	while (done < length) {
+		ssize_t readBytes = pread(fd, (char *) buffer + done, length - done, offset + done);
+		if (readBytes < 0 && errno == EINTR) {
+			continue;
+		}
+		if (readBytes <= 0) {
+			if (readBytes == 0) {
+				errno = EIO;
+			}
+			return -1;
+		}
+		done += readBytes;
+	}
+	return 0;
+}
+
+int utilWriteAll(int fd, const void *buffer, size_t length, off_t offset) {
+	size_t done = 0;
+	while (done < length) {
+		ssize_t written = pwrite(fd, (const char *) buffer + done, length - done, offset + done);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		done += written;
+	}
+	return 0;
+}
+
+// Whatever is past the end of the file reads as zeros, for a destination that
+// is shorter than the source until the sync is done.
+int utilReadZeroFilled(int fd, void *buffer, size_t length, off_t offset) {
+	return utilReadZeroFilledFrom(readFile, &fd, buffer, length, offset);
+}
+
+int utilReadZeroFilledFrom(UtilReadFunction read, void *source, void *buffer, size_t length, off_t offset) {
+	size_t done = 0;
+	while (done < length) {
+		ssize_t readBytes = read(source, (char *) buffer + done, length - done, offset + done);
+		if (readBytes < 0 && errno == EINTR) {
+			continue;
+		}
+		if (readBytes < 0) {
+			return -1;
+		}
+		if (readBytes == 0) {
+			break;
+		}
+		done += readBytes;
+	}
+	memset((char *) buffer + done, 0, length - done);
+	return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef BIGSYNC_UTIL_H
+#define BIGSYNC_UTIL_H
+
+// Helpers shared by the modules that read and write their own files; not
+// part of what engine.h offers.
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+
+// The size of every module's error buffer (CHECKSUMS_ERROR_SIZE,
+// STORE_ERROR_SIZE and so on)
+#define UTIL_ERROR_SIZE 512
+
+static inline void setError(char *error, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static inline void setError(char *error, const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(error, UTIL_ERROR_SIZE, fmt, ap);
+	va_end(ap);
+}
+
+// Every file format is little-endian, whatever the host is.
+
+static inline void put32(unsigned char *p, uint32_t value) {
+	int i;
+	for (i = 0; i < 4; i++) {
+		p[i] = (unsigned char) (value >> (8 * i));
+	}
+}
+
+static inline void put64(unsigned char *p, uint64_t value) {
+	int i;
+	for (i = 0; i < 8; i++) {
+		p[i] = (unsigned char) (value >> (8 * i));
+	}
+}
+
+static inline uint32_t get32(const unsigned char *p) {
+	return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline uint64_t get64(const unsigned char *p) {
+	return (uint64_t) get32(p) | ((uint64_t) get32(p + 4) << 32);
+}
+
+// Reads up to length bytes at offset, fewer only at the end of what is read.
+typedef ssize_t (*UtilReadFunction)(void *source, char *data, size_t length, off_t offset);
+
+int utilReadAll(int fd, void *buffer, size_t length, off_t offset);
+int utilWriteAll(int fd, const void *buffer, size_t length, off_t offset);
+int utilReadZeroFilled(int fd, void *buffer, size_t length, off_t offset);
+int utilReadZeroFilledFrom(UtilReadFunction read, void *source, void *buffer, size_t length, off_t offset);
+
+#endif
@@ -0,0 +1,593 @@
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "zero.h"
+#include "writer.h"
+
+// Destination writer. Changed blocks that follow each other are merged into
+// one run and written with a single pwrite(); the destination is fsync()ed
+// according to the sync policy. Checksums of written blocks are held back
+// until the fsync() that makes their data durable, so the checksums file can
+// never claim a block that didn't reach the disk.
+//
+// With io_uring, a run is queued instead of written, and the next one is
+// gathered in another buffer meanwhile; everything queued is waited for
+// before the fsync().
+//
+// With hole punching on, zeros in a block are deallocated with
+// FALLOC_FL_PUNCH_HOLE instead of written, whole filesystem blocks at a time.
+//
+// With a remote destination, runs and holes are streamed to the receiver
+// instead, and a sync is a round trip to it.
+
+#define WRITER_RUN_SIZE (64 * 1024 * 1024)
+
+// run buffers are good for O_DIRECT
+#define WRITER_ALIGNMENT 4096
+
+static char *allocateRun(size_t size) {
+	void *run;
+	if (posix_memalign(&run, WRITER_ALIGNMENT, size) != 0) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return run;
+}
+
+Writer *writerCreate(int fd, int syncPolicy, uint64_t syncEveryBytes, uint64_t blockSize,
+	WriterCommitFunction commit, void *commitContext) {
+
+	Writer *writer = calloc(1, sizeof(Writer));
+	if (writer == NULL) {
+		return NULL;
+	}
+
+	writer->fd = fd;
+	writer->directFd = -1;
+	writer->syncPolicy = syncPolicy;
+	writer->syncEveryBytes = syncEveryBytes;
+	writer->blockSize = blockSize;
+	writer->commit = commit;
+	writer->commitContext = commitContext;
+
+	// whole blocks only, and at least one
+	writer->runCapacity = blockSize;
+	if (syncPolicy != SYNC_POLICY_PER_BLOCK && blockSize < WRITER_RUN_SIZE) {
+		writer->runCapacity = (WRITER_RUN_SIZE / blockSize) * blockSize;
+	}
+
+	writer->run = allocateRun(writer->runCapacity);
+	if (writer->run == NULL) {
+		free(writer);
+		return NULL;
+	}
+
+	return writer;
+}
+
+void writerSetJournal(Writer *writer, WriterJournalFunction journal, void *journalContext) {
+	writer->journal = journal;
+	writer->journalContext = journalContext;
+}
+
+// Splits the run buffer into queueDepth buffers (of at least a block each) to
+// be written through the ring.
+int writerSetUring(Writer *writer, Uring *uring, int queueDepth) {
+	if (queueDepth < 1) {
+		queueDepth = 1;
+	}
+
+	size_t capacity = (writer->runCapacity / queueDepth / writer->blockSize) * writer->blockSize;
+	if (capacity < writer->blockSize) {
+		capacity = writer->blockSize;
+	}
+
+	WriterBuffer *buffers = calloc(queueDepth, sizeof(WriterBuffer));
+	if (buffers == NULL) {
+		return -1;
+	}
+
+	int i;
+	for (i = 0; i < queueDepth; i++) {
+		buffers[i].data = allocateRun(capacity);
+		if (buffers[i].data == NULL) {
+			while (i--) {
+				free(buffers[i].data);
+			}
+			free(buffers);
+			return -1;
+		}
+	}
+
+	free(writer->run);
+	writer->uring = uring;
+	writer->buffers = buffers;
+	writer->buffersCount = queueDepth;
+	writer->currentBuffer = 0;
+	writer->run = buffers[0].data;
+	writer->runCapacity = capacity;
+	return 0;
+}
+
+// directFd, unless -1, is the destination opened with O_DIRECT, used for
+// every write it accepts. shouldDropCache drops the destination's pages from
+// the page cache after every sync.
+void writerSetCachePolicy(Writer *writer, int directFd, int shouldDropCache) {
+	writer->directFd = directFd;
+	writer->shouldDropCache = shouldDropCache;
+}
+
+// granularity is the destination filesystem's block size; 0 turns hole
+// punching off.
+void writerSetHolePunching(Writer *writer, size_t granularity) {
+	writer->holeGranularity = granularity;
+}
+
+// Sends everything to a receiver rather than to fd, which is then unused.
+void writerSetRemote(Writer *writer, Remote *remote) {
+	writer->remote = remote;
+}
+
+// Every write and hole punch waits for the throttle first.
+void writerSetThrottle(Writer *writer, Throttle *throttle) {
+	writer->throttle = throttle;
+}
+
+// Writes and syncs are timed into stats.
+void writerSetStats(Writer *writer, Stats *stats) {
+	writer->stats = stats;
+}
+
+// For benchmarks: every write takes this much longer, like it would on a
+// slow destination.
+void writerSetLatency(Writer *writer, uint64_t microseconds) {
+	writer->latencyMicroseconds = microseconds;
+}
+
+static void waitLatency(Writer *writer) {
+	if (writer->latencyMicroseconds) {
+		usleep(writer->latencyMicroseconds);
+	}
+}
+
+// O_DIRECT only takes aligned buffers, offsets and lengths, so the last
+// block of a file goes through the page cache.
+static int descriptorFor(Writer *writer, const char *data, size_t length, off_t offset) {
+	if (writer->directFd == -1 ||
+		(uintptr_t) data % WRITER_ALIGNMENT || length % WRITER_ALIGNMENT || offset % WRITER_ALIGNMENT) {
+		return writer->fd;
+	}
+	return writer->directFd;
+}
+
+static int journalPending(Writer *writer) {
+	if (writer->journal == NULL || writer->journaledCount == writer->pendingCount) {
+		return 0;
+	}
+
+	if (writer->journal(writer->journalContext, writer->pending, writer->pendingCount, writer->journaledCount) == -1) {
+		return -1;
+	}
+
+	writer->journaledCount = writer->pendingCount;
+	return 0;
+}
+
+static int writeAll(Writer *writer, const char *data, size_t length, off_t offset) {
+	if (journalPending(writer) == -1) {
+		return -1;
+	}
+	throttleWrite(writer->throttle, length);
+
+	uint64_t startedAt = statsNow();
+	statsWritten(writer->stats, length);
+	waitLatency(writer);
+
+	if (writer->remote) {
+		int result = remoteWrite(writer->remote, data, length, offset);
+		statsStage(writer->stats, STATS_WRITE, startedAt);
+		return result;
+	}
+
+	while (length > 0) {
+		int fd = descriptorFor(writer, data, length, offset);
+		ssize_t written = pwrite(fd, data, length, offset);
+		if (written < 0 && errno == EINVAL && fd != writer->fd) {
+			written = pwrite(writer->fd, data, length, offset);
+		}
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		data += written;
+		length -= written;
+		offset += written;
+	}
+	statsStage(writer->stats, STATS_WRITE, startedAt);
+	return 0;
+}
+
+static int queueBuffer(Writer *writer, int index) {
+	WriterBuffer *buffer = &writer->buffers[index];
+
+	if (uringWrite(writer->uring, buffer->fd, buffer->data + buffer->written, buffer->length - buffer->written,
+		buffer->offset + buffer->written, index) == -1) {
+		return -1;
+	}
+
+	return uringSubmit(writer->uring);
+}
+
+// Waits for one queued write to finish.
+static int reapBuffer(Writer *writer) {
+	uint64_t index;
+	int result;
+
+	if (uringWait(writer->uring, &index, &result) == -1) {
+		return -1;
+	}
+
+	WriterBuffer *buffer = &writer->buffers[index];
+
+	// O_DIRECT refused it after all
+	if (result == -EINVAL && buffer->fd != writer->fd) {
+		buffer->fd = writer->fd;
+		return queueBuffer(writer, index);
+	}
+
+	// interrupted, or a short write: queue the rest
+	if (result == -EINTR || result == -EAGAIN || (result > 0 && buffer->written + result < buffer->length)) {
+		if (result > 0) {
+			buffer->written += result;
+			buffer->fd = descriptorFor(writer, buffer->data + buffer->written, buffer->length - buffer->written,
+				buffer->offset + buffer->written);
+		}
+		return queueBuffer(writer, index);
+	}
+
+	buffer->isInFlight = 0;
+	writer->inFlight--;
+
+	if (result <= 0) {
+		errno = result < 0 ? -result : EIO;
+		return -1;
+	}
+	return 0;
+}
+
+static int queueRun(Writer *writer) {
+	if (journalPending(writer) == -1) {
+		return -1;
+	}
+	throttleWrite(writer->throttle, writer->runLength);
+
+	// queued, and once all buffers are, waiting for one to be written
+	uint64_t startedAt = statsNow();
+	statsWritten(writer->stats, writer->runLength);
+	waitLatency(writer);
+
+	WriterBuffer *buffer = &writer->buffers[writer->currentBuffer];
+	buffer->offset = writer->runOffset;
+	buffer->length = writer->runLength;
+	buffer->written = 0;
+	buffer->fd = descriptorFor(writer, buffer->data, buffer->length, buffer->offset);
+
+	if (queueBuffer(writer, writer->currentBuffer) == -1) {
+		return -1;
+	}
+	buffer->isInFlight = 1;
+	writer->inFlight++;
+
+	for (;;) {
+		int i;
+		for (i = 0; i < writer->buffersCount; i++) {
+			if (!writer->buffers[i].isInFlight) {
+				writer->currentBuffer = i;
+				writer->run = writer->buffers[i].data;
+				statsStage(writer->stats, STATS_WRITE, startedAt);
+				return 0;
+			}
+		}
+
+		if (reapBuffer(writer) == -1) {
+			return -1;
+		}
+	}
+}
+
+int writerFlush(Writer *writer) {
+	if (writer->runLength == 0) {
+		return 0;
+	}
+
+	if (writer->uring) {
+		if (queueRun(writer) == -1) {
+			return -1;
+		}
+	} else if (writeAll(writer, writer->run, writer->runLength, writer->runOffset) == -1) {
+		return -1;
+	}
+
+	writer->bytesSinceSync += writer->runLength;
+	writer->runLength = 0;
+	return 0;
+}
+
+static int writerWrite(Writer *writer, off_t offset, const char *data, size_t length) {
+	int isAdjacent = writer->runLength > 0 && writer->runOffset + (off_t) writer->runLength == offset;
+
+	if (!isAdjacent || writer->runLength + length > writer->runCapacity) {
+		if (writerFlush(writer) == -1) {
+			return -1;
+		}
+	}
+
+	// a block larger than the run buffer can only happen if the buffer
+	// couldn't be sized for it, write it through
+	if (length > writer->runCapacity) {
+		if (writeAll(writer, data, length, offset) == -1) {
+			return -1;
+		}
+		writer->bytesSinceSync += length;
+		return 0;
+	}
+
+	if (writer->runLength == 0) {
+		writer->runOffset = offset;
+	}
+
+	memcpy(writer->run + writer->runLength, data, length);
+	writer->runLength += length;
+	return 0;
+}
+
+// Returns 1 if the filesystem can't punch holes.
+static int punchHole(Writer *writer, off_t offset, size_t length) {
+	throttleWrite(writer->throttle, 0);
+
+	// the receiver writes zeros itself if it has to
+	if (writer->remote) {
+		if (journalPending(writer) == -1 || remotePunch(writer->remote, offset, length) == -1) {
+			return -1;
+		}
+		writer->bytesSinceSync += length;
+		writer->punchedBytes += length;
+		return 0;
+	}
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if (journalPending(writer) == -1) {
+		return -1;
+	}
+
+	while (fallocate(writer->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == -1) {
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno == EOPNOTSUPP || errno == ENOSYS) {
+			return 1;
+		}
+		return -1;
+	}
+
+	writer->bytesSinceSync += length;
+	writer->punchedBytes += length;
+	return 0;
+#else
+	(void) writer;
+	(void) offset;
+	(void) length;
+	return 1;
+#endif
+}
+
+// Writes the data around the block's zero runs and punches the runs out.
+// Runs start at filesystem block boundaries and are at least a filesystem
+// block long; shorter stretches of zeros are cheaper written than punched.
+static int writerWriteSparse(Writer *writer, off_t offset, const char *data, size_t length) {
+	size_t granularity = writer->holeGranularity;
+	size_t lead = (granularity - offset % granularity) % granularity;
+	if (lead > length) {
+		lead = length;
+	}
+
+	size_t done = 0;
+	size_t position = 0;
+	ZeroRun run;
+
+	while (zeroNextRun((const unsigned char *) data + lead, length - lead, granularity, &position, &run)) {
+		if (run.length < granularity) {
+			continue;
+		}
+
+		size_t runStart = lead + run.offset;
+		if (runStart > done && writerWrite(writer, offset + done, data + done, runStart - done) == -1) {
+			return -1;
+		}
+		done = runStart;
+
+		int result = punchHole(writer, offset + runStart, run.length);
+		if (result == -1) {
+			return -1;
+		}
+		if (result == 1) {
+			writer->holeGranularity = 0;
+			break;
+		}
+		done += run.length;
+	}
+
+	if (done < length) {
+		return writerWrite(writer, offset + done, data + done, length - done);
+	}
+	return 0;
+}
+
+static int writeData(Writer *writer, off_t offset, const char *data, size_t length) {
+	return writer->holeGranularity ?
+		writerWriteSparse(writer, offset, data, length) :
+		writerWrite(writer, offset, data, length);
+}
+
+// Writes the runs of changed leaves.
+static int writeLeaves(Writer *writer, off_t offset, const char *data, size_t length, const WriterLeaves *leaves) {
+	uint32_t i = 0;
+	while (i < leaves->count) {
+		if (!leaves->isChanged[i]) {
+			i++;
+			continue;
+		}
+
+		uint32_t end = i + 1;
+		while (end < leaves->count && leaves->isChanged[end]) {
+			end++;
+		}
+
+		size_t start = (size_t) i * leaves->leafSize;
+		size_t stop = (size_t) end * leaves->leafSize;
+		if (stop > length) {
+			stop = length;
+		}
+		if (start < stop && writeData(writer, offset + start, data + start, stop - start) == -1) {
+			return -1;
+		}
+		i = end;
+	}
+	return 0;
+}
+
+static void freePendingLeaves(Writer *writer) {
+	size_t i;
+	for (i = 0; i < writer->pendingCount; i++) {
+		free(writer->pending[i].leafDigests);
+	}
+}
+
+static int applyPendingCommits(Writer *writer) {
+	size_t i;
+	for (i = 0; i < writer->pendingCount; i++) {
+		if (writer->commit(writer->commitContext, &writer->pending[i]) == -1) {
+			return -1;
+		}
+	}
+	freePendingLeaves(writer);
+	writer->pendingCount = 0;
+	writer->journaledCount = 0;
+	return 0;
+}
+
+int writerSync(Writer *writer) {
+	if (writerFlush(writer) == -1) {
+		return -1;
+	}
+
+	while (writer->inFlight > 0) {
+		if (reapBuffer(writer) == -1) {
+			return -1;
+		}
+	}
+
+	if (writer->bytesSinceSync > 0) {
+		uint64_t startedAt = statsNow();
+		if (writer->remote ? remoteSync(writer->remote) == -1 : fsync(writer->fd) == -1) {
+			return -1;
+		}
+		statsStage(writer->stats, STATS_SYNC, startedAt);
+		writer->syncsCount++;
+		writer->bytesSinceSync = 0;
+
+#ifdef POSIX_FADV_DONTNEED
+		// all clean now, so this actually drops them
+		if (writer->shouldDropCache && writer->remote == NULL) {
+			posix_fadvise(writer->fd, 0, 0, POSIX_FADV_DONTNEED);
+		}
+#endif
+	}
+
+	return applyPendingCommits(writer);
+}
+
+// Writes a block (data may be NULL for blocks that need no writing, like
+// holes) and queues its checksum, extent hint and leaf digests (leaves may be
+// NULL); they are passed on to the commit function after the next sync.
+int writerWriteBlock(Writer *writer, uint64_t index, off_t offset, const char *data, size_t length,
+	const unsigned char *digest, uint64_t extentHint, const WriterLeaves *leaves) {
+
+	if (writer->pendingCount == writer->pendingCapacity) {
+		size_t capacity = writer->pendingCapacity ? writer->pendingCapacity * 2 : 64;
+		WriterPendingCommit *pending = realloc(writer->pending, capacity * sizeof(WriterPendingCommit));
+		if (pending == NULL) {
+			return -1;
+		}
+		writer->pending = pending;
+		writer->pendingCapacity = capacity;
+	}
+
+	WriterPendingCommit *commit = &writer->pending[writer->pendingCount];
+	commit->index = index;
+	commit->offset = offset;
+	commit->length = length;
+	memcpy(commit->digest, digest, HASH_MAX_DIGEST_SIZE);
+	commit->extentHint = extentHint;
+	commit->leafDigests = NULL;
+	commit->leavesCount = 0;
+
+	if (leaves && leaves->count > 0) {
+		commit->leafDigests = malloc((size_t) leaves->count * leaves->digestSize);
+		if (commit->leafDigests == NULL) {
+			return -1;
+		}
+		memcpy(commit->leafDigests, leaves->digests, (size_t) leaves->count * leaves->digestSize);
+		commit->leavesCount = leaves->count;
+	}
+	writer->pendingCount++;
+
+	if (data) {
+		int result = leaves && leaves->isChanged ?
+			writeLeaves(writer, offset, data, length, leaves) :
+			writeData(writer, offset, data, length);
+		if (result == -1) {
+			return -1;
+		}
+	}
+
+	switch (writer->syncPolicy) {
+		case SYNC_POLICY_PER_BLOCK:
+			return writerSync(writer);
+
+		case SYNC_POLICY_EVERY_MB:
+			if (writer->bytesSinceSync + writer->runLength >= writer->syncEveryBytes) {
+				return writerSync(writer);
+			}
+			break;
+	}
+
+	return 0;
+}
+
+int writerClose(Writer *writer) {
+	int result = writerSync(writer);
+
+	if (writer->buffers) {
+		int i;
+		for (i = 0; i < writer->buffersCount; i++) {
+			free(writer->buffers[i].data);
+		}
+		free(writer->buffers);
+	} else {
+		free(writer->run);
+	}
+	freePendingLeaves(writer);
+	free(writer->pending);
+	free(writer);
+
+	return result;
+}
@@ -0,0 +1,112 @@
+#ifndef BIGSYNC_WRITER_H
+#define BIGSYNC_WRITER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "hash.h"
+#include "uring.h"
+#include "remote.h"
+#include "throttle.h"
+#include "stats.h"
+
+#define SYNC_POLICY_PER_BLOCK 0
+#define SYNC_POLICY_EVERY_MB 1
+#define SYNC_POLICY_END 2
+
+typedef struct {
+	uint64_t index;
+	off_t offset;
+	uint64_t length;
+	unsigned char digest[HASH_MAX_DIGEST_SIZE];
+	uint64_t extentHint;
+	unsigned char *leafDigests; // owned by the writer, NULL without leaves
+	uint32_t leavesCount;
+} WriterPendingCommit;
+
+// Called for every committed block once its data is on disk.
+typedef int (*WriterCommitFunction)(void *context, const WriterPendingCommit *commit);
+
+// Leaf digests of a block (see checksums.h), committed along with its digest.
+// If isChanged is given, only the leaves flagged in it are written.
+typedef struct {
+	uint32_t leafSize;
+	uint32_t count;
+	int digestSize;
+	const unsigned char *digests;
+	const unsigned char *isChanged;
+} WriterLeaves;
+
+// Called before the destination is written to, with all blocks not yet synced;
+// the first journaledCount of them were already passed on the previous call.
+typedef int (*WriterJournalFunction)(void *context, WriterPendingCommit *pending, size_t count, size_t journaledCount);
+
+// A run buffer of the io_uring writer; runs are written from it in the
+// background until the next sync.
+typedef struct {
+	char *data;
+	off_t offset;
+	size_t length;
+	size_t written;
+	int fd;
+	int isInFlight;
+} WriterBuffer;
+
+typedef struct {
+	int fd;
+	int directFd;
+	int shouldDropCache;
+	int syncPolicy;
+	uint64_t blockSize;
+	uint64_t syncEveryBytes;
+	uint64_t bytesSinceSync;
+
+	char *run;
+	size_t runCapacity;
+	size_t runLength;
+	off_t runOffset;
+
+	WriterPendingCommit *pending;
+	size_t pendingCount;
+	size_t pendingCapacity;
+	size_t journaledCount;
+
+	WriterCommitFunction commit;
+	void *commitContext;
+
+	WriterJournalFunction journal;
+	void *journalContext;
+
+	Uring *uring;
+	WriterBuffer *buffers;
+	int buffersCount;
+	int currentBuffer;
+	int inFlight;
+
+	size_t holeGranularity;
+
+	Remote *remote;
+	Throttle *throttle;
+	Stats *stats;
+	uint64_t latencyMicroseconds;
+
+	uint64_t syncsCount;
+	uint64_t punchedBytes;
+} Writer;
+
+Writer *writerCreate(int fd, int syncPolicy, uint64_t syncEveryBytes, uint64_t blockSize,
+	WriterCommitFunction commit, void *commitContext);
+void writerSetJournal(Writer *writer, WriterJournalFunction journal, void *journalContext);
+int writerSetUring(Writer *writer, Uring *uring, int queueDepth);
+void writerSetCachePolicy(Writer *writer, int directFd, int shouldDropCache);
+void writerSetHolePunching(Writer *writer, size_t granularity);
+void writerSetRemote(Writer *writer, Remote *remote);
+void writerSetThrottle(Writer *writer, Throttle *throttle);
+void writerSetStats(Writer *writer, Stats *stats);
+void writerSetLatency(Writer *writer, uint64_t microseconds);
+int writerWriteBlock(Writer *writer, uint64_t index, off_t offset, const char *data, size_t length,
+	const unsigned char *digest, uint64_t extentHint, const WriterLeaves *leaves);
+int writerFlush(Writer *writer);
+int writerSync(Writer *writer);
+int writerClose(Writer *writer);
+
+#endif
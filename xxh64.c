@@ -0,0 +1,136 @@
+// XXH64, the 64-bit variant of Yann Collet's xxHash (BSD 2-Clause),
+// written from the public specification.
+
+#include <string.h>
+#include "xxh64.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline uint64_t read64(const unsigned char *p) {
+	return (uint64_t) p[0] | ((uint64_t) p[1] << 8) | ((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 24) |
+		((uint64_t) p[4] << 32) | ((uint64_t) p[5] << 40) | ((uint64_t) p[6] << 48) | ((uint64_t) p[7] << 56);
+}
+
+static inline uint32_t read32(const unsigned char *p) {
+	return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline uint64_t xxh64Round(uint64_t acc, uint64_t input) {
+	acc += input * PRIME64_2;
+	acc = ROTL64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static inline uint64_t xxh64MergeRound(uint64_t acc, uint64_t value) {
+	acc ^= xxh64Round(0, value);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+void xxh64Init(Xxh64State *state, uint64_t seed) {
+	memset(state, 0, sizeof(Xxh64State));
+	state->seed = seed;
+	state->v[0] = seed + PRIME64_1 + PRIME64_2;
+	state->v[1] = seed + PRIME64_2;
+	state->v[2] = seed;
+	state->v[3] = seed - PRIME64_1;
+}
+
+void xxh64Update(Xxh64State *state, const unsigned char *input, size_t length) {
+	const unsigned char *end = input + length;
+
+	state->totalLength += length;
+
+	if (state->bufferSize + length < 32) {
+		memcpy(state->buffer + state->bufferSize, input, length);
+		state->bufferSize += length;
+		return;
+	}
+
+	if (state->bufferSize > 0) {
+		size_t fill = 32 - state->bufferSize;
+		memcpy(state->buffer + state->bufferSize, input, fill);
+		state->v[0] = xxh64Round(state->v[0], read64(state->buffer));
+		state->v[1] = xxh64Round(state->v[1], read64(state->buffer + 8));
+		state->v[2] = xxh64Round(state->v[2], read64(state->buffer + 16));
+		state->v[3] = xxh64Round(state->v[3], read64(state->buffer + 24));
+		input += fill;
+		state->bufferSize = 0;
+	}
+
+	uint64_t v1 = state->v[0], v2 = state->v[1], v3 = state->v[2], v4 = state->v[3];
+	while (input + 32 <= end) {
+		v1 = xxh64Round(v1, read64(input));
+		v2 = xxh64Round(v2, read64(input + 8));
+		v3 = xxh64Round(v3, read64(input + 16));
+		v4 = xxh64Round(v4, read64(input + 24));
+		input += 32;
+	}
+	state->v[0] = v1;
+	state->v[1] = v2;
+	state->v[2] = v3;
+	state->v[3] = v4;
+
+	if (input < end) {
+		state->bufferSize = end - input;
+		memcpy(state->buffer, input, state->bufferSize);
+	}
+}
+
+uint64_t xxh64Final(Xxh64State *state) {
+	uint64_t h;
+
+	if (state->totalLength >= 32) {
+		uint64_t v1 = state->v[0], v2 = state->v[1], v3 = state->v[2], v4 = state->v[3];
+		h = ROTL64(v1, 1) + ROTL64(v2, 7) + ROTL64(v3, 12) + ROTL64(v4, 18);
+		h = xxh64MergeRound(h, v1);
+		h = xxh64MergeRound(h, v2);
+		h = xxh64MergeRound(h, v3);
+		h = xxh64MergeRound(h, v4);
+	} else {
+		h = state->seed + PRIME64_5;
+	}
+
+	h += state->totalLength;
+
+	const unsigned char *p = state->buffer;
+	const unsigned char *end = state->buffer + state->bufferSize;
+
+	while (p + 8 <= end) {
+		h ^= xxh64Round(0, read64(p));
+		h = ROTL64(h, 27) * PRIME64_1 + PRIME64_4;
+		p += 8;
+	}
+
+	if (p + 4 <= end) {
+		h ^= (uint64_t) read32(p) * PRIME64_1;
+		h = ROTL64(h, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+	}
+
+	while (p < end) {
+		h ^= (*p) * PRIME64_5;
+		h = ROTL64(h, 11) * PRIME64_1;
+		p++;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+uint64_t xxh64(const unsigned char *input, size_t length, uint64_t seed) {
+	Xxh64State state;
+	xxh64Init(&state, seed);
+	xxh64Update(&state, input, length);
+	return xxh64Final(&state);
+}
@@ -0,0 +1,20 @@
+#ifndef BIGSYNC_XXH64_H
+#define BIGSYNC_XXH64_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct {
+	uint64_t totalLength;
+	uint64_t v[4];
+	unsigned char buffer[32];
+	size_t bufferSize;
+	uint64_t seed;
+} Xxh64State;
+
+void xxh64Init(Xxh64State *state, uint64_t seed);
+void xxh64Update(Xxh64State *state, const unsigned char *input, size_t length);
+uint64_t xxh64Final(Xxh64State *state);
+uint64_t xxh64(const unsigned char *input, size_t length, uint64_t seed);
+
+#endif
@@ -0,0 +1,129 @@
+// All-zero detection, with SSE2 and AVX2 versions picked on first use.
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "zero.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+typedef int (*ZeroFunction)(const unsigned char *data, size_t length);
+
+static ZeroFunction zeroFunction;
+static pthread_once_t zeroFunctionOnce = PTHREAD_ONCE_INIT;
+
+static int isZeroScalar(const unsigned char *data, size_t length) {
+	size_t i = 0;
+
+	for (; i + 32 <= length; i += 32) {
+		uint64_t words[4];
+		memcpy(words, data + i, sizeof(words));
+		if (words[0] | words[1] | words[2] | words[3]) {
+			return 0;
+		}
+	}
+
+	for (; i < length; i++) {
+		if (data[i]) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+#ifdef HAVE_X86_SIMD
+
+__attribute__((target("sse2")))
+static int isZeroSse2(const unsigned char *data, size_t length) {
+	size_t i = 0;
+
+	for (; i + 64 <= length; i += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *) (data + i));
+		__m128i b = _mm_loadu_si128((const __m128i *) (data + i + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *) (data + i + 32));
+		__m128i d = _mm_loadu_si128((const __m128i *) (data + i + 48));
+		__m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xffff) {
+			return 0;
+		}
+	}
+
+	return isZeroScalar(data + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static int isZeroAvx2(const unsigned char *data, size_t length) {
+	size_t i = 0;
+
+	for (; i + 128 <= length; i += 128) {
+		__m256i a = _mm256_loadu_si256((const __m256i *) (data + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *) (data + i + 32));
+		__m256i c = _mm256_loadu_si256((const __m256i *) (data + i + 64));
+		__m256i d = _mm256_loadu_si256((const __m256i *) (data + i + 96));
+		__m256i any = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+		if (!_mm256_testz_si256(any, any)) {
+			return 0;
+		}
+	}
+
+	return isZeroScalar(data + i, length - i);
+}
+
+#endif
+
+static void zeroPickFunction() {
+	zeroFunction = isZeroScalar;
+
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		zeroFunction = isZeroAvx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		zeroFunction = isZeroSse2;
+	}
+#endif
+}
+
+int zeroIsZero(const unsigned char *data, size_t length) {
+	pthread_once(&zeroFunctionOnce, zeroPickFunction);
+	return zeroFunction(data, length);
+}
+
+// Finds the next run of all-zero granules at or after *position (granules
+// are aligned to the start of data; the last one may be shorter) and moves
+// *position past it. Returns 0 when there are no more.
+int zeroNextRun(const unsigned char *data, size_t length, size_t granularity, size_t *position, ZeroRun *run) {
+	size_t offset = *position;
+
+	pthread_once(&zeroFunctionOnce, zeroPickFunction);
+
+	while (offset < length) {
+		size_t granule = length - offset < granularity ? length - offset : granularity;
+		if (zeroFunction(data + offset, granule)) {
+			break;
+		}
+		offset += granule;
+	}
+
+	if (offset >= length) {
+		*position = length;
+		return 0;
+	}
+
+	run->offset = offset;
+	while (offset < length) {
+		size_t granule = length - offset < granularity ? length - offset : granularity;
+		if (!zeroFunction(data + offset, granule)) {
+			break;
+		}
+		offset += granule;
+	}
+	run->length = offset - run->offset;
+
+	*position = offset;
+	return 1;
+}
@@ -0,0 +1,14 @@
+#ifndef BIGSYNC_ZERO_H
+#define BIGSYNC_ZERO_H
+
+#include <stddef.h>
+
+typedef struct {
+	size_t offset;
+	size_t length;
+} ZeroRun;
+
+int zeroIsZero(const unsigned char *data, size_t length);
+int zeroNextRun(const unsigned char *data, size_t length, size_t granularity, size_t *position, ZeroRun *run);
+
+#endif